@@ -31,6 +31,39 @@ typedef enum {STAT_OK = 0, STAT_BUSY = 1,STAT_ERROR = -1} snfs_call_status_t;
 int snfs_init(char* local_addr, char* remote_addr);
 
 
+/*
+ * snfs_init_shards: same as snfs_init for a server running 'nshards'
+ * shards. Requests are spread by the handle they carry (file or
+ * directory) and lookups by pathname, so a lookup and the requests on
+ * the handle it returns may be served by different shards.
+ * - local_addr - client socket address
+ * - remote_addr - socket address of shard 0
+ * - nshards - number of shards of the server (1..SNFS_MAX_SHARDS)
+ *   returns: -1/0 if (un)suceeds
+ */
+int snfs_init_shards(char* local_addr, char* remote_addr, int nshards);
+
+
+/*
+ * snfs_init_stream: connect to the server's stream transport. After it
+ * succeeds all calls use the connection, and the bulk calls keep up to
+ * SNFS_MAX_OUTSTANDING requests in flight. Call after snfs_init.
+ * - remote_addr - server socket address
+ *   returns: -1/0 if (un)suceeds
+ */
+int snfs_init_stream(char* remote_addr);
+
+
+/*
+ * snfs_set_deadline: the requests sent from now on tell the server how
+ * long the client waits for them, and the server answers the ones it
+ * could not get to in time with an error instead of serving them.
+ * Needs the compact message format.
+ * - msec - the deadline, 0 for none (the default)
+ */
+void snfs_set_deadline(unsigned msec);
+
+
 /*
  * snfs_ping: dummy service just to ping the server.
  * - inmsg - message to send
@@ -79,6 +112,80 @@ snfs_call_status_t snfs_write(snfs_fhandle_t fhandle, unsigned offset,
    unsigned count, char* buffer, unsigned int* fsize);
 
 
+/*
+ * read_bulk: same as read for any 'count'. On the stream transport it
+ * is split in bulk requests of up to SNFS_MAX_BULK_DATA whose data is
+ * received into 'buffer' (or, with a server without them, in pipelined
+ * MAX_READ_DATA requests); otherwise in MAX_READ_DATA round trips
+ *   returns: status ('nread' < 'count' at the end of the file)
+ */
+snfs_call_status_t snfs_read_bulk(snfs_fhandle_t fhandle, unsigned offset,
+   unsigned count, char* buffer, int* nread);
+
+
+/*
+ * write_bulk: same as write for any 'count', split in bulk requests of
+ * up to SNFS_MAX_BULK_DATA sent from 'buffer' on the stream transport
+ * (MAX_WRITE_DATA requests otherwise); overwrites are pipelined on the
+ * stream, chunks that grow the file are sent in order
+ * - fsize - current size of the file [in], size after the write [out]
+ *   returns: status
+ */
+snfs_call_status_t snfs_write_bulk(snfs_fhandle_t fhandle, unsigned offset, 
+   unsigned count, char* buffer, unsigned int* fsize);
+
+
+/*
+ * Asynchronous calls: read_async, write_async and lookup_async send the
+ * request and return at once with a handle for it; the call finishes
+ * later, in snfs_poll or snfs_wait_any, which fill its [out] arguments
+ * (that must stay valid until then) and run its callback, if any.
+ * Up to SNFS_MAX_OUTSTANDING calls can be in flight, sharing the window
+ * of the bulk calls; on the stream transport they overlap, otherwise
+ * each is done by the time it returns. The responses are matched to
+ * the requests by the serial number of their frames.
+ */
+
+typedef int snfs_handle_t;
+
+// called when an asynchronous call finishes
+typedef void (*snfs_callback_t)(snfs_handle_t handle, snfs_call_status_t status,
+   void* arg);
+
+/*
+ * read_async/write_async/lookup_async: same as read, write and lookup;
+ * reads and writes take up to SNFS_MAX_BULK_DATA bytes if the server
+ * has bulk messages, MAX_READ_DATA/MAX_WRITE_DATA otherwise. 'buffer'
+ * of a write is also kept until the call finishes (it is sent again if
+ * the server turns the request away busy).
+ * - callback - run when the call finishes (may be NULL), with 'arg'
+ *   returns: handle of the call, -1 on error
+ */
+snfs_handle_t snfs_read_async(snfs_fhandle_t fhandle, unsigned offset,
+   unsigned count, char* buffer, int* nread, snfs_callback_t callback, void* arg);
+
+snfs_handle_t snfs_write_async(snfs_fhandle_t fhandle, unsigned offset,
+   unsigned count, char* buffer, unsigned int* fsize, snfs_callback_t callback,
+   void* arg);
+
+snfs_handle_t snfs_lookup_async(char* pathname, snfs_fhandle_t* file,
+   unsigned* fsize, snfs_callback_t callback, void* arg);
+
+/*
+ * snfs_poll: finishes the asynchronous calls whose responses already
+ * arrived, without waiting
+ *   returns: the number of calls finished
+ */
+int snfs_poll();
+
+/*
+ * snfs_wait_any: waits for an asynchronous call to finish
+ * - status - status of the call [out]
+ *   returns: its handle, -1 if there are no calls in flight
+ */
+snfs_handle_t snfs_wait_any(snfs_call_status_t* status);
+
+
 /*
  * create: create file 'name' in directory 'dir'
  * - dir - file handle of the directory
@@ -148,11 +255,20 @@ snfs_call_status_t snfs_copy(snfs_fhandle_t src_dir, char* src_name,
 snfs_call_status_t snfs_append(snfs_fhandle_t dir1, char* name1, snfs_fhandle_t dir2, char* name2, unsigned int* fsize);
 
 /*
- * defragmentation: operates the file system block defragmentation 
- *   returns: status
+ * defragmentation: starts the file system block defragmentation, that
+ * goes on in the background on the server
+ *   returns: status (STAT_BUSY if a defragmentation is still running)
  */
 snfs_call_status_t snfs_defrag();
 
+/*
+ * defragmentation status: progress of the running defragmentation, or
+ * of the last one
+ * - progress - blocks moved and inodes walked so far [out]
+ *   returns: status (STAT_BUSY while it is running, STAT_OK when done)
+ */
+snfs_call_status_t snfs_defrag_status(snfs_msg_res_defrag_t* progress);
+
 /*
  * diskusage: dumps the file system busy blocks along with the
  * name of the files that are using them. This dumping operation takes place on the server side.
@@ -166,6 +282,16 @@ snfs_call_status_t snfs_diskusage();
  */
 snfs_call_status_t snfs_dumpcache();
 
+/*
+ * stats: the server's counters for the requests of type 'op': how many
+ * were served, how many failed, the bytes they moved and the histograms
+ * of their queue wait and service times (see snfs_proto.h)
+ * - op - request type
+ * - stats - the counters [out]
+ *   returns: status
+ */
+snfs_call_status_t snfs_stats(snfs_msg_type_t op, snfs_msg_res_stats_t* stats);
+
 
 
 /*
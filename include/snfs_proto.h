@@ -44,6 +44,12 @@
 typedef int snfs_fhandle_t;
 
 
+// maximum number of server shards; shard 0 listens on the server
+// address and shard i > 0 on SNFS_SHARD_SOCK_FMT (address, i)
+#define SNFS_MAX_SHARDS 16
+#define SNFS_SHARD_SOCK_FMT "%s.%d"
+
+
 // file type in a directory entry
 typedef enum {SNFS_DIR = 1, SNFS_FILE = 2} snfs_dir_entry_type_t;
 
@@ -76,15 +82,59 @@ typedef enum {
    REQ_APPEND = 10,
    REQ_DEFRAG = 11,
    REQ_DISKUSAGE = 12,
-   REQ_DUMPCACHE = 13   
+   REQ_DUMPCACHE = 13,
+   REQ_READ_BULK = 14,
+   REQ_WRITE_BULK = 15,
+   REQ_STATS = 16
 } snfs_msg_type_t;
 
+// number of message types (one past the last one)
+#define SNFS_NUM_REQ_TYPES 17
+
 typedef int snfs_req_serial_num_t;
 
+
+/*
+ * SNFS Stream Transport
+ *
+ * Besides datagrams, the server accepts stream connections on
+ * SNFS_STREAM_SOCK_FMT (server address). On a connection each message
+ * goes in a frame: a snfs_frame_hdr_t followed by 'len' bytes of a
+ * request or response message. The client tags every request with a
+ * serial number that the server copies to the response, so many
+ * requests may be in flight and responses may come in any order.
+ */
+
+#define SNFS_STREAM_SOCK_FMT "%s.stream"
+
+// maximum number of requests a client keeps in flight on a connection
+#define SNFS_MAX_OUTSTANDING 32
+
+typedef struct {
+   unsigned len;
+   snfs_req_serial_num_t serial;
+} snfs_frame_hdr_t;
+
+
+/*
+ * SNFS Bulk Transfer (stream transport and compact format only)
+ *
+ * REQ_READ_BULK and REQ_WRITE_BULK move up to SNFS_MAX_BULK_DATA bytes
+ * in one request. Their data does not go in the message: it takes the
+ * last 'count' bytes of the frame, right after the compact message, so
+ * both ends send it straight from their buffers with one iovec each.
+ *   - request message: snfs_msg_req_bulk_t (+ data for writes)
+ *   - response message: snfs_msg_res_bulk_t (+ data for reads)
+ */
+
+#define SNFS_MAX_BULK_DATA (256*1024)
+
 typedef enum {
    RES_OK = 0,
    RES_ERROR = -1,
-   RES_UNKNOWN = -2
+   RES_UNKNOWN = -2,
+   RES_BUSY = -3,		// the server is overloaded, try again later
+   RES_TIMEOUT = -4		// the deadline of the request passed (snfs_wire.h)
 } snfs_msg_res_status_t;
 
 
@@ -163,6 +213,26 @@ typedef struct {
 } snfs_msg_res_write_t;
 
 
+/*
+ * SNFS Bulk Read/Write (see SNFS Bulk Transfer)
+ *   - request message: snfs_msg_req_bulk_t
+ *   - response message: snfs_msg_res_bulk_t
+ */
+
+
+typedef struct {
+   snfs_fhandle_t fhandle;
+   unsigned offset;
+   unsigned count;
+} snfs_msg_req_bulk_t;
+
+
+typedef struct {
+   unsigned count;	// bytes read or written
+   unsigned fsize;	// size of the file after a write
+} snfs_msg_res_bulk_t;
+
+
 /*
  * SNFS Create
  *   - request message: snfs_msg_req_create_t
@@ -273,6 +343,59 @@ typedef struct {
 } snfs_msg_res_append_t;
 
 
+/*
+ * SNFS Defrag: starts the defragmentation, that runs in the background
+ * on the server, or (query) only reports its progress. The status is
+ * RES_UNKNOWN while a defragmentation is running: a new one is not
+ * started
+ *   - request message: snfs_msg_req_defrag_t
+ *   - response message: snfs_msg_res_defrag_t
+ */
+
+
+typedef struct {
+  unsigned query;
+} snfs_msg_req_defrag_t;
+
+typedef struct {
+   unsigned moved;     // blocks moved so far
+   unsigned done;      // inodes already walked
+   unsigned total;     // inodes to walk
+} snfs_msg_res_defrag_t;
+
+
+/*
+ * SNFS Stats: the server's counters for the requests of type 'op'
+ *   - request message: snfs_msg_req_stats_t
+ *   - response message: snfs_msg_res_stats_t
+ *
+ * Times are kept in log2 histograms of microseconds: bucket 0 counts
+ * the times under 1us, bucket i the times in [2^(i-1), 2^i) us, and the
+ * last bucket everything longer. 'wait' is the time a request spent in
+ * the server's queues, 'service' the time its handler took.
+ * 'p50'..'p999' are percentiles (50, 90, 99 and 99.9) of the whole time
+ * from receiving the request to sending its response, in us, within a
+ * few percent. 'expired' counts the requests answered RES_TIMEOUT (also
+ * counted in 'errors').
+ */
+
+#define SNFS_STATS_BUCKETS 24
+
+typedef struct {
+  snfs_msg_type_t op;
+} snfs_msg_req_stats_t;
+
+typedef struct {
+   unsigned count;
+   unsigned errors;
+   unsigned kbytes;
+   unsigned expired;
+   unsigned p50, p90, p99, p999;
+   unsigned wait[SNFS_STATS_BUCKETS];
+   unsigned service[SNFS_STATS_BUCKETS];
+} snfs_msg_res_stats_t;
+
+
 
 /*
  * SNFS Messages
@@ -300,6 +423,9 @@ typedef struct {
     snfs_msg_req_remove_t remove;
 	snfs_msg_req_copy_t copy;
 	snfs_msg_req_append_t append;	
+	snfs_msg_req_defrag_t defrag;
+    snfs_msg_req_bulk_t bulk;
+    snfs_msg_req_stats_t stats;
   } body;
 } snfs_msg_req_t;
 
@@ -317,6 +443,9 @@ typedef struct {
 	  snfs_msg_res_remove_t remove;
 	  snfs_msg_res_copy_t copy;
 	  snfs_msg_res_append_t append;	
+	  snfs_msg_res_defrag_t defrag;
+      snfs_msg_res_bulk_t bulk;
+      snfs_msg_res_stats_t stats;
    } body;
 } snfs_msg_res_t;
 
@@ -0,0 +1,100 @@
+/*
+ * SNFS Compact Wire Format
+ *
+ * snfs_wire.h
+ *
+ * Compact encoding of the SNFS messages, used both by the SNFS library
+ * and the SNFS server. The fixed messages of snfs_proto.h are unions
+ * sized for the largest body; on the wire a compact message only
+ * carries the fields of its type:
+ *
+ *   - request:  magic, type, fields
+ *   - response: magic, type, status, fields
+ *
+ * Integers are varints (7 bits per byte, low bits first); strings and
+ * data are a varint length followed by the bytes. The magic byte can
+ * never start a fixed message, so both formats can arrive on the same
+ * socket: the server answers each request in the format it came in,
+ * and a client talking to a server that only knows the fixed format
+ * gets RES_UNKNOWN back and falls back to it.
+ *
+ * Bulk messages (REQ_READ_BULK/REQ_WRITE_BULK) only exist in this
+ * format; their data is not encoded, it fills the rest of the frame.
+ *
+ * A request can carry a deadline: how long, in us, the client will
+ * wait for the response. It starts with SNFS_WIRE_MAGIC_DEADLINE and
+ * the deadline goes right after the type; the server answers
+ * RES_TIMEOUT instead of serving a request whose deadline has passed.
+ */
+
+#ifndef _SNFS_WIRE_H_
+#define _SNFS_WIRE_H_
+
+#include <snfs_proto.h>
+
+
+// first byte of every compact message (or of a request with a deadline)
+#define SNFS_WIRE_MAGIC 0xC5
+#define SNFS_WIRE_MAGIC_DEADLINE 0xC6
+
+// upper bound of the size of an encoded message
+#define SNFS_WIRE_MAX (sizeof(snfs_msg_res_t) + 64)
+
+
+/*
+ * snfs_wire_is_compact: tells if the message in 'buf' is compact
+ *   returns: 1 if it is, 0 if it is a fixed message
+ */
+int snfs_wire_is_compact(const char* buf, int len);
+
+
+/*
+ * snfs_wire_encode_req/res: encode a fixed message into 'buf', which
+ * must hold SNFS_WIRE_MAX bytes
+ *   returns: size of the encoded message
+ */
+int snfs_wire_encode_req(const snfs_msg_req_t* req, char* buf);
+int snfs_wire_encode_res(const snfs_msg_res_t* res, char* buf);
+
+
+/*
+ * snfs_wire_encode_res_head: same as snfs_wire_encode_res, but the data
+ * of a REQ_READ response is left out (only its length is encoded), so
+ * that it can be sent from where it is, right after the encoding
+ *   returns: size of the encoded part
+ */
+int snfs_wire_encode_res_head(const snfs_msg_res_t* res, char* buf);
+
+
+/*
+ * snfs_wire_encode_req_deadline: same as snfs_wire_encode_req, with a
+ * deadline of 'usec' (none if 0)
+ *   returns: size of the encoded message
+ */
+int snfs_wire_encode_req_deadline(const snfs_msg_req_t* req, unsigned usec, char* buf);
+
+
+/*
+ * snfs_wire_req_deadline: the deadline of the compact request in 'buf'
+ *   returns: the deadline in us, 0 if it has none
+ */
+unsigned snfs_wire_req_deadline(const char* buf, int len);
+
+
+/*
+ * snfs_wire_decode_req/res: decode a compact message into a fixed one;
+ * only the header and the body of its type are written
+ *   returns: size the fixed message would have, or -1 if malformed
+ */
+int snfs_wire_decode_req(const char* buf, int len, snfs_msg_req_t* req);
+int snfs_wire_decode_res(const char* buf, int len, snfs_msg_res_t* res);
+
+
+/*
+ * snfs_wire_res_size: size of the fixed response of the given type
+ * (header plus the body of that type)
+ */
+int snfs_wire_res_size(snfs_msg_type_t type);
+
+
+#endif
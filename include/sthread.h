@@ -40,6 +40,54 @@ void sthread_init();
  *ARGUMENTO ADICONADO: int priority*/
 sthread_t sthread_create(sthread_start_func_t start_routine, void *arg,int priority);
 
+/**********************************************************************/
+/* Thread attributes: stack size, CPU affinity and NUMA placement     */
+/**********************************************************************/
+
+/* Highest number of CPUs that can be named in an affinity mask */
+#define STHREAD_MAX_CPUS 64
+
+/* Creation attributes. Always initialize with sthread_attr_init before
+ * setting individual fields.
+ * - stack_size: bytes of stack for the new thread, 0 for the default
+ * - cpu_mask: bit i set allows the thread to run on CPU i, 0 for any CPU
+ * - numa_node: preferred memory node, -1 for no preference
+ *
+ * The pthread implementation honours all fields. The user-level
+ * implementation runs every sthread on a single kernel thread, so it
+ * only honours stack_size.
+ */
+typedef struct {
+  unsigned int stack_size;
+  unsigned long long cpu_mask;
+  int numa_node;
+} sthread_attr_t;
+
+/* Reset attr to the defaults (default stack, any CPU, any node) */
+void sthread_attr_init(sthread_attr_t *attr);
+
+/* Set the stack size, in bytes, of threads created with attr */
+void sthread_attr_setstacksize(sthread_attr_t *attr, unsigned int size);
+
+/* Replace the affinity mask: bit i allows CPU i */
+void sthread_attr_setaffinity(sthread_attr_t *attr, unsigned long long cpu_mask);
+
+/* Add one CPU to the affinity mask */
+void sthread_attr_setcpu(sthread_attr_t *attr, int cpu);
+
+/* Prefer the CPUs of NUMA node 'node'. When a cpu_mask is also given
+ * the thread is restricted to the CPUs present in both. */
+void sthread_attr_setnumanode(sthread_attr_t *attr, int node);
+
+/* Return the number of online CPUs (at least 1) */
+int sthread_num_cpus(void);
+
+/* Same as sthread_create but the thread is placed according to attr
+ * (NULL means the defaults). Returns NULL if the attributes can not
+ * be applied. */
+sthread_t sthread_create_attr(sthread_start_func_t start_routine, void *arg,
+			      int priority, const sthread_attr_t *attr);
+
 /* Exit the calling thread with return value ret.
  * Note: In this version of simplethreads, there is no way
  * to retrieve the return value.
@@ -53,16 +101,42 @@ void  sthread_yield(void);
 
 
 /* Suspends current thread for the time specified. The time is defined
- * in milliseconds (e.g. 1s -> time=1000). Returns 0 if successful.
+ * in microseconds (e.g. 1s -> time=1000000). Returns 0 if successful.
+ * The user-level implementation rounds down to its 10 ms clock tick.
  */
 int sthread_sleep(int time);
 
+/* Nanoseconds elapsed on a monotonic clock. Only differences between
+ * two calls are meaningful. */
+unsigned long long sthread_now(void);
+
 
 int sthread_join(sthread_t thread, void **value_ptr);
 
  /*Invocacao do Dump pela tarefa*/
 void sthread_dump();
 
+/**********************************************************************/
+/* Thread-local storage                                               */
+/**********************************************************************/
+
+/* Maximum number of keys that can be created by a program */
+#define STHREAD_KEYS_MAX 32
+
+typedef int sthread_key_t;
+
+/* Create a new key, visible to all threads, whose value starts as NULL
+ * in every thread. When a thread exits with a non-NULL value for the
+ * key, destructor (if not NULL) is called with that value.
+ * Returns 0 if successful, -1 if all keys are in use. */
+int sthread_key_create(sthread_key_t *key, void (*destructor)(void *));
+
+/* Return the calling thread's value for key (NULL if never set) */
+void *sthread_getspecific(sthread_key_t key);
+
+/* Set the calling thread's value for key. Returns 0 if successful */
+int sthread_setspecific(sthread_key_t key, const void *value);
+
 /**********************************************************************/
 /* Synchronization Primitives: Mutexs and Condition Variables         */
 /**********************************************************************/
@@ -82,6 +156,12 @@ void sthread_mutex_lock(sthread_mutex_t lock);
 /* Release the lock. Assumed that the calling thread owns the lock */
 void sthread_mutex_unlock(sthread_mutex_t lock);
 
+/* Name the lock's class for the lock dependency checker (library built
+ * with -DSTHREAD_LOCKDEP). Locks with the same name share a class and
+ * their acquisition order is checked together; unnamed locks are a
+ * class of their own. Does nothing in normal builds. */
+void sthread_mutex_setname(sthread_mutex_t lock, const char *name);
+
 typedef struct _sthread_mon *sthread_mon_t;
 
 /* Return a new, unlocked monitor */
@@ -97,9 +177,17 @@ void sthread_monitor_enter(sthread_mon_t mon);
 /* Exit the monitor's critical section. */
 void sthread_monitor_exit(sthread_mon_t mon);
 
+/* Same as sthread_mutex_setname, for monitors */
+void sthread_monitor_setname(sthread_mon_t mon, const char *name);
+
 /* Wait on monitor, blocking if neccessary. */
 void sthread_monitor_wait(sthread_mon_t mon);
 
+/* Wait on monitor for at most 'time' microseconds. Like
+ * sthread_monitor_wait, the monitor is held again on return.
+ * Returns 0 if signalled, 1 if the time expired. */
+int sthread_monitor_timedwait(sthread_mon_t mon, int time);
+
 /* Signal the monitor's waiters */
 void sthread_monitor_signal(sthread_mon_t mon);
 
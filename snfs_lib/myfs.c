@@ -50,6 +50,9 @@ int my_init_lib()
 		printf("[my_init_lib] Unable to initialize SNFS API.\n");
 		return -1;
 	}
+	// pipelined transport when the server offers it, datagrams otherwise
+	if(snfs_init_stream(SERVER_SOCK) < 0)
+		dprintf("[my_init_lib] Stream transport not available.\n");
 	Open_files_list = queue_create();
 	Lib_initted = 1;
 	
@@ -172,33 +175,19 @@ int my_read(int fileId, char* buffer, unsigned numBytes)
 		return 0;
 	
 	int nread;
-	unsigned rBytes;
-	int counter = 0;
 	
 	// If bytes to be read are greater than file size
 	if(fdesc->size < ((unsigned)fdesc->read_offset) + numBytes)
 		numBytes = fdesc->size - (unsigned)(fdesc->read_offset);
 	
-	//if data must be read using blocks
-	if(numBytes > MAX_READ_DATA)
-		rBytes = MAX_READ_DATA;
-	else
-		rBytes = numBytes;
-	
-	while(numBytes) {
-		if(rBytes > numBytes)
-			rBytes = numBytes;
-		
-		if (snfs_read(fileId,(unsigned)fdesc->read_offset,rBytes,&buffer[counter],&nread) != STAT_OK) {
-			printf("[my_read] Error reading from file.\n");
-			return -1;
-		}
-		fdesc->read_offset += nread;
-		numBytes -= (unsigned)nread;
-		counter += nread;
+	// the API splits it in bulk (or MAX_READ_DATA) requests
+	if (snfs_read_bulk(fileId,(unsigned)fdesc->read_offset,numBytes,buffer,&nread) != STAT_OK) {
+		printf("[my_read] Error reading from file.\n");
+		return -1;
 	}
+	fdesc->read_offset += nread;
 	
-	return counter;
+	return nread;
 }
 
 int my_write(int fileId, char* buffer, unsigned numBytes)
@@ -214,30 +203,17 @@ int my_write(int fileId, char* buffer, unsigned numBytes)
 		return -1;
 	}
 	
-	unsigned fsize;
-	unsigned wBytes;
-	int counter = 0;
-	
-	if(numBytes > MAX_WRITE_DATA)
-		wBytes = MAX_WRITE_DATA;
-	else
-		wBytes = numBytes;
+	unsigned fsize = fdesc->size;
 	
-	while(numBytes) {
-		if(wBytes > numBytes)
-			wBytes = numBytes;
-		
-		if (snfs_write(fileId,(unsigned)fdesc->write_offset,wBytes,&buffer[counter],&fsize) != STAT_OK) {
-			printf("[my_write] Error writing to file.\n");
-			return -1;
-		}
-		fdesc->size = fsize;
-		fdesc->write_offset += (int)wBytes;
-		numBytes -= (unsigned)wBytes;
-		counter += (int)wBytes;
+	// the API splits it in bulk (or MAX_WRITE_DATA) requests
+	if (snfs_write_bulk(fileId,(unsigned)fdesc->write_offset,numBytes,buffer,&fsize) != STAT_OK) {
+		printf("[my_write] Error writing to file.\n");
+		return -1;
 	}
+	fdesc->size = fsize;
+	fdesc->write_offset += (int)numBytes;
 	
-	return counter;
+	return (int)numBytes;
 }
 
 int my_close(int fileId)
@@ -796,8 +772,9 @@ int my_append(char *nameOrigem,char *nameDestino){
 			return 0;
 }
 
-/*Efecutar do lado do servidor a desfragmentacao do disco associado ao sistema de ficheiros.
- * Devolve 1 se teve sucesso, 0 caso esteja em curso uma operacao de desfragmentacao que ainda nao
+/*Lancar do lado do servidor a desfragmentacao do disco associado ao sistema de ficheiros, que
+ * corre em segundo plano (ver snfs_defrag_status).
+ * Devolve 1 se foi lancada, 0 caso esteja em curso uma operacao de desfragmentacao que ainda nao
  * terminou e -1 caso nao haja disponibilidade de espaco em disco para realizar a desfragmentacao*/
 int my_defrag(){
 		
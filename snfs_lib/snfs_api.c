@@ -9,9 +9,13 @@
  * for futher information about the services.
  */
 
+#define _DEFAULT_SOURCE 1		// usleep
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -21,6 +25,7 @@
 
 #include <snfs_api.h>
 #include <snfs_proto.h>
+#include <snfs_wire.h>
 
 
 /*
@@ -33,8 +38,75 @@ static int Cli_sock;
 // the client socket address
 static struct sockaddr_un Cli_addr;
 
-// the server socket address
-static struct sockaddr_un Serv_addr;
+// the socket addresses of the server shards
+static struct sockaddr_un Serv_addr[SNFS_MAX_SHARDS];
+static int Num_shards = 1;
+
+// messages go in the compact format (snfs_wire.h) unless the server
+// turns out to only know the fixed one
+static int Wire_compact = 1;
+
+// deadline sent with every compact request (snfs_set_deadline), in us
+static unsigned Deadline_us = 0;
+
+// stream transport (snfs_init_stream): connection to the server, the
+// frames waiting to be written and the bytes received not yet parsed
+// (which must hold a whole bulk read response)
+#define STREAM_BUF_SIZE (64*1024)
+
+static int Stream_sock = -1;
+static snfs_req_serial_num_t Next_serial = 1;
+static char Stream_out[STREAM_BUF_SIZE];
+static int Stream_outlen = 0;
+static char Stream_in[STREAM_BUF_SIZE + SNFS_MAX_BULK_DATA];
+static int Stream_inlen = 0;
+
+// bulk messages on the stream: -1 until the server is asked once
+static int Bulk_ok = -1;
+
+// asynchronous calls (snfs_*_async): the request, kept to send it again
+// if the server is busy, where its results go and what to run once it
+// finishes. 'slot' is its Pending slot while in flight on the stream,
+// -1 once done without it ('status' is then the size of 'res' or -1).
+// 'resend' is set while it waits to be sent again (the server was busy).
+static struct {
+   int used;
+   int gen;				// tells apart the calls of an entry
+   snfs_msg_req_t req;
+   int reqsz;
+   const char* data;			// bulk write data
+   int slot;
+   int status;
+   int retries;
+   long long resend;			// when to send it again (us), 0 if not waiting
+   snfs_msg_res_t res;
+   char* buffer;
+   int* nread;
+   unsigned* fsize;
+   snfs_fhandle_t* file;
+   snfs_callback_t callback;
+   void* arg;
+} Async[SNFS_MAX_OUTSTANDING];
+
+// a request the server turns away (RES_BUSY) is sent again after a
+// pause of SNFS_BUSY_PAUSE us, doubled each time, at most
+// SNFS_BUSY_RETRIES times
+#define SNFS_BUSY_RETRIES 8
+#define SNFS_BUSY_PAUSE 200
+
+// requests sent on the stream and not yet collected; 'res' receives
+// the response and 'status' its size once it arrives (-1 on error);
+// the data of a bulk read goes to 'data' (at most 'datamax' bytes)
+static struct {
+   snfs_req_serial_num_t serial;	// 0 if the slot is free
+   snfs_msg_res_t* res;
+   int ressz;
+   char* data;
+   unsigned datamax;
+   int done;
+   int status;
+   int compact;				// the response came in the compact format
+} Pending[SNFS_MAX_OUTSTANDING];
 
 
 /*
@@ -42,18 +114,285 @@ static struct sockaddr_un Serv_addr;
  */
 
 /*
- * Makes a remote call, sending 'req' to the server (defined in the global variable Serv_addr)
- * and waiting for the response.
-*/
+ * Chooses the shard that serves 'req' from the handle it carries: the
+ * file for reads and writes, the directory for the operations on names.
+ * Lookups only have the pathname, so they hash it and may go to another
+ * shard than the later requests on the handle they return; requests
+ * without a handle go to shard 0. The shards share the file system,
+ * whose locks order the requests, not the queues.
+ */
 
-static int remote_call(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+static int req_shard(snfs_msg_req_t *req)
+{
+   unsigned h = 0;
+   char* c;
+
+   if (Num_shards == 1)
+      return 0;
+   switch (req->type) {
+      case REQ_READ:    h = req->body.read.fhandle; break;
+      case REQ_WRITE:   h = req->body.write.fhandle; break;
+      case REQ_CREATE:  h = req->body.create.dir; break;
+      case REQ_MKDIR:   h = req->body.mkdir.dir; break;
+      case REQ_READDIR: h = req->body.readdir.dir; break;
+      case REQ_REMOVE:  h = req->body.remove.dir; break;
+      case REQ_COPY:    h = req->body.copy.src_dir; break;
+      case REQ_APPEND:  h = req->body.append.dir1; break;
+      case REQ_READ_BULK:
+      case REQ_WRITE_BULK: h = req->body.bulk.fhandle; break;
+      case REQ_LOOKUP:
+         for (c = req->body.lookup.pname; *c; c++)
+            h = h * 31 + (unsigned char)*c;
+         break;
+      default:
+         return 0;
+   }
+   return h % Num_shards;
+}
+
+
+/*
+ * Message formats: 'wire_out' gives the bytes to send for 'req' and
+ * 'wire_in' fills 'res' from a received message of either format
+ */
+
+static char* wire_out(snfs_msg_req_t *req, int* reqsz, char* buf)
+{
+   if (!Wire_compact)
+      return (char*)req;
+   *reqsz = snfs_wire_encode_req_deadline(req, Deadline_us, buf);
+   return buf;
+}
+
+static int wire_in(const char* buf, int len, snfs_msg_res_t *res, int ressz)
+{
+   if (snfs_wire_is_compact(buf, len))
+      return snfs_wire_decode_res(buf, len, res);
+   if (len > ressz)
+      len = ressz;
+   memcpy(res, buf, len);
+   return len;
+}
+
+
+/*
+ * Stream transport: requests are queued with stream_post, written in
+ * batches by stream_flush and collected in any order with stream_wait.
+ */
+
+static void stream_close()
+{
+   close(Stream_sock);
+   Stream_sock = -1;
+   for (int i = 0; i < SNFS_MAX_OUTSTANDING; i++)
+      if (Pending[i].serial != 0 && !Pending[i].done) {
+         Pending[i].done = 1;
+         Pending[i].status = -1;
+      }
+}
+
+/* writes all the iovecs, resuming partial writes */
+static int stream_sendv(struct iovec* iov, int iovcnt)
+{
+   struct msghdr msg;
+   ssize_t status;
+
+   while (iovcnt > 0) {
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = iovcnt;
+      status = sendmsg(Stream_sock, &msg, MSG_NOSIGNAL);
+      if (status < 0) {
+         if (errno == EINTR) continue;
+         printf("[snfs_api] stream send error: %s.\n", strerror(errno));
+         stream_close();
+         return -1;
+      }
+      while (iovcnt > 0 && (size_t)status >= iov->iov_len) {
+         status -= iov->iov_len;
+         iov++; iovcnt--;
+      }
+      if (iovcnt > 0) {
+         iov->iov_base = (char*)iov->iov_base + status;
+         iov->iov_len -= status;
+      }
+   }
+   return 0;
+}
+
+static int stream_flush()
+{
+   struct iovec iov = { Stream_out, Stream_outlen };
+
+   if (Stream_outlen > 0 && stream_sendv(&iov, 1) < 0)
+      return -1;
+   Stream_outlen = 0;
+   return 0;
+}
+
+/* queues 'req' and returns the pending slot of its response, or -1 if
+ * SNFS_MAX_OUTSTANDING requests are already in flight. Bulk requests
+ * are written right away, their 'data' straight from the caller's
+ * buffer; the data of a bulk read response goes to 'rdata'. */
+static int stream_post_bulk(snfs_msg_req_t *req, int reqsz, const char* data,
+   unsigned datalen, snfs_msg_res_t *res, int ressz, char* rdata, unsigned rmax)
+{
+   snfs_frame_hdr_t hdr;
+   char wire[SNFS_WIRE_MAX];
+   char* msg = wire_out(req, &reqsz, wire);
+   int slot;
+
+   if (Stream_sock < 0)
+      return -1;
+   for (slot = 0; slot < SNFS_MAX_OUTSTANDING && Pending[slot].serial != 0; slot++);
+   if (slot == SNFS_MAX_OUTSTANDING)
+      return -1;
+
+   hdr.len = reqsz + datalen;
+   hdr.serial = Next_serial++;
+   if (Next_serial <= 0)
+      Next_serial = 1;
+   if (data != NULL) {
+      struct iovec iov[3] = {
+         { &hdr, sizeof(hdr) }, { msg, reqsz }, { (char*)data, datalen }
+      };
+      if (stream_flush() < 0 || stream_sendv(iov, 3) < 0)
+         return -1;
+   } else {
+      if (Stream_outlen + sizeof(hdr) + reqsz > STREAM_BUF_SIZE && stream_flush() < 0)
+         return -1;
+      memcpy(Stream_out + Stream_outlen, &hdr, sizeof(hdr));
+      memcpy(Stream_out + Stream_outlen + sizeof(hdr), msg, reqsz);
+      Stream_outlen += sizeof(hdr) + reqsz;
+   }
+
+   Pending[slot].serial = hdr.serial;
+   Pending[slot].res = res;
+   Pending[slot].ressz = ressz;
+   Pending[slot].data = rdata;
+   Pending[slot].datamax = rmax;
+   Pending[slot].done = 0;
+   Pending[slot].status = -1;
+   return slot;
+}
+
+static int stream_post(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
    int ressz)
+{
+   return stream_post_bulk(req, reqsz, NULL, 0, res, ressz, NULL, 0);
+}
+
+/* completes slot i with the frame payload 'msg'; the data of a bulk
+ * read response is its last 'count' bytes */
+static void stream_complete(int i, const char* msg, unsigned len)
+{
+   snfs_msg_res_t* res = Pending[i].res;
+   int status = wire_in(msg, len, res, Pending[i].ressz);
+
+   if (status >= 0 && Pending[i].data != NULL && res->type == REQ_READ_BULK &&
+       res->status == RES_OK) {
+      unsigned n = res->body.bulk.count;
+      if (n > Pending[i].datamax || n > len)
+         status = -1;
+      else
+         memcpy(Pending[i].data, msg + len - n, n);
+   }
+   Pending[i].status = status;
+   Pending[i].compact = snfs_wire_is_compact(msg, len);
+   Pending[i].done = 1;
+}
+
+/* receives frames until there are none left in the socket buffer (or,
+ * if 'block', at least one arrived), completing their pending slots */
+static int stream_receive(int block)
+{
+   snfs_frame_hdr_t hdr;
+   int pos = 0, status, i;
+
+   status = recv(Stream_sock, Stream_in + Stream_inlen, sizeof(Stream_in) - Stream_inlen,
+                 block ? 0 : MSG_DONTWAIT);
+   if (status < 0 && !block && errno == EAGAIN)
+      return 0;
+   if (status <= 0) {
+      if (status < 0)
+         printf("[snfs_api] stream recv error: %s.\n", strerror(errno));
+      else
+         printf("[snfs_api] server is closed.\n");
+      stream_close();
+      return -1;
+   }
+   Stream_inlen += status;
+
+   while (Stream_inlen - pos >= (int)sizeof(hdr)) {
+      memcpy(&hdr, Stream_in + pos, sizeof(hdr));
+      if (hdr.len > sizeof(snfs_msg_res_t) + SNFS_MAX_BULK_DATA) {
+         printf("[snfs_api] malformed frame.\n");
+         stream_close();
+         return -1;
+      }
+      if (Stream_inlen - pos < (int)(sizeof(hdr) + hdr.len))
+         break;
+      for (i = 0; i < SNFS_MAX_OUTSTANDING; i++)
+         if (Pending[i].serial == hdr.serial && !Pending[i].done) {
+            stream_complete(i, Stream_in + pos + sizeof(hdr), hdr.len);
+            break;
+         }
+      pos += sizeof(hdr) + hdr.len;
+   }
+   memmove(Stream_in, Stream_in + pos, Stream_inlen - pos);
+   Stream_inlen -= pos;
+   return 0;
+}
+
+/* waits for the response of the given slot and frees the slot;
+ * returns the size of the response or -1 */
+static int stream_wait(int slot)
 {
    int status;
+
+   if (Stream_outlen > 0 && stream_flush() < 0)
+      return -1;
+   while (!Pending[slot].done)
+      if (stream_receive(1) < 0)
+         break;
+   status = Pending[slot].status;
+   Pending[slot].serial = 0;
+   return status;
+}
+
+
+/* posts a request on the stream and waits for its response, sending it
+ * again while the server is busy; see stream_post_bulk for the rest */
+static int stream_call_bulk(snfs_msg_req_t *req, int reqsz, const char* data,
+   unsigned datalen, snfs_msg_res_t *res, int ressz, char* rdata, unsigned rmax)
+{
+   int slot, status, retry;
+
+   for (retry = 0; ; retry++) {
+      slot = stream_post_bulk(req, reqsz, data, datalen, res, ressz, rdata, rmax);
+      if (slot < 0) {
+         printf("[snfs_api] too many requests in flight.\n");
+         return -1;
+      }
+      status = stream_wait(slot);
+      if (status < 0 || res->status != RES_BUSY || retry == SNFS_BUSY_RETRIES)
+         return status;
+      usleep(SNFS_BUSY_PAUSE << retry);
+   }
+}
+
+/* one datagram each way, to the server shard chosen by req_shard */
+static int dgram_call(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+   int ressz)
+{
+   int status, sentsz = reqsz;
+   int shard = req_shard(req);
+   char wire[SNFS_WIRE_MAX];
+   char* msg;
    
-   
-   status = sendto(Cli_sock, (void*)req, reqsz, 0, 
-      (struct sockaddr *)&Serv_addr, sizeof(Serv_addr));
+   msg = wire_out(req, &sentsz, wire);
+   status = sendto(Cli_sock, (void*)msg, sentsz, 0, 
+      (struct sockaddr *)&Serv_addr[shard], sizeof(Serv_addr[shard]));
    if (status < 0) {
      //printf("DEBUG: serv_addr: %s\n", Serv_addr.sun_path);
       printf("[snfs_api] sendto error: %s.\n", strerror(errno));
@@ -61,7 +400,7 @@ static int remote_call(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res,
    }
   
    // waits for an answer
-   status = recvfrom(Cli_sock, res, ressz, 0, NULL, NULL);
+   status = recvfrom(Cli_sock, wire, sizeof(wire), 0, NULL, NULL);
    if (status < 0) {
       printf("[snfs_api] recvfrom error: %s.\n", strerror(errno));
       return -1;
@@ -71,7 +410,35 @@ static int remote_call(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res,
       return -1;
    }
 
-   return status;
+   // a server without the compact format does not know the request
+   if (msg == wire && !snfs_wire_is_compact(wire, status)) {
+      Wire_compact = 0;
+      return dgram_call(req, reqsz, res, ressz);
+   }
+   return wire_in(wire, status, res, ressz);
+}
+
+
+/*
+ * Makes a remote call, sending 'req' to the server shard chosen by req_shard
+ * (addresses in the global variable Serv_addr) and waiting for the response.
+*/
+
+static int remote_call(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+   int ressz)
+{
+   int status, retry;
+   
+   // on a stream connection the call is one frame each way
+   if (Stream_sock >= 0)
+      return stream_call_bulk(req, reqsz, NULL, 0, res, ressz, NULL, 0);
+   
+   for (retry = 0; ; retry++) {
+      status = dgram_call(req, reqsz, res, ressz);
+      if (status < 0 || res->status != RES_BUSY || retry == SNFS_BUSY_RETRIES)
+         return status;
+      usleep(SNFS_BUSY_PAUSE << retry);
+   }
 }
 
 
@@ -81,6 +448,64 @@ static int remote_call(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res,
 
 int snfs_init(char* cli_name, char* server_name)
 {
+   return snfs_init_shards(cli_name, server_name, 1);
+}
+
+
+int snfs_init_stream(char* server_name)
+{
+   struct sockaddr_un addr;
+
+   if ((Stream_sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+      printf("[snfs_api] socket error: %s.\n", strerror(errno));
+      return -1;
+   }
+   bzero(&addr, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   snprintf(addr.sun_path, sizeof(addr.sun_path), SNFS_STREAM_SOCK_FMT, server_name);
+   if (connect(Stream_sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+      close(Stream_sock);
+      Stream_sock = -1;
+      return -1;
+   }
+   Stream_outlen = Stream_inlen = 0;
+   memset(Pending, 0, sizeof(Pending));
+   for (int i = 0; i < SNFS_MAX_OUTSTANDING; i++)
+      Async[i].used = 0;
+   Bulk_ok = -1;
+
+   // requests in flight cannot be resent in the other format, so the
+   // server's format is found out before: an empty compact request is
+   // answered as unknown, in the compact format only by a server that
+   // knows it
+   if (Wire_compact) {
+      snfs_msg_req_t req;
+      snfs_msg_res_t res;
+      int slot;
+
+      memset(&req, 0, sizeof(req));
+      req.type = REQ_NULL;
+      if ((slot = stream_post(&req, sizeof(req.type), &res, sizeof(res))) < 0 ||
+          stream_wait(slot) < 0)
+         return -1;
+      Wire_compact = Pending[slot].compact;
+   }
+   return 0;
+}
+
+
+void snfs_set_deadline(unsigned msec)
+{
+   Deadline_us = msec * 1000;
+}
+
+
+int snfs_init_shards(char* cli_name, char* server_name, int nshards)
+{
+   if (nshards < 1 || nshards > SNFS_MAX_SHARDS) {
+      printf("[snfs_api] invalid number of shards.\n");
+      return -1;
+   }
    if (cli_name == NULL || server_name == NULL) {
       printf("[snfs_api] invalid client/server address names.\n");
       return -1;
@@ -108,12 +533,17 @@ int snfs_init(char* cli_name, char* server_name)
       return -1;
    }
 
-   // server structure address cleaning
-   bzero(&Serv_addr, sizeof(Serv_addr));
-   Serv_addr.sun_family = AF_UNIX;
-
-     //printf("DEBUG: serv_addr initialized to: %s\n", Serv_addr.sun_path);
-   strcpy(Serv_addr.sun_path, server_name);
+   // server structure addresses cleaning
+   bzero(Serv_addr, sizeof(Serv_addr));
+   for (int i = 0; i < nshards; i++) {
+      Serv_addr[i].sun_family = AF_UNIX;
+      if (i == 0)
+         strcpy(Serv_addr[i].sun_path, server_name);
+      else
+         snprintf(Serv_addr[i].sun_path, sizeof(Serv_addr[i].sun_path),
+                  SNFS_SHARD_SOCK_FMT, server_name, i);
+   }
+   Num_shards = nshards;
    return 0;
 }
 
@@ -232,6 +662,479 @@ snfs_call_status_t snfs_write(snfs_fhandle_t fhandle, unsigned offset,
 }
 
 
+/* the response buffers of the chunks in flight of a bulk transfer */
+static snfs_msg_res_t Bulk_res[SNFS_MAX_OUTSTANDING];
+
+/* tells if the bulk messages can be used: only on the stream, in the
+ * compact format, and if the server knows them (asked once) */
+static int bulk_supported()
+{
+	snfs_msg_req_t req;
+	snfs_msg_res_t res;
+	
+	if (Stream_sock < 0 || !Wire_compact)
+		return 0;
+	if (Bulk_ok < 0) {
+		// an empty read: any answer but RES_UNKNOWN will do
+		memset(&req,0,sizeof(req));
+		memset(&res,0,sizeof(res));
+		req.type = REQ_READ_BULK;
+		Bulk_ok = remote_call(&req, sizeof(req.type) + sizeof(req.body.bulk),
+		                      &res, sizeof(res)) >= 0 && res.status != RES_UNKNOWN;
+	}
+	return Bulk_ok;
+}
+
+/* the request of one chunk of a bulk transfer: a bulk message or, if
+ * the server has none, a plain read/write; returns its size */
+static int read_chunk_req(snfs_msg_req_t* req, int bulk, snfs_fhandle_t fhandle,
+   unsigned offset, unsigned count)
+{
+	memset(req, 0, sizeof(*req));
+	if (bulk) {
+		req->type = REQ_READ_BULK;
+		req->body.bulk.fhandle = fhandle;
+		req->body.bulk.offset = offset;
+		req->body.bulk.count = count;
+		return sizeof(req->type) + sizeof(req->body.bulk);
+	}
+	req->type = REQ_READ;
+	req->body.read.fhandle = fhandle;
+	req->body.read.offset = offset;
+	req->body.read.count = count;
+	return sizeof(req->type) + sizeof(req->body.read);
+}
+
+static int write_chunk_req(snfs_msg_req_t* req, int bulk, snfs_fhandle_t fhandle,
+   unsigned offset, unsigned count, const char* data)
+{
+	memset(req, 0, sizeof(*req));
+	if (bulk) {
+		// the data is sent straight from the caller's buffer
+		req->type = REQ_WRITE_BULK;
+		req->body.bulk.fhandle = fhandle;
+		req->body.bulk.offset = offset;
+		req->body.bulk.count = count;
+		return sizeof(req->type) + sizeof(req->body.bulk);
+	}
+	req->type = REQ_WRITE;
+	req->body.write.fhandle = fhandle;
+	req->body.write.offset = offset;
+	req->body.write.count = count;
+	memcpy(req->body.write.data, data, count);
+	return sizeof(req->type) + sizeof(req->body.write);
+}
+
+snfs_call_status_t snfs_read_bulk(snfs_fhandle_t fhandle, unsigned offset,
+   unsigned count, char* buffer, int* nread)
+{
+	snfs_msg_req_t req;
+	int slot[SNFS_MAX_OUTSTANDING];
+	unsigned chunk[SNFS_MAX_OUTSTANDING];
+	unsigned posted = 0, done = 0;
+	int head = 0, tail = 0, inflight = 0, n, reqsz, status, eof = 0, error = 0;
+	int bulk = bulk_supported();
+	unsigned max = bulk ? SNFS_MAX_BULK_DATA : MAX_READ_DATA;
+	
+	*nread = 0;
+	while (done < count) {
+		// without a stream, one chunk per round trip
+		if (Stream_sock < 0) {
+			n = count - done > MAX_READ_DATA ? MAX_READ_DATA : count - done;
+			if (snfs_read(fhandle, offset + done, n, buffer + done, &n) != STAT_OK)
+				return STAT_ERROR;
+			done += n;
+			*nread = done;
+			if (n == 0)
+				break;
+			continue;
+		}
+		
+		// fill the window, then collect the oldest chunk
+		while (!eof && !error && posted < count && inflight < SNFS_MAX_OUTSTANDING) {
+			// bulk data lands straight in the caller's buffer
+			chunk[tail] = count - posted > max ? max : count - posted;
+			reqsz = read_chunk_req(&req, bulk, fhandle, offset + posted, chunk[tail]);
+			slot[tail] = stream_post_bulk(&req, reqsz, NULL, 0, &Bulk_res[tail],
+			                              sizeof(Bulk_res[tail]),
+			                              bulk ? buffer + posted : NULL, chunk[tail]);
+			if (slot[tail] < 0)
+				break;
+			posted += chunk[tail];
+			tail = (tail + 1) % SNFS_MAX_OUTSTANDING;
+			inflight++;
+		}
+		if (inflight == 0)
+			break;
+		
+		status = stream_wait(slot[head]);
+		if (status >= 0 && Bulk_res[head].status == RES_BUSY) {
+			// turned away: asked for again on its own, so the chunks
+			// still complete in order (past the end of file it is moot)
+			if (eof) {
+				Bulk_res[head].status = RES_OK;
+			} else {
+				reqsz = read_chunk_req(&req, bulk, fhandle, offset + done, chunk[head]);
+				status = stream_call_bulk(&req, reqsz, NULL, 0, &Bulk_res[head],
+				                          sizeof(Bulk_res[head]),
+				                          bulk ? buffer + done : NULL, chunk[head]);
+			}
+		}
+		if (status < 0 || Bulk_res[head].status != RES_OK)
+			error = 1;
+		else if (!eof) {
+			if (bulk) {
+				n = Bulk_res[head].body.bulk.count;
+			} else {
+				n = Bulk_res[head].body.read.nread;
+				memcpy(buffer + done, Bulk_res[head].body.read.data, n);
+			}
+			done += n;
+			if ((unsigned)n < chunk[head])
+				eof = 1;	// the chunks after this one are discarded
+		}
+		head = (head + 1) % SNFS_MAX_OUTSTANDING;
+		inflight--;
+		if ((eof || error) && inflight == 0)
+			break;
+	}
+	*nread = done;
+	return error ? STAT_ERROR : STAT_OK;
+}
+
+
+snfs_call_status_t snfs_write_bulk(snfs_fhandle_t fhandle, unsigned offset, 
+   unsigned count, char* buffer, unsigned int* fsize)
+{
+	snfs_msg_req_t req;
+	int slot[SNFS_MAX_OUTSTANDING];
+	unsigned at[SNFS_MAX_OUTSTANDING], len[SNFS_MAX_OUTSTANDING];
+	unsigned posted = 0, size = *fsize, n;
+	int head = 0, tail = 0, inflight = 0, reqsz, status, error = 0;
+	int bulk = bulk_supported();
+	unsigned max = bulk ? SNFS_MAX_BULK_DATA : MAX_WRITE_DATA;
+	
+	while (posted < count || inflight > 0) {
+		n = count - posted > max ? max : count - posted;
+		
+		// a chunk that grows the file must reach the server after the
+		// ones before it (the server appends at the end of the file),
+		// so it waits for the window to drain; overwrites are pipelined
+		int grows = offset + posted + n > size;
+		
+		if (Stream_sock >= 0 && !error && posted < count &&
+		    inflight < SNFS_MAX_OUTSTANDING && !(grows && inflight > 0)) {
+			reqsz = write_chunk_req(&req, bulk, fhandle, offset + posted, n, buffer + posted);
+			slot[tail] = stream_post_bulk(&req, reqsz, bulk ? buffer + posted : NULL,
+			                              bulk ? n : 0, &Bulk_res[tail],
+			                              sizeof(Bulk_res[tail]), NULL, 0);
+			if (slot[tail] >= 0) {
+				at[tail] = posted;
+				len[tail] = n;
+				posted += n;
+				tail = (tail + 1) % SNFS_MAX_OUTSTANDING;
+				inflight++;
+				if (!grows)
+					continue;
+			} else if (inflight == 0 && Stream_sock >= 0) {
+				error = 1;
+			}
+		}
+		
+		if (inflight > 0) {
+			status = stream_wait(slot[head]);
+			if (status >= 0 && Bulk_res[head].status == RES_BUSY) {
+				// turned away: written again on its own (a chunk that
+				// grows the file is always alone in flight)
+				const char* data = buffer + at[head];
+				reqsz = write_chunk_req(&req, bulk, fhandle, offset + at[head], len[head], data);
+				status = stream_call_bulk(&req, reqsz, bulk ? data : NULL, bulk ? len[head] : 0,
+				                          &Bulk_res[head], sizeof(Bulk_res[head]), NULL, 0);
+			}
+			if (status < 0 || Bulk_res[head].status != RES_OK)
+				error = 1;
+			else if (bulk && Bulk_res[head].body.bulk.fsize > size)
+				size = Bulk_res[head].body.bulk.fsize;
+			else if (!bulk && Bulk_res[head].body.write.fsize > size)
+				size = Bulk_res[head].body.write.fsize;
+			head = (head + 1) % SNFS_MAX_OUTSTANDING;
+			inflight--;
+		} else if (error) {
+			break;
+		} else if (Stream_sock < 0) {
+			// without a stream, one chunk per round trip
+			if (snfs_write(fhandle, offset + posted, n, buffer + posted, &size) != STAT_OK)
+				return STAT_ERROR;
+			posted += n;
+		}
+	}
+	*fsize = size;
+	return error ? STAT_ERROR : STAT_OK;
+}
+
+
+/*
+ * Asynchronous calls
+ */
+
+/* a free Async entry, cleared, or -1 */
+static int async_alloc()
+{
+	int i;
+	
+	for (i = 0; i < SNFS_MAX_OUTSTANDING && Async[i].used; i++);
+	if (i == SNFS_MAX_OUTSTANDING)
+		return -1;
+	memset(&Async[i].req, 0, sizeof(Async[i].req));
+	Async[i].used = 1;
+	Async[i].gen++;
+	Async[i].data = NULL;
+	Async[i].buffer = NULL;
+	Async[i].nread = NULL;
+	Async[i].fsize = NULL;
+	Async[i].file = NULL;
+	Async[i].retries = 0;
+	Async[i].resend = 0;
+	return i;
+}
+
+static snfs_handle_t async_handle(int i)
+{
+	return (Async[i].gen & 0xffffff) * SNFS_MAX_OUTSTANDING + i;
+}
+
+/* sends the request of entry i: posted on the stream, or done right
+ * away without it; returns -1 if it could not be sent */
+static int async_send(int i)
+{
+	snfs_msg_req_t* req = &Async[i].req;
+	int bulk_read = req->type == REQ_READ_BULK;
+	int bulk_write = req->type == REQ_WRITE_BULK;
+	
+	memset(&Async[i].res, 0, sizeof(Async[i].res));
+	if (Stream_sock < 0) {
+		Async[i].slot = -1;
+		Async[i].status = remote_call(req, Async[i].reqsz, &Async[i].res,
+		                              sizeof(Async[i].res));
+		return 0;
+	}
+	Async[i].slot = stream_post_bulk(req, Async[i].reqsz,
+	                                 bulk_write ? Async[i].data : NULL,
+	                                 bulk_write ? req->body.bulk.count : 0,
+	                                 &Async[i].res, sizeof(Async[i].res),
+	                                 bulk_read ? Async[i].buffer : NULL,
+	                                 bulk_read ? req->body.bulk.count : 0);
+	return Async[i].slot < 0 ? -1 : 0;
+}
+
+static snfs_handle_t async_start(int i, snfs_callback_t callback, void* arg)
+{
+	Async[i].callback = callback;
+	Async[i].arg = arg;
+	if (async_send(i) < 0) {
+		printf("[snfs_api] too many requests in flight.\n");
+		Async[i].used = 0;
+		return -1;
+	}
+	return async_handle(i);
+}
+
+static int async_done(int i)
+{
+	return Async[i].resend == 0 && (Async[i].slot < 0 || Pending[Async[i].slot].done);
+}
+
+/* monotonic clock, in us */
+static long long now_us()
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* sends again the calls the server turned away whose pause is over; one
+ * that cannot be sent finishes with an error */
+static void async_resend()
+{
+	long long now = now_us();
+	int i;
+	
+	for (i = 0; i < SNFS_MAX_OUTSTANDING; i++) {
+		if (!Async[i].used || Async[i].resend == 0 || Async[i].resend > now)
+			continue;
+		Async[i].resend = 0;
+		if (async_send(i) < 0)
+			Async[i].status = -1;
+	}
+}
+
+/* us until the next call turned away is sent again, -1 if none waits */
+static long long async_next_resend()
+{
+	long long next = -1, now = now_us(), left;
+	int i;
+	
+	for (i = 0; i < SNFS_MAX_OUTSTANDING; i++) {
+		if (!Async[i].used || Async[i].resend == 0)
+			continue;
+		left = Async[i].resend > now ? Async[i].resend - now : 0;
+		if (next < 0 || left < next)
+			next = left;
+	}
+	return next;
+}
+
+/* finishes the call of entry i, whose response arrived: fills its
+ * [out] arguments and runs its callback; returns 0 if instead the server
+ * was busy: it is then sent again after a pause by a later snfs_poll or
+ * snfs_wait_any, without waiting here */
+static int async_finish(int i, snfs_call_status_t* status)
+{
+	snfs_msg_res_t* res = &Async[i].res;
+	snfs_handle_t handle = async_handle(i);
+	snfs_call_status_t st;
+	int size = Async[i].status;
+	
+	if (Async[i].slot >= 0) {
+		size = Pending[Async[i].slot].status;
+		Pending[Async[i].slot].serial = 0;
+		Async[i].slot = -1;
+		if (size >= 0 && res->status == RES_BUSY && Async[i].retries < SNFS_BUSY_RETRIES) {
+			Async[i].resend = now_us() + (SNFS_BUSY_PAUSE << Async[i].retries++);
+			return 0;
+		}
+	}
+	
+	st = (size < 0 || res->status != RES_OK) ? STAT_ERROR : STAT_OK;
+	if (st == STAT_OK) {
+		switch (Async[i].req.type) {
+			case REQ_READ:
+				*Async[i].nread = res->body.read.nread;
+				memcpy(Async[i].buffer, res->body.read.data, res->body.read.nread);
+				break;
+			case REQ_READ_BULK:
+				*Async[i].nread = res->body.bulk.count;
+				break;
+			case REQ_WRITE:
+				*Async[i].fsize = res->body.write.fsize;
+				break;
+			case REQ_WRITE_BULK:
+				*Async[i].fsize = res->body.bulk.fsize;
+				break;
+			case REQ_LOOKUP:
+				*Async[i].file = res->body.lookup.file;
+				*Async[i].fsize = res->body.lookup.fsize;
+				break;
+			default:
+				break;
+		}
+	}
+	Async[i].used = 0;
+	if (status != NULL)
+		*status = st;
+	if (Async[i].callback != NULL)
+		Async[i].callback(handle, st, Async[i].arg);
+	return 1;
+}
+
+
+snfs_handle_t snfs_read_async(snfs_fhandle_t fhandle, unsigned offset,
+   unsigned count, char* buffer, int* nread, snfs_callback_t callback, void* arg)
+{
+	int bulk = bulk_supported();
+	int i;
+	
+	if (count > (bulk ? SNFS_MAX_BULK_DATA : MAX_READ_DATA) || (i = async_alloc()) < 0)
+		return -1;
+	// bulk data lands straight in the caller's buffer
+	Async[i].reqsz = read_chunk_req(&Async[i].req, bulk, fhandle, offset, count);
+	Async[i].buffer = buffer;
+	Async[i].nread = nread;
+	return async_start(i, callback, arg);
+}
+
+
+snfs_handle_t snfs_write_async(snfs_fhandle_t fhandle, unsigned offset,
+   unsigned count, char* buffer, unsigned int* fsize, snfs_callback_t callback,
+   void* arg)
+{
+	int bulk = bulk_supported();
+	int i;
+	
+	if (count > (bulk ? SNFS_MAX_BULK_DATA : MAX_WRITE_DATA) || (i = async_alloc()) < 0)
+		return -1;
+	Async[i].reqsz = write_chunk_req(&Async[i].req, bulk, fhandle, offset, count, buffer);
+	Async[i].data = buffer;
+	Async[i].fsize = fsize;
+	return async_start(i, callback, arg);
+}
+
+
+snfs_handle_t snfs_lookup_async(char* pathname, snfs_fhandle_t* file,
+   unsigned* fsize, snfs_callback_t callback, void* arg)
+{
+	int i;
+	
+	if (strlen(pathname) >= MAX_PATH_NAME_SIZE || (i = async_alloc()) < 0)
+		return -1;
+	Async[i].req.type = REQ_LOOKUP;
+	strcpy(Async[i].req.body.lookup.pname, pathname);
+	Async[i].reqsz = sizeof(Async[i].req.type) + sizeof(Async[i].req.body.lookup);
+	Async[i].file = file;
+	Async[i].fsize = fsize;
+	return async_start(i, callback, arg);
+}
+
+
+int snfs_poll()
+{
+	int i, n = 0;
+	
+	// a broken stream completes everything in flight with an error
+	if (Stream_sock >= 0 && stream_flush() == 0)
+		stream_receive(0);
+	async_resend();
+	for (i = 0; i < SNFS_MAX_OUTSTANDING; i++)
+		if (Async[i].used && async_done(i))
+			n += async_finish(i, NULL);
+	return n;
+}
+
+
+snfs_handle_t snfs_wait_any(snfs_call_status_t* status)
+{
+	snfs_handle_t handle;
+	struct pollfd pfd;
+	long long pause_us;
+	int i, inflight;
+	
+	while (1) {
+		async_resend();
+		for (i = 0, inflight = 0; i < SNFS_MAX_OUTSTANDING; i++) {
+			if (!Async[i].used)
+				continue;
+			inflight++;
+			handle = async_handle(i);
+			if (async_done(i) && async_finish(i, status))
+				return handle;
+		}
+		if (inflight == 0)
+			return -1;
+		// with calls turned away, waits no longer than the next resend
+		pause_us = async_next_resend();
+		if (Stream_sock >= 0 && stream_flush() == 0) {
+			pfd.fd = Stream_sock;
+			pfd.events = POLLIN;
+			if (pause_us < 0 || poll(&pfd, 1, (int)((pause_us + 999) / 1000)) > 0)
+				stream_receive(1);
+		} else if (pause_us > 0) {
+			usleep(pause_us);
+		}
+	}
+}
+
+
 snfs_call_status_t snfs_create(snfs_fhandle_t dir, char* name, 
    snfs_fhandle_t* file)
 {
@@ -360,6 +1263,7 @@ snfs_call_status_t snfs_copy(snfs_fhandle_t src_dir, char* src_name, snfs_fhandl
 		if(status < 0 || res.status != RES_OK){
 			return STAT_ERROR;
 		}
+		*file = res.body.copy.file;
 		return STAT_OK;
 }
 
@@ -391,7 +1295,8 @@ snfs_call_status_t snfs_append(snfs_fhandle_t dir1, char* name1, snfs_fhandle_t
 	return STAT_OK;
 }
 
-snfs_call_status_t snfs_defrag()  
+/*Pedido de desfragmentacao: lancar (query = 0) ou so saber o progresso*/
+static snfs_call_status_t defrag_call(unsigned query, snfs_msg_res_defrag_t* progress)
 {   
 	snfs_msg_req_t req;
 	snfs_msg_res_t res;
@@ -400,16 +1305,30 @@ snfs_call_status_t snfs_defrag()
 	memset(&res,0,sizeof(res));
 		
 	req.type = REQ_DEFRAG;
-	int status = remote_call(&req,sizeof(req.type),&res,sizeof(res));
+	req.body.defrag.query = query;
+	int status = remote_call(&req,sizeof(req.type)+sizeof(req.body.defrag),&res,sizeof(res));
 
 	//formatar a resposta
 	if(status < 0 || res.status == RES_ERROR){
 		return STAT_ERROR;
-	}else if(res.status == RES_UNKNOWN)
+	}
+	if(progress != NULL)
+		*progress = res.body.defrag;
+	if(res.status == RES_UNKNOWN)
 		return STAT_BUSY;
 	return STAT_OK;
 }
 
+snfs_call_status_t snfs_defrag()  
+{   
+	return defrag_call(0,NULL);
+}
+
+snfs_call_status_t snfs_defrag_status(snfs_msg_res_defrag_t* progress)
+{
+	return defrag_call(1,progress);
+}
+
 
 snfs_call_status_t snfs_diskusage()  
 {   
@@ -448,8 +1367,30 @@ snfs_call_status_t snfs_dumpcache()
 }
 
 
+snfs_call_status_t snfs_stats(snfs_msg_type_t op, snfs_msg_res_stats_t* stats)
+{
+	snfs_msg_req_t req;
+	snfs_msg_res_t res;
+
+	memset(&req,0,sizeof(req));
+	memset(&res,0,sizeof(res));
+
+	req.type = REQ_STATS;
+	req.body.stats.op = op;
+	int status = remote_call(&req,sizeof(req.type)+sizeof(req.body.stats),&res,sizeof(res));
+
+	if(status < 0 || res.status != RES_OK){
+		return STAT_ERROR;
+	}
+	*stats = res.body.stats;
+	return STAT_OK;
+}
+
+
 void snfs_finish()
 {
+   if (Stream_sock >= 0)
+      close(Stream_sock);
    close(Cli_sock);
    unlink(Cli_addr.sun_path);
 }
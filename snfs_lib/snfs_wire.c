@@ -0,0 +1,472 @@
+/*
+ * SNFS Compact Wire Format
+ *
+ * snfs_wire.c
+ *
+ * Encoding and decoding of compact messages (see snfs_wire.h). This
+ * file is linked both in the SNFS library and in the SNFS server.
+ */
+
+#include <string.h>
+
+#include <snfs_wire.h>
+
+
+#define REQ_SIZE(field) ((int)(sizeof(((snfs_msg_req_t*)0)->type) + \
+                               sizeof(((snfs_msg_req_t*)0)->body.field)))
+#define RES_SIZE(field) ((int)(sizeof(snfs_msg_res_t) - \
+                               sizeof(((snfs_msg_res_t*)0)->body) + \
+                               sizeof(((snfs_msg_res_t*)0)->body.field)))
+
+
+/*
+ * Field encoding
+ */
+
+static char* put_uint(char* p, unsigned v)
+{
+   while (v >= 0x80) {
+      *p++ = (char)(v | 0x80);
+      v >>= 7;
+   }
+   *p++ = (char)v;
+   return p;
+}
+
+static const char* get_uint(const char* p, const char* end, unsigned* v)
+{
+   unsigned shift = 0;
+
+   *v = 0;
+   while (p < end && shift < 35) {
+      unsigned char c = (unsigned char)*p++;
+      *v |= (unsigned)(c & 0x7f) << shift;
+      if (!(c & 0x80))
+         return p;
+      shift += 7;
+   }
+   return NULL;
+}
+
+static char* put_bytes(char* p, const char* data, unsigned n)
+{
+   p = put_uint(p, n);
+   memcpy(p, data, n);
+   return p + n;
+}
+
+// strings are fixed arrays that need not be terminated
+static char* put_str(char* p, const char* s, unsigned max)
+{
+   unsigned n = 0;
+   while (n < max && s[n] != '\0')
+      n++;
+   return put_bytes(p, s, n);
+}
+
+static const char* get_bytes(const char* p, const char* end, char* data,
+   unsigned max, unsigned* n)
+{
+   if (p == NULL || (p = get_uint(p, end, n)) == NULL)
+      return NULL;
+   if (*n > max || *n > (unsigned)(end - p))
+      return NULL;
+   memcpy(data, p, *n);
+   return p + *n;
+}
+
+static const char* get_str(const char* p, const char* end, char* s, unsigned max)
+{
+   unsigned n;
+
+   if ((p = get_bytes(p, end, s, max, &n)) != NULL && n < max)
+      s[n] = '\0';
+   return p;
+}
+
+#define GET_UINT(p, end, dst) \
+   do { unsigned v_; if (p == NULL || (p = get_uint(p, end, &v_)) == NULL) return -1; \
+        dst = v_; } while (0)
+
+
+/*
+ * Requests
+ */
+
+int snfs_wire_is_compact(const char* buf, int len)
+{
+   return len > 0 && ((unsigned char)buf[0] == SNFS_WIRE_MAGIC ||
+                      (unsigned char)buf[0] == SNFS_WIRE_MAGIC_DEADLINE);
+}
+
+
+unsigned snfs_wire_req_deadline(const char* buf, int len)
+{
+   unsigned usec;
+
+   if (len < 2 || (unsigned char)buf[0] != SNFS_WIRE_MAGIC_DEADLINE ||
+       get_uint(buf + 2, buf + len, &usec) == NULL)
+      return 0;
+   return usec;
+}
+
+
+int snfs_wire_encode_req(const snfs_msg_req_t* req, char* buf)
+{
+   return snfs_wire_encode_req_deadline(req, 0, buf);
+}
+
+
+int snfs_wire_encode_req_deadline(const snfs_msg_req_t* req, unsigned usec, char* buf)
+{
+   char* p = buf;
+
+   *p++ = (char)(usec ? SNFS_WIRE_MAGIC_DEADLINE : SNFS_WIRE_MAGIC);
+   *p++ = (char)req->type;
+   if (usec)
+      p = put_uint(p, usec);
+   switch (req->type) {
+      case REQ_PING:
+         p = put_str(p, req->body.ping.msg, sizeof(req->body.ping.msg));
+         break;
+      case REQ_LOOKUP:
+         p = put_str(p, req->body.lookup.pname, MAX_PATH_NAME_SIZE);
+         break;
+      case REQ_READ:
+         p = put_uint(p, req->body.read.fhandle);
+         p = put_uint(p, req->body.read.offset);
+         p = put_uint(p, req->body.read.count);
+         break;
+      case REQ_WRITE:
+         p = put_uint(p, req->body.write.fhandle);
+         p = put_uint(p, req->body.write.offset);
+         p = put_bytes(p, req->body.write.data,
+                       req->body.write.count < MAX_WRITE_DATA ? req->body.write.count : MAX_WRITE_DATA);
+         break;
+      case REQ_CREATE:
+         p = put_uint(p, req->body.create.dir);
+         p = put_str(p, req->body.create.name, MAX_FILE_NAME_SIZE);
+         break;
+      case REQ_MKDIR:
+         p = put_uint(p, req->body.mkdir.dir);
+         p = put_str(p, req->body.mkdir.file, MAX_FILE_NAME_SIZE);
+         break;
+      case REQ_READDIR:
+         p = put_uint(p, req->body.readdir.dir);
+         p = put_uint(p, req->body.readdir.cmax);
+         break;
+      case REQ_REMOVE:
+         p = put_uint(p, req->body.remove.dir);
+         p = put_str(p, req->body.remove.name, MAX_FILE_NAME_SIZE);
+         break;
+      case REQ_COPY:
+         p = put_uint(p, req->body.copy.src_dir);
+         p = put_uint(p, req->body.copy.dst_dir);
+         p = put_str(p, req->body.copy.src_name, MAX_FILE_NAME_SIZE);
+         p = put_str(p, req->body.copy.dst_name, MAX_FILE_NAME_SIZE);
+         break;
+      case REQ_APPEND:
+         p = put_uint(p, req->body.append.dir1);
+         p = put_uint(p, req->body.append.dir2);
+         p = put_str(p, req->body.append.name1, MAX_FILE_NAME_SIZE);
+         p = put_str(p, req->body.append.name2, MAX_FILE_NAME_SIZE);
+         break;
+      case REQ_DEFRAG:
+         p = put_uint(p, req->body.defrag.query);
+         break;
+      case REQ_READ_BULK:
+      case REQ_WRITE_BULK:
+         // write data follows the message in the frame (not encoded here)
+         p = put_uint(p, req->body.bulk.fhandle);
+         p = put_uint(p, req->body.bulk.offset);
+         p = put_uint(p, req->body.bulk.count);
+         break;
+      case REQ_STATS:
+         p = put_uint(p, req->body.stats.op);
+         break;
+      default:
+         break;
+   }
+   return p - buf;
+}
+
+
+int snfs_wire_decode_req(const char* buf, int len, snfs_msg_req_t* req)
+{
+   const char* p = buf + 2;
+   const char* end = buf + len;
+   unsigned n;
+
+   if (len < 2 || !snfs_wire_is_compact(buf, len))
+      return -1;
+   req->type = (snfs_msg_type_t)(unsigned char)buf[1];
+   if ((unsigned char)buf[0] == SNFS_WIRE_MAGIC_DEADLINE)
+      GET_UINT(p, end, n);		// see snfs_wire_req_deadline
+   switch (req->type) {
+      case REQ_PING:
+         p = get_str(p, end, req->body.ping.msg, sizeof(req->body.ping.msg));
+         return p ? REQ_SIZE(ping) : -1;
+      case REQ_LOOKUP:
+         p = get_str(p, end, req->body.lookup.pname, MAX_PATH_NAME_SIZE);
+         return p ? REQ_SIZE(lookup) : -1;
+      case REQ_READ:
+         GET_UINT(p, end, req->body.read.fhandle);
+         GET_UINT(p, end, req->body.read.offset);
+         GET_UINT(p, end, req->body.read.count);
+         return REQ_SIZE(read);
+      case REQ_WRITE:
+         GET_UINT(p, end, req->body.write.fhandle);
+         GET_UINT(p, end, req->body.write.offset);
+         p = get_bytes(p, end, req->body.write.data, MAX_WRITE_DATA, &n);
+         req->body.write.count = n;
+         return p ? REQ_SIZE(write) : -1;
+      case REQ_CREATE:
+         GET_UINT(p, end, req->body.create.dir);
+         p = get_str(p, end, req->body.create.name, MAX_FILE_NAME_SIZE);
+         return p ? REQ_SIZE(create) : -1;
+      case REQ_MKDIR:
+         GET_UINT(p, end, req->body.mkdir.dir);
+         p = get_str(p, end, req->body.mkdir.file, MAX_FILE_NAME_SIZE);
+         return p ? REQ_SIZE(mkdir) : -1;
+      case REQ_READDIR:
+         GET_UINT(p, end, req->body.readdir.dir);
+         GET_UINT(p, end, req->body.readdir.cmax);
+         return REQ_SIZE(readdir);
+      case REQ_REMOVE:
+         GET_UINT(p, end, req->body.remove.dir);
+         p = get_str(p, end, req->body.remove.name, MAX_FILE_NAME_SIZE);
+         return p ? REQ_SIZE(remove) : -1;
+      case REQ_COPY:
+         GET_UINT(p, end, req->body.copy.src_dir);
+         GET_UINT(p, end, req->body.copy.dst_dir);
+         p = get_str(p, end, req->body.copy.src_name, MAX_FILE_NAME_SIZE);
+         p = get_str(p, end, req->body.copy.dst_name, MAX_FILE_NAME_SIZE);
+         return p ? REQ_SIZE(copy) : -1;
+      case REQ_APPEND:
+         GET_UINT(p, end, req->body.append.dir1);
+         GET_UINT(p, end, req->body.append.dir2);
+         p = get_str(p, end, req->body.append.name1, MAX_FILE_NAME_SIZE);
+         p = get_str(p, end, req->body.append.name2, MAX_FILE_NAME_SIZE);
+         return p ? REQ_SIZE(append) : -1;
+      case REQ_DEFRAG:
+         GET_UINT(p, end, req->body.defrag.query);
+         return REQ_SIZE(defrag);
+      case REQ_READ_BULK:
+      case REQ_WRITE_BULK:
+         GET_UINT(p, end, req->body.bulk.fhandle);
+         GET_UINT(p, end, req->body.bulk.offset);
+         GET_UINT(p, end, req->body.bulk.count);
+         return REQ_SIZE(bulk);
+      case REQ_STATS:
+         GET_UINT(p, end, req->body.stats.op);
+         return REQ_SIZE(stats);
+      default:
+         // no body (or unknown, which the server answers as such)
+         return sizeof(req->type);
+   }
+}
+
+
+/*
+ * Responses
+ */
+
+int snfs_wire_res_size(snfs_msg_type_t type)
+{
+   switch (type) {
+      case REQ_PING:    return RES_SIZE(ping);
+      case REQ_LOOKUP:  return RES_SIZE(lookup);
+      case REQ_READ:    return RES_SIZE(read);
+      case REQ_WRITE:   return RES_SIZE(write);
+      case REQ_CREATE:  return RES_SIZE(create);
+      case REQ_MKDIR:   return RES_SIZE(mkdir);
+      case REQ_READDIR: return RES_SIZE(readdir);
+      case REQ_REMOVE:  return RES_SIZE(remove);
+      case REQ_COPY:    return RES_SIZE(copy);
+      case REQ_APPEND:  return RES_SIZE(append);
+      case REQ_DEFRAG:  return RES_SIZE(defrag);
+      case REQ_READ_BULK:
+      case REQ_WRITE_BULK: return RES_SIZE(bulk);
+      case REQ_STATS:   return RES_SIZE(stats);
+      default:          return sizeof(snfs_msg_res_t) - sizeof(((snfs_msg_res_t*)0)->body);
+   }
+}
+
+
+static int encode_res(const snfs_msg_res_t* res, char* buf, int withdata)
+{
+   char* p = buf;
+   unsigned n, i;
+
+   *p++ = (char)SNFS_WIRE_MAGIC;
+   *p++ = (char)res->type;
+   *p++ = (char)(signed char)res->status;
+   switch (res->type) {
+      case REQ_PING:
+         p = put_str(p, res->body.ping.msg, sizeof(res->body.ping.msg));
+         break;
+      case REQ_LOOKUP:
+         p = put_uint(p, res->body.lookup.file);
+         p = put_uint(p, res->body.lookup.fsize);
+         break;
+      case REQ_READ:
+         n = res->body.read.nread < MAX_READ_DATA ? res->body.read.nread : MAX_READ_DATA;
+         if (res->status != RES_OK)
+            n = 0;
+         if (withdata)
+            p = put_bytes(p, res->body.read.data, n);
+         else
+            p = put_uint(p, n);
+         break;
+      case REQ_WRITE:
+         p = put_uint(p, res->body.write.fsize);
+         break;
+      case REQ_CREATE:
+         p = put_uint(p, res->body.create.file);
+         break;
+      case REQ_MKDIR:
+         p = put_uint(p, res->body.mkdir.newdirid);
+         break;
+      case REQ_READDIR:
+         n = res->body.readdir.count < MAX_READDIR_ENTRIES ? res->body.readdir.count : MAX_READDIR_ENTRIES;
+         p = put_uint(p, n);
+         for (i = 0; i < n; i++) {
+            p = put_str(p, res->body.readdir.list[i].name, MAX_FILE_NAME_SIZE);
+            p = put_uint(p, res->body.readdir.list[i].len);
+            p = put_uint(p, res->body.readdir.list[i].type);
+         }
+         break;
+      case REQ_REMOVE:
+         p = put_uint(p, res->body.remove.file);
+         break;
+      case REQ_COPY:
+         p = put_uint(p, res->body.copy.file);
+         break;
+      case REQ_APPEND:
+         p = put_uint(p, res->body.append.fsize);
+         break;
+      case REQ_DEFRAG:
+         p = put_uint(p, res->body.defrag.moved);
+         p = put_uint(p, res->body.defrag.done);
+         p = put_uint(p, res->body.defrag.total);
+         break;
+      case REQ_READ_BULK:
+      case REQ_WRITE_BULK:
+         p = put_uint(p, res->body.bulk.count);
+         p = put_uint(p, res->body.bulk.fsize);
+         break;
+      case REQ_STATS:
+         p = put_uint(p, res->body.stats.count);
+         p = put_uint(p, res->body.stats.errors);
+         p = put_uint(p, res->body.stats.kbytes);
+         p = put_uint(p, res->body.stats.expired);
+         p = put_uint(p, res->body.stats.p50);
+         p = put_uint(p, res->body.stats.p90);
+         p = put_uint(p, res->body.stats.p99);
+         p = put_uint(p, res->body.stats.p999);
+         for (i = 0; i < SNFS_STATS_BUCKETS; i++)
+            p = put_uint(p, res->body.stats.wait[i]);
+         for (i = 0; i < SNFS_STATS_BUCKETS; i++)
+            p = put_uint(p, res->body.stats.service[i]);
+         break;
+      default:
+         break;
+   }
+   return p - buf;
+}
+
+
+int snfs_wire_encode_res(const snfs_msg_res_t* res, char* buf)
+{
+   return encode_res(res, buf, 1);
+}
+
+
+int snfs_wire_encode_res_head(const snfs_msg_res_t* res, char* buf)
+{
+   return encode_res(res, buf, 0);
+}
+
+
+int snfs_wire_decode_res(const char* buf, int len, snfs_msg_res_t* res)
+{
+   const char* p = buf + 3;
+   const char* end = buf + len;
+   unsigned n, i;
+
+   if (len < 3 || !snfs_wire_is_compact(buf, len))
+      return -1;
+   res->type = (snfs_msg_type_t)(unsigned char)buf[1];
+   res->status = (snfs_msg_res_status_t)(signed char)buf[2];
+   switch (res->type) {
+      case REQ_PING:
+         p = get_str(p, end, res->body.ping.msg, sizeof(res->body.ping.msg));
+         break;
+      case REQ_LOOKUP:
+         GET_UINT(p, end, res->body.lookup.file);
+         GET_UINT(p, end, res->body.lookup.fsize);
+         break;
+      case REQ_READ:
+         p = get_bytes(p, end, res->body.read.data, MAX_READ_DATA, &n);
+         res->body.read.nread = n;
+         break;
+      case REQ_WRITE:
+         GET_UINT(p, end, res->body.write.fsize);
+         break;
+      case REQ_CREATE:
+         GET_UINT(p, end, res->body.create.file);
+         break;
+      case REQ_MKDIR:
+         GET_UINT(p, end, res->body.mkdir.newdirid);
+         break;
+      case REQ_READDIR:
+         GET_UINT(p, end, n);
+         if (n > MAX_READDIR_ENTRIES)
+            return -1;
+         res->body.readdir.count = n;
+         for (i = 0; i < n && p != NULL; i++) {
+            snfs_dir_entry_t* e = &res->body.readdir.list[i];
+            memset(e->name, 0, MAX_FILE_NAME_SIZE);
+            p = get_str(p, end, e->name, MAX_FILE_NAME_SIZE);
+            GET_UINT(p, end, e->len);
+            GET_UINT(p, end, e->type);
+         }
+         break;
+      case REQ_REMOVE:
+         GET_UINT(p, end, res->body.remove.file);
+         break;
+      case REQ_COPY:
+         GET_UINT(p, end, res->body.copy.file);
+         break;
+      case REQ_APPEND:
+         GET_UINT(p, end, res->body.append.fsize);
+         break;
+      case REQ_DEFRAG:
+         GET_UINT(p, end, res->body.defrag.moved);
+         GET_UINT(p, end, res->body.defrag.done);
+         GET_UINT(p, end, res->body.defrag.total);
+         break;
+      case REQ_READ_BULK:
+      case REQ_WRITE_BULK:
+         GET_UINT(p, end, res->body.bulk.count);
+         GET_UINT(p, end, res->body.bulk.fsize);
+         break;
+      case REQ_STATS:
+         GET_UINT(p, end, res->body.stats.count);
+         GET_UINT(p, end, res->body.stats.errors);
+         GET_UINT(p, end, res->body.stats.kbytes);
+         GET_UINT(p, end, res->body.stats.expired);
+         GET_UINT(p, end, res->body.stats.p50);
+         GET_UINT(p, end, res->body.stats.p90);
+         GET_UINT(p, end, res->body.stats.p99);
+         GET_UINT(p, end, res->body.stats.p999);
+         for (i = 0; i < SNFS_STATS_BUCKETS; i++)
+            GET_UINT(p, end, res->body.stats.wait[i]);
+         for (i = 0; i < SNFS_STATS_BUCKETS; i++)
+            GET_UINT(p, end, res->body.stats.service[i]);
+         break;
+      default:
+         break;
+   }
+   return p ? snfs_wire_res_size(res->type) : -1;
+}
@@ -0,0 +1,111 @@
+/* 
+ * Scratch Arenas
+ * 
+ * arena.c
+ *
+ * Bump-pointer arenas attached to each sthread. Requests that do not
+ * fit in the remaining space get their own chunk, chained to the arena
+ * and freed on the next reset, so a large request never fails while
+ * the common case stays a pointer increment.
+ * 
+ */
+
+#include <stdlib.h>
+#include <sthread.h>
+#include "arena.h"
+
+
+#define ARENA_ALIGN(sz) (((sz) + 7) & ~7u)
+
+// chunk allocated outside of the arena for an oversized request
+struct arena_chunk_ {
+   struct arena_chunk_* next;
+   double data[0];		// keeps the data aligned
+};
+
+// internal implementation of the per-thread arena
+struct arena_ {
+   unsigned used;
+   struct arena_chunk_* extra;
+   double data[ARENA_SIZE / sizeof(double)];
+};
+
+static sthread_key_t Arena_key;
+
+
+static void arena_release(struct arena_* arena)
+{
+   while (arena->extra != NULL) {
+      struct arena_chunk_* next = arena->extra->next;
+      free(arena->extra);
+      arena->extra = next;
+   }
+   arena->used = 0;
+}
+
+
+// called when a thread exits (its key value is already cleared)
+static void arena_destroy(void* ptr)
+{
+   arena_release((struct arena_*) ptr);
+   free(ptr);
+}
+
+
+void arena_init()
+{
+   if (sthread_key_create(&Arena_key, arena_destroy) != 0) {
+      exit(-1);
+   }
+}
+
+
+static struct arena_* arena_get()
+{
+   struct arena_* arena = sthread_getspecific(Arena_key);
+
+   if (arena == NULL) {
+      arena = (struct arena_*) malloc(sizeof(struct arena_));
+      if (arena == NULL) {
+         return NULL;
+      }
+      arena->used = 0;
+      arena->extra = NULL;
+      sthread_setspecific(Arena_key, arena);
+   }
+   return arena;
+}
+
+
+void* arena_alloc(unsigned size)
+{
+   struct arena_* arena = arena_get();
+   if (arena == NULL) {
+      return NULL;
+   }
+
+   size = ARENA_ALIGN(size);
+   if (size <= ARENA_SIZE - arena->used) {
+      void* ptr = (char*)arena->data + arena->used;
+      arena->used += size;
+      return ptr;
+   }
+
+   struct arena_chunk_* chunk = (struct arena_chunk_*)
+      malloc(sizeof(struct arena_chunk_) + size);
+   if (chunk == NULL) {
+      return NULL;
+   }
+   chunk->next = arena->extra;
+   arena->extra = chunk;
+   return chunk->data;
+}
+
+
+void arena_reset()
+{
+   struct arena_* arena = sthread_getspecific(Arena_key);
+   if (arena != NULL) {
+      arena_release(arena);
+   }
+}
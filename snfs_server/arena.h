@@ -0,0 +1,44 @@
+/* 
+ * Scratch Arenas
+ * 
+ * arena.h
+ *
+ * Per-thread bump-pointer allocator for memory that only lives until
+ * the end of the current request. Each sthread gets its own arena
+ * (kept in thread-local storage), so allocation takes no locks; the
+ * request loop releases everything at once with arena_reset.
+ * 
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+
+// size of the arena created for each thread
+#define ARENA_SIZE (16*1024)
+
+
+/*
+ * arena_init: creates the thread-local key of the arenas; must be
+ * called once, after sthread_init and before any other arena function
+ */
+void arena_init();
+
+
+/*
+ * arena_alloc: allocate memory from the calling thread's arena
+ * - size: number of bytes
+ *   returns: memory aligned to 8 bytes, valid until the next
+ *   arena_reset of this thread (NULL if out of memory)
+ */
+void* arena_alloc(unsigned size);
+
+
+/*
+ * arena_reset: release everything allocated by the calling thread
+ * since its last reset
+ */
+void arena_reset();
+
+
+#endif
@@ -74,6 +74,20 @@ int block_read(blocks_t* bks, unsigned block_no, char* block)
 }
 
 
+int block_read_run(blocks_t* bks, unsigned block_no, unsigned count, char* blocks)
+{
+   if (count == 0 || block_no >= bks->num_blocks || 
+       count > bks->num_blocks - block_no) {
+	  return -1;
+   }
+
+   io_delay_read_block();
+   char* ptr = &bks->blocks[block_no * bks->block_size]; 
+   memcpy(blocks,ptr,count * bks->block_size);
+   return 0;
+}
+
+
 int block_write(blocks_t* bks, unsigned block_no, char* block)
 {
    if (block_no >= bks->num_blocks) {
@@ -57,6 +57,18 @@ unsigned block_num_blocks(blocks_t* bks);
 int block_read(blocks_t* bks, unsigned block_no, char* block);
 
 
+/*
+ * block_read_run: read 'count' consecutive blocks in one access; the
+ * disk delay is paid once, as for a single block
+ * - bks: the blocks instance
+ * - block_no: the number of the first block to read
+ * - count: the number of blocks to read
+ * - blocks: the buffer were to copy the blocks, count*block size [out]
+ *   returns: 0 if sucessful, -1 if not
+ */
+int block_read_run(blocks_t* bks, unsigned block_no, unsigned count, char* blocks);
+
+
 /*
  * block_write: write a whole block
  * - bks: the blocks instance
@@ -20,7 +20,11 @@
  * 2- nao referenciadas, modificadas
  * 3- referenciadas, nao modificadas
  * 4- referenciadas, modificadas
- * 5 - nao validas*/
+ * 5 - nao validas
+ * 
+ * Os blocos de metadados (escreverCacheMeta) nunca sao escritos pela cache:
+ * ficam presos ate o diario do fs os recolher e os escrever no sitio, por
+ * isso a cache pode passar da sua dimensao enquanto os tem*/
 
 /*Funcionamento da cache ao longo do tempo:
  * 1 - O sys pede para criar uma cache de uma dimensao fixa.
@@ -36,7 +40,7 @@
 #include "cache.h"
 #include "string.h"
 
-#define BLOCK_SIZE 512
+#define BLOCK_SIZE FS_BLOCK_SIZE
 
 #define dprintf if(0) printf
 
@@ -51,6 +55,7 @@ cache_t criarCache(int dimensaoCache,blocks_t* disco){
 	novaCache->tabela = newHash(dimensaoCache);
 	novaCache->numeroNosUtilizados = 0;
 	novaCache->numeroMaxNos = dimensaoCache;
+	novaCache->numeroMeta = 0;
 	novaCache->disco = disco;
 	novaCache->naoRef_naoMod = newList();
 	novaCache->naoRef_Mod = newList();
@@ -58,6 +63,7 @@ cache_t criarCache(int dimensaoCache,blocks_t* disco){
 	novaCache->Ref_Mod = newList();
 	
 	novaCache->mutex = sthread_mutex_init();
+	sthread_mutex_setname(novaCache->mutex, "cache.mutex");
 	return novaCache;
 }
 
@@ -66,7 +72,7 @@ cache_t criarCache(int dimensaoCache,blocks_t* disco){
 icache_t novaEntradaCache(cache_t cache, int idbloco,int modificado,char* dados){
 	int status;
 	
-	if(cache->numeroNosUtilizados == cache->numeroMaxNos){
+	if(cache->numeroNosUtilizados >= cache->numeroMaxNos){
 		dprintf("\n[cache] cache cheia\n");
 		libertarEspaco(cache);
 	}
@@ -79,6 +85,10 @@ icache_t novaEntradaCache(cache_t cache, int idbloco,int modificado,char* dados)
 	blocoCache->referenciado = SIM;
 	blocoCache->modificado = modificado;
 	blocoCache->tempoEmCache = 0;
+	blocoCache->pins = 0;
+	blocoCache->retirado = NAO;
+	blocoCache->metadados = NAO;
+	blocoCache->noDiario = NAO;
 	
 	char *bloco = (char*) malloc(sizeof(char)*BLOCK_SIZE);	//alocar um bloco para guardar estes dados
 	memcpy(bloco,dados,BLOCK_SIZE);	//copiar o bloco para a cache
@@ -94,6 +104,17 @@ icache_t novaEntradaCache(cache_t cache, int idbloco,int modificado,char* dados)
 	return blocoCache;
 }
 
+/*Libertar uma entrada que ja saiu da tabela; se estiver fixada fica
+ * para quando for largada*/
+static void largarEntrada(icache_t entrada){
+	if(entrada->pins > 0){
+		entrada->retirado = SIM;
+		return;
+	}
+	free(entrada->conteudobloco);
+	free(entrada);
+}
+
 /* Carregar um bloco do disco
  * - cache - cache onde sera inserido
  * - idBloco - numero do bloco
@@ -116,14 +137,28 @@ icache_t carregarBlocoParaCache(cache_t cache,int idbloco){
 }
 
 
+/*Uma entrada de metadados que ainda nao esta no sitio nao pode sair da cache*/
+static int presa(icache_t entrada){
+	return entrada->valido == SIM && entrada->metadados &&
+		(entrada->modificado || entrada->noDiario);
+}
+
+/*Uma entrada de metadados por recolher: conta em cache->numeroMeta*/
+static int porRecolher(icache_t entrada){
+	return entrada->valido == SIM && entrada->metadados && entrada->modificado;
+}
+
 /**Escrever um bloco completo em cache. Cuidado, quando for escrito em
- * disco ira substituir completamente o bloco antigo*/
-int escreverCache(cache_t cache,int idbloco,char* bloco){
+ * disco ira substituir completamente o bloco antigo. Um bloco de metadados
+ * continua a se-lo ate sair da cache*/
+static int escreverEntrada(cache_t cache,int idbloco,char* bloco,int metadados){
 	icache_t entradaCache;
 	
 	sthread_mutex_lock(cache->mutex);
 	
 	int status = hashGet(cache->tabela,idbloco,&entradaCache);//procurar o icache do bloco na hash
+	if(status == 0)
+		cache->numeroMeta -= porRecolher(entradaCache);
 	
 	if(status == 0 && entradaCache->valido == NAO){	//existe e esta invalida
 		retirarDaCache(cache,idbloco);			//Retirar o lixo da cache
@@ -140,18 +175,41 @@ int escreverCache(cache_t cache,int idbloco,char* bloco){
 			return -1;
 		}
 		dprintf("Substituir conteudo\n");
-		memcpy(entradaCache->conteudobloco,bloco,BLOCK_SIZE);	//substituir o conteudo
-		entradaCache->referenciado = SIM;
-		entradaCache->modificado = SIM;
-		entradaCache->valido = SIM;
+		if(entradaCache->pins > 0){
+			//ha quem esteja a enviar o conteudo antigo: fica com ele e a
+			//tabela passa a ter uma entrada nova
+			int noDiario = entradaCache->noDiario;
+			metadados |= entradaCache->metadados;
+			hashRemove(cache->tabela,idbloco,NULL);
+			cache->numeroNosUtilizados--;
+			largarEntrada(entradaCache);
+			entradaCache = novaEntradaCache(cache,idbloco,SIM,bloco);
+			entradaCache->noDiario = noDiario;
+		}
+		else{
+			memcpy(entradaCache->conteudobloco,bloco,BLOCK_SIZE);	//substituir o conteudo
+			entradaCache->referenciado = SIM;
+			entradaCache->modificado = SIM;
+			entradaCache->valido = SIM;
+		}
 	}
-	
-	
+	if(metadados)
+		entradaCache->metadados = SIM;
+	cache->numeroMeta += porRecolher(entradaCache);
 	
 	dprintf("icache: bloco id: %d,valido: %d,referenciado %d,modificado: %d,tempoEmCache: %d\n conteudo: %s",entradaCache->idBloco,entradaCache->valido,entradaCache->referenciado,entradaCache->modificado,entradaCache->tempoEmCache,entradaCache->conteudobloco);
 	sthread_mutex_unlock(cache->mutex);
 	return 0;
 }
+
+int escreverCache(cache_t cache,int idbloco,char* bloco){
+	return escreverEntrada(cache,idbloco,bloco,NAO);
+}
+
+/**Escrever um bloco de metadados (ver cache.h)*/
+int escreverCacheMeta(cache_t cache,int idbloco,char* bloco){
+	return escreverEntrada(cache,idbloco,bloco,SIM);
+}
 	
 /**Ler um bloco da cache: (caso nao exista na cache, carrega do disco)
  * - cache - cache que pode conter o bloco
@@ -184,6 +242,75 @@ int lerCache(cache_t cache,int idBloco,char* bloco){
 	return 0;
 }
 
+/**Pre-carregar blocos seguidos do disco (ver cache.h)*/
+int preCarregarCache(cache_t cache,int idBloco,int n){
+	icache_t entradaCache;
+	int i,status;
+	
+	if(n > cache->numeroMaxNos/2)	//nao deixar a leitura antecipada esvaziar a cache
+		n = cache->numeroMaxNos/2;
+	
+	sthread_mutex_lock(cache->mutex);
+	for(i = 0; i < n; i++){	//so os blocos que faltam antes do primeiro que ja esta em cache
+		if(hashGet(cache->tabela,idBloco+i,&entradaCache) == 0)
+			break;
+	}
+	if(i < 2){	//um so bloco: lerCache le-o quando for preciso
+		sthread_mutex_unlock(cache->mutex);
+		return 0;
+	}
+	n = i;
+	
+	dprintf("Vou carregar do disco os blocos %d a %d\n",idBloco,idBloco+n-1);
+	char* blocos = (char*) malloc(sizeof(char)*BLOCK_SIZE*n);
+	status = block_read_run(cache->disco,idBloco,n,blocos);	//um so acesso ao disco
+	if(status != 0){
+		dprintf("[cache] erro de leitura do disco\n");
+		free(blocos);
+		sthread_mutex_unlock(cache->mutex);
+		return -1;
+	}
+	for(i = 0; i < n; i++)
+		novaEntradaCache(cache,idBloco+i,NAO,blocos+i*BLOCK_SIZE);
+	free(blocos);
+	sthread_mutex_unlock(cache->mutex);
+	return n;
+}
+
+/**Fixar um bloco da cache (ver cache.h)*/
+icache_t fixarBloco(cache_t cache,int idBloco){
+	icache_t entradaCache;
+	
+	sthread_mutex_lock(cache->mutex);
+	int status = hashGet(cache->tabela,idBloco,&entradaCache);//procurar o icache do bloco na hash
+
+	if(status == 0 && !(entradaCache->valido)){
+		retirarDaCache(cache,idBloco);			//Retirar o lixo da cache
+		status = 1;
+	}
+	if(status == 1){ //a entrada nao existe (ou era lixo)
+		entradaCache = carregarBlocoParaCache(cache,idBloco);
+		if(entradaCache == NULL){
+			sthread_mutex_unlock(cache->mutex);
+			return NULL;
+		}
+	}
+	entradaCache->referenciado = SIM;
+	entradaCache->pins++;
+	sthread_mutex_unlock(cache->mutex);
+	return entradaCache;
+}
+
+/**Largar um bloco fixado (ver cache.h)*/
+void largarBloco(cache_t cache,icache_t entrada){
+	sthread_mutex_lock(cache->mutex);
+	if(--entrada->pins == 0 && entrada->retirado){
+		free(entrada->conteudobloco);
+		free(entrada);
+	}
+	sthread_mutex_unlock(cache->mutex);
+}
+
 /*Colocar uma entrada da cache como invalida
  * return 0 se colocou como invalido
  * return -1 se nao estava em cache*/
@@ -198,6 +325,7 @@ int invalidarBloco(cache_t cache,int idBloco){
 	}
 	
 	
+	cache->numeroMeta -= porRecolher(entradaCache);
 	entradaCache->valido = NAO;
 	sthread_mutex_unlock(cache->mutex);
 	return 0;
@@ -217,7 +345,7 @@ int retirarDaCache(cache_t cache,int idBloco){
 		dprintf("[retirar Bloco Da Cache] O bloco nao existe na cache\n");
 		return -1;
 	}
-	if(blocoRemovido->modificado && blocoRemovido->valido == SIM){	//se e invalido, nao e escrito em disco
+	if(blocoRemovido->modificado && blocoRemovido->valido == SIM && !blocoRemovido->metadados){	//se e invalido, nao e escrito em disco
 		dprintf("Vou escrever em disco o bloco %d removido\n",idBloco);
 		status = block_write(cache->disco,idBloco,blocoRemovido->conteudobloco); //guardar o bloco em disco
 		if(status<0){
@@ -226,6 +354,7 @@ int retirarDaCache(cache_t cache,int idBloco){
 		}
 	}
 	cache->numeroNosUtilizados--;	//eliminamos 1 bloco
+	largarEntrada(blocoRemovido);
 	return 0;
 }
 
@@ -235,15 +364,16 @@ int actualizarCache(cache_t cache,int intervaloTempo){
 	HashMap hmap = cache->tabela;
 	icache_t entrada;
 	int i;
-	HashNode aux;
+	HashNode aux,prox;
 	sthread_mutex_lock(cache->mutex);
 	for(i = 0; i<hmap->length;i++)
-		for(aux=hmap->elems[i];aux;aux=aux->next){
+		for(aux=hmap->elems[i];aux;aux=prox){
+			prox=aux->next;	//aux e libertado se a entrada sair da tabela
 			entrada = aux->value;
 			
 			entrada->tempoEmCache += intervaloTempo;		//SUPONDO QUE O ALGORITMO DE ACTUALIZACAO E INVOCADO DE 2s em 2s
 			entrada->referenciado = NAO;
-			if(entrada->tempoEmCache >= 10){	//ja aguardou 10 segundos
+			if(entrada->tempoEmCache >= 10 && !presa(entrada)){	//ja aguardou 10 segundos
 				retirarDaCache(cache,entrada->idBloco);
 			}
 		}
@@ -252,6 +382,31 @@ int actualizarCache(cache_t cache,int intervaloTempo){
 }
 
 
+/*Gravar em disco todos os blocos modificados, sem os retirar da cache.
+ * Os de metadados vao pelo diario*/
+int gravarCache(cache_t cache){
+	HashMap hmap = cache->tabela;
+	icache_t entrada;
+	int i,status = 0;
+	HashNode aux;
+	sthread_mutex_lock(cache->mutex);
+	for(i = 0; i<hmap->length;i++)
+		for(aux=hmap->elems[i];aux;aux=aux->next){
+			entrada = aux->value;
+			if(entrada->modificado && entrada->valido == SIM && !entrada->metadados){
+				if(block_write(cache->disco,entrada->idBloco,entrada->conteudobloco) < 0){
+					dprintf("[gravarCache] Erro de escrita em disco\n");
+					status = -1;
+					continue;
+				}
+				entrada->modificado = NAO;
+			}
+		}
+	sthread_mutex_unlock(cache->mutex);
+	return status;
+}
+
+
 //Libertar espaco na cache//
 /*Quando a cache atinge uma determinada ocupacao, vamos tentar arranjar espaco na cache segundo a ordem:
  *  - blocos invalidos
@@ -263,11 +418,12 @@ int actualizarCache(cache_t cache,int intervaloTempo){
 void libertarEspaco(cache_t cache){
 	HashMap hmap = cache->tabela;
 	icache_t entrada;
-	int i,entradas_removidas;
-	HashNode aux;
+	int i,entradas_removidas = 0;
+	HashNode aux,prox;
 	
 	for(i = 0; i<hmap->length;i++){
-		for(aux=hmap->elems[i];aux;aux=aux->next){
+		for(aux=hmap->elems[i];aux;aux=prox){
+			prox=aux->next;	//aux e libertado se a entrada sair da tabela
 			entrada = aux->value;
 	
 			if(entrada->valido == NAO){
@@ -285,10 +441,11 @@ void libertarEspaco(cache_t cache){
 	//Pesquisar pelo grupo Nao Referenciada e nao modificada
 	entradas_removidas = 0;
 	for(i = 0; i<hmap->length;i++){
-		for(aux=hmap->elems[i];aux;aux=aux->next){
+		for(aux=hmap->elems[i];aux;aux=prox){
+			prox=aux->next;
 			entrada = aux->value;
 	
-			if(!(entrada->referenciado) && !(entrada->modificado)){
+			if(!(entrada->referenciado) && !(entrada->modificado) && !presa(entrada)){
 				retirarDaCache(cache,entrada->idBloco);
 				dprintf("[libertarEspaco - Algoritmo NRU] libertou bloco: %d : Nao Ref e Nao Mod\n",entrada->idBloco);
 				entradas_removidas++;
@@ -303,10 +460,11 @@ void libertarEspaco(cache_t cache){
 	//procurar no grupo Nao Referenciadas, Modificadas
 	entradas_removidas = 0;
 	for(i = 0; i<hmap->length;i++){
-		for(aux=hmap->elems[i];aux;aux=aux->next){
+		for(aux=hmap->elems[i];aux;aux=prox){
+			prox=aux->next;
 			entrada = aux->value;
 	
-			if(!(entrada->referenciado) && (entrada->modificado)){
+			if(!(entrada->referenciado) && (entrada->modificado) && !presa(entrada)){
 				retirarDaCache(cache,entrada->idBloco);
 				dprintf("[libertarEspaco - Algoritmo NRU] libertou bloco: %d : Nao Ref e Mod\n",entrada->idBloco);
 				entradas_removidas++;
@@ -321,10 +479,11 @@ void libertarEspaco(cache_t cache){
 	//procurar no grupo Referenciadas, nao Modificadas
 	entradas_removidas = 0;
 	for(i = 0; i<hmap->length;i++){
-		for(aux=hmap->elems[i];aux;aux=aux->next){
+		for(aux=hmap->elems[i];aux;aux=prox){
+			prox=aux->next;
 			entrada = aux->value;
 	
-			if((entrada->referenciado) && !(entrada->modificado)){
+			if((entrada->referenciado) && !(entrada->modificado) && !presa(entrada)){
 				retirarDaCache(cache,entrada->idBloco);
 				dprintf("[libertarEspaco - Algoritmo NRU] libertou bloco: %d :Ref e Nao Mod\n",entrada->idBloco);
 				entradas_removidas++;
@@ -339,10 +498,11 @@ void libertarEspaco(cache_t cache){
 	//procurar no grupo Referenciadas, Modificadas
 	entradas_removidas = 0;
 	for(i = 0; i<hmap->length;i++){
-		for(aux=hmap->elems[i];aux;aux=aux->next){
+		for(aux=hmap->elems[i];aux;aux=prox){
+			prox=aux->next;
 			entrada = aux->value;
 	
-			if((entrada->referenciado) && (entrada->modificado)){
+			if((entrada->referenciado) && (entrada->modificado) && !presa(entrada)){
 				retirarDaCache(cache,entrada->idBloco);
 				dprintf("[libertarEspaco - Algoritmo NRU] libertou bloco: %d : Ref e Mod\n",entrada->idBloco);
 				entradas_removidas++;
@@ -355,38 +515,60 @@ void libertarEspaco(cache_t cache){
 	return;
 }
 
-/*Apagar um bloco do sistema:
- * - Se o bloco tem mais do que 1 ficheiro a referenciar, retira a referencia e esta pronto.
- * - Se existia em cache, fica invalido
- * - Apagar do disco
- * - cache
- * - indice do bloco a eliminar
- * - indice do inode do ficheiro que pretende apagar este bloco
- * 
- * return 1: apagou do disco
- * */
-int eliminarBlocoCache(cache_t cache,unsigned idBloco){
-	int status;
+/*Recolher os blocos de metadados modificados (ver cache.h)*/
+int recolherMetaCache(cache_t cache,unsigned* ids,char* blocos,int max){
+	HashMap hmap = cache->tabela;
+	icache_t entrada;
+	int i,n = 0;
+	HashNode aux;
+	sthread_mutex_lock(cache->mutex);
+	for(i = 0; i<hmap->length;i++)
+		for(aux=hmap->elems[i];aux && n < max;aux=aux->next){
+			entrada = aux->value;
+			if(entrada->metadados && entrada->modificado && entrada->valido == SIM){
+				ids[n] = entrada->idBloco;
+				memcpy(&blocos[n*BLOCK_SIZE],entrada->conteudobloco,BLOCK_SIZE);
+				n++;
+				entrada->modificado = NAO;
+				entrada->noDiario = SIM;	//ate estar no sitio, o disco tem a versao antiga
+				cache->numeroMeta--;
+			}
+		}
+	sthread_mutex_unlock(cache->mutex);
+	return n;
+}
+
+/*Os blocos de metadados "ids" ja estao no sitio (ver cache.h)*/
+void gravadosMetaCache(cache_t cache,unsigned* ids,int n){
 	icache_t entradaCache;
-	
+	int i;
 	sthread_mutex_lock(cache->mutex);
-	status = hashGet(cache->tabela,idBloco,&entradaCache);//procurar o icache do bloco na hash
-	
-	if(status == 0){ //o bloco esta em cache
-		entradaCache->valido = NAO;	//coloca como entrada invalida
-	}
-	
-	char blocoVazio[BLOCK_SIZE];
-    memset(&blocoVazio,0,sizeof(blocoVazio));	//criar um bloco completamente limpo
-	
-	block_write(cache->disco,idBloco,blocoVazio);	//formata colocando o bloco como vazio
-	
+	for(i = 0; i < n; i++)
+		if(hashGet(cache->tabela,ids[i],&entradaCache) == 0)
+			entradaCache->noDiario = NAO;
 	sthread_mutex_unlock(cache->mutex);
-	return 1;	//removemos o bloco do disco
 }
-		
-	
 
+/*Numero de blocos de metadados por recolher (ver cache.h)*/
+int contarMetaCache(cache_t cache){
+	return cache->numeroMeta;	//so uma leitura: nao precisa do mutex
+}
+
+/*Esquecer todos os blocos (ver cache.h)*/
+void limparCache(cache_t cache){
+	HashMap hmap = cache->tabela;
+	int i;
+	HashNode aux,prox;
+	sthread_mutex_lock(cache->mutex);
+	for(i = 0; i<hmap->length;i++)
+		for(aux=hmap->elems[i];aux;aux=prox){
+			prox=aux->next;
+			aux->value->valido = NAO;	//nao e escrito
+			retirarDaCache(cache,aux->value->idBloco);
+		}
+	cache->numeroMeta = 0;
+	sthread_mutex_unlock(cache->mutex);
+}
 
 //Visualizar todo o conteudo da cache
 /*
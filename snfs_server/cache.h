@@ -31,6 +31,16 @@ cache_t criarCache(int dimensaoCache,blocks_t* disco);
 int escreverCache(cache_t cache,int idBloco,char* bloco);
 
 
+/**Escrever um bloco de metadados (directorio, indice, tabela de referencias)
+ * na cache. Fica na cache ate o diario do fs o recolher (recolherMetaCache)
+ * e o escrever no sitio (gravadosMetaCache): a cache nunca o escreve
+ * @param cache - cache onde sera inserido
+ * @param idBloco - numero do bloco
+ * @return 0 se sucesso, <0 erro
+ */
+int escreverCacheMeta(cache_t cache,int idBloco,char* bloco);
+
+
 /**Ler um bloco da cache: (caso nao exista na cache, carrega do disco)
  * @param cache - cache que pode conter o bloco
  * @param idBloco - numero de bloco
@@ -38,6 +48,32 @@ int escreverCache(cache_t cache,int idBloco,char* bloco);
 
 int lerCache(cache_t cache,int idBloco,char* bloco);
 
+
+/**Pre-carregar os blocos seguidos idBloco..idBloco+n-1 (ate ao primeiro
+ * que ja esteja em cache) com uma so leitura do disco, para que os
+ * lerCache/fixarBloco seguintes os encontrem. Carrega no maximo metade
+ * da cache
+ * @param cache - cache onde sao inseridos
+ * @param idBloco - primeiro bloco
+ * @param n - numero de blocos seguidos no disco que vao ser lidos
+ * @return numero de blocos carregados, <0 erro*/
+int preCarregarCache(cache_t cache,int idBloco,int n);
+
+
+/**Fixar um bloco da cache: como lerCache, mas sem copia. O conteudo
+ * (entrada->conteudobloco) nao muda nem e libertado ate largarBloco;
+ * uma escrita no bloco entretanto vai para uma entrada nova
+ * @param cache - cache que pode conter o bloco
+ * @param idBloco - numero de bloco
+ * @return a entrada fixada, NULL em caso de erro*/
+icache_t fixarBloco(cache_t cache,int idBloco);
+
+
+/**Largar um bloco fixado com fixarBloco
+ * @param cache - cache a que pertence a entrada
+ * @param entrada - entrada devolvida por fixarBloco*/
+void largarBloco(cache_t cache,icache_t entrada);
+
 /**
 *Varre todos os blocos da cache, fazendo reset à sua referência e incrementando o tempo em cache em 2 segundos
 *@param cache - cache que queremos varrer
@@ -70,9 +106,25 @@ int visualizarCache(cache_t cache);
 */
 int retirarDaCache(cache_t cache,int idBloco);
 
-/*Apagar o bloco da cache e do disco
- * return 1: apagou do disco*/
-int eliminarBlocoCache(cache_t cache,unsigned idBloco);
+/*Gravar em disco todos os blocos modificados; ficam na cache, ja nao
+ * modificados (antes de um commit dos metadados que apontam para eles)
+ * return 0 se sucesso, -1 se houve um erro de escrita*/
+int gravarCache(cache_t cache);
+
+/*Copiar para "blocos" (e os numeros para "ids") ate "max" blocos de
+ * metadados modificados desde a ultima recolha. Ficam na cache, presos ate
+ * gravadosMetaCache
+ * return numero de blocos copiados*/
+int recolherMetaCache(cache_t cache,unsigned* ids,char* blocos,int max);
+
+/*Os blocos de metadados "ids" ja estao no sitio: podem sair da cache*/
+void gravadosMetaCache(cache_t cache,unsigned* ids,int n);
+
+/*Numero de blocos de metadados modificados desde a ultima recolha*/
+int contarMetaCache(cache_t cache);
+
+/*Esquecer todos os blocos da cache, sem os escrever (o disco foi apagado)*/
+void limparCache(cache_t cache);
 
 /*Colocar uma entrada da cache como invalida
  * return 0 se colocou como invalido
@@ -0,0 +1,233 @@
+/*
+ *
+ * Implementacao da cache de entradas de directorio
+ *
+ * Guarda o resultado das procuras de nomes nos directorios: (directorio
+ * pai, nome) -> inode, ou a indicacao de que o nome nao existe (entrada
+ * negativa). Um fs_lookup de um caminho ja procurado passa a custar uma
+ * procura na tabela por componente, sem ler blocos nem trancar os
+ * directorios.
+ *
+ * Tabela de hash por encadeamento externo, com um numero de listas
+ * potencia de dois, e uma lista duplamente ligada pela ordem de uso: a
+ * cache cheia substitui a entrada usada ha mais tempo (LRU).
+ *
+ * Cada directorio tem uma geracao, que muda sempre que ganha ou perde
+ * uma entrada (ou e apagado). Cada entrada da cache guarda a geracao do
+ * seu directorio quando foi inserida; se ja nao for a actual, a entrada
+ * nao e usada e sai da cache quando for encontrada.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dcache.h"
+
+#include <sthread.h>
+
+#define dprintf if(0) printf
+
+//estrutura de uma entrada da cache
+typedef struct dentrada_{
+	inodeid_t pai;		//directorio
+	char nome[FS_MAX_FNAME_SZ];
+	int existe;		//0: entrada negativa
+	inodeid_t id;
+	unsigned geracao;	//geracao do pai quando foi inserida
+	struct dentrada_* seguinte;	//lista da tabela de hash
+	struct dentrada_* maisRecente;	//lista LRU
+	struct dentrada_* menosRecente;
+}*dentrada_t;
+
+struct dcache_{
+	dentrada_t* tabela;
+	unsigned numListas;	//potencia de dois
+	int numeroEntradas;
+	int numeroMaxEntradas;
+	unsigned* geracoes;	//geracao de cada inode
+	int numInodes;
+	dentrada_t maisRecente;	//inicio e fim da lista LRU
+	dentrada_t menosRecente;
+	unsigned long acertos;
+	unsigned long negativos;	//acertos em entradas negativas
+	unsigned long falhas;
+	sthread_mutex_t mutex;
+};
+
+
+/**Criar uma cache de entradas de directorio*/
+dcache_t criarDCache(int dimensao,int numInodes){
+	dcache_t dcache = (dcache_t) calloc(1,sizeof(struct dcache_));
+
+	dcache->numListas = 1;
+	while(dcache->numListas < (unsigned)dimensao)
+		dcache->numListas *= 2;
+	dcache->tabela = (dentrada_t*) calloc(dcache->numListas,sizeof(dentrada_t));
+	dcache->numeroMaxEntradas = dimensao;
+	dcache->geracoes = (unsigned*) calloc(numInodes,sizeof(unsigned));
+	dcache->numInodes = numInodes;
+
+	dcache->mutex = sthread_mutex_init();
+	sthread_mutex_setname(dcache->mutex, "dcache.mutex");
+	return dcache;
+}
+
+
+/*Indice da lista da tabela de hash de (pai, nome): FNV-1a*/
+static unsigned funcaoHashDCache(dcache_t dcache,inodeid_t pai,char* nome){
+	unsigned h = 2166136261u ^ pai;
+	for(; *nome; nome++){
+		h ^= (unsigned char)*nome;
+		h *= 16777619u;
+	}
+	return h & (dcache->numListas-1);
+}
+
+/*Tirar uma entrada da lista LRU*/
+static void desligarLRU(dcache_t dcache,dentrada_t e){
+	if(e->maisRecente)
+		e->maisRecente->menosRecente = e->menosRecente;
+	else
+		dcache->maisRecente = e->menosRecente;
+	if(e->menosRecente)
+		e->menosRecente->maisRecente = e->maisRecente;
+	else
+		dcache->menosRecente = e->maisRecente;
+}
+
+/*Por uma entrada no inicio da lista LRU (a mais recente)*/
+static void ligarLRU(dcache_t dcache,dentrada_t e){
+	e->maisRecente = NULL;
+	e->menosRecente = dcache->maisRecente;
+	if(dcache->maisRecente)
+		dcache->maisRecente->maisRecente = e;
+	else
+		dcache->menosRecente = e;
+	dcache->maisRecente = e;
+}
+
+/*Retirar a entrada "e", que esta na lista "*anterior" da tabela, e liberta-la*/
+static void retirarDCache(dcache_t dcache,dentrada_t* anterior,dentrada_t e){
+	*anterior = e->seguinte;
+	desligarLRU(dcache,e);
+	free(e);
+	dcache->numeroEntradas--;
+}
+
+/*Encontrar (pai, nome) na tabela; as entradas de geracoes antigas que
+ * estao no caminho sao retiradas. Com o mutex da cache
+ * Devolve o endereco do ponteiro para a entrada, ou NULL*/
+static dentrada_t* encontrarDCache(dcache_t dcache,inodeid_t pai,char* nome){
+	dentrada_t* anterior = &dcache->tabela[funcaoHashDCache(dcache,pai,nome)];
+
+	while(*anterior){
+		dentrada_t e = *anterior;
+		if(e->geracao != dcache->geracoes[e->pai]){
+			retirarDCache(dcache,anterior,e);
+			continue;
+		}
+		if(e->pai == pai && strcmp(e->nome,nome) == 0)
+			return anterior;
+		anterior = &e->seguinte;
+	}
+	return NULL;
+}
+
+
+/**Procurar o nome "nome" no directorio "pai"*/
+int procurarDCache(dcache_t dcache,inodeid_t pai,char* nome,inodeid_t* id){
+	int resultado = -1;
+
+	if(strlen(nome) >= FS_MAX_FNAME_SZ)	//nunca existe, e nao cabe numa entrada
+		return -1;
+
+	sthread_mutex_lock(dcache->mutex);
+	dentrada_t* encontrada = encontrarDCache(dcache,pai,nome);
+	if(encontrada){
+		dentrada_t e = *encontrada;
+		desligarLRU(dcache,e);
+		ligarLRU(dcache,e);
+		resultado = e->existe;
+		if(e->existe){
+			*id = e->id;
+			dcache->acertos++;
+		}
+		else
+			dcache->negativos++;
+	}
+	else
+		dcache->falhas++;
+	sthread_mutex_unlock(dcache->mutex);
+
+	return resultado;
+}
+
+
+/**Guardar o resultado de uma procura no directorio "pai"*/
+void inserirDCache(dcache_t dcache,inodeid_t pai,char* nome,int existe,inodeid_t id){
+	if(strlen(nome) >= FS_MAX_FNAME_SZ)
+		return;
+
+	sthread_mutex_lock(dcache->mutex);
+	dentrada_t* encontrada = encontrarDCache(dcache,pai,nome);
+	dentrada_t e;
+	if(encontrada){	//outro lookup ja a inseriu
+		e = *encontrada;
+		desligarLRU(dcache,e);
+	}
+	else{
+		if(dcache->numeroEntradas == dcache->numeroMaxEntradas){	//cheia: sai a usada ha mais tempo
+			dentrada_t velha = dcache->menosRecente;
+			dentrada_t* anterior = &dcache->tabela[funcaoHashDCache(dcache,velha->pai,velha->nome)];
+			while(*anterior != velha)
+				anterior = &(*anterior)->seguinte;
+			retirarDCache(dcache,anterior,velha);
+			dprintf("[dcache] cache cheia\n");
+		}
+		e = (dentrada_t) malloc(sizeof(struct dentrada_));
+		e->pai = pai;
+		strcpy(e->nome,nome);
+		dentrada_t* lista = &dcache->tabela[funcaoHashDCache(dcache,pai,nome)];
+		e->seguinte = *lista;
+		*lista = e;
+		dcache->numeroEntradas++;
+	}
+	e->existe = existe;
+	e->id = id;
+	e->geracao = dcache->geracoes[pai];
+	ligarLRU(dcache,e);
+	sthread_mutex_unlock(dcache->mutex);
+}
+
+
+/**Invalidar todas as entradas do directorio "dir"*/
+void invalidarDCache(dcache_t dcache,inodeid_t dir){
+	sthread_mutex_lock(dcache->mutex);
+	dcache->geracoes[dir]++;
+	sthread_mutex_unlock(dcache->mutex);
+}
+
+
+/**Esvaziar a cache*/
+void limparDCache(dcache_t dcache){
+	sthread_mutex_lock(dcache->mutex);
+	while(dcache->menosRecente){
+		dentrada_t velha = dcache->menosRecente;
+		dentrada_t* anterior = &dcache->tabela[funcaoHashDCache(dcache,velha->pai,velha->nome)];
+		while(*anterior != velha)
+			anterior = &(*anterior)->seguinte;
+		retirarDCache(dcache,anterior,velha);
+	}
+	sthread_mutex_unlock(dcache->mutex);
+}
+
+
+/**Mostrar a ocupacao e os acertos e falhas da cache*/
+void estatisticasDCache(dcache_t dcache){
+	sthread_mutex_lock(dcache->mutex);
+	printf("===== Dump: Cache of Directory Entries =======================\n");
+	printf("Entries: %d/%d\n",dcache->numeroEntradas,dcache->numeroMaxEntradas);
+	printf("Hits: %lu (negative: %lu) Misses: %lu\n",
+		dcache->acertos+dcache->negativos,dcache->negativos,dcache->falhas);
+	printf("************************************************************\n");
+	sthread_mutex_unlock(dcache->mutex);
+}
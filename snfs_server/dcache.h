@@ -0,0 +1,57 @@
+/*
+ *
+ *Cache de entradas de directorio (dentry cache)
+ * */
+#ifndef _DCACHE_
+#define _DCACHE_
+#include "fs.h"
+
+typedef struct dcache_* dcache_t;
+
+//##########Assinaturas da cache de entradas de directorio#####################
+
+/**Criar uma cache de entradas de directorio
+ * @param dimensao - numero maximo de entradas (as menos usadas recentemente saem primeiro)
+ * @param numInodes - numero de inodes do sistema de ficheiros
+ * @return a cache criada*/
+dcache_t criarDCache(int dimensao,int numInodes);
+
+
+/**Procurar o nome "nome" no directorio "pai"
+ * @param dcache - cache onde se procura
+ * @param pai - inode do directorio
+ * @param nome - nome da entrada
+ * @param id - inode da entrada, se existir [out]
+ * @return 1 se existe (positiva), 0 se se sabe que nao existe (negativa),
+ * -1 se nao esta em cache*/
+int procurarDCache(dcache_t dcache,inodeid_t pai,char* nome,inodeid_t* id);
+
+
+/**Guardar o resultado de uma procura no directorio "pai". O chamador tem o
+ * trinco do directorio, para que nao mude entre a procura e a insercao
+ * @param dcache - cache onde se insere
+ * @param pai - inode do directorio
+ * @param nome - nome procurado
+ * @param existe - 1 se o nome existe no directorio, 0 se nao existe
+ * @param id - inode da entrada (se existe)*/
+void inserirDCache(dcache_t dcache,inodeid_t pai,char* nome,int existe,inodeid_t id);
+
+
+/**Invalidar todas as entradas do directorio "dir" (mudou ou deixou de
+ * existir): passa a uma nova geracao, e as entradas da anterior sao
+ * descartadas quando forem encontradas
+ * @param dcache - cache a invalidar
+ * @param dir - inode do directorio*/
+void invalidarDCache(dcache_t dcache,inodeid_t dir);
+
+
+/**Esvaziar a cache (formatacao do sistema de ficheiros)
+ * @param dcache - cache a esvaziar*/
+void limparDCache(dcache_t dcache);
+
+
+/**Mostrar a ocupacao e os acertos e falhas da cache
+ * @param dcache - cache a mostrar*/
+void estatisticasDCache(dcache_t dcache);
+
+#endif
@@ -14,33 +14,56 @@
  * 
  *  
  * Caracteristicas do sistema de ficheiros:
- * Tamanho maximo de ficheiro: 10 blocos
+ * Tamanho maximo de ficheiro: 10 blocos directos, mais 128 pelo bloco indirecto e
+ * 	128*128 pelo duplamente indirecto (cerca de 8MB com blocos de 512bytes)
  * Suporta a criacao de subdirectorios no directorio de raiz
- * Tamanho dos blocos tem dimensao fixa de 512bytes. O numero de blocos e definido em tempo de compilacao
+ * Tamanho dos blocos e FS_BLOCK_SIZE (512bytes por omissao). O numero de blocos e definido em tempo de compilacao
  * 
- * O sistema de ficheiros é baseado em i-nodes com 10 entradas directas para blocos de dados.
+ * O sistema de ficheiros é baseado em i-nodes com 10 entradas directas para blocos de dados,
+ * uma para um bloco indirecto e outra para um bloco duplamente indirecto.
  * Cada i-node ocupada 64bytes. 
- * Temos 64 i-nodes por omissao (a tabela assim ocupa 8 blocos) o valor pode ser alterado em tempo de compilacao
+ * Temos um i-node por cada FS_BLOCKS_PER_INODE blocos (2048 com 16384 blocos), ate 65536
  * 
  * Directorios:
  * 		Fichiero com tabela de entradas, 16 bytes: nomeficheiro ou directorio | numero de idone a 2bytes
- *		Podem ocupar no maximo 4 blocos, ou seja, ate 128 entradas
+ *		Os blocos de entradas usam o mapa de blocos do inode (como os ficheiros) e sao lidos pela cache
+ *		Cada directorio tem um indice de hash (enderecamento aberto) em blocos seguidos, que da a entrada
+ *		a partir do nome sem percorrer o directorio; sem espaco para o indice, a procura e linear
  * 
  * 
- * BLOCO:
- * |BLOCO0|Reservado para o bitmap de blocos Livres|
- * |Bloco1|Reservado para bitmap de i-nodes livres|
- * |Bloco2-9|Reservado para tabela de i-nodes|
- * |Bloco>10| dados de ficheiros e directorios|
+ * BLOCO (as dimensoes estao no superbloco):
+ * |BLOCO0|Superbloco: disposicao do volume|
+ * |Bloco1-...|Bitmap de blocos livres, um bit por bloco|
+ * |...|Bitmap de i-nodes livres|
+ * |...|Tabela de i-nodes|
+ * |...|Diario dos metadados: bloco de controlo e registo circular de transaccoes|
+ * |data_start-...| dados de ficheiros e directorios|
+ *
+ * Metadados (bitmaps, tabela de inodes e, na zona de dados, os blocos dos directorios,
+ * dos seus indices e de referencias):
+ *		Os bitmaps e a tabela estao em memoria e as operacoes so marcam os blocos que
+ *		alteraram; os outros ficam presos na cache (escreverCacheMeta), que nunca os escreve.
+ *		De INTERVALO_TEMPO_CACHE em INTERVALO_TEMPO_CACHE segundos, as alteracoes de todos
+ *		os pedidos desde a ultima vez vao juntas para o diario (group commit), depois dos
+ *		blocos de dados modificados que estao na cache. Os da zona de dados vao para o sitio
+ *		logo depois do commit, os outros so no checkpoint, quando o diario precisa de espaco;
+ *		fs_new refaz as transaccoes que estao no diario. Cada commit e uma so transaccao
+ *		(entrarFS faz o commit antes de ela deixar de caber no diario), e um bloco libertado
+ *		so pode ser reservado depois de o commit que o liberta estar no disco e de o diario
+ *		ja nao ter copias dele: depois de um crash o disco e consistente.
  */
 
 
+#define _POSIX_C_SOURCE 200809L	// strtok_r
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <stdint.h>
 #include "fs.h"
 #include "cache.h"
+#include "dcache.h"
+#include "arena.h"
 
 #include <sthread.h>		//para criar a thread que varre a cache
 #ifdef USE_PTHREADS
@@ -55,31 +78,43 @@
 #define CACHE_ACTIVA 1   //1 cache activa, 0 cache inactiva
 
 #define INODES_USED_BY_FS  1  //blocos ocupados pelo fs
-#define NUM_BLOCOS_MAX INODE_NUM_BLKS*ITAB_SIZE //maximo de blocos que podem ser apontados
 
 #define LEITURA 0
 #define ESCRITA 1
 
-#define BLOCK_SIZE 512
+#define BLOCK_SIZE FS_BLOCK_SIZE
 
 #define DIM_CACHE 8	//dimensao da cache
+#define DIM_DCACHE 1024	//entradas da cache de entradas de directorio
 
 /*
  * Inode
  * - inode size = 64 bytes
  * - num of direct block refs = 10 blocks
+ * - reserved[INODE_IND]: single indirect block, EXT_INODE_NUM_BLKS refs
+ * - reserved[INODE_DIND]: double indirect block, EXT_INODE_NUM_BLKS refs
+ *   to single indirect blocks
  */
 
 #define INODE_NUM_BLKS 10
 
 #define EXT_INODE_NUM_BLKS (BLOCK_SIZE / sizeof(unsigned int))
 
+#define INODE_IND 0		//bloco indirecto: referencias para blocos de dados
+#define INODE_DIND 1	//bloco duplamente indirecto: referencias para blocos indirectos
+#define INODE_DIDX 2	//directorios: primeiro bloco do indice
+#define INODE_DIDX_BLKS 3	//directorios: numero de blocos do indice
+
+//numero maximo de blocos de dados de um ficheiro
+#define FILE_MAX_BLKS (INODE_NUM_BLKS + EXT_INODE_NUM_BLKS + EXT_INODE_NUM_BLKS*EXT_INODE_NUM_BLKS)
+
 //inode do FileSystem: tipo, dimensao, vector de ponteiros para blocos, 4 para realizar a extensao da tabela
 typedef struct fs_inode {
    fs_itype_t type;			//tipo do i-node: FS_DIR
    unsigned int size;		//dimensao 
    unsigned int blocks[INODE_NUM_BLKS];//blocos associados ao inode
-   unsigned int reserved[4]; // reserved[0] -> extending table block number
+   unsigned int reserved[4]; // reserved[INODE_IND], reserved[INODE_DIND] -> extending table block numbers
+                             // reserved[INODE_DIDX], reserved[INODE_DIDX_BLKS] -> directory index
 
 } fs_inode_t;
 
@@ -101,120 +136,611 @@ typedef struct dentry {
 } fs_dentry_t;
 
 
+/*
+ * Directory index
+ * - hash table (open addressing, linear probing) from the name to the
+ *   position of its entry in the directory
+ * - reserved[INODE_DIDX_BLKS] consecutive blocks from reserved[INODE_DIDX],
+ *   a power of two, read and written through the cache
+ * - each slot keeps the whole hash, so a lookup only reads a directory
+ *   entry when the hash matches
+ * - a directory without index (no blocks for it) is scanned
+ */
+
+typedef struct dir_idx {
+   unsigned entrada;	//posicao da entrada no directorio + 1, 0 se livre
+   unsigned hash;		//hash do nome
+} fs_dir_idx_t;
+
+#define DIR_IDX_PER_BLOCK (BLOCK_SIZE / sizeof(fs_dir_idx_t))	//posicoes do indice por bloco
+
+
 /*
  * File syste structure
- * - inode table size = 64 entries (8 blocks)
- * 
- * Internal organization 
- *   - block 0        - free block bitmap
- *   - block 1        - free inode bitmap
- *   - block 2-9      - inode table (8 blocks)
- *   - block 10-(N-1) - data blocks, where N is the number of blocks
+ * - block 0 is the superblock, which describes the layout; the other
+ *   regions are sized at format time from the number of blocks:
+ *   - block bitmap: one bit per block of the volume
+ *   - inode bitmap: one bit per inode
+ *   - inode table: one inode per FS_BLOCKS_PER_INODE blocks, in whole
+ *     blocks, up to FS_MAX_INODES (inodeid_t is 16 bits)
+ *   - metadata journal: FS_JOURNAL_BLKS blocks, a control block and a
+ *     circular log of transactions (descriptor + copies of the blocks)
+ *   - data blocks, from data_start to the end of the volume
  */
 
-#define ITAB_NUM_BLKS 8 //numero de blocos da tabela de cada inode
+#define FS_MAGIC 0x53464e53	//"SNFS"
+
+#ifndef FS_BLOCKS_PER_INODE
+#define FS_BLOCKS_PER_INODE 8
+#endif
+
+#define FS_MAX_INODES 65536
 
-#define ITAB_SIZE (ITAB_NUM_BLKS*BLOCK_SIZE / sizeof(fs_inode_t)) //tamanho de cada tabela Inodes
+#ifndef FS_JOURNAL_BLKS
+#define FS_JOURNAL_BLKS 256	//bloco de controlo + registo
+#endif
+
+#define FS_JOURNAL_MAGIC 0x4c4e524a	//"JRNL"
+
+#define INODES_PER_BLOCK (BLOCK_SIZE / sizeof(fs_inode_t))	//inodes em cada bloco da tabela
+
+#define BMAP_BITS_PER_BLOCK (BLOCK_SIZE*8)	//bits de um bloco de um bitmap
+
+//superbloco: disposicao do volume (bloco 0)
+typedef struct fs_super {
+   unsigned magic;			//FS_MAGIC se o volume esta formatado
+   unsigned block_size;		//BLOCK_SIZE com que foi formatado
+   unsigned num_blocks;		//blocos do volume
+   unsigned num_inodes;		//entradas da tabela de inodes
+   unsigned bmap_start;		//bitmap de blocos
+   unsigned bmap_blks;
+   unsigned imap_start;		//bitmap de inodes
+   unsigned imap_blks;
+   unsigned itab_start;		//tabela de inodes
+   unsigned itab_blks;
+   unsigned jrnl_start;		//diario dos metadados
+   unsigned jrnl_blks;
+   unsigned data_start;		//primeiro bloco de dados
+} fs_super_t;
+
+/*Descritor de uma transaccao do registo: ocupa JRNL_DESC_BLKS(num)
+ * blocos (home[] continua nos blocos seguintes ao primeiro) e os "num"
+ * blocos do registo a seguir sao copias dos blocos de metadados
+ * home[0..num). O primeiro bloco e escrito depois de todos os outros: e o
+ * commit da transaccao inteira*/
+typedef struct fs_journal {
+   unsigned magic;			//FS_JOURNAL_MAGIC
+   unsigned seq;			//numero da transaccao
+   unsigned num;
+   unsigned home[];
+} fs_journal_t;
+
+/*Bloco de controlo (primeiro bloco do diario): as transaccoes a refazer
+ * comecam na posicao "inicio" do registo, com o numero "seq". Muda
+ * depois de cada checkpoint*/
+typedef struct fs_journal_ctl {
+   unsigned magic;			//FS_JOURNAL_MAGIC
+   unsigned seq;
+   unsigned inicio;
+} fs_journal_ctl_t;
+
+#define JRNL_LOG_BLKS(sb) ((sb)->jrnl_blks - 1)	//blocos do registo
+//homes no primeiro bloco do descritor e em cada um dos seguintes
+#define JRNL_HOMES (BLOCK_SIZE / sizeof(unsigned) - 3)
+#define JRNL_HOMES_BLK (BLOCK_SIZE / sizeof(unsigned))
+//blocos do descritor de uma transaccao de "num" blocos
+#define JRNL_DESC_BLKS(num) ((num) <= JRNL_HOMES ? 1 : 1 + ((num) - JRNL_HOMES + JRNL_HOMES_BLK-1) / JRNL_HOMES_BLK)
+
+#if FS_JOURNAL_BLKS < 3
+#error "FS_JOURNAL_BLKS must be at least 3"
+#endif
+
+#define FS_NUM_INODES(fs) ((fs)->sb.num_inodes)
 
-struct fs_ {		//um file system e constituido por um 
+/*Trinco leitores/escritores. O monitor so e ocupado para mudar os
+ * contadores, nao durante a operacao. Os escritores tem prioridade: um
+ * leitor novo espera enquanto houver escritores a espera*/
+typedef struct {
+   sthread_mon_t mon;
+   int leitores;		//numero de leitores activos
+   int escritor;		//1 se ha um escritor activo
+   int wanna_escritor;	//numero de threads que querem escrever
+} fs_trinco_t;
+
+//grupos de blocos com um contador de livres, para a procura saltar os
+//grupos cheios sem ler o bitmap
+#define BMAP_GROUP 512
+#define BMAP_NUM_GROUPS(fs) (((fs)->sb.num_blocks + BMAP_GROUP-1) / BMAP_GROUP)
+
+struct fs_ {		//um file system e constituido por um
    blocks_t* blocks;		//estrutura de dados percistente
    cache_t cache;			//uma cache
+   dcache_t dcache;			//cache de entradas de directorio (fs_lookup)
    char* referencias;		//contador de referencias (char porque basta 1 byte para contar o numero de referencias*/
-   char inode_bmap [BLOCK_SIZE];	//bitmap de inodes
-   char blk_bmap [BLOCK_SIZE];		//bitmap de blocos
-   fs_inode_t inode_tab [ITAB_SIZE]; //uma tabela de inodes
-   
-   //cada FS controla os seus acessos
-   sthread_mon_t monLeitores;	//monitor para os leitores
-   sthread_mon_t monEscritores;//monitor para os escritores
-   int leitores;	//numero de leitores activos
-   int escritores;	//numero de escritores activos
-   int wanna_leitor;	//numero de threads que querem ler
-   int wanna_escritor;	//numero de threads que querem escrever   
-   int turno;		//leitura ou escrita
+   inodeid_t* dono;			//mapa inverso: ultimo inode que passou a usar cada bloco (0 se nenhum)
+   fs_super_t sb;			//disposicao do volume
+   char* inode_bmap;		//bitmap de inodes (sb.imap_blks blocos)
+   char* blk_bmap;			//bitmap de blocos (sb.bmap_blks blocos)
+   char* imap_sujo;			//blocos do bitmap de inodes por guardar
+   char* bmap_sujo;			//blocos do bitmap de blocos por guardar
+   char* itab_sujo;			//blocos da tabela de inodes por guardar
+   char* diario;			//transaccao a gravar: descritor e copias (sb.jrnl_blks blocos)
+   char* commitado;			//metadados como estao no diario (bmap_start..jrnl_start)
+   char* ckpt_sujo;			//blocos de "commitado" que ainda nao estao no sitio
+   char* registados;		//bitmap dos blocos da zona de dados que estao no registo
+   char* a_libertar;		//bitmap dos blocos libertados desde o ultimo commit
+   char* em_commit;			//e dos que sao libertados pelo commit a ser gravado
+   unsigned num_libertar;	//blocos em a_libertar e em em_commit
+   unsigned marcados;		//blocos marcados nos bitmaps e na tabela desde o ultimo commit
+   unsigned jseq;			//numero da proxima transaccao
+   unsigned jcabeca;		//posicao no registo da proxima transaccao
+   unsigned jcauda;			//e da mais antiga que ainda nao esta no sitio
+   unsigned epoca;			//muda quando fsi_store_fsdata grava todos os metadados
+   unsigned short* livres;	//blocos livres em cada grupo do bitmap de blocos
+   unsigned cursor;			//proxima procura de blocos livres comeca aqui (next fit)
+   fs_inode_t* inode_tab;	//uma tabela de inodes (sb.num_inodes)
+
+   //sincronizacao (ver "Protocolo de trincos")
+   fs_trinco_t trincoFS;			//todo o FS: partilhado pelas operacoes, exclusivo para format/diskUsage
+   fs_trinco_t* trincos;	//um trinco por inode
+   sthread_mutex_t trincoBitmaps;	//bitmaps e contadores de referencias
+   sthread_mutex_t trincoDisco;		//escrita dos metadados em disco
+   sthread_mutex_t trincoDiario;	//um commit de cada vez
+
+   //desfragmentacao em segundo plano (ver fs_defrag)
+   sthread_mutex_t trincoDesfrag;	//estado da desfragmentacao
+   fs_defrag_stat_t desfrag;		//progresso da que esta a correr ou da ultima
+   sthread_t desfragThread;		//NULL se nunca correu
 };
 
 #define NOT_FS_INITIALIZER  1
                                
+/*
+ * Bitmap management macros
+ */
+
+#define BMAP_SET(bmap,num) ((bmap)[(num)/8]|=(0x1<<((num)%8)))	//bpmap, num esta OCUPADO
+
+#define BMAP_CLR(bmap,num) ((bmap)[(num)/8]&=~((0x1<<((num)%8))))	//num esta LIVRE
+
+#define BMAP_ISSET(bmap,num) ((bmap)[(num)/8]&(0x1<<((num)%8)))		//qual o estado de num?
+
 /*
  * Internal functions for loading/storing file system metadata do the blocks
  */
                                 
                                 
+/*Calcular a disposicao de um volume de "num_blocks" blocos*/
+static void fsi_layout(fs_super_t* sb, unsigned num_blocks)
+{
+   unsigned inodes = num_blocks / FS_BLOCKS_PER_INODE;
+
+   if (inodes > FS_MAX_INODES)
+      inodes = FS_MAX_INODES;
+   sb->magic = FS_MAGIC;
+   sb->block_size = BLOCK_SIZE;
+   sb->num_blocks = num_blocks;
+   sb->itab_blks = (inodes + INODES_PER_BLOCK-1) / INODES_PER_BLOCK;
+   if (sb->itab_blks == 0)	//pelo menos um bloco
+      sb->itab_blks = 1;
+   sb->num_inodes = sb->itab_blks * INODES_PER_BLOCK;
+   if (sb->num_inodes > FS_MAX_INODES)
+      sb->num_inodes = FS_MAX_INODES;
+   sb->bmap_start = 1;
+   sb->bmap_blks = (num_blocks + BMAP_BITS_PER_BLOCK-1) / BMAP_BITS_PER_BLOCK;
+   sb->imap_start = sb->bmap_start + sb->bmap_blks;
+   sb->imap_blks = (sb->num_inodes + BMAP_BITS_PER_BLOCK-1) / BMAP_BITS_PER_BLOCK;
+   sb->itab_start = sb->imap_start + sb->imap_blks;
+   sb->jrnl_start = sb->itab_start + sb->itab_blks;
+   sb->jrnl_blks = FS_JOURNAL_BLKS;
+   sb->data_start = sb->jrnl_start + sb->jrnl_blks;
+}
+
+/*Ler o superbloco: se o volume foi formatado com este tamanho de bloco,
+ * a disposicao e a que la esta; senao fica a de fsi_layout, que o
+ * format vai escrever. Devolve 1 se o volume estava formatado*/
+static int fsi_load_super(fs_t* fs)
+{
+   char* bloco = (char*) malloc(BLOCK_SIZE);
+   fs_super_t sb;
+
+   block_read(fs->blocks,0,bloco);
+   memcpy(&sb,bloco,sizeof(sb));
+   free(bloco);
+   if (sb.magic != FS_MAGIC || sb.block_size != BLOCK_SIZE ||
+       sb.num_blocks > block_num_blocks(fs->blocks) || sb.data_start >= sb.num_blocks)
+      return 0;
+   fs->sb = sb;
+   return 1;
+}
+
 static void fsi_load_fsdata(fs_t* fs)
 {
    blocks_t* bks = fs->blocks;
+   fs_super_t* sb = &fs->sb;
 
-   // load free block bitmap from block 0
-   /*if(CACHE_ACTIVA)
-		lerCache(fs->cache,0,fs->blk_bmap);
-   else*/
-		block_read(bks,0,fs->blk_bmap);
-
-   // load free inode bitmap from block 1
-  /* if(CACHE_ACTIVA)
-		lerCache(fs->cache,1,fs->inode_bmap);
-   else*/
-		block_read(bks,1,fs->inode_bmap);
+   // load free block bitmap
+   for (int i = 0; i < sb->bmap_blks; i++)
+		block_read(bks,sb->bmap_start+i,&fs->blk_bmap[i*BLOCK_SIZE]);
+
+   // load free inode bitmap
+   for (int i = 0; i < sb->imap_blks; i++)
+		block_read(bks,sb->imap_start+i,&fs->inode_bmap[i*BLOCK_SIZE]);
    
-   // load inode table from blocks 2-9
-   for (int i = 0; i < ITAB_NUM_BLKS; i++) {
-     /* if(CACHE_ACTIVA)
-		lerCache(fs->cache,i+2,&((char*)fs->inode_tab)[i*BLOCK_SIZE]);
-	else*/
-		block_read(bks,i+2,&((char*)fs->inode_tab)[i*BLOCK_SIZE]);
+   // load inode table
+   for (int i = 0; i < sb->itab_blks; i++) {
+		block_read(bks,sb->itab_start+i,&((char*)fs->inode_tab)[i*BLOCK_SIZE]);
    }
 #define NOT_FS_INITIALIZER  1  //file system is already initialized, subsequent block acess will be delayed using a sleep function.
 }
 
 
+/*Esvaziar o registo (todos os blocos estao no sitio): escrever o bloco
+ * de controlo com a transaccao seguinte. Com o trincoDisco*/
+static void fsi_journal_ctl(fs_t* fs, char* bloco)
+{
+   fs_journal_ctl_t* ctl = (fs_journal_ctl_t*) bloco;
+
+   memset(bloco,0,BLOCK_SIZE);
+   fs->jcabeca %= JRNL_LOG_BLKS(&fs->sb);
+   fs->jcauda = fs->jcabeca;
+   ctl->magic = FS_JOURNAL_MAGIC;
+   ctl->seq = fs->jseq;
+   ctl->inicio = fs->jcabeca;
+   block_write(fs->blocks,fs->sb.jrnl_start,bloco);
+   memset(fs->registados,0,fs->sb.bmap_blks*BLOCK_SIZE);
+}
+
+/*Os metadados em memoria estao todos no sitio: passam a ser a versao
+ * commitada e o checkpoint nao tem nada a escrever*/
+static void fsi_journal_reset(fs_t* fs)
+{
+   fs_super_t* sb = &fs->sb;
+
+   memcpy(&fs->commitado[(sb->bmap_start-sb->bmap_start)*BLOCK_SIZE],fs->blk_bmap,sb->bmap_blks*BLOCK_SIZE);
+   memcpy(&fs->commitado[(sb->imap_start-sb->bmap_start)*BLOCK_SIZE],fs->inode_bmap,sb->imap_blks*BLOCK_SIZE);
+   memcpy(&fs->commitado[(sb->itab_start-sb->bmap_start)*BLOCK_SIZE],fs->inode_tab,sb->itab_blks*BLOCK_SIZE);
+   memset(fs->ckpt_sujo,0,sb->jrnl_start-sb->bmap_start);
+}
+
 static void fsi_store_fsdata(fs_t* fs)
 {
    blocks_t* bks = fs->blocks;
- 
-   // store free block bitmap to block 0
-   //if(CACHE_ACTIVA)
-	//	escreverCache(fs->cache,0,fs->blk_bmap);
-   //else
-		block_write(bks,0,fs->blk_bmap);	//os metadados sao gravados de imediato em disco
-
-   // store free inode bitmap to block 1
-  // if(CACHE_ACTIVA)
-	//	escreverCache(fs->cache,1,fs->inode_bmap);
-	//else
-		block_write(bks,1,fs->inode_bmap);
+   fs_super_t* sb = &fs->sb;
+   char* bloco = (char*) malloc(BLOCK_SIZE);
+
+   memset(bloco,0,BLOCK_SIZE);
+   memcpy(bloco,sb,sizeof(*sb));
+
+   sthread_mutex_lock(fs->trincoDisco);
+   block_write(bks,0,bloco);	//os metadados sao gravados de imediato em disco
+
+   // store free block bitmap
+   for (int i = 0; i < sb->bmap_blks; i++) {
+		fs->bmap_sujo[i] = 0;
+		block_write(bks,sb->bmap_start+i,&fs->blk_bmap[i*BLOCK_SIZE]);
+   }
+
+   // store free inode bitmap
+   for (int i = 0; i < sb->imap_blks; i++) {
+		fs->imap_sujo[i] = 0;
+		block_write(bks,sb->imap_start+i,&fs->inode_bmap[i*BLOCK_SIZE]);
+   }
    
-   // store inode table to blocks 2-9
-   for (int i = 0; i < ITAB_NUM_BLKS; i++) {
-	  // if(CACHE_ACTIVA)
-		//	escreverCache(fs->cache,i+2,&((char*)fs->inode_tab)[i*BLOCK_SIZE]);
-		//else
-			block_write(bks,i+2,&((char*)fs->inode_tab)[i*BLOCK_SIZE]);
+   // store inode table
+   for (int i = 0; i < sb->itab_blks; i++) {
+			fs->itab_sujo[i] = 0;
+			block_write(bks,sb->itab_start+i,&((char*)fs->inode_tab)[i*BLOCK_SIZE]);
+   }
+
+   // nothing left to replay: a commit copied before this one is older
+   fs->marcados = 0;
+   fsi_journal_reset(fs);
+   fsi_journal_ctl(fs,bloco);
+   fs->epoca++;
+   sthread_mutex_unlock(fs->trincoDisco);
+   free(bloco);
+}
+
+/*Marcar o bloco "i" de uma regiao dos metadados (bitmaps ou tabela) para
+ * o proximo commit*/
+static void fsi_marcar(fs_t* fs, char* sujo, unsigned i)
+{
+   if (!sujo[i]) {
+      sujo[i] = 1;
+      fs->marcados++;	//so uma estimativa para entrarFS: nao tem trinco
+   }
+}
+
+/*Marcar o bloco da tabela onde esta "inode" para ser gravado. Os
+ * bitmaps sao marcados quando mudam (fsi_blk_set, fsi_alloc_inode...) e
+ * os blocos de directorios, indices e referencias sao escritos na cache
+ * com escreverCacheMeta: todos vao no mesmo commit*/
+static void fsi_mark_inode(fs_t* fs, inodeid_t inode)
+{
+   fsi_marcar(fs,fs->itab_sujo,inode / INODES_PER_BLOCK);
+}
+
+/*Maior numero de blocos de uma transaccao: o descritor e as copias
+ * cabem no registo*/
+static unsigned fsi_journal_max(fs_super_t* sb)
+{
+   unsigned max = JRNL_LOG_BLKS(sb) - 1;
+
+   while (JRNL_DESC_BLKS(max) + max > JRNL_LOG_BLKS(sb))
+      max--;
+   return max;
+}
+
+/*Juntar a transaccao em fs->diario os blocos marcados de uma regiao dos
+ * metadados, com as copias em "copias", ate a transaccao ter "max"
+ * blocos. Com o trincoFS exclusivo*/
+static void fsi_journal_add(fs_t* fs, char* copias, char* meta, char* sujo, unsigned start, unsigned nblks, unsigned max)
+{
+   fs_journal_t* cab = (fs_journal_t*) fs->diario;
+
+   for (unsigned i = 0; i < nblks && cab->num < max; i++) {
+      if (!sujo[i])
+         continue;
+      sujo[i] = 0;
+      memcpy(&copias[cab->num*BLOCK_SIZE],&meta[i*BLOCK_SIZE],BLOCK_SIZE);
+      cab->home[cab->num++] = start+i;
+   }
+}
+
+static unsigned fsi_bmap_next(const char* bmap, unsigned size, unsigned desde, int livre);
+
+/*Os blocos libertados desde o ultimo commit vao livres na copia do bitmap
+ * de blocos que esta na transaccao e passam para fs->em_commit: no bitmap
+ * em memoria so ficam livres depois de o commit estar no disco
+ * (fsi_journal_release). Com o trincoFS exclusivo, depois de o bitmap ser
+ * juntado a transaccao*/
+static void fsi_journal_frees(fs_t* fs, char* copias)
+{
+   fs_super_t* sb = &fs->sb;
+   fs_journal_t* cab = (fs_journal_t*) fs->diario;
+   unsigned total = sb->num_blocks, i;
+
+   for (unsigned b = fsi_bmap_next(fs->a_libertar,total,0,0); b < total;
+        b = fsi_bmap_next(fs->a_libertar,total,b+1,0)) {
+      for (i = 0; i < cab->num && cab->home[i] != sb->bmap_start + b / BMAP_BITS_PER_BLOCK; i++);
+      if (i == cab->num)	//o seu bloco do bitmap ficou para a transaccao seguinte
+         continue;
+      BMAP_CLR(&copias[i*BLOCK_SIZE],b % BMAP_BITS_PER_BLOCK);
+      BMAP_CLR(fs->a_libertar,b);
+      BMAP_SET(fs->em_commit,b);
+   }
+}
+
+/*O commit que liberta os blocos de fs->em_commit esta no disco: podem
+ * ser reservados. O bitmap que foi gravado ja os tem livres, por isso
+ * nao e marcado. Com o trincoBitmaps*/
+static void fsi_journal_release(fs_t* fs)
+{
+   unsigned total = fs->sb.num_blocks;
+
+   for (unsigned b = fsi_bmap_next(fs->em_commit,total,0,0); b < total;
+        b = fsi_bmap_next(fs->em_commit,total,b+1,0)) {
+      BMAP_CLR(fs->em_commit,b);
+      BMAP_CLR(fs->blk_bmap,b);
+      fs->livres[b / BMAP_GROUP]++;
+      fs->num_libertar--;
+   }
+}
+
+/*Ha blocos de metadados marcados? (so para evitar o trincoFS quando nao ha)*/
+static int fsi_meta_dirty(fs_t* fs)
+{
+   fs_super_t* sb = &fs->sb;
+
+   return memchr(fs->bmap_sujo,1,sb->bmap_blks) || memchr(fs->imap_sujo,1,sb->imap_blks) ||
+      memchr(fs->itab_sujo,1,sb->itab_blks) || contarMetaCache(fs->cache) > 0;
+}
+
+static void iniciaEscrita(fs_trinco_t* t);
+static void terminaEscrita(fs_trinco_t* t);
+static void iniciaLeitura(fs_trinco_t* t);
+static void terminaLeitura(fs_trinco_t* t);
+
+/*Bloco do disco na posicao "pos" do registo*/
+#define JRNL_BLOCK(sb,pos) ((sb)->jrnl_start + 1 + (pos) % JRNL_LOG_BLKS(sb))
+
+/*Escrever no sitio os blocos que estao no registo (a versao commitada)
+ * e esvaziar o registo. Com o trincoDisco*/
+static void fsi_checkpoint(fs_t* fs)
+{
+   fs_super_t* sb = &fs->sb;
+   char bloco[BLOCK_SIZE];
+
+   for (unsigned i = 0; i < sb->jrnl_start - sb->bmap_start; i++) {
+      if (!fs->ckpt_sujo[i])
+         continue;
+      fs->ckpt_sujo[i] = 0;
+      block_write(fs->blocks,sb->bmap_start+i,&fs->commitado[i*BLOCK_SIZE]);
+   }
+   fsi_journal_ctl(fs,bloco);	//as copias da zona de dados ja foram escritas
+}
+
+/*Juntar ao registo as alteracoes aos metadados de todos os pedidos desde
+ * o ultimo commit, numa so transaccao: os blocos marcados dos bitmaps e da
+ * tabela e os blocos de metadados presos na cache. A copia e feita com o
+ * trincoFS exclusivo, entre operacoes. Os blocos de dados modificados na
+ * cache vao para o disco antes do commit, para que os metadados nunca
+ * apontem para blocos que ainda nao foram escritos. No registo: copias,
+ * blocos seguintes do descritor e depois o primeiro (o commit). Os blocos
+ * da zona de dados nao tem copia em memoria: vao para o sitio logo a
+ * seguir, e so entao podem sair da cache; os outros so no checkpoint,
+ * quando o registo nao tem espaco.
+ * Um bloco libertado continua reservado ate ao commit que o liberta estar
+ * no disco: antes disso os metadados commitados ainda o podem usar. Se ha
+ * uma copia dele no registo, o registo e esvaziado antes de ele poder ser
+ * reservado (refazer a transaccao antiga apagava o que la for escrito).
+ * Se entretanto fsi_store_fsdata gravou tudo, a copia ja e antiga e nao
+ * se grava. So se as alteracoes nao cabem no registo (entrarFS faz o
+ * commit antes disso) a transaccao e partida*/
+static void fsi_journal_commit(fs_t* fs)
+{
+   fs_super_t* sb = &fs->sb;
+   fs_journal_t* cab = (fs_journal_t*) fs->diario;
+   unsigned max = fsi_journal_max(sb), num, epoca, b;
+   char* copias = &fs->diario[JRNL_DESC_BLKS(max)*BLOCK_SIZE];
+   int resto;
+
+   sthread_mutex_lock(fs->trincoDiario);	//quem chega a meio de outro commit espera por ele
+   if (!fsi_meta_dirty(fs)) {
+      sthread_mutex_unlock(fs->trincoDiario);
+      return;
+   }
+   do {
+      iniciaEscrita(&fs->trincoFS);
+      cab->num = 0;
+      fsi_journal_add(fs,copias,fs->blk_bmap,fs->bmap_sujo,sb->bmap_start,sb->bmap_blks,max);
+      if (fs->num_libertar > 0)
+         fsi_journal_frees(fs,copias);
+      fsi_journal_add(fs,copias,fs->inode_bmap,fs->imap_sujo,sb->imap_start,sb->imap_blks,max);
+      fsi_journal_add(fs,copias,(char*)fs->inode_tab,fs->itab_sujo,sb->itab_start,sb->itab_blks,max);
+      cab->num += recolherMetaCache(fs->cache,&cab->home[cab->num],&copias[cab->num*BLOCK_SIZE],max-cab->num);
+      num = cab->num;
+      resto = fsi_meta_dirty(fs);
+      fs->marcados = 0;
+      epoca = fs->epoca;
+      terminaEscrita(&fs->trincoFS);
+      if (num == 0)
+         break;
+      if (resto)
+         printf("[fs] metadata changes larger than the journal: committed in parts.\n");
+
+      gravarCache(fs->cache);	//dados antes dos metadados
+
+      sthread_mutex_lock(fs->trincoDisco);
+      if (epoca == fs->epoca) {
+         unsigned ndesc = JRNL_DESC_BLKS(num);
+         if (fs->jcabeca - fs->jcauda + ndesc + num > JRNL_LOG_BLKS(sb))
+            fsi_checkpoint(fs);
+         for (unsigned i = 0; i < num; i++)
+            block_write(fs->blocks,JRNL_BLOCK(sb,fs->jcabeca+ndesc+i),&copias[i*BLOCK_SIZE]);
+         for (unsigned d = 1; d < ndesc; d++)
+            block_write(fs->blocks,JRNL_BLOCK(sb,fs->jcabeca+d),&fs->diario[d*BLOCK_SIZE]);
+         cab->magic = FS_JOURNAL_MAGIC;
+         cab->seq = fs->jseq++;
+         block_write(fs->blocks,JRNL_BLOCK(sb,fs->jcabeca),fs->diario);	//commit
+         fs->jcabeca += ndesc + num;
+         for (unsigned i = 0; i < num; i++) {
+            if (cab->home[i] >= sb->data_start) {
+               block_write(fs->blocks,cab->home[i],&copias[i*BLOCK_SIZE]);
+               BMAP_SET(fs->registados,cab->home[i]);
+               continue;
+            }
+            unsigned k = cab->home[i] - sb->bmap_start;
+            memcpy(&fs->commitado[k*BLOCK_SIZE],&copias[i*BLOCK_SIZE],BLOCK_SIZE);
+            fs->ckpt_sujo[k] = 1;
+         }
+         for (b = fsi_bmap_next(fs->em_commit,sb->num_blocks,0,0); b < sb->num_blocks;
+              b = fsi_bmap_next(fs->em_commit,sb->num_blocks,b+1,0))
+            if (BMAP_ISSET(fs->registados,b)) {	//libertado com uma copia no registo
+               fsi_checkpoint(fs);
+               break;
+            }
+      }
+      gravadosMetaCache(fs->cache,cab->home,num);	//ja podem sair da cache
+      sthread_mutex_unlock(fs->trincoDisco);
+
+      iniciaLeitura(&fs->trincoFS);	//um format nao muda os bitmaps entretanto
+      sthread_mutex_lock(fs->trincoBitmaps);
+      if (epoca == fs->epoca)
+         fsi_journal_release(fs);
+      sthread_mutex_unlock(fs->trincoBitmaps);
+      terminaLeitura(&fs->trincoFS);
+   } while (resto);
+   sthread_mutex_unlock(fs->trincoDiario);
+}
+
+/*Refazer, por ordem, as transaccoes que estao no registo desde o ultimo
+ * checkpoint. Uma transaccao interrompida nao tem o primeiro bloco do
+ * descritor (ou tem um de outra volta ao registo, com outro numero) e
+ * acaba a procura*/
+static void fsi_replay_journal(fs_t* fs)
+{
+   fs_super_t* sb = &fs->sb;
+   fs_journal_ctl_t ctl;
+   fs_journal_t* cab = (fs_journal_t*) fs->diario;
+   char* bloco = &fs->diario[(sb->jrnl_blks-1)*BLOCK_SIZE];	//nunca e do descritor
+   unsigned max = fsi_journal_max(sb), refeitas = 0;
+
+   block_read(fs->blocks,sb->jrnl_start,bloco);
+   memcpy(&ctl,bloco,sizeof(ctl));
+   if (ctl.magic != FS_JOURNAL_MAGIC)
+      return;
+   fs->jseq = ctl.seq;
+   fs->jcabeca = fs->jcauda = ctl.inicio % JRNL_LOG_BLKS(sb);
+
+   while (fs->jcabeca - fs->jcauda < JRNL_LOG_BLKS(sb)) {
+      block_read(fs->blocks,JRNL_BLOCK(sb,fs->jcabeca),fs->diario);
+      if (cab->magic != FS_JOURNAL_MAGIC || cab->seq != fs->jseq || cab->num == 0 || cab->num > max)
+         break;
+      unsigned ndesc = JRNL_DESC_BLKS(cab->num);
+      if (fs->jcabeca - fs->jcauda + ndesc + cab->num > JRNL_LOG_BLKS(sb))
+         break;
+      for (unsigned d = 1; d < ndesc; d++)
+         block_read(fs->blocks,JRNL_BLOCK(sb,fs->jcabeca+d),&fs->diario[d*BLOCK_SIZE]);
+      for (unsigned i = 0; i < cab->num; i++) {
+         if (cab->home[i] < sb->bmap_start || cab->home[i] >= sb->num_blocks ||
+             (cab->home[i] >= sb->jrnl_start && cab->home[i] < sb->data_start))	//so metadados
+            continue;
+         block_read(fs->blocks,JRNL_BLOCK(sb,fs->jcabeca+ndesc+i),bloco);
+         block_write(fs->blocks,cab->home[i],bloco);
+      }
+      fs->jcabeca += ndesc + cab->num;
+      fs->jseq++;
+      refeitas++;
+   }
+   if (refeitas > 0) {
+      printf("[fs_new] replayed %u metadata journal transactions.\n",refeitas);
+      fsi_journal_ctl(fs,bloco);
    }
 }
 
 
 /*
- * Bitmap management macros and functions
+ * Bitmap management functions
  */
 
-#define BMAP_SET(bmap,num) ((bmap)[(num)/8]|=(0x1<<((num)%8)))	//bpmap, num esta OCUPADO
-
-#define BMAP_CLR(bmap,num) ((bmap)[(num)/8]&=~((0x1<<((num)%8))))	//num esta LIVRE
+/*Palavra de 64 bits do bitmap a partir do bit "bit" (multiplo de 64):
+ * o bit i do bitmap e o bit i%64 da palavra*/
+static inline uint64_t fsi_bmap_word(const char* bmap, unsigned bit)
+{
+   uint64_t w;
+   memcpy(&w, bmap + bit/8, sizeof(w));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+   w = __builtin_bswap64(w);
+#endif
+   return w;
+}
 
-#define BMAP_ISSET(bmap,num) ((bmap)[(num)/8]&(0x1<<((num)%8)))		//qual o estado de num?
+/*Primeiro bit de "desde" ate "size" que esta livre (livre=1) ou ocupado
+ * (livre=0), 64 de cada vez. Devolve "size" se nao ha nenhum*/
+static unsigned fsi_bmap_next(const char* bmap, unsigned size, unsigned desde, int livre)
+{
+   for (unsigned bit = desde & ~63u; bit < size; bit += 64) {
+      uint64_t w = fsi_bmap_word(bmap,bit);
+      if (livre)
+         w = ~w;
+      if (bit < desde)
+         w &= ~0ULL << (desde - bit);
+      if (w != 0) {
+         unsigned i = bit + __builtin_ctzll(w);
+         return (i < size) ? i : size;
+      }
+   }
+   return size;
+}
 
 /*Procura blocos livres no bmap. Retorna 0 se nao ha livres,
  * 1 se ha livres e em free o indice do bit que esta livre para um novo inode*/
 static int fsi_bmap_find_free(char* bmap, int size, unsigned* free)
 {
-   for (int i = 0; i < size; i++) {
-      if (!BMAP_ISSET(bmap,i)) {
-         *free = i;
-         return 1;
-      }
-   }
-   return 0;
+   *free = fsi_bmap_next(bmap,size,0,1);
+   return *free < size;
 }
 
 
@@ -240,6 +766,9 @@ static void fsi_dump_bmap(char* bmap, int size)
                                 
 #define OFFSET_TO_BLOCKS(pos) ((pos)/BLOCK_SIZE+(((pos)%BLOCK_SIZE>0)?1:0))	//calcular o numero de entradas ocupadas do vector de blocos do inode
 
+//blocos que se podem reservar: todos os do volume
+#define FS_NUM_BLOCKS(fs) ((fs)->sb.num_blocks)
+
 /*Inicializar um inode*/                         
 static void fsi_inode_init(fs_inode_t* inode, fs_itype_t type)
 {
@@ -256,80 +785,683 @@ static void fsi_inode_init(fs_inode_t* inode, fs_itype_t type)
    }
 }
 
+/*Marcar o bloco "num" como ocupado/livre no bitmap de blocos, mantendo
+ * o contador do seu grupo. Com o trincoBitmaps*/
+static void fsi_blk_set(fs_t* fs, unsigned num)
+{
+   if (!BMAP_ISSET(fs->blk_bmap,num)) {
+      BMAP_SET(fs->blk_bmap,num);
+      fs->livres[num / BMAP_GROUP]--;
+      fsi_marcar(fs,fs->bmap_sujo,num / BMAP_BITS_PER_BLOCK);
+   }
+}
+
+static void fsi_blk_clr(fs_t* fs, unsigned num)
+{
+   if (BMAP_ISSET(fs->blk_bmap,num)) {
+      BMAP_CLR(fs->blk_bmap,num);
+      fs->livres[num / BMAP_GROUP]++;
+      fsi_marcar(fs,fs->bmap_sujo,num / BMAP_BITS_PER_BLOCK);
+   }
+}
+
+/*Libertar o bloco "num", que nenhum inode usa: so fica livre (e pode ser
+ * reservado) quando o commit que o liberta estiver no disco, ver
+ * fsi_journal_commit. Com o trincoBitmaps*/
+static void fsi_blk_free(fs_t* fs, unsigned num)
+{
+   if (BMAP_ISSET(fs->blk_bmap,num) && !BMAP_ISSET(fs->a_libertar,num)) {
+      BMAP_SET(fs->a_libertar,num);
+      fs->num_libertar++;
+      fsi_marcar(fs,fs->bmap_sujo,num / BMAP_BITS_PER_BLOCK);
+   }
+}
+
+/*Contar os livres de cada grupo, depois de o bitmap ser lido ou apagado*/
+static void fsi_blk_count(fs_t* fs)
+{
+   unsigned total = FS_NUM_BLOCKS(fs);
+
+   for (unsigned g = 0; g < BMAP_NUM_GROUPS(fs); g++) {
+      unsigned i = g*BMAP_GROUP, fim = MIN(i + BMAP_GROUP, total);
+      fs->livres[g] = 0;
+      for (; i < fim; i++)
+         if (!BMAP_ISSET(fs->blk_bmap,i))
+            fs->livres[g]++;
+   }
+   fs->cursor = 0;
+}
+
+/*Primeiro bloco livre a partir de "desde", saltando os grupos cheios.
+ * Devolve FS_NUM_BLOCKS se nao ha. Com o trincoBitmaps*/
+static unsigned fsi_blk_next_free(fs_t* fs, unsigned desde)
+{
+   unsigned total = FS_NUM_BLOCKS(fs);
+
+   while (desde < total) {
+      unsigned g = desde / BMAP_GROUP;
+      unsigned fim = MIN((g+1)*BMAP_GROUP, total);
+      if (fs->livres[g] > 0) {
+         unsigned i = fsi_bmap_next(fs->blk_bmap,fim,desde,1);
+         if (i < fim)
+            return i;
+      }
+      desde = fim;
+   }
+   return total;
+}
+
+/*Procurar um bloco livre a partir do cursor (next fit), dando a volta
+ * ao disco. Com o trincoBitmaps*/
+static int fsi_blk_find(fs_t* fs, unsigned* blk)
+{
+   unsigned total = FS_NUM_BLOCKS(fs);
+
+   *blk = fsi_blk_next_free(fs,fs->cursor);
+   if (*blk == total)
+      *blk = fsi_blk_next_free(fs,0);
+   return *blk < total;
+}
+
+/*Reservar "n" blocos a partir de "blk", ja vistos livres: cada um tem
+ * uma referencia, a de quem o reservou. Com o trincoBitmaps*/
+static void fsi_blk_take(fs_t* fs, unsigned blk, unsigned n)
+{
+   for (unsigned i = 0; i < n; i++) {
+      fsi_blk_set(fs,blk+i);
+      fs->referencias[blk+i] = 1;
+   }
+   fs->cursor = blk+n;
+}
+
+/*Procurar e reservar um bloco/inode livre. Os bitmaps so sao tocados com
+ * o trincoBitmaps, que e curto: nao se faz IO com ele. O inode e
+ * inicializado antes de ficar marcado, por isso um inode marcado tem
+ * sempre um tipo valido. Um bloco reservado tem uma referencia, a de
+ * quem o reservou*/
+static int fsi_alloc_block(fs_t* fs, unsigned* blk)
+{
+   sthread_mutex_lock(fs->trincoBitmaps);
+   int found = fsi_blk_find(fs,blk);
+   if (found)
+      fsi_blk_take(fs,*blk,1);
+   sthread_mutex_unlock(fs->trincoBitmaps);
+   return found;
+}
+
+/*Reservar ate "n" blocos seguidos no disco, para que um ficheiro que
+ * cresce fique contiguo: de preferencia a partir de "alvo" (o bloco a
+ * seguir ao ultimo do ficheiro, 0 se nao ha), senao a primeira sequencia
+ * livre de "n" blocos a partir do cursor, ou a maior que houver. Cada
+ * bloco reservado tem uma referencia, como em fsi_alloc_block. Devolve
+ * quantos reservou, 0 se nao ha blocos livres, e o primeiro em "blk"*/
+static unsigned fsi_alloc_run(fs_t* fs, unsigned alvo, unsigned n, unsigned* blk)
+{
+   unsigned total = FS_NUM_BLOCKS(fs), got = 0, i, j;
+
+   sthread_mutex_lock(fs->trincoBitmaps);
+   if (alvo > 0 && alvo < total) {
+      *blk = alvo;
+      got = fsi_bmap_next(fs->blk_bmap,MIN(alvo+n,total),alvo,0) - alvo;
+   }
+   if (got == 0) {	//nao da para continuar o ficheiro
+      unsigned desde = fs->cursor;
+      for (int volta = 0; volta < 2 && got < n; volta++) {	//do cursor ao fim e do inicio ao cursor
+         unsigned fim = volta ? desde : total;
+         for (i = volta ? 0 : desde; got < n; i = j) {
+            i = fsi_blk_next_free(fs,i);
+            if (i >= fim)
+               break;
+            j = fsi_bmap_next(fs->blk_bmap,MIN(i+n,total),i,0);
+            if (j-i > got) {	//a primeira com "n" blocos, senao a maior
+               *blk = i;
+               got = j-i;
+            }
+         }
+      }
+   }
+   if (got > 0)
+      fsi_blk_take(fs,*blk,got);
+   sthread_mutex_unlock(fs->trincoBitmaps);
+   return got;
+}
+
+static int fsi_alloc_inode(fs_t* fs, fs_itype_t type, unsigned* inode)
+{
+   sthread_mutex_lock(fs->trincoBitmaps);
+   int found = fsi_bmap_find_free(fs->inode_bmap,FS_NUM_INODES(fs),inode);
+   if (found) {
+      fsi_inode_init(&fs->inode_tab[*inode],type);
+      BMAP_SET(fs->inode_bmap,*inode);
+      fsi_marcar(fs,fs->imap_sujo,*inode / BMAP_BITS_PER_BLOCK);
+   }
+   sthread_mutex_unlock(fs->trincoBitmaps);
+   return found;
+}
+
+static void fsi_free_inode(fs_t* fs, unsigned inode)
+{
+   sthread_mutex_lock(fs->trincoBitmaps);
+   BMAP_CLR(fs->inode_bmap,inode);
+   fsi_marcar(fs,fs->imap_sujo,inode / BMAP_BITS_PER_BLOCK);
+   fsi_inode_init(&fs->inode_tab[inode],0);
+   sthread_mutex_unlock(fs->trincoBitmaps);
+}
+
+/*Mapa de blocos de um ficheiro: o bloco "iblock" do ficheiro esta em
+ *  - blocks[iblock], se iblock < INODE_NUM_BLKS
+ *  - no bloco indirecto, nos EXT_INODE_NUM_BLKS seguintes
+ *  - no duplamente indirecto, que aponta para blocos indirectos, nos
+ *    restantes ate FILE_MAX_BLKS
+ * Os blocos de referencias sao lidos e escritos pela cache, como os de
+ * dados, e sao so do inode: nunca sao partilhados por copy/append.
+ * Uma referencia a 0 e um bloco que ainda nao existe.*/
+
+/*Devolve o bloco "iblock" do ficheiro, 0 se nao existe*/
+static unsigned fsi_get_block(fs_t* fs, fs_inode_t* inode, unsigned iblock)
+{
+   fs_inode_ext_t tabela[EXT_INODE_NUM_BLKS];
+
+   if (iblock < INODE_NUM_BLKS)
+      return inode->blocks[iblock];
+
+   iblock -= INODE_NUM_BLKS;
+   if (iblock < EXT_INODE_NUM_BLKS) {
+      if (inode->reserved[INODE_IND] == 0)
+         return 0;
+      lerCache(fs->cache,inode->reserved[INODE_IND],(char*)tabela);
+      return tabela[iblock];
+   }
+
+   iblock -= EXT_INODE_NUM_BLKS;
+   if (iblock >= EXT_INODE_NUM_BLKS*EXT_INODE_NUM_BLKS || inode->reserved[INODE_DIND] == 0)
+      return 0;
+   lerCache(fs->cache,inode->reserved[INODE_DIND],(char*)tabela);
+   unsigned indirecto = tabela[iblock / EXT_INODE_NUM_BLKS];
+   if (indirecto == 0)
+      return 0;
+   lerCache(fs->cache,indirecto,(char*)tabela);
+   return tabela[iblock % EXT_INODE_NUM_BLKS];
+}
+
+/*Devolve quantos blocos do ficheiro a partir de "iblock" (no maximo
+ * "max") estao seguidos no disco, e o primeiro em "blk": basta uma
+ * consulta ao mapa por sequencia, em vez de uma por bloco. Uma sequencia
+ * nao passa de uma tabela de referencias para a seguinte*/
+static unsigned fsi_get_run(fs_t* fs, fs_inode_t* inode, unsigned iblock, unsigned max, unsigned* blk)
+{
+   fs_inode_ext_t tabela[EXT_INODE_NUM_BLKS];
+   unsigned* refs;
+   unsigned n, i;
+
+   if (iblock < INODE_NUM_BLKS) {
+      refs = &inode->blocks[iblock];
+      n = INODE_NUM_BLKS - iblock;
+   }
+   else {
+      unsigned tbl, idx = iblock - INODE_NUM_BLKS;
+      if (idx < EXT_INODE_NUM_BLKS)
+         tbl = inode->reserved[INODE_IND];
+      else {
+         idx -= EXT_INODE_NUM_BLKS;
+         tbl = 0;
+         if (idx < EXT_INODE_NUM_BLKS*EXT_INODE_NUM_BLKS && inode->reserved[INODE_DIND] != 0) {
+            lerCache(fs->cache,inode->reserved[INODE_DIND],(char*)tabela);
+            tbl = tabela[idx / EXT_INODE_NUM_BLKS];
+         }
+         idx %= EXT_INODE_NUM_BLKS;
+      }
+      if (tbl == 0) {
+         *blk = 0;
+         return 1;
+      }
+      lerCache(fs->cache,tbl,(char*)tabela);
+      refs = &tabela[idx];
+      n = EXT_INODE_NUM_BLKS - idx;
+   }
+
+   *blk = refs[0];
+   n = MIN(n,max);
+   for (i = 1; i < n && refs[0] != 0 && refs[i] == refs[0]+i; i++);
+   return i;
+}
+
+/*Ler o bloco de referencias "*tbl" para "tabela"; se ainda nao existe,
+ * reserva-o e a tabela comeca a zeros. Devolve -1 se nao ha blocos livres*/
+static int fsi_load_table(fs_t* fs, unsigned* tbl, fs_inode_ext_t* tabela)
+{
+   if (*tbl != 0) {
+      lerCache(fs->cache,*tbl,(char*)tabela);
+      return 0;
+   }
+   if (!fsi_alloc_block(fs,tbl)) {
+      dprintf("[fsi_load_table] there are no free blocks.\n");
+      return -1;
+   }
+   memset(tabela,0,BLOCK_SIZE);
+   return 0;
+}
+
+/*Registar no mapa inverso que o bloco "blk" passou a ser do inode. E so
+ * uma indicacao: um bloco partilhado por copy/append fica com o ultimo, e
+ * um bloco libertado fica com o dono antigo. Quem a usa confirma-a no
+ * mapa do inode (ver fs_defrag)*/
+static void fsi_set_owner(fs_t* fs, unsigned blk, fs_inode_t* inode)
+{
+   if (blk != 0)
+      fs->dono[blk] = inode - fs->inode_tab;
+}
+
+/*Colocar "blk" como bloco "iblock" do ficheiro, reservando os blocos de
+ * referencias que faltem. O chamador tem o trinco de escrita do inode e
+ * guarda o inode depois. Devolve -1 se o ficheiro nao pode crescer*/
+static int fsi_set_block(fs_t* fs, fs_inode_t* inode, unsigned iblock, unsigned blk)
+{
+   fs_inode_ext_t tabela[EXT_INODE_NUM_BLKS];
+
+   fsi_set_owner(fs,blk,inode);
+   if (iblock < INODE_NUM_BLKS) {
+      inode->blocks[iblock] = blk;
+      return 0;
+   }
+
+   iblock -= INODE_NUM_BLKS;
+   if (iblock < EXT_INODE_NUM_BLKS) {
+      if (fsi_load_table(fs,&inode->reserved[INODE_IND],tabela) < 0)
+         return -1;
+      fsi_set_owner(fs,inode->reserved[INODE_IND],inode);
+      tabela[iblock] = blk;
+      escreverCacheMeta(fs->cache,inode->reserved[INODE_IND],(char*)tabela);
+      return 0;
+   }
+
+   iblock -= EXT_INODE_NUM_BLKS;
+   if (iblock >= EXT_INODE_NUM_BLKS*EXT_INODE_NUM_BLKS) {
+      dprintf("[fsi_set_block] block %u past the double indirect block.\n",iblock);
+      return -1;
+   }
+   if (fsi_load_table(fs,&inode->reserved[INODE_DIND],tabela) < 0)
+      return -1;
+   fsi_set_owner(fs,inode->reserved[INODE_DIND],inode);
+
+   fs_inode_ext_t indirectos[EXT_INODE_NUM_BLKS];
+   unsigned indirecto = tabela[iblock / EXT_INODE_NUM_BLKS];
+   if (fsi_load_table(fs,&indirecto,indirectos) < 0) {
+      escreverCacheMeta(fs->cache,inode->reserved[INODE_DIND],(char*)tabela);	//o duplamente indirecto pode ser novo
+      return -1;
+   }
+   fsi_set_owner(fs,indirecto,inode);
+   if (indirecto != tabela[iblock / EXT_INODE_NUM_BLKS]) {	//reservamos um bloco indirecto novo
+      tabela[iblock / EXT_INODE_NUM_BLKS] = indirecto;
+      escreverCacheMeta(fs->cache,inode->reserved[INODE_DIND],(char*)tabela);
+   }
+   indirectos[iblock % EXT_INODE_NUM_BLKS] = blk;
+   escreverCacheMeta(fs->cache,indirecto,(char*)indirectos);
+   return 0;
+}
+
+int apagarBloco(fs_t* fs,unsigned idBloco,inodeid_t inode);
+int escreverBloco(fs_t* fs,unsigned idBloco,inodeid_t idFile,unsigned iblock,char* dados);
+
+/*Ler a entrada "slot" do directorio "idir"*/
+static void fsi_dentry_read(fs_t* fs, fs_inode_t* idir, unsigned slot, fs_dentry_t* entrada)
+{
+   fs_dentry_t page[DIR_PAGE_ENTRIES];
+
+   lerCache(fs->cache,fsi_get_block(fs,idir,slot / DIR_PAGE_ENTRIES),(char*)page);
+   *entrada = page[slot % DIR_PAGE_ENTRIES];
+}
+
+/*Escrever a entrada "slot" do directorio "dir", que ja tem o seu bloco.
+ * Os blocos de um directorio nunca sao partilhados (copy/append so aceitam
+ * ficheiros): nao ha copy-on-write*/
+static void fsi_dentry_write(fs_t* fs, inodeid_t dir, unsigned slot, fs_dentry_t* entrada)
+{
+   fs_dentry_t page[DIR_PAGE_ENTRIES];
+   fs_inode_t* idir = &fs->inode_tab[dir];
+   unsigned iblock = slot / DIR_PAGE_ENTRIES;
+   unsigned blk = fsi_get_block(fs,idir,iblock);
+
+   lerCache(fs->cache,blk,(char*)page);
+   page[slot % DIR_PAGE_ENTRIES] = *entrada;
+   escreverCacheMeta(fs->cache,blk,(char*)page);
+}
+
+/*Hash de um nome (FNV-1a)*/
+static unsigned fsi_dir_hash(const char* nome)
+{
+   unsigned h = 2166136261u;
+   for (; *nome; nome++)
+      h = (h ^ (unsigned char)*nome) * 16777619u;
+   return h;
+}
+
+//numero de posicoes do indice do directorio (0 se nao tem)
+#define DIR_IDX_CAP(idir) ((idir)->reserved[INODE_DIDX_BLKS] * DIR_IDX_PER_BLOCK)
+
+/*Ler/escrever a posicao "pos" do indice do directorio*/
+static void fsi_idx_get(fs_t* fs, fs_inode_t* idir, unsigned pos, fs_dir_idx_t* e)
+{
+   fs_dir_idx_t tabela[DIR_IDX_PER_BLOCK];
+
+   lerCache(fs->cache,idir->reserved[INODE_DIDX] + pos / DIR_IDX_PER_BLOCK,(char*)tabela);
+   *e = tabela[pos % DIR_IDX_PER_BLOCK];
+}
+
+static void fsi_idx_put(fs_t* fs, fs_inode_t* idir, unsigned pos, fs_dir_idx_t* e)
+{
+   fs_dir_idx_t tabela[DIR_IDX_PER_BLOCK];
+   unsigned blk = idir->reserved[INODE_DIDX] + pos / DIR_IDX_PER_BLOCK;
+
+   lerCache(fs->cache,blk,(char*)tabela);
+   tabela[pos % DIR_IDX_PER_BLOCK] = *e;
+   escreverCacheMeta(fs->cache,blk,(char*)tabela);
+}
+
+/*Libertar o indice do directorio "dir". O chamador tem o trinco de
+ * escrita do directorio e guarda o inode depois*/
+static void fsi_dir_idx_free(fs_t* fs, inodeid_t dir)
+{
+   fs_inode_t* idir = &fs->inode_tab[dir];
+
+   for (unsigned i = 0; i < idir->reserved[INODE_DIDX_BLKS]; i++)
+      apagarBloco(fs,idir->reserved[INODE_DIDX]+i,dir);
+   idir->reserved[INODE_DIDX] = 0;
+   idir->reserved[INODE_DIDX_BLKS] = 0;
+}
+
+/*(Re)construir o indice do directorio "dir" com todas as entradas, com
+ * no maximo um quarto das posicoes ocupadas. Se nao ha blocos seguidos
+ * para ele, o directorio fica sem indice. O chamador tem o trinco de
+ * escrita do directorio e guarda o inode depois.
+ *   returns: 0 if successful, -1 otherwise
+ */
+static int fsi_dir_idx_build(fs_t* fs, inodeid_t dir)
+{
+   fs_inode_t* idir = &fs->inode_tab[dir];
+   unsigned num = idir->size / sizeof(fs_dentry_t);
+   unsigned nblks = 1, inicio, i;
+
+   while (nblks * DIR_IDX_PER_BLOCK < 4 * num)
+      nblks *= 2;
+
+   fsi_dir_idx_free(fs,dir);
+   unsigned got = fsi_alloc_run(fs,0,nblks,&inicio);
+   if (got < nblks) {
+      dprintf("[fsi_dir_idx_build] no %u free consecutive blocks.\n",nblks);
+      for (i = 0; i < got; i++)
+         apagarBloco(fs,inicio+i,dir);
+      return -1;
+   }
+
+   unsigned cap = nblks * DIR_IDX_PER_BLOCK;
+   fs_dir_idx_t* tabela = (fs_dir_idx_t*) calloc(nblks,BLOCK_SIZE);
+   fs_dentry_t page[DIR_PAGE_ENTRIES];
+   for (unsigned slot = 0; slot < num; slot++) {
+      if (slot % DIR_PAGE_ENTRIES == 0)
+         lerCache(fs->cache,fsi_get_block(fs,idir,slot / DIR_PAGE_ENTRIES),(char*)page);
+      unsigned h = fsi_dir_hash(page[slot % DIR_PAGE_ENTRIES].name);
+      unsigned pos = h & (cap-1);
+      while (tabela[pos].entrada != 0)
+         pos = (pos+1) & (cap-1);
+      tabela[pos].entrada = slot+1;
+      tabela[pos].hash = h;
+   }
+   for (i = 0; i < nblks; i++)
+      escreverCacheMeta(fs->cache,inicio+i,(char*)&tabela[i*DIR_IDX_PER_BLOCK]);
+   free(tabela);
+
+   for (i = 0; i < nblks; i++)
+      fsi_set_owner(fs,inicio+i,idir);
+   idir->reserved[INODE_DIDX] = inicio;
+   idir->reserved[INODE_DIDX_BLKS] = nblks;
+   return 0;
+}
+
+/*Juntar ao indice a entrada "slot", com o nome "nome", que ja esta no
+ * directorio (e conta no seu size). O indice cresce quando passa de
+ * metade; um directorio sem indice ganha-o aqui*/
+static void fsi_dir_idx_add(fs_t* fs, inodeid_t dir, char* nome, unsigned slot)
+{
+   fs_inode_t* idir = &fs->inode_tab[dir];
+   unsigned cap = DIR_IDX_CAP(idir);
+   fs_dir_idx_t e;
+
+   if (2 * (idir->size / sizeof(fs_dentry_t)) > cap) {
+      fsi_dir_idx_build(fs,dir);
+      return;
+   }
+   unsigned h = fsi_dir_hash(nome);
+   unsigned pos = h & (cap-1);
+   for (fsi_idx_get(fs,idir,pos,&e); e.entrada != 0; fsi_idx_get(fs,idir,pos,&e))
+      pos = (pos+1) & (cap-1);
+   e.entrada = slot+1;
+   e.hash = h;
+   fsi_idx_put(fs,idir,pos,&e);
+}
+
+/*Tirar do indice a posicao "pos", chegando para tras as seguintes do
+ * mesmo grupo que deixariam de ser encontradas (sem marcas de apagado)*/
+static void fsi_dir_idx_del(fs_t* fs, fs_inode_t* idir, unsigned pos)
+{
+   unsigned mask = DIR_IDX_CAP(idir) - 1;
+   unsigned i = pos, j = pos;
+   fs_dir_idx_t e, vazio = {0, 0};
+
+   for (;;) {
+      j = (j+1) & mask;
+      fsi_idx_get(fs,idir,j,&e);
+      if (e.entrada == 0)
+         break;
+      unsigned k = e.hash & mask;	//posicao inicial de "e"
+      if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+         continue;	//continua a ser encontrada
+      fsi_idx_put(fs,idir,i,&e);
+      i = j;
+   }
+   fsi_idx_put(fs,idir,i,&vazio);
+}
+
+/*A entrada "nome" passou da posicao "de" para "para" do directorio*/
+static void fsi_dir_idx_move(fs_t* fs, fs_inode_t* idir, char* nome, unsigned de, unsigned para)
+{
+   unsigned cap = DIR_IDX_CAP(idir);
+   unsigned pos = fsi_dir_hash(nome) & (cap-1);
+   fs_dir_idx_t e;
+
+   for (unsigned i = 0; i < cap; i++, pos = (pos+1) & (cap-1)) {
+      fsi_idx_get(fs,idir,pos,&e);
+      if (e.entrada == 0)
+         return;
+      if (e.entrada == de+1) {
+         e.entrada = para+1;
+         fsi_idx_put(fs,idir,pos,&e);
+         return;
+      }
+   }
+}
+
 /*  Procurar o directorio 
- * Procurar em todas as entradas do directorio o dentry com o nome do ficheiro e devolve o id do inode do ficheiro
+ * Procurar a entrada com o nome do ficheiro e devolver o id do inode do
+ * ficheiro, a posicao da entrada no directorio ("slot") e a sua posicao
+ * no indice ("pos", -1 se o directorio nao tem indice). Com indice, so
+ * sao lidas as entradas cujo hash coincide; sem ele, todas.
  * 	Recebe:
  * 	- File system
  *  - inode do file que buscamos
  *  - nome do file
  *  - devolve o id do inode do ficheiro no fileid
  *   */
-static int fsi_dir_search(fs_t* fs, inodeid_t dir, char* file,inodeid_t* fileid)
+static int fsi_dir_find(fs_t* fs, inodeid_t dir, char* file, inodeid_t* fileid, unsigned* slot, int* pos)
 {	
-   fs_dentry_t page[DIR_PAGE_ENTRIES];	//Criar um bloco constituido por entradas de directorio
    fs_inode_t* idir = &fs->inode_tab[dir];	//Carregar o inode do directorio
-   int num = idir->size / sizeof(fs_dentry_t);	//numero de dentrys do inode
-   int iblock = 0;
-	
-   while (num > 0) {
-	   if(idir->type == FS_FILE)
-			lerCache(fs->cache,idir->blocks[iblock++],(char*)page);
-		else
-			block_read(fs->blocks,idir->blocks[iblock++],(char*)page);
-      for (int i = 0; i < DIR_PAGE_ENTRIES && num > 0; i++, num--) {
-         if (strcmp(page[i].name,file) == 0) {	//verificar se a entrada de directorio tem o nome do ficheiro
-            *fileid = page[i].inodeid;//colocar o id do node do ficheiro na resposta
+   unsigned num = idir->size / sizeof(fs_dentry_t);	//numero de dentrys do inode
+   unsigned cap = DIR_IDX_CAP(idir);
+   fs_dentry_t entrada;
+
+   if (cap == 0) {	//sem indice: percorrer as entradas
+      fs_dentry_t page[DIR_PAGE_ENTRIES];	//Criar um bloco constituido por entradas de directorio
+      for (unsigned i = 0; i < num; i++) {
+         if (i % DIR_PAGE_ENTRIES == 0)
+            lerCache(fs->cache,fsi_get_block(fs,idir,i / DIR_PAGE_ENTRIES),(char*)page);
+         if (strcmp(page[i % DIR_PAGE_ENTRIES].name,file) == 0) {	//verificar se a entrada de directorio tem o nome do ficheiro
+            *fileid = page[i % DIR_PAGE_ENTRIES].inodeid;//colocar o id do node do ficheiro na resposta
+            *slot = i;
+            *pos = -1;
             return 0;
          }
       }
+      return -1;
+   }
+
+   fs_dir_idx_t tabela[DIR_IDX_PER_BLOCK];
+   unsigned h = fsi_dir_hash(file);
+   unsigned p = h & (cap-1), carregado = cap;	//bloco do indice que esta em "tabela"
+   for (unsigned i = 0; i < cap; i++, p = (p+1) & (cap-1)) {
+      if (p / DIR_IDX_PER_BLOCK != carregado) {
+         carregado = p / DIR_IDX_PER_BLOCK;
+         lerCache(fs->cache,idir->reserved[INODE_DIDX] + carregado,(char*)tabela);
+      }
+      fs_dir_idx_t* e = &tabela[p % DIR_IDX_PER_BLOCK];
+      if (e->entrada == 0)
+         return -1;
+      if (e->hash != h || e->entrada > num)
+         continue;
+      fsi_dentry_read(fs,idir,e->entrada-1,&entrada);
+      if (strcmp(entrada.name,file) == 0) {
+         *fileid = entrada.inodeid;
+         *slot = e->entrada-1;
+         *pos = p;
+         return 0;
+      }
    }
    return -1;
 }
 
+static int fsi_dir_search(fs_t* fs, inodeid_t dir, char* file,inodeid_t* fileid)
+{
+   unsigned slot;
+   int pos;
+
+   return fsi_dir_find(fs,dir,file,fileid,&slot,&pos);
+}
+
 
 /**Algoritmos para garantir sincronizacao*/
-/*Inicia a leitura se nao houver escritores activos ou que pretendam escrever
- * e se estivermos no turno de leitura*/
-void iniciaLeitura(fs_t* fs){
-	fs->wanna_leitor++;	//desejo ser leitor
-	sthread_monitor_enter(fs->monLeitores);
-	while(fs->escritores != 0 || (fs->turno != LEITURA && fs->wanna_escritor > 0))
-			sthread_monitor_wait(fs->monLeitores);
-	fs->wanna_leitor--; 
-	fs->leitores++;
-	if(fs->wanna_leitor != 0)
-			sthread_monitor_signalall(fs->monLeitores);
-	else
-		fs->turno = ESCRITA;
+/*Protocolo de trincos. Cada operacao pede os trincos por esta ordem e
+ * nunca pede um de um nivel anterior aos que ja tem:
+ *  0. trincoDiario, so no commit (que pede o trincoFS exclusivo e depois
+ *     partilhado): nunca com outro trinco
+ *  1. trincoFS, partilhado (so format, diskUsage e o commit o pedem exclusivo)
+ *  2. trincos de directorios, por ordem crescente de inode
+ *  3. trincos dos ficheiros (e da entrada que um remove apaga), por ordem
+ *     crescente
+ *  4. trincoBitmaps, depois trincoDisco e a cache
+ * O mutex da cache de entradas de directorio e o ultimo: nao se pede nada
+ * com ele. Quem muda um directorio invalida as suas entradas com o
+ * directorio trancado para escrita; um lookup so insere com ele trancado.
+ * Um lookup tem um so directorio trancado de cada vez. Um create nao tranca
+ * o inode novo, que e inicializado antes de ser marcado no bitmap
+ * (fsi_alloc_inode). Assim escritas em ficheiros diferentes correm em
+ * paralelo e so se cruzam nos bitmaps. A desfragmentacao tambem tem um so
+ * inode trancado de cada vez; o trincoDesfrag so guarda o seu estado e nao
+ * se pede nada com ele.*/
+
+static void fsi_trinco_init(fs_trinco_t* t, const char* nome){
+	t->mon = sthread_monitor_init();
+	sthread_monitor_setname(t->mon, nome);
+	t->leitores = 0;
+	t->escritor = 0;
+	t->wanna_escritor = 0;
+}
+
+/*Inicia a leitura se nao houver escritores activos ou que pretendam escrever*/
+static void iniciaLeitura(fs_trinco_t* t){
+	sthread_monitor_enter(t->mon);
+	while(t->escritor || t->wanna_escritor > 0)
+		sthread_monitor_wait(t->mon);
+	t->leitores++;
+	sthread_monitor_exit(t->mon);
 }
 
-/*Terminou leitura. Se eramos o ultimo leitor, acordar um escritor.
- * (apenas pode estar um escritor activo pelo que não e necessário desbloquear todos*/
-void terminaLeitura(fs_t* fs){
-	fs->leitores--;
-	if(fs->leitores == 0)	//ja todos leram
-		sthread_monitor_signal(fs->monEscritores);
-	sthread_monitor_exit(fs->monLeitores);
+/*Terminou leitura. Se eramos o ultimo leitor, acordar quem espera*/
+static void terminaLeitura(fs_trinco_t* t){
+	sthread_monitor_enter(t->mon);
+	if(--t->leitores == 0)	//ja todos leram
+		sthread_monitor_signalall(t->mon);
+	sthread_monitor_exit(t->mon);
 }
 
 /*Inicia escrita quando nao houver escritores nem leitores*/
-void iniciaEscrita(fs_t* fs){
-	fs->wanna_escritor++;
-	sthread_monitor_enter(fs->monEscritores);
-	while(fs->escritores != 0 || fs->leitores != 0)
-		sthread_monitor_wait(fs->monEscritores);
-	fs->wanna_escritor--;
-	fs->escritores++;
-}
-
-void terminaEscrita(fs_t* fs){
-	fs->escritores--;
-	fs->turno = LEITURA;
-	if(fs->wanna_leitor != 0)
-		sthread_monitor_signalall(fs->monLeitores);
+static void iniciaEscrita(fs_trinco_t* t){
+	sthread_monitor_enter(t->mon);
+	t->wanna_escritor++;
+	while(t->escritor || t->leitores != 0)
+		sthread_monitor_wait(t->mon);
+	t->wanna_escritor--;
+	t->escritor = 1;
+	sthread_monitor_exit(t->mon);
+}
+
+static void terminaEscrita(fs_trinco_t* t){
+	sthread_monitor_enter(t->mon);
+	t->escritor = 0;
+	sthread_monitor_signalall(t->mon);	//leitores e escritores voltam a testar
+	sthread_monitor_exit(t->mon);
+}
+
+/*Entrar/sair do FS: o trincoFS partilhado, no inicio e no fim de cada operacao.
+ *Com metade de uma transaccao por commitar, faz-se o commit antes de
+ *entrar: o que os pedidos que estao a correr ainda marcam cabe no resto*/
+static void entrarFS(fs_t* fs){
+	if(fs->marcados + contarMetaCache(fs->cache) > fsi_journal_max(&fs->sb) / 2)
+		fsi_journal_commit(fs);
+	iniciaLeitura(&fs->trincoFS);
+}
+
+static void sairFS(fs_t* fs){
+	terminaLeitura(&fs->trincoFS);
+}
+
+/*Trancar/destrancar um inode, em modo LEITURA ou ESCRITA*/
+static void trancar(fs_t* fs, inodeid_t inode, int modo){
+	if(modo == LEITURA)
+		iniciaLeitura(&fs->trincos[inode]);
 	else
-		sthread_monitor_signal(fs->monEscritores);
-	sthread_monitor_exit(fs->monEscritores);
+		iniciaEscrita(&fs->trincos[inode]);
+}
+
+static void destrancar(fs_t* fs, inodeid_t inode, int modo){
+	if(modo == LEITURA)
+		terminaLeitura(&fs->trincos[inode]);
+	else
+		terminaEscrita(&fs->trincos[inode]);
+}
+
+/*Trancar dois inodes do mesmo nivel por ordem crescente (um so se forem o
+ * mesmo, com o modo mais forte)*/
+static void trancarDois(fs_t* fs, inodeid_t a, int modoA, inodeid_t b, int modoB){
+	if(a == b){
+		trancar(fs,a,MAX(modoA,modoB));
+		return;
+	}
+	if(a < b){
+		trancar(fs,a,modoA);
+		trancar(fs,b,modoB);
+	}
+	else{
+		trancar(fs,b,modoB);
+		trancar(fs,a,modoA);
+	}
+}
+
+static void destrancarDois(fs_t* fs, inodeid_t a, int modoA, inodeid_t b, int modoB){
+	if(a == b){
+		destrancar(fs,a,MAX(modoA,modoB));
+		return;
+	}
+	destrancar(fs,a,modoA);
+	destrancar(fs,b,modoB);
 }
 
 /*Algoritmo em arvore. Percorrer o FS em todos os ramos. Quando e aberto um directorio, 
@@ -339,7 +1471,8 @@ void terminaEscrita(fs_t* fs){
  * 		-inodeId
  * 		-pathname obtido
  * Esta estrutura e inserida ordenadamente (atraves do blockId) numa lista (insertion sort) criando deste modo
- * uma lista que indica cada uma das referencias de cada bloco de modo ordenado.*/
+ * uma lista que indica cada uma das referencias de cada bloco de modo ordenado.
+ * Os nos e os paths vivem na arena do pedido (arena.h) e sao libertados com ela.*/
 
 /*Recebe o sistema de ficheiros em questao, o numero de inode, o path ja acumulado e a lista de referencias
  * 
@@ -355,54 +1488,59 @@ void terminaEscrita(fs_t* fs){
 
 
  * 		retorna 1 quando chega a um ficheiro*/
+static void adicionarReferencia(List* lista,unsigned blockId,inodeid_t inode,char* path){
+	noRef_t novoNo = (noRef_t) arena_alloc(sizeof(noRef_));
+	novoNo->blockId = blockId;
+	novoNo->inodeId = inode;
+	novoNo->pathname = path;
+	inserirOrdenado(*lista,(void*)novoNo,blockId);
+}
+
 int gerar_lista_referencias_aux(fs_t*fs,inodeid_t inode,char** path,List* lista){
 	fs_inode_t* idir = &fs->inode_tab[inode];	//abrir o inode
+	char* nome = *path;	//nome com que aparecem os blocos do inode
 	
-	if(idir->type == FS_FILE){	//se ficheiro
-		int num = OFFSET_TO_BLOCKS(idir->size);
-		for(int i = 0;i<num;i++){
-			noRef_t novoNo = (noRef_t) malloc(sizeof(noRef_));
-			novoNo->blockId = idir->blocks[i];		//adicionar uma entrada por cada bloco do inode
-			novoNo->pathname = *path;
-			inserirOrdenado(*lista,(void*)novoNo,idir->blocks[i]);
-		}
-		return 1;
+	if(idir->type == FS_DIR){	//a raiz aparece como "/"
+		nome = (char*) arena_alloc(sizeof(char)*MAX_PATH_NAME_SIZE+1);
+		strcpy(nome,(inode == 1) ? "/" : *path);
 	}
 	
+	//uma entrada por cada bloco do inode, de dados ou de entradas de directorio
+	int num = OFFSET_TO_BLOCKS(idir->size);
+	for(int i = 0;i<num;i++)
+		adicionarReferencia(lista,fsi_get_block(fs,idir,i),inode,nome);
+	
+	//e pelos blocos de referencias, que tambem sao do inode
+	if(idir->reserved[INODE_IND] != 0)
+		adicionarReferencia(lista,idir->reserved[INODE_IND],inode,nome);
+	if(idir->reserved[INODE_DIND] != 0){
+		fs_inode_ext_t tabela[EXT_INODE_NUM_BLKS];
+		adicionarReferencia(lista,idir->reserved[INODE_DIND],inode,nome);
+		lerCache(fs->cache,idir->reserved[INODE_DIND],(char*)tabela);
+		for(int k = 0;k<EXT_INODE_NUM_BLKS;k++)
+			if(tabela[k] != 0)
+				adicionarReferencia(lista,tabela[k],inode,nome);
+	}
+	
+	if(idir->type == FS_FILE)	//se ficheiro
+		return 1;
+	
+	//se for directorio: os blocos do indice e as entradas
+	for(unsigned k = 0;k<idir->reserved[INODE_DIDX_BLKS];k++)
+		adicionarReferencia(lista,idir->reserved[INODE_DIDX]+k,inode,nome);
 	
-	//se for directorio
 	fs_dentry_t page[DIR_PAGE_ENTRIES];	//Criar buffer para as entradas de directorio
-	int num = idir->size / sizeof(fs_dentry_t);	//numero de dentrys do directorio
-	int iblock = 0;
-	int i;
-	 while (num > 0) {	//percorrer todas as dentrys
-		if(idir->type == FS_FILE)
-			lerCache(fs->cache,idir->blocks[iblock],(char*)page);
-		else
-			block_read(fs->blocks,idir->blocks[iblock],(char*)page);
-		
-		noRef_t novoNoDir = (noRef_t) malloc(sizeof(noRef_));		//considerar a referencia do directorio aos seus blocos
-		char *newPathDIR = (char*) malloc(sizeof(char)*MAX_PATH_NAME_SIZE+1);
-		
-		if(inode == 1)
-			strcpy(newPathDIR,"/");
-		else
-			strcpy(newPathDIR,*path);	//criar uma copia do nosso path
+	num = idir->size / sizeof(fs_dentry_t);	//numero de dentrys do directorio
+	for (int i = 0; i < num; i++) {	//percorrer todas as dentrys
+		if (i % DIR_PAGE_ENTRIES == 0)
+			lerCache(fs->cache,fsi_get_block(fs,idir,i / DIR_PAGE_ENTRIES),(char*)page);
 		
-		novoNoDir->blockId = idir->blocks[iblock];
-		novoNoDir->inodeId = inode;
-		novoNoDir->pathname = newPathDIR;
-		inserirOrdenado(*lista,(void*)novoNoDir,idir->blocks[iblock]);
-		
-		for (i = 0; i < DIR_PAGE_ENTRIES && num > 0; i++, num--) {
-			char *newPath = (char*) malloc(sizeof(char)*MAX_PATH_NAME_SIZE+1);
-			strcpy(newPath,*path);	//criar uma copia do nosso path
-			strcat(newPath,"/");		//adicionar o nome do ficheiro/directorio que vamos seguir
-			strcat(newPath,page[i].name);
-			gerar_lista_referencias_aux(fs,page[i].inodeid,&newPath,lista);		
-			}	
-		iblock++;
-		}
+		char *newPath = (char*) arena_alloc(sizeof(char)*MAX_PATH_NAME_SIZE+1);
+		strcpy(newPath,*path);	//criar uma copia do nosso path
+		strcat(newPath,"/");		//adicionar o nome do ficheiro/directorio que vamos seguir
+		strcat(newPath,page[i % DIR_PAGE_ENTRIES].name);
+		gerar_lista_referencias_aux(fs,page[i % DIR_PAGE_ENTRIES].inodeid,&newPath,lista);		
+	}
 	return 0;	//sou um directorio	
 }
 
@@ -411,7 +1549,7 @@ List gerar_lista_referencias(fs_t* fs){
 	
 	List refList = newList();
 	
-	char *path = (char*) malloc(sizeof(char)*MAX_PATH_NAME_SIZE+1);
+	char *path = (char*) arena_alloc(sizeof(char)*MAX_PATH_NAME_SIZE+1);
 	strcpy(path,"");
 	
 	
@@ -430,32 +1568,34 @@ List gerar_lista_referencias(fs_t* fs){
  * 
  * Nao, vamos elimina-lo utilizando o mecanismo disponibilizado pela cache
  * 
+ * As referencias e o bitmap sao mudados com o trincoBitmaps; o bloco so
+ * fica livre com o commit seguinte (fsi_blk_free) e o disco nao e apagado:
+ * ate la os metadados commitados ainda o podem usar.
+ * 
  * return 0 - bloco nao referenciado
  * return 1 - eramos a unica referencia
  * return 2 - havia mais referencias*/
 int apagarBloco(fs_t* fs,unsigned idBloco,inodeid_t inode){
 	dprintf("[apagarBloco] START bloco %d\n",idBloco);
 	
+	sthread_mutex_lock(fs->trincoBitmaps);
 	int nRef = fs->referencias[idBloco];
 	
 	if(nRef > 1){
 		dprintf("[apagarBloco] retirar referencia ao bloco %d\n",idBloco);
 		fs->referencias[idBloco]--;
+		sthread_mutex_unlock(fs->trincoBitmaps);
 		return 2;
 	}
+	fs->referencias[idBloco] = 0;
+	sthread_mutex_unlock(fs->trincoBitmaps);
 	
 	dprintf("[apagarBloco] apagar bloco so nosso");
-	fs_inode_t* iNode = &fs->inode_tab[inode];	
-	fs->referencias[idBloco] = 0;
-	if(iNode != NULL && iNode->type == FS_DIR){	//se for directorio, operar sobre o disco
-		char null_block[BLOCK_SIZE];
-		memset(null_block,0,sizeof(null_block)); //criar um bloco vazio/zerado
-		block_write(fs->blocks,idBloco,null_block);
-	}
-	else
-		eliminarBlocoCache(fs->cache,idBloco);
+	invalidarBloco(fs->cache,idBloco);	//ficheiros e directorios passam pela cache
 		
-	BMAP_CLR(fs->blk_bmap,idBloco);	//considerar bloco livre
+	sthread_mutex_lock(fs->trincoBitmaps);
+	fsi_blk_free(fs,idBloco);	//livre depois do commit
+	sthread_mutex_unlock(fs->trincoBitmaps);
 	return 0;
 }
 
@@ -463,97 +1603,187 @@ int apagarBloco(fs_t* fs,unsigned idBloco,inodeid_t inode){
 /*Mecanismo de Copy-on-Write
  * 1º Verificar quantas referencias tem o bloco
 * 2º se tiver 1, sai porque somos a unica
-* 3º se tiver mais do que 1, vamos ler o bloco para um buffer (de onde será copiado)
-* 4º obter a lista de referencias do bloco
-* 5º para cada referencia vamos:
-	-criar um bloco novo
-	-alterar a referencia do inode para o novo bloco
-	-diminuir uma referencia do bloco antigo
+* 3º se tiver mais do que 1, vamos reservar um bloco novo para o inode
+* 4º alterar a referencia do inode para o novo bloco
+* 5º diminuir uma referencia do bloco antigo
+* 
+* O conteudo antigo nao e copiado: o chamador escreve o bloco novo por
+* inteiro. O chamador tem o trinco de escrita do inode; as referencias
+* sao partilhadas com outros inodes e so mudam com o trincoBitmaps.
+* Se o outro dono tambem copiou entretanto, o bloco antigo fica sem
+* referencias e e libertado aqui.
 
  * return -2 se nao possui referencias, -1 se somos a unica referencia
  * se fez cria um novo devolve o id do novobloco*/
-int copy_on_write(fs_t* fs,unsigned blockId,inodeid_t idFile){
-	int i;
+int copy_on_write(fs_t* fs,unsigned blockId,inodeid_t idFile,unsigned iblock){
+	sthread_mutex_lock(fs->trincoBitmaps);
 	int nRef = fs->referencias[blockId];	//determinar o numero de referencias que o bloco tem
 	
 	if(nRef == 0){
 		dprintf("[copy_on_write] o bloco %d nao possui referencias\n",blockId);
+		sthread_mutex_unlock(fs->trincoBitmaps);
 		return -2;
 	}
 	
 	dprintf("[copy_on_write] o bloco %d possui %d referencia\n",blockId,nRef);
 	
 	if(nRef == 1){
+		sthread_mutex_unlock(fs->trincoBitmaps);
 		return -1;
 	}
 	
-	//alterar no inode a referencia para o novo bloco
-	fs_inode_t* iNode = &fs->inode_tab[idFile];	//carregar o inode que referencia
-
-	//Vamos criar uma copia do bloco e alterar a referencia para este conteudo
 	unsigned bks;	//indice do novo bloco
-	int k;	//indice dentro do vector do inode onde se encontrava o bloco referenciado
-	
-	char block[BLOCK_SIZE];
 	
-	if(iNode->type == FS_FILE)
-		lerCache(fs->cache,blockId,block);
-	else
-		block_read(fs->blocks,blockId,block);	
-			
 	//reservar novo bloco
-	if (!fsi_bmap_find_free(fs->blk_bmap,block_num_blocks(fs->blocks),&bks)) { // ITAB_SIZE	Procurar blocos livres
+	if (!fsi_blk_find(fs,&bks)) { //Procurar blocos livres
 			dprintf("[copy_on_write] there are no free blocks.\n");
+			sthread_mutex_unlock(fs->trincoBitmaps);
 			return -1;
 	}
 		
-	BMAP_SET(fs->blk_bmap, bks);//Colocar o bloco a set
-		
-	for(i = 0,k = -1; i< INODE_NUM_BLKS; i++){	//determinar qual a entrada do inode que tem a ref deste bloco
-		if((iNode->blocks[i]) == blockId){
-				k = i;
-				break;
-			}
-		}
-		
-	if(k == -1){
-		dprintf("[copy_on_write] nao encontro a referencia neste inode\n");
-		return -1;
-	}
-	//alterar a referencia do bloco antigo para o novo
-	iNode->blocks[k] = bks;
-	//incrementar as referencias do novo
-	fs->referencias[bks]++;
+	fsi_blk_take(fs,bks,1);	//o novo bloco e so nosso
 		
 	fs->referencias[blockId]--; //retiramos uma referencia ao bloco
+	int orfao = (fs->referencias[blockId] == 0);
+	sthread_mutex_unlock(fs->trincoBitmaps);
 	
-	if(iNode->type == FS_FILE)		//realizar a copia
-		escreverCache(fs->cache,bks,block);
-	else
-		block_write(fs->blocks,bks,block);	
+	//alterar no mapa do inode a referencia do bloco antigo para o novo
+	//(a entrada "iblock" ja existe, por isso nao se reserva nenhuma tabela)
+	fsi_set_block(fs,&fs->inode_tab[idFile],iblock,bks);
 	
+	if(orfao){
+		invalidarBloco(fs->cache,blockId);
+		sthread_mutex_lock(fs->trincoBitmaps);
+		fsi_blk_free(fs,blockId);
+		sthread_mutex_unlock(fs->trincoBitmaps);
+	}
 	return bks;
 }
 		
 
-int escreverBloco(fs_t* fs,unsigned idBloco,inodeid_t idFile,char* dados){
-	int novoBloco = copy_on_write(fs,idBloco,idFile);		//garantir que ao escrevermos no bloco, somos os unicos a referencia-lo
+/*Escrever "dados" no bloco "idBloco", que e o bloco "iblock" do inode*/
+int escreverBloco(fs_t* fs,unsigned idBloco,inodeid_t idFile,unsigned iblock,char* dados){
+	int novoBloco = copy_on_write(fs,idBloco,idFile,iblock);		//garantir que ao escrevermos no bloco, somos os unicos a referencia-lo
 	
-	fs_inode_t* iNode = &fs->inode_tab[idFile];	//carregar o inode que referencia
+	if(novoBloco >= 0)
+		escreverCache(fs->cache,novoBloco,dados);	//se criamos um novo bloco, vamos escrever nele
+	else
+		escreverCache(fs->cache,idBloco,dados);
+	return 0;
+}
 
-	if(novoBloco >= 0){
-		if(iNode->type == FS_DIR)
-			block_write(fs->blocks,novoBloco,dados);
-		else
-			escreverCache(fs->cache,novoBloco,dados);	//se criamos um novo bloco, vamos escrever nele
+
+/*Libertar os blocos de dados [desde, ate) do ficheiro, e os blocos de
+ * referencias que so tinham blocos desse intervalo: trunca o ficheiro em
+ * "desde", por isso "ate" e o fim dos blocos que o ficheiro tem. O
+ * chamador tem o trinco de escrita do inode*/
+static void fsi_free_blocks(fs_t* fs, inodeid_t file, unsigned desde, unsigned ate)
+{
+	fs_inode_t* inode = &fs->inode_tab[file];
+	fs_inode_ext_t tabela[EXT_INODE_NUM_BLKS];
+	unsigned primeiroDuplo = INODE_NUM_BLKS + EXT_INODE_NUM_BLKS;	//primeiro bloco do duplamente indirecto
+	
+	for(unsigned i = desde; i < ate; i++){
+		unsigned idBlock = fsi_get_block(fs,inode,i);
+		if(idBlock == 0)
+			continue;
+		if(idBlock < fs->sb.data_start){
+			printf("[fsi_free_blocks] Nao pode remover um bloco do sistema de ficheiros\n");
+			continue;
+		}
+		apagarBloco(fs,idBlock,file);	//solicitar remocao do bloco
+		
+		//destruir a referencia, se a tabela onde esta nao vai ser libertada
+		unsigned inicioTabela = i < INODE_NUM_BLKS ? i :
+			i < primeiroDuplo ? INODE_NUM_BLKS :
+			primeiroDuplo + (i - primeiroDuplo) / EXT_INODE_NUM_BLKS * EXT_INODE_NUM_BLKS;
+		if(i < INODE_NUM_BLKS || inicioTabela < desde)
+			fsi_set_block(fs,inode,i,0);
+	}
+	
+	if(desde <= INODE_NUM_BLKS && inode->reserved[INODE_IND] != 0){
+		apagarBloco(fs,inode->reserved[INODE_IND],file);
+		inode->reserved[INODE_IND] = 0;
+	}
+	if(inode->reserved[INODE_DIND] != 0){
+		int mudou = 0;
+		lerCache(fs->cache,inode->reserved[INODE_DIND],(char*)tabela);
+		for(unsigned k = 0; k < EXT_INODE_NUM_BLKS; k++){
+			if(tabela[k] != 0 && primeiroDuplo + k*EXT_INODE_NUM_BLKS >= desde){
+				apagarBloco(fs,tabela[k],file);
+				tabela[k] = 0;
+				mudou = 1;
+			}
+		}
+		if(desde <= primeiroDuplo){
+			apagarBloco(fs,inode->reserved[INODE_DIND],file);
+			inode->reserved[INODE_DIND] = 0;
+		}
+		else if(mudou)
+			escreverCacheMeta(fs->cache,inode->reserved[INODE_DIND],(char*)tabela);
 	}
-	else{
-		if(iNode->type == FS_DIR)
-			block_write(fs->blocks,idBloco,dados);
-		else
-			escreverCache(fs->cache,idBloco,dados);	//se criamos um novo bloco, vamos escrever nele
+}
+
+
+/*Contar mais uma referencia do inode "id" ao bloco "blk"*/
+static void fsi_ref_add(fs_t* fs, unsigned blk, inodeid_t id)
+{
+	if(blk < fs->sb.data_start || blk >= FS_NUM_BLOCKS(fs))
+		return;
+	if(fs->referencias[blk] < 127)	//char: satura
+		fs->referencias[blk]++;
+	fs->dono[blk] = id;
+}
+
+/*Refazer os contadores de referencias e o mapa inverso, que nao estao no
+ * disco, a partir dos mapas de blocos dos inodes: um bloco que ficou
+ * partilhado por copy/append continua a ter as referencias de todos.
+ * Os blocos de dados marcados no bitmap que nenhum inode usa (reservados
+ * quando o servidor parou) ficam livres. Antes de haver pedidos (fs_new),
+ * depois de fsi_blk_count*/
+static void fsi_load_refs(fs_t* fs)
+{
+	fs_inode_ext_t tabela[EXT_INODE_NUM_BLKS];
+	fs_inode_ext_t indirectos[EXT_INODE_NUM_BLKS];
+	unsigned i, j;
+
+	for(unsigned id = INODES_USED_BY_FS; id < FS_NUM_INODES(fs); id++){
+		if(!BMAP_ISSET(fs->inode_bmap,id))
+			continue;
+		fs_inode_t* inode = &fs->inode_tab[id];
+		for(i = 0; i < INODE_NUM_BLKS; i++)
+			fsi_ref_add(fs,inode->blocks[i],id);
+		if(inode->reserved[INODE_IND] != 0){
+			fsi_ref_add(fs,inode->reserved[INODE_IND],id);
+			lerCache(fs->cache,inode->reserved[INODE_IND],(char*)tabela);
+			for(i = 0; i < EXT_INODE_NUM_BLKS; i++)
+				fsi_ref_add(fs,tabela[i],id);
+		}
+		if(inode->reserved[INODE_DIND] != 0){
+			fsi_ref_add(fs,inode->reserved[INODE_DIND],id);
+			lerCache(fs->cache,inode->reserved[INODE_DIND],(char*)tabela);
+			for(i = 0; i < EXT_INODE_NUM_BLKS; i++){
+				if(tabela[i] == 0)
+					continue;
+				fsi_ref_add(fs,tabela[i],id);
+				lerCache(fs->cache,tabela[i],(char*)indirectos);
+				for(j = 0; j < EXT_INODE_NUM_BLKS; j++)
+					fsi_ref_add(fs,indirectos[j],id);
+			}
+		}
+		if(inode->type == FS_DIR)
+			for(i = 0; i < inode->reserved[INODE_DIDX_BLKS]; i++)
+				fsi_ref_add(fs,inode->reserved[INODE_DIDX]+i,id);
 	}
-	return 0;
+
+	unsigned perdidos = 0;
+	for(i = fs->sb.data_start; i < FS_NUM_BLOCKS(fs); i++)
+		if(BMAP_ISSET(fs->blk_bmap,i) && fs->referencias[i] == 0){
+			fsi_blk_clr(fs,i);	//vai no proximo commit
+			perdidos++;
+		}
+	if(perdidos > 0)
+		printf("[fs_new] freed %u blocks that no inode uses.\n",perdidos);
 }
 
 
@@ -571,18 +1801,56 @@ fs_t* fs_new(unsigned num_blocks, int disk_delay)
    fs->blocks = block_new(num_blocks,BLOCK_SIZE);	//criar uma estrutura de dados permanente
    fs->cache = criarCache(DIM_CACHE,fs->blocks);	//criar uma cache de blocos
    fs->referencias = (char*) malloc((sizeof(char)*num_blocks));	//estrutura para registar quantas referencias tem cada bloco
-   fs->monLeitores = sthread_monitor_init();
-   fs->monEscritores = sthread_monitor_init();
-   fs->leitores = 0;
-   fs->escritores = 0;
-   fs->wanna_escritor = 0;
-   fs->wanna_leitor = 0;
+   fs->dono = (inodeid_t*) calloc(num_blocks,sizeof(inodeid_t));
+   
+   fsi_layout(&fs->sb,num_blocks);	//disposicao por omissao, se o volume ainda nao foi formatado
+   int formatado = fsi_load_super(fs);
+   fs->blk_bmap = (char*) calloc(fs->sb.bmap_blks,BLOCK_SIZE);
+   fs->inode_bmap = (char*) calloc(fs->sb.imap_blks,BLOCK_SIZE);
+   fs->bmap_sujo = (char*) calloc(fs->sb.bmap_blks,sizeof(char));
+   fs->imap_sujo = (char*) calloc(fs->sb.imap_blks,sizeof(char));
+   fs->itab_sujo = (char*) calloc(fs->sb.itab_blks,sizeof(char));
+   fs->diario = (char*) calloc(fs->sb.jrnl_blks,BLOCK_SIZE);
+   fs->commitado = (char*) calloc(fs->sb.jrnl_start - fs->sb.bmap_start,BLOCK_SIZE);
+   fs->ckpt_sujo = (char*) calloc(fs->sb.jrnl_start - fs->sb.bmap_start,sizeof(char));
+   fs->registados = (char*) calloc(fs->sb.bmap_blks,BLOCK_SIZE);
+   fs->a_libertar = (char*) calloc(fs->sb.bmap_blks,BLOCK_SIZE);
+   fs->em_commit = (char*) calloc(fs->sb.bmap_blks,BLOCK_SIZE);
+   fs->num_libertar = 0;
+   fs->marcados = 0;
+   fs->jseq = 1;
+   fs->jcabeca = fs->jcauda = 0;
+   fs->epoca = 0;
+   fs->livres = (unsigned short*) calloc(BMAP_NUM_GROUPS(fs),sizeof(unsigned short));
+   fs->inode_tab = (fs_inode_t*) calloc(fs->sb.itab_blks,BLOCK_SIZE);
+   fs->trincos = (fs_trinco_t*) malloc(sizeof(fs_trinco_t)*FS_NUM_INODES(fs));
+   fs->dcache = criarDCache(DIM_DCACHE,FS_NUM_INODES(fs));
+   
+   fsi_trinco_init(&fs->trincoFS, "fs.trincoFS");
+   for(i = 0; i<FS_NUM_INODES(fs); i++)
+	   fsi_trinco_init(&fs->trincos[i], "fs.inode");
+   fs->trincoBitmaps = sthread_mutex_init();
+   sthread_mutex_setname(fs->trincoBitmaps, "fs.bitmaps");
+   fs->trincoDisco = sthread_mutex_init();
+   sthread_mutex_setname(fs->trincoDisco, "fs.disco");
+   fs->trincoDiario = sthread_mutex_init();
+   sthread_mutex_setname(fs->trincoDiario, "fs.diario");
+   fs->trincoDesfrag = sthread_mutex_init();
+   sthread_mutex_setname(fs->trincoDesfrag, "fs.desfrag");
+   memset(&fs->desfrag,0,sizeof(fs->desfrag));
+   fs->desfragThread = NULL;
    
    for(i = 0; i<num_blocks; i++){
 	   fs->referencias[i] = 0;	//inicialmente todos tem referencias a 0
    }
    
+   if (formatado)
+      fsi_replay_journal(fs);	//antes de carregar os metadados
    fsi_load_fsdata(fs);		//actulizar o file system
+   fsi_journal_reset(fs);
+   fsi_blk_count(fs);
+   if (formatado)
+      fsi_load_refs(fs);
    io_delay_on(disk_delay);
 	   if((sthread_create(thread_actualiza_Cache,(void*)fs,1)) == NULL){
 	   printf("[new File System] Erro ao criar a thread de actualizacao da cache");
@@ -594,15 +1862,14 @@ fs_t* fs_new(unsigned num_blocks, int disk_delay)
 /*Formatar o sistema de ficheiros*/
 int fs_format(fs_t* fs)
 {
-	iniciaEscrita(fs);	//sincronizar	
-	
 	int i;
    if (fs == NULL) {
       printf("[fs_format] argument is null.\n");
-      terminaEscrita(fs);
       return -1;
    }
 
+	iniciaEscrita(&fs->trincoFS);	//sincronizar: ninguem mais pode estar no FS
+
    // erase all blocks
    char null_block[BLOCK_SIZE];
    memset(null_block,0,sizeof(null_block)); //criar um bloco vazio/zerado
@@ -610,28 +1877,28 @@ int fs_format(fs_t* fs)
 		block_write(fs->blocks,i,null_block);
    }
 	
+	limparCache(fs->cache);	//nada do que la estava pode voltar ao disco
+	
 	//destruir todas as referencias que existiam
 	for(i = 0; i<block_num_blocks(fs->blocks); i++){
 	   fs->referencias[i] = 0;	//inicialmente todos tem referencias a 0
+	   fs->dono[i] = 0;
 	}
 	
-	//Apagar todo o bitmap de blocos
-	for(i = 0; i<BLOCK_SIZE*sizeof(char)*8;i++){
-		BMAP_CLR(fs->blk_bmap,i);
-	}
-	
-		//Apagar todo o bitmap de inodes
-	for(i = 0; i<BLOCK_SIZE*sizeof(char)*8;i++){	//num bits =nºcaracteres*dimensao em byte dos caracteres*nºbits de um byte
-		BMAP_CLR(fs->inode_bmap,i);
-	}
+	limparDCache(fs->dcache);
 	
+	//Apagar os bitmaps de blocos e de inodes
+	memset(fs->blk_bmap,0,fs->sb.bmap_blks*BLOCK_SIZE);
+	memset(fs->a_libertar,0,fs->sb.bmap_blks*BLOCK_SIZE);
+	memset(fs->em_commit,0,fs->sb.bmap_blks*BLOCK_SIZE);
+	fs->num_libertar = 0;
+	memset(fs->inode_bmap,0,fs->sb.imap_blks*BLOCK_SIZE);
 	
-   // reserve file system meta data blocks
-   BMAP_SET(fs->blk_bmap,0);
-   BMAP_SET(fs->blk_bmap,1);
-   for (int i = 0; i < ITAB_NUM_BLKS; i++) {
-      BMAP_SET(fs->blk_bmap,i+2);
+   // reserve file system meta data blocks: superblock, bitmaps and inode table
+   for (i = 0; i < fs->sb.data_start; i++) {
+      BMAP_SET(fs->blk_bmap,i);
    }
+   fsi_blk_count(fs);
 
    // reserve inodes 0 (will never be used) and 1 (the root)
    BMAP_SET(fs->inode_bmap,0);
@@ -641,20 +1908,24 @@ int fs_format(fs_t* fs)
    // save the file system metadata
    fsi_store_fsdata(fs);
    
-   terminaEscrita(fs);
+   terminaEscrita(&fs->trincoFS);
    return 0;
 }
 
 
 int fs_get_attrs(fs_t* fs, inodeid_t file, fs_file_attrs_t* attrs)
 {
-   if (fs == NULL || file >= ITAB_SIZE || attrs == NULL) {
+   if (fs == NULL || file >= FS_NUM_INODES(fs) || attrs == NULL) {
       dprintf("[fs_get_attrs] malformed arguments.\n");
       return -1;
    }
 
+   entrarFS(fs);
+   trancar(fs,file,LEITURA);
    if (!BMAP_ISSET(fs->inode_bmap,file)) {
       dprintf("[fs_get_attrs] inode is not being used.\n");
+      destrancar(fs,file,LEITURA);
+      sairFS(fs);
       return -1;
    }
 
@@ -673,6 +1944,8 @@ int fs_get_attrs(fs_t* fs, inodeid_t file, fs_file_attrs_t* attrs)
          dprintf("[fs_get_attrs] fatal error - invalid inode.\n");
          exit(-1);
    }
+   destrancar(fs,file,LEITURA);
+   sairFS(fs);
    return 0;
 }
 
@@ -693,6 +1966,7 @@ int fs_lookup(fs_t* fs, char* file, inodeid_t* fileid)
 char *token;
 char line[MAX_PATH_NAME_SIZE]; 
 char *search = "/";
+char *resto;	//estado do strtok_r: lookups concorrentes nao partilham o do strtok
 int i=0;
 int dir=0;
    if (fs==NULL || file==NULL ) { //Se o nome do ficheiro ou do file system for nulo, erro
@@ -707,39 +1981,138 @@ int dir=0;
     }
 
     strcpy(line,file);	//Guardar o nome do ficheiro
-    token = strtok(line, search);//separar os nomes de cada parte do directorio /parte1/parte2...
+    token = strtok_r(line, search, &resto);//separar os nomes de cada parte do directorio /parte1/parte2...
     
-    iniciaLeitura(fs);
+    entrarFS(fs);
    while(token != NULL) {
      i++;
      if(i==1) dir=1;   //Root directory, se so tem o /
      
+     inodeid_t fid;
+     int emCache = procurarDCache(fs->dcache,dir,token,&fid);	//sem trancar nem ler o directorio
+     if (emCache == 0) {
+        dprintf("[fs_lookup] file does not exist (dcache).\n");
+        sairFS(fs);
+        return 0;
+     }
+     if (emCache == 1) {
+        *fileid = fid;
+        dir=fid;
+        token = strtok_r(NULL, search, &resto);
+        continue;
+     }
+     
+     trancar(fs,dir,LEITURA);	//um directorio trancado de cada vez
      if (!BMAP_ISSET(fs->inode_bmap,dir)) {	//se o inode do directorio nao esta usado, e porque o inode nao existe
 	      dprintf("[fs_lookup] inode is not being used.\n");
-	      terminaLeitura(fs);
+	      destrancar(fs,dir,LEITURA);
+	      sairFS(fs);
 	      return -1;
      }
      fs_inode_t* idir = &fs->inode_tab[dir];//obter o i-node do diretorio
      if (idir->type != FS_DIR) { //se esse inode nao for do tipo FS_DIR, diz que nao e um directorio e da erro
         dprintf("[fs_lookup] inode is not a directory.\n");
-        terminaLeitura(fs);
+        destrancar(fs,dir,LEITURA);
+        sairFS(fs);
         return -1;
      }
-     inodeid_t fid;
      if (fsi_dir_search(fs,dir,token,&fid) < 0) { //vamos procurar o ficheiro dentro da pasta
         dprintf("[fs_lookup] file does not exist.\n");
-        terminaLeitura(fs);
+        inserirDCache(fs->dcache,dir,token,0,0);	//entrada negativa
+        destrancar(fs,dir,LEITURA);
+        sairFS(fs);
         return 0;
      }
+     inserirDCache(fs->dcache,dir,token,1,fid);
+     destrancar(fs,dir,LEITURA);
      *fileid = fid; //obteve o ficheiro
      dir=fid;
-     token = strtok(NULL, search); //vai avancar na procura
+     token = strtok_r(NULL, search, &resto); //vai avancar na procura
    }
-	terminaLeitura(fs);
+	sairFS(fs);
    return 1;
 }
 
 
+/* Cursor sobre um vector de iovecs: os dados de fs_readv/fs_writev sao
+ * copiados directamente entre os blocos e os buffers do chamador, sem
+ * passar por um buffer intermedio do tamanho do pedido */
+typedef struct {
+	const struct iovec* iov;
+	int iovcnt;
+	size_t off;	//posicao dentro de iov[0]
+} iov_cursor_t;
+
+static void iov_cursor_init(iov_cursor_t* cur, const struct iovec* iov, int iovcnt)
+{
+	cur->iov = iov;
+	cur->iovcnt = iovcnt;
+	cur->off = 0;
+	while (cur->iovcnt > 0 && cur->iov->iov_len == 0) {
+		cur->iov++;
+		cur->iovcnt--;
+	}
+}
+
+static void iov_cursor_skip(iov_cursor_t* cur, size_t n)
+{
+	while (n > 0 && cur->iovcnt > 0) {
+		size_t left = cur->iov->iov_len - cur->off;
+		size_t num = MIN(left, n);
+		cur->off += num;
+		n -= num;
+		if (cur->off == cur->iov->iov_len) {
+			cur->iov++;
+			cur->iovcnt--;
+			cur->off = 0;
+		}
+	}
+	while (cur->iovcnt > 0 && cur->iov->iov_len == 0) {
+		cur->iov++;
+		cur->iovcnt--;
+	}
+}
+
+/* Devolve um ponteiro para os proximos n bytes se estiverem seguidos
+ * no mesmo iovec, NULL caso contrario */
+static char* iov_cursor_contig(iov_cursor_t* cur, size_t n)
+{
+	if (cur->iovcnt == 0 || cur->iov->iov_len - cur->off < n)
+		return NULL;
+	return (char*)cur->iov->iov_base + cur->off;
+}
+
+static void iov_copy_out(iov_cursor_t* cur, const char* src, size_t n)
+{
+	while (n > 0 && cur->iovcnt > 0) {
+		size_t num = MIN(cur->iov->iov_len - cur->off, n);
+		memcpy((char*)cur->iov->iov_base + cur->off, src, num);
+		src += num;
+		n -= num;
+		iov_cursor_skip(cur, num);
+	}
+}
+
+static void iov_copy_in(iov_cursor_t* cur, char* dst, size_t n)
+{
+	while (n > 0 && cur->iovcnt > 0) {
+		size_t num = MIN(cur->iov->iov_len - cur->off, n);
+		memcpy(dst, (char*)cur->iov->iov_base + cur->off, num);
+		dst += num;
+		n -= num;
+		iov_cursor_skip(cur, num);
+	}
+}
+
+static size_t iov_total(const struct iovec* iov, int iovcnt)
+{
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	return total;
+}
+
+
 /*Devolver até "count" bytes de "data" do ficheiro "file" apartir do byte "offset" a contar do inicio do ficheiro.
  * O primeiro byte do ficheiro corresponde ao offset 0
  * 
@@ -754,65 +2127,173 @@ int dir=0;
 int fs_read(fs_t* fs, inodeid_t file, unsigned offset, unsigned count, 
    char* buffer, int* nread)
 {
-	if (fs==NULL || file >= ITAB_SIZE || buffer==NULL || nread==NULL) {
-		dprintf("[fs_read] malformed arguments.\n");		
+	struct iovec iov = { buffer, count };
+
+	if (buffer == NULL) {
+		dprintf("[fs_read] malformed arguments.\n");		
+		return -1;
+	}
+	return fs_readv(fs, file, offset, &iov, 1, nread);
+}
+
+/*Versao scatter de fs_read: os dados sao lidos para os buffers de "iov"
+ * pela ordem do vector, ate a soma dos seus tamanhos. Os blocos inteiros
+ * que caem num so iovec sao lidos da cache directamente para la */
+int fs_readv(fs_t* fs, inodeid_t file, unsigned offset,
+   const struct iovec* iov, int iovcnt, int* nread)
+{
+	if (fs==NULL || file >= FS_NUM_INODES(fs) || iov==NULL || iovcnt < 0 || nread==NULL) {
+		dprintf("[fs_readv] malformed arguments.\n");		
 		return -1;
 	}
 	
-	iniciaLeitura(fs);
+	entrarFS(fs);
+	trancar(fs,file,LEITURA);
 	
 	if (!BMAP_ISSET(fs->inode_bmap,file)) {
-		dprintf("[fs_read] inode is not being used.\n");
-		terminaLeitura(fs);
+		dprintf("[fs_readv] inode is not being used.\n");
+		destrancar(fs,file,LEITURA);
+		sairFS(fs);
 		return -1;
 	}
 
 	fs_inode_t* ifile = &fs->inode_tab[file]; //abrir o inode	
 	if (ifile->type != FS_FILE) {
-		dprintf("[fs_read] inode is not a file.\n"); //verificar se nao e um directorio
-		terminaLeitura(fs);
+		dprintf("[fs_readv] inode is not a file.\n"); //verificar se nao e um directorio
+		destrancar(fs,file,LEITURA);
+		sairFS(fs);
 		return -1;
 	}
 
 	if (offset >= ifile->size) { //se excedemos o tamanho, acabamos a leitura, retorna 0
 		*nread = 0;
-		terminaLeitura(fs);
+		destrancar(fs,file,LEITURA);
+		sairFS(fs);
 		return 0;
 	}
 	
    	// read the specified range
-	int pos = 0;
+	unsigned pos = 0;
 	int iblock = offset/BLOCK_SIZE; //determinar qual o numero do bloco em que vamos comecar
 	int blks_used = OFFSET_TO_BLOCKS(ifile->size); //tamanho ocupado no bloco
-	int max = MIN(count,ifile->size-offset);
-	int tbl_pos;
-	unsigned int *blk;
+	unsigned max = MIN(iov_total(iov, iovcnt),ifile->size-offset);
 	char block[BLOCK_SIZE];
-   
+	unsigned blk = 0, seguidos = 0; //sequencia de blocos seguidos no disco em que estamos
+	iov_cursor_t cur;
+
+	iov_cursor_init(&cur, iov, iovcnt);
 	while (pos < max && iblock < blks_used) { //enquanto nao chegar ao maximo do bloco e o bloco nao for maior que os blocos usados
-		if(iblock < INODE_NUM_BLKS) { //verificar se o bloco ainda esta dentro da tabela de inodes
-			blk = ifile->blocks;
-			tbl_pos = iblock;
-		}
+		if (seguidos == 0) //directo, indirecto ou duplamente indirecto
+			seguidos = fsi_get_run(fs,ifile,iblock,blks_used-iblock,&blk);
+		if (seguidos > 1)
+			preCarregarCache(fs->cache, blk, seguidos); //o resto da sequencia numa so leitura
 		
+		int start = ((pos == 0)?(offset % BLOCK_SIZE):0);
+		int num = MIN(BLOCK_SIZE - start, max - pos);
+		char* dst = iov_cursor_contig(&cur, BLOCK_SIZE);
+
+		if (num == BLOCK_SIZE && dst != NULL) {
+			lerCache(fs->cache, blk, dst); //bloco inteiro: directo para o buffer do chamador
+			iov_cursor_skip(&cur, BLOCK_SIZE);
+		} else {
+			lerCache(fs->cache, blk, block); //ler o bloco
+			iov_copy_out(&cur, &block[start], num);
+		}
+
+		pos += num;
+		iblock++;
+		blk++;
+		seguidos--;
+	}
+	*nread = pos;
+	destrancar(fs,file,LEITURA);
+	sairFS(fs);
+	return 0;
+}
+
+/*Versao de fs_read sem copias: os iovecs apontam para os blocos da cache,
+ * que ficam fixados ate fs_unpin. Uma escrita entretanto nao os altera
+ * (a cache passa a usar uma entrada nova), por isso o que e enviado e o
+ * conteudo do ficheiro no momento da leitura*/
+int fs_read_pinned(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
+   struct iovec* iov, icache_t* pins, int maxiov, int* iovcnt, int* nread)
+{
+	if (fs==NULL || file >= FS_NUM_INODES(fs) || iov==NULL || pins==NULL || iovcnt==NULL || nread==NULL) {
+		dprintf("[fs_read_pinned] malformed arguments.\n");		
+		return -1;
+	}
+	
+	entrarFS(fs);
+	trancar(fs,file,LEITURA);
+	
+	if (!BMAP_ISSET(fs->inode_bmap,file)) {
+		dprintf("[fs_read_pinned] inode is not being used.\n");
+		destrancar(fs,file,LEITURA);
+		sairFS(fs);
+		return -1;
+	}
+
+	fs_inode_t* ifile = &fs->inode_tab[file]; //abrir o inode	
+	if (ifile->type != FS_FILE) {
+		dprintf("[fs_read_pinned] inode is not a file.\n"); //verificar se nao e um directorio
+		destrancar(fs,file,LEITURA);
+		sairFS(fs);
+		return -1;
+	}
+
+	*iovcnt = 0;
+	*nread = 0;
+	if (offset >= ifile->size) { //se excedemos o tamanho, acabamos a leitura, retorna 0
+		destrancar(fs,file,LEITURA);
+		sairFS(fs);
+		return 0;
+	}
+	
+	unsigned pos = 0;
+	int iblock = offset/BLOCK_SIZE; //bloco em que vamos comecar
+	int blks_used = OFFSET_TO_BLOCKS(ifile->size);
+	unsigned max = MIN(count,ifile->size-offset);
+	unsigned blk = 0, seguidos = 0;
+   
+	while (pos < max && iblock < blks_used) {
+		if (seguidos == 0) //directo, indirecto ou duplamente indirecto
+			seguidos = fsi_get_run(fs,ifile,iblock,blks_used-iblock,&blk);
+		if (seguidos > 1)
+			preCarregarCache(fs->cache, blk, seguidos);
 		
-		if(ifile->type == FS_FILE)
-			lerCache(fs->cache, blk[tbl_pos], block); //ler o bloco
-		else
-			block_read(fs->blocks, blk[tbl_pos], block); //ler o bloco
-			
 		int start = ((pos == 0)?(offset % BLOCK_SIZE):0);
 		int num = MIN(BLOCK_SIZE - start, max - pos);
-		memcpy(&buffer[pos],&block[start],num);
+		icache_t entrada;
+
+		if (*iovcnt == maxiov || (entrada = fixarBloco(fs->cache, blk)) == NULL) {
+			fs_unpin(fs, pins, *iovcnt);
+			*iovcnt = 0;
+			destrancar(fs,file,LEITURA);
+			sairFS(fs);
+			return -1;
+		}
+		pins[*iovcnt] = entrada;
+		iov[*iovcnt].iov_base = entrada->conteudobloco + start;
+		iov[*iovcnt].iov_len = num;
+		(*iovcnt)++;
 
 		pos += num;
 		iblock++;
+		blk++;
+		seguidos--;
 	}
 	*nread = pos;
-	terminaLeitura(fs);
+	destrancar(fs,file,LEITURA);
+	sairFS(fs);
 	return 0;
 }
 
+void fs_unpin(fs_t* fs, icache_t* pins, int npins)
+{
+	for (int i = 0; i < npins; i++)
+		largarBloco(fs->cache, pins[i]);
+}
+
 /*Escrever "data" apartir do byte "offset" a partir do inicio do ficheiro "file".
  * O primeiro byte do ficheiro está no offset 0. A operacao de esctrita é atomica. Os dados de escrita
  * nao serao misturados com os dados da escrita de outro cliente. Se bem sucedida devolve a dimensao
@@ -821,24 +2302,43 @@ int fs_read(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
 int fs_write(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
    char* buffer)
 {
-	dprintf("[my_write] START\n");
-	if (fs == NULL || file >= ITAB_SIZE || buffer == NULL) {
+	struct iovec iov = { buffer, count };
+
+	if (buffer == NULL) {
 		dprintf("[fs_write] malformed arguments.\n");
 		return -1;
 	}
+	return fs_writev(fs, file, offset, &iov, 1);
+}
+
+/*Escrita de fs_writev. Devolve -2 se nao ha blocos livres (a escrita e
+ * desfeita)*/
+static int fsi_writev(fs_t* fs, inodeid_t file, unsigned offset,
+   const struct iovec* iov, int iovcnt)
+{
+	dprintf("[my_write] START\n");
+	if (fs == NULL || file >= FS_NUM_INODES(fs) || iov == NULL || iovcnt < 0) {
+		dprintf("[fs_writev] malformed arguments.\n");
+		return -1;
+	}
 	
-	iniciaEscrita(fs);
+	unsigned count = iov_total(iov, iovcnt);
+
+	entrarFS(fs);
+	trancar(fs,file,ESCRITA);
 	
 	if (!BMAP_ISSET(fs->inode_bmap,file)) {
-		dprintf("[fs_write] inode is not being used.\n");
-		terminaEscrita(fs);
+		dprintf("[fs_writev] inode is not being used.\n");
+		destrancar(fs,file,ESCRITA);
+		sairFS(fs);
 		return -1;
 	}
 
 	fs_inode_t* ifile = &fs->inode_tab[file]; //abrir o inode	
 	if (ifile->type != FS_FILE) {
-		dprintf("[fs_write] inode is not a file.\n"); //verificar se nao e um directorio
-		terminaEscrita(fs);
+		dprintf("[fs_writev] inode is not a file.\n"); //verificar se nao e um directorio
+		destrancar(fs,file,ESCRITA);
+		sairFS(fs);
 		return -1;
 	}
 
@@ -846,104 +2346,187 @@ int fs_write(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
 		offset = ifile->size;
 	}
 
-	unsigned *blk;
-
 	int blks_used = OFFSET_TO_BLOCKS(ifile->size); //Calcula o numero de blocos utilizados
 	int blks_req = MAX(OFFSET_TO_BLOCKS(offset+count),blks_used)-blks_used; //tamanho ocupado no bloco
 
-	dprintf("[fs_write] count=%d, offset=%d, fsize=%d, bused=%d, breq=%d\n",
+	dprintf("[fs_writev] count=%d, offset=%d, fsize=%d, bused=%d, breq=%d\n",
 		count,offset,ifile->size,blks_used,blks_req);
 	
 	if (blks_req > 0) {
-		if(blks_req > INODE_NUM_BLKS-blks_used) { //Se sao necessarios blocos mas nao os ha neste inode
-			dprintf("[fs_write] no free block entries in inode.\n");
-			terminaEscrita(fs);
+		if(blks_req > FILE_MAX_BLKS-blks_used) { //Se sao necessarios blocos mas nao os ha neste inode
+			dprintf("[fs_writev] no free block entries in inode.\n");
+			destrancar(fs,file,ESCRITA);
+			sairFS(fs);
 			return -1;
 		}
 
-		dprintf("[fs_write] required %d blocks, used %d\n", blks_req, blks_used); //requerir blocos
-
-      		// check and reserve if there are free blocks
-		for (int i = blks_used; i < blks_used + blks_req; i++) {
-
-			if(i < INODE_NUM_BLKS) //se ainda der para reservar um bloco dentro da estruta do inode
-				blk = &ifile->blocks[i];
-	 
-			if (!fsi_bmap_find_free(fs->blk_bmap,block_num_blocks(fs->blocks),blk)) { // ITAB_SIZE	Procurar blocos livres
-				dprintf("[fs_write] there are no free blocks.\n");
-				terminaEscrita(fs);
-				return -1;
+		dprintf("[fs_writev] required %d blocks, used %d\n", blks_req, blks_used); //requerir blocos
+
+      		// check and reserve if there are free blocks, in runs as long as possible
+		unsigned alvo = (blks_used > 0) ? fsi_get_block(fs,ifile,blks_used-1)+1 : 0; //continuar o ficheiro
+		int i = blks_used;
+		while (i < blks_used + blks_req) {
+			unsigned novo, k;
+			unsigned got = fsi_alloc_run(fs,alvo,blks_used+blks_req-i,&novo);
+			if (got == 0) { //nao ha blocos livres
+				dprintf("[fs_writev] there are no free blocks.\n");
+				fsi_free_blocks(fs,file,blks_used,i); //desfazer: a escrita e atomica
+				fsi_mark_inode(fs,file);
+				destrancar(fs,file,ESCRITA);
+				sairFS(fs);
+				return -2;
+			}
+			for (k = 0; k < got; k++, i++) {
+				if (fsi_set_block(fs,ifile,i,novo+k) < 0) { //pode precisar de um bloco de referencias
+					dprintf("[fs_writev] no free blocks for the block map.\n");
+					for (; k < got; k++)
+						apagarBloco(fs,novo+k,file);
+					fsi_free_blocks(fs,file,blks_used,i);
+					fsi_mark_inode(fs,file);
+					destrancar(fs,file,ESCRITA);
+					sairFS(fs);
+					return -2;
+				}
 			}
-			BMAP_SET(fs->blk_bmap, *blk);//Colocar o bloco a set
-			fs->referencias[*blk]++;	//adicionar uma referencia ao bloco			
-			dprintf("[fs_write] block %d allocated.\n", *blk);
+			dprintf("[fs_writev] blocks %d to %d allocated.\n", novo, novo+got-1);
+			alvo = novo+got;
 		}
 	}
    
 	char block[BLOCK_SIZE]; //criar um buffer do tamanho de todo o bloco
-	int num = 0, pos;
+	unsigned num = 0;
 	int iblock = offset/BLOCK_SIZE;	//bloco em que comecamos
+	iov_cursor_t cur;
 
-   	// write within the existent blocks
-	while (num < count && iblock < blks_used) { //enquanto nao escrevermos tudo e nao excedermos os blocos usados
-		if(iblock < INODE_NUM_BLKS) { //se o bloco ainda esta dentro do numero max de blocos de cada inode
-			blk = ifile->blocks; //abrir a tabela de blocos do inode do ficheiro
-			pos = iblock; 	//abrir a posicao correcta no bloco
-		}
-		
-		if(ifile->type == FS_FILE)
-			lerCache(fs->cache,blk[pos], block);
-		else
-			block_read(fs->blocks, blk[pos], block);
+	iov_cursor_init(&cur, iov, iovcnt);
 
-		int start = ((num == 0)?(offset % BLOCK_SIZE):0);
-		
-		for (int i = start; i < BLOCK_SIZE && num < count; i++, num++) {
-			block[i] = buffer[num];
-		}
+   	// write within the existent blocks and then within the allocated ones
+	unsigned blk = 0, seguidos = 0; //um copy-on-write so muda o bloco em que estamos
+	while (num < count && iblock < blks_used + blks_req) { //enquanto nao escrevermos tudo
+		if (seguidos == 0) //directo, indirecto ou duplamente indirecto
+			seguidos = fsi_get_run(fs,ifile,iblock,blks_used+blks_req-iblock,&blk);
 		
-		if(ifile->type == FS_FILE)
-			escreverBloco(fs, blk[pos],file,block);
-		else 
-			block_write(fs->blocks, blk[pos], block);
-		iblock++;
-	}
-
-	dprintf("[fs_write] written %d bytes within.\n", num);
-
-  	// write within the allocated blocks
-	while (num < count && iblock < blks_used + blks_req) {
-		if(iblock < INODE_NUM_BLKS) {
-			blk = ifile->blocks;
-			pos = iblock;
-		}
-      
-		for (int i = 0; i < BLOCK_SIZE && num < count; i++, num++) {
-			block[i] = buffer[num];
+		int start = ((num == 0)?(offset % BLOCK_SIZE):0);
+		int len = MIN(BLOCK_SIZE - start, count - num);
+		char* src = iov_cursor_contig(&cur, BLOCK_SIZE);
+
+		if (len == BLOCK_SIZE && src != NULL) {
+			//bloco reescrito por inteiro: nao e preciso ler o conteudo antigo
+			escreverBloco(fs, blk,file,iblock,src);
+			iov_cursor_skip(&cur, BLOCK_SIZE);
+		} else {
+			if (iblock < blks_used)
+				lerCache(fs->cache,blk, block);
+			else
+				memset(block, 0, BLOCK_SIZE); //bloco novo
+			iov_copy_in(&cur, &block[start], len);
+			escreverBloco(fs, blk,file,iblock,block);
 		}
-		if(ifile->type == FS_FILE)
-			escreverBloco(fs, blk[pos],file,block);
-		else
-			block_write(fs->blocks, blk[pos], block);
+		num += len;
 		iblock++;
+		blk++;
+		seguidos--;
 	}
 
 	if (num != count) {
-		printf("[fs_write] severe error: num=%d != count=%d!\n", num, count);
-		terminaEscrita(fs);
+		printf("[fs_writev] severe error: num=%d != count=%d!\n", num, count);
+		destrancar(fs,file,ESCRITA);
+		sairFS(fs);
 		exit(-1);
 	}
 
 	ifile->size = MAX(offset + count, ifile->size);
 
-   	// update the inode in disk
-	fsi_store_fsdata(fs);
-
-	dprintf("[fs_write] written %d bytes, file size %d.\n", count, ifile->size);	
-	terminaEscrita(fs);
+   	// update the inode in disk (the block bitmap marks its own blocks)
+	fsi_mark_inode(fs,file);
+	dprintf("[fs_writev] written %d bytes, file size %d.\n", count, ifile->size);	
+	destrancar(fs,file,ESCRITA);
+	sairFS(fs);
 	return 0;
 }
 
+/*Versao gather de fs_write: escreve a concatenacao dos buffers de "iov".
+ * Um bloco que e reescrito por inteiro a partir de um so iovec nao e lido
+ * da cache e vai directamente do buffer do chamador para o bloco. Sem
+ * blocos livres, tenta outra vez depois do commit, que liberta os que
+ * estao a espera dele (fsi_blk_free)*/
+int fs_writev(fs_t* fs, inodeid_t file, unsigned offset,
+   const struct iovec* iov, int iovcnt)
+{
+	int r = fsi_writev(fs,file,offset,iov,iovcnt);
+
+	if (r == -2 && fs->num_libertar > 0) {
+		fsi_journal_commit(fs);
+		r = fsi_writev(fs,file,offset,iov,iovcnt);
+	}
+	return r < 0 ? -1 : r;
+}
+
+/*Criar a entrada "file", do tipo "type", no directorio "dir". O chamador
+ * tem o trinco de escrita de "dir" e ja verificou que e um directorio.
+ * O inode novo nao e trancado: fica inicializado antes de ser marcado
+ * (ver fsi_alloc_inode) e so e visivel pelo nome depois de escrita a
+ * entrada, com o trinco do directorio.
+ *   returns: 0 if successful, -1 otherwise
+ */
+static int fsi_create(fs_t* fs, inodeid_t dir, char* file, fs_itype_t type, inodeid_t* fileid)
+{
+   fs_inode_t* idir = &fs->inode_tab[dir];	//abrir o inode do directorio
+
+   if (fsi_dir_search(fs,dir,file,fileid) == 0) { //ver se o ficheiro ja existe dentro do directorio
+      dprintf("[fsi_create] file already exists.\n");
+      return -1;
+   }
+   
+   // reserve and init the new inode
+   unsigned finode;
+   if (!fsi_alloc_inode(fs,type,&finode)) { //procurar um inodes livre
+      dprintf("[fsi_create] there are no free inodes.\n");
+      return -1;
+   }
+
+	dprintf("[fsi_create]inode do ficheiro: %d\n",finode);
+
+   // add a new block to the directory if necessary
+   unsigned slot = idir->size / sizeof(fs_dentry_t);	//posicao da entrada nova
+   unsigned iblock = slot / DIR_PAGE_ENTRIES;
+   fs_dentry_t page[DIR_PAGE_ENTRIES]; //Criar um array de entradas de diretorio
+   if (slot % DIR_PAGE_ENTRIES == 0) { //se o bloco do directorio esta cheio ou vazio:
+      unsigned fblock;
+      if (iblock >= FILE_MAX_BLKS || !fsi_alloc_block(fs,&fblock)) { 	//procurar e reservar um bloco livre
+         dprintf("[fsi_create] no free blocks to augment directory.\n");
+         fsi_free_inode(fs,finode);
+         return -1;
+      }
+      if (fsi_set_block(fs,idir,iblock,fblock) < 0) {	//pode precisar de um bloco de referencias
+         dprintf("[fsi_create] no free blocks for the directory block map.\n");
+         apagarBloco(fs,fblock,dir);
+         fsi_free_inode(fs,finode);
+         return -1;
+      }
+      dprintf("[fsi_create]adicionei o bloco %d ao directorio %d\n",fblock,dir);
+      memset(page,0,sizeof(page));
+   }
+   else
+      lerCache(fs->cache,fsi_get_block(fs,idir,iblock),(char*)page); //ler o bloco do directorio actual
+
+   // add the entry to the directory
+   fs_dentry_t* entry = &page[slot % DIR_PAGE_ENTRIES]; //seleccionar a entrada livre
+   strcpy(entry->name,file);	//dar o nome do ficheiro a essa entrada de directorio
+   entry->inodeid = finode;		//colocar a entrada de directorio a apontar para o inode novo
+   escreverCacheMeta(fs->cache,fsi_get_block(fs,idir,iblock),(char*)page); //escrever o bloco ja com a nova entrada
+   idir->size += sizeof(fs_dentry_t);
+   fsi_dir_idx_add(fs,dir,file,slot);
+   invalidarDCache(fs->dcache,dir);	//os lookups que nao o encontraram ficaram em cache
+
+   // the inode table blocks go to disk with the bitmaps, in the next flush
+   fsi_mark_inode(fs,dir); //actualizar a meta data
+   fsi_mark_inode(fs,finode);
+
+   *fileid = finode;
+   return 0;
+}
+
 /*Criar um ficheiro num directorio especifico
  * 
  * Os atributos iniciais do ficheiro sao dados por "atributes". Se o resultado
@@ -959,7 +2542,7 @@ int fs_create(fs_t* fs, inodeid_t dir, char* file, inodeid_t* fileid)
 {
 	dprintf("[fs_create]Criar o ficheiro %s, no directorio %d\n",file,dir);
 	
-   if (fs == NULL || dir >= ITAB_SIZE || file == NULL || fileid == NULL) {
+   if (fs == NULL || dir >= FS_NUM_INODES(fs) || file == NULL || fileid == NULL) {
       printf("[fs_create] malformed arguments.\n");
       return -1;
    }
@@ -969,83 +2552,28 @@ int fs_create(fs_t* fs, inodeid_t dir, char* file, inodeid_t* fileid)
       return -1;
    }
    
-   iniciaEscrita(fs);
+   entrarFS(fs);
+   trancar(fs,dir,ESCRITA);	//so o directorio: creates noutros directorios correm em paralelo
 
    if (!BMAP_ISSET(fs->inode_bmap,dir)) { //verificar se o inode esta ocupado
       dprintf("[fs_create] inode is not being used.\n");
-      terminaEscrita(fs);
+      destrancar(fs,dir,ESCRITA);
+      sairFS(fs);
       return -1;
    }
 
    fs_inode_t* idir = &fs->inode_tab[dir];	//abrir o inode do directorio
    if (idir->type != FS_DIR) {
       dprintf("[fs_create] inode is not a directory.\n");
-      terminaEscrita(fs);
-      return -1;
-   }
-
-   if (fsi_dir_search(fs,dir,file,fileid) == 0) { //ver se o ficheiro ja existe dentro do directorio
-      dprintf("[fs_create] file already exists.\n");
-      terminaEscrita(fs);
+      destrancar(fs,dir,ESCRITA);
+      sairFS(fs);
       return -1;
    }
-   
-   // check if there are free inodes
-   unsigned finode;
-   if (!fsi_bmap_find_free(fs->inode_bmap,ITAB_SIZE,&finode)) { //procurar um inodes livre
-      dprintf("[fs_create] there are no free inodes.\n");
-      terminaEscrita(fs);
-      return -1;
-   }
-
-	dprintf("[fs_create]inode do ficheiro: %d\n",finode);
-
-   // add a new block to the directory if necessary
-   if (idir->size % BLOCK_SIZE == 0) { //se o bloco do directorio esta cheio ou vazio:
-      unsigned fblock;
-      if (!fsi_bmap_find_free(fs->blk_bmap,block_num_blocks(fs->blocks),&fblock)) { 	//procurar um bloco livre
-         dprintf("[fs_create] no free blocks to augment directory.\n");
-         terminaEscrita(fs);
-         return -1;
-      }
-     ///fs->referencias[fblock]++; apenas necessario no caso da copia de directorios
-      dprintf("[fs_create]adicionei o bloco %d ao directorio %d\n",fblock,dir);
-      BMAP_SET(fs->blk_bmap,fblock); //indifcar que o nosso bloco vai ser utilizado
-      idir->blocks[idir->size / BLOCK_SIZE] = fblock;  //Add nº do novo bloco ao vector de blocos do directorio
-   }
-
-   // add the entry to the directory
-   fs_dentry_t page[DIR_PAGE_ENTRIES]; //Criar um array de entradas de diretorio
-   if(idir->type == FS_FILE)
-		lerCache(fs->cache,idir->blocks[idir->size/BLOCK_SIZE],(char*)page); //ler o bloco do directorio actual
-   else
-		block_read(fs->blocks,idir->blocks[idir->size/BLOCK_SIZE],(char*)page);
-	
-	dprintf("[fs_create]Vou ler o bloco do %d, o conteudo: %s\n\n",idir->blocks[idir->size/BLOCK_SIZE],(char*)page);
-	
-	
-   fs_dentry_t* entry = &page[idir->size % BLOCK_SIZE / sizeof(fs_dentry_t)]; //seleccionar a entrada livre
-   strcpy(entry->name,file);	//dar o nome do ficheiro a essa entrada de directorio
-   entry->inodeid = finode;		//colocar a entrada de directorio a apontar para o inode novo
-   
-   if(idir->type == FS_FILE)
-		escreverBloco(fs,idir->blocks[idir->size/BLOCK_SIZE],dir,(char*)page); //escrever o bloco ja com a nova entrada
-   else
-		block_write(fs->blocks,idir->blocks[idir->size/BLOCK_SIZE],(char*)page);
-		
-	dprintf("[fs_create]Escrevi o bloco %d, com o conteudo: %s\n\n",idir->blocks[idir->size/BLOCK_SIZE],(char*)page);
-   idir->size += sizeof(fs_dentry_t);
 
-   // reserve and init the new file inode
-   BMAP_SET(fs->inode_bmap,finode);	//reservar o inode que associamos ao ficheiro
-   fsi_inode_init(&fs->inode_tab[finode],FS_FILE); //inicializar esse inode como um inode do FILE SYSTEM
-
-   // save the file system metadata
-   fsi_store_fsdata(fs); //actualizar a meta data
-
-   *fileid = finode;
-   terminaEscrita(fs);
-   return 0;
+   int status = fsi_create(fs,dir,file,FS_FILE,fileid);
+   destrancar(fs,dir,ESCRITA);
+   sairFS(fs);
+   return status;
 }
 
 /*Cria o novo directorio "name" no directório "dir". A resposta STAT_OK, indica que o 
@@ -1062,7 +2590,7 @@ int fs_mkdir(fs_t* fs, inodeid_t dir, char* newdir, inodeid_t* newdirid)
 	dprintf("[fs_mkdir] criar um directorio com nome: %s, no directorio: %d\n",newdir,dir);
 	
 	
-	if (fs==NULL || dir>=ITAB_SIZE || newdir==NULL || newdirid==NULL) {
+	if (fs==NULL || dir>=FS_NUM_INODES(fs) || newdir==NULL || newdirid==NULL) {
 		printf("[fs_mkdir] malformed arguments.\n");
 		return -1;
 	}
@@ -1072,74 +2600,27 @@ int fs_mkdir(fs_t* fs, inodeid_t dir, char* newdir, inodeid_t* newdirid)
 		return -1;
 	}
 	
-	iniciaEscrita(fs);
+	entrarFS(fs);
+	trancar(fs,dir,ESCRITA);
 	if (!BMAP_ISSET(fs->inode_bmap,dir)) {
 		printf("[fs_mkdir] inode is not being used.\n");
+		destrancar(fs,dir,ESCRITA);
+		sairFS(fs);
 		return -1;
 	}
 
 	fs_inode_t* idir = &fs->inode_tab[dir];
 	if (idir->type != FS_DIR) {
 		printf("[fs_mkdir] inode is not a directory.\n");
-		terminaEscrita(fs);
-		return -1;
-	}
-
-	if (fsi_dir_search(fs,dir,newdir,newdirid) == 0) {
-		printf("[fs_mkdir] directory already exists.\n");
-		terminaEscrita(fs);
+		destrancar(fs,dir,ESCRITA);
+		sairFS(fs);
 		return -1;
 	}
-   
-   	// check if there are free inodes
-	unsigned finode;
-	if (!fsi_bmap_find_free(fs->inode_bmap,ITAB_SIZE,&finode)) {
-		printf("[fs_mkdir] there are no free inodes.\n");
-		terminaEscrita(fs);
-		return -1;
-	}
-
-   	// add a new block to the directory if necessary
-	if (idir->size % BLOCK_SIZE == 0) {
-		unsigned fblock;
-		if (!fsi_bmap_find_free(fs->blk_bmap,block_num_blocks(fs->blocks),&fblock)) {
-			printf("[fs_mkdir] no free blocks to augment directory.\n");
-			terminaEscrita(fs);
-			return -1;
-		}
-		///fs->referencias[fblock]++; apenas necessario no caso da copia de directorios
-		BMAP_SET(fs->blk_bmap,fblock);
-		idir->blocks[idir->size / BLOCK_SIZE] = fblock;
-	}
-
-   	// add the entry to the directory
-	fs_dentry_t page[DIR_PAGE_ENTRIES];
-	if(idir->type == FS_FILE)
-		lerCache(fs->cache,idir->blocks[idir->size/BLOCK_SIZE],(char*)page);
-	else
-		block_read(fs->blocks,idir->blocks[idir->size/BLOCK_SIZE],(char*)page);
-		
-	fs_dentry_t* entry = &page[idir->size % BLOCK_SIZE / sizeof(fs_dentry_t)];
-	strcpy(entry->name,newdir);
-	entry->inodeid = finode;
-	
-	if(idir->type == FS_FILE)
-		escreverBloco(fs,idir->blocks[idir->size/BLOCK_SIZE],dir,(char*)page);
-	else	
-		block_write(fs->blocks,idir->blocks[idir->size/BLOCK_SIZE],(char*)page);
-		
-	idir->size += sizeof(fs_dentry_t);
-
-   	// reserve and init the new file inode
-	BMAP_SET(fs->inode_bmap,finode);
-	fsi_inode_init(&fs->inode_tab[finode],FS_DIR);
 
-   	// save the file system metadata
-	fsi_store_fsdata(fs);
-
-	*newdirid = finode;
-	terminaEscrita(fs);
-	return 0;
+	int status = fsi_create(fs,dir,newdir,FS_DIR,newdirid);
+	destrancar(fs,dir,ESCRITA);
+	sairFS(fs);
+	return status;
 }
 
 /*				LER DIRECTORIO
@@ -1150,24 +2631,27 @@ int fs_mkdir(fs_t* fs, inodeid_t dir, char* newdir, inodeid_t* newdirid)
 int fs_readdir(fs_t* fs, inodeid_t dir, fs_file_name_t* entries, int maxentries,
    int* numentries)
 {
-   if (fs == NULL || dir >= ITAB_SIZE || entries == NULL ||
+   if (fs == NULL || dir >= FS_NUM_INODES(fs) || entries == NULL ||
       numentries == NULL || maxentries < 0) {
       printf("[fs_readdir] malformed arguments.\n");
       return -1;
    }
 
-	iniciaLeitura(fs);
+	entrarFS(fs);
+	trancar(fs,dir,LEITURA);
 	
    if (!BMAP_ISSET(fs->inode_bmap,dir)) {
       printf("[fs_readdir] inode is not being used.\n");
-      terminaLeitura(fs);
+      destrancar(fs,dir,LEITURA);
+      sairFS(fs);
       return -1;
    }
 
    fs_inode_t* idir = &fs->inode_tab[dir];
    if (idir->type != FS_DIR) {
       printf("[fs_readdir] inode is not a directory.\n");
-       terminaLeitura(fs);
+       destrancar(fs,dir,LEITURA);
+       sairFS(fs);
       return -1;
    }
 
@@ -1177,10 +2661,7 @@ int fs_readdir(fs_t* fs, inodeid_t dir, fs_file_name_t* entries, int maxentries,
    int iblock = 0, ientry = 0;
 
    while (num > 0) {
-	   if(idir->type == FS_FILE)
-			lerCache(fs->cache,idir->blocks[iblock++],(char*)page);
-	   else
-			block_read(fs->blocks,idir->blocks[iblock++],(char*)page);
+		lerCache(fs->cache,fsi_get_block(fs,idir,iblock++),(char*)page);
 		
       for (int i = 0; i < DIR_PAGE_ENTRIES && num > 0; i++, num--) {
          strcpy(entries[ientry].name, page[i].name);
@@ -1189,7 +2670,8 @@ int fs_readdir(fs_t* fs, inodeid_t dir, fs_file_name_t* entries, int maxentries,
       }
    }
    *numentries = ientry;
-    terminaLeitura(fs);
+    destrancar(fs,dir,LEITURA);
+    sairFS(fs);
    return 0;
 }
 /*NOSSA IMPLEMENTACAO
@@ -1216,9 +2698,8 @@ Por fim apagar o inode de dentro do directorio
 int fs_remove(fs_t* fs, inodeid_t directorio, char* nomeFicheiro, inodeid_t* fileHandler){
 	
 	dprintf("[fs_remove] START: remover ficheiro %s, do directorio %d\n",nomeFicheiro,directorio);
-	int i;
 	
-	if (fs==NULL || directorio>=ITAB_SIZE || nomeFicheiro==NULL || fileHandler==NULL) {
+	if (fs==NULL || directorio>=FS_NUM_INODES(fs) || nomeFicheiro==NULL || fileHandler==NULL) {
 		printf("[fs_remove] malformed arguments.\n");
 		return -1;
 	}
@@ -1229,11 +2710,13 @@ int fs_remove(fs_t* fs, inodeid_t directorio, char* nomeFicheiro, inodeid_t* fil
 		return -1;
 	}
 	
-	iniciaEscrita(fs);
+	entrarFS(fs);
+	trancar(fs,directorio,ESCRITA);
 	//verificar se o directorio existe
 	if (!BMAP_ISSET(fs->inode_bmap,directorio)) {
 		printf("[fs_remove] inode is not being used.\n");
-		terminaEscrita(fs);
+		destrancar(fs,directorio,ESCRITA);
+		sairFS(fs);
 		return -1;
 	}
 
@@ -1242,16 +2725,20 @@ int fs_remove(fs_t* fs, inodeid_t directorio, char* nomeFicheiro, inodeid_t* fil
 	
 	if (idirectorio->type != FS_DIR) {
 		printf("[fs_remove] inode is not a directory.\n");
-		terminaEscrita(fs);
+		destrancar(fs,directorio,ESCRITA);
+		sairFS(fs);
 		return -1;
 	}
 	
 	inodeid_t idFile;
+	unsigned slot;	//posicao da entrada no directorio
+	int pos;		//e no indice
 	
 	//procurar o id do inode do ficheiro		(newFileHandle e o id do ficheiro*/
-	if (fsi_dir_search(fs,directorio,nomeFicheiro,&idFile) != 0) {		
+	if (fsi_dir_find(fs,directorio,nomeFicheiro,&idFile,&slot,&pos) != 0) {		
 		printf("[fs_remove] file doesn't exist.\n");
-		terminaEscrita(fs);
+		destrancar(fs,directorio,ESCRITA);
+		sairFS(fs);
 		return -1;
 	}	
 	
@@ -1259,130 +2746,84 @@ int fs_remove(fs_t* fs, inodeid_t directorio, char* nomeFicheiro, inodeid_t* fil
 	dprintf("[fs_remove]ficheiro na inode_tab: %d\n",idFile);
    
    
+	//trancar a entrada. Um subdirectorio com inode menor que o pai obriga
+	//a largar o pai, para os directorios serem trancados por ordem crescente
+	if (fs->inode_tab[idFile].type == FS_DIR && idFile < directorio) {
+		destrancar(fs,directorio,ESCRITA);
+		trancarDois(fs,idFile,ESCRITA,directorio,ESCRITA);
+		inodeid_t idConfirmado;
+		if (!BMAP_ISSET(fs->inode_bmap,directorio) || idirectorio->type != FS_DIR ||
+		    fsi_dir_find(fs,directorio,nomeFicheiro,&idConfirmado,&slot,&pos) != 0 || idConfirmado != idFile) {
+			printf("[fs_remove] directory changed while removing.\n");
+			destrancarDois(fs,directorio,ESCRITA,idFile,ESCRITA);
+			sairFS(fs);
+			return -1;
+		}
+	}
+	else
+		trancar(fs,idFile,ESCRITA);
+   
    //Abrir o inode do ficheiro
    fs_inode_t* ifile = &fs->inode_tab[idFile];
    if(ifile->type == FS_DIR){
 	   dprintf("[fs_remove] Vou remover um DIRECTORIO");
 	   if(ifile->size != 0){
 			printf("[fs_remove] Remoção de um directorio nao vazio, por favor remova o conteudo primeiro\n");
-			terminaEscrita(fs);
+			destrancarDois(fs,directorio,ESCRITA,idFile,ESCRITA);
+			sairFS(fs);
 			return -1;
 		}
    }
    
    
-    //Vamos formatar os blocos que o inode estava a ocupar e declara-los como livres
-	int blocosOcupados = OFFSET_TO_BLOCKS(ifile->size);	//numero de blocos ocupados
-    
-    int idBlock;
-    
-	for(i = 0; i < blocosOcupados; i++){
-		idBlock = ifile->blocks[i];	//obter o numero de bloco
-		if(idBlock < 10){
-			printf("[fs_remove] Nao pode remover um bloco do sistema de ficheiros");
-			terminaEscrita(fs);
-			return -1;
-		}
-			apagarBloco(fs,idBlock,idFile);	//solicitar remocao do bloco
-			ifile->blocks[i] = 0;	//destruir o ponteiro do inode
-   }
+    //Vamos formatar os blocos que o inode estava a ocupar (e os de referencias) e declara-los como livres
+	fsi_free_blocks(fs,idFile,0,OFFSET_TO_BLOCKS(ifile->size));
+	if(ifile->type == FS_DIR){
+		fsi_dir_idx_free(fs,idFile);
+		invalidarDCache(fs->dcache,idFile);	//o inode pode voltar a ser um directorio
+	}
    
    
 	//Apagar da entrada de directorio: (substituindo-a pela ultima entrada do directorio)
-	//calcular a localizacao da entrada
-	int idEntradaDirectorio = -1;
-	fs_dentry_t ficheirosContidos[DIR_PAGE_ENTRIES];	//Criar um bloco constituido por entradas de directorio
-	int num = idirectorio->size / sizeof(fs_dentry_t);	//numero de dentrys que o inode tem
-	int stop = 1, iblock = 0;	//comecar a ler do bloco 0
-	
-	if(num == 1){	//se somos a unica entrada do directorio, podemos apagar o bloco
-		apagarBloco(fs,idirectorio->blocks[iblock],directorio);
-		idirectorio->blocks[iblock] = 0;	//destruir o ponteiro do idirectory			
-	}
-	else{	//procurar a entrada
-		while (num > 0 && stop) {
-			if(idirectorio->type == FS_FILE)
-				lerCache(fs->cache,idirectorio->blocks[iblock],(char*)ficheirosContidos);//ler id's dos do inode de directoria para um vector de entradas de directorio
-			else
-				block_read(fs->blocks,idirectorio->blocks[iblock],(char*)ficheirosContidos);
-				
-			for (int i = 0; i < DIR_PAGE_ENTRIES && num > 0; i++, num--) { 
-				if (strcmp(ficheirosContidos[i].name,nomeFicheiro) == 0) {	//verificar se a entrada de directorio tem o nome do ficheiro
-					dprintf("[fs_remove]O FICHEIRO TEM ID: %d\n",ficheirosContidos[i].inodeid);
-					idEntradaDirectorio = i;	//i e a entrada do dentry no bloco
-					stop = 0;
-					//break;
-				}
-			}
-			iblock++;
-		}
-		
-		if(idEntradaDirectorio == -1){
-			printf("[fs_remove] Nao encontrou entrada do ficheiro no directorio");
-			terminaEscrita(fs);
-			return -1;
-		}
-   
-   //a entrada a eliminar localiza-se no bloco iblock e no indice i
-    fs_dentry_t* entrada = &ficheirosContidos[idEntradaDirectorio];
-
+	unsigned ultima = idirectorio->size / sizeof(fs_dentry_t) - 1;	//posicao da ultima entrada
+	fs_dentry_t entrada;
 	
-	//procurar a ultima entrada, troca-la com esta e eliminar a ultima entrada
-	//obter a ultima entrada de ficheiros do directorio
-	num = idirectorio->size / sizeof(fs_dentry_t);	//numero de dentrys que o inode tem
-	int idUltimaEntrada;
-	int ultimoBloco = num/DIR_PAGE_ENTRIES;		//indice do ultimo bloco
-	if(ultimoBloco == 0)
-		idUltimaEntrada = num-1;
-	else
-		idUltimaEntrada = (num-1) %(ultimoBloco*DIR_PAGE_ENTRIES);	//indice da ultima entrada
-		
-	if(!(ultimoBloco == 0 && idUltimaEntrada == 0)){		//se nao estamos a remover a unica entrada do directorio, substituimos pela ultima
-		fs_dentry_t entradasUltimoBloco[DIR_PAGE_ENTRIES];
-		
-		if(idirectorio->type == FS_FILE)
-			lerCache(fs->cache,idirectorio->blocks[ultimoBloco],(char*)entradasUltimoBloco);	//ler o ultimo bloco
-		else
-			block_read(fs->blocks,idirectorio->blocks[ultimoBloco],(char*)entradasUltimoBloco);	//ler o ultimo bloco
-
-		fs_dentry_t* ultimo = &entradasUltimoBloco[idUltimaEntrada];
-		strcpy(entrada->name,ultimo->name);
-		entrada->inodeid = ultimo->inodeid;
-	
-		if(idUltimaEntrada == 0){ //eliminamos a ultima entrada de um bloco que nao o primeiro, temos de libertar este bloco
-			apagarBloco(fs,idirectorio->blocks[ultimoBloco],directorio);
-				idirectorio->blocks[ultimoBloco] = 0;	//destruir o ponteiro do idirectory
-				
-		}
-		else{
-			strcpy(ultimo->name,""); //escrever lixo para garantir que os dados sao apagados
-			ultimo->inodeid = -1;
-				escreverBloco(fs,idirectorio->blocks[ultimoBloco],directorio,(char*)entradasUltimoBloco);	//escrever o bloco com a ultima entrada eliminada
-		}
-	}
-	else{	//unica entrada, podemos apagar o bloco do directorio
-		apagarBloco(fs,idirectorio->blocks[iblock],directorio);
+	if(pos >= 0)
+		fsi_dir_idx_del(fs,idirectorio,pos);
+	if(slot != ultima){	//a ultima passa para o lugar da que sai
+		fsi_dentry_read(fs,idirectorio,ultima,&entrada);
+		fsi_dentry_write(fs,directorio,slot,&entrada);
+		if(pos >= 0)
+			fsi_dir_idx_move(fs,idirectorio,entrada.name,ultima,slot);
 	}
+	
+	if(ultima % DIR_PAGE_ENTRIES == 0) //era a unica entrada do ultimo bloco, temos de libertar este bloco
+		fsi_free_blocks(fs,directorio,ultima / DIR_PAGE_ENTRIES,ultima / DIR_PAGE_ENTRIES + 1);
+	else{
+		strcpy(entrada.name,""); //escrever lixo para garantir que os dados sao apagados
+		entrada.inodeid = -1;
+		fsi_dentry_write(fs,directorio,ultima,&entrada);	//escrever o bloco com a ultima entrada eliminada
 	}
+	invalidarDCache(fs->dcache,directorio);
 	idirectorio->size -= sizeof(fs_dentry_t);	//subtrair o tamanho da entrada que retiramos do bloco
 	
 	
-	fsi_inode_init(ifile,0);
-	
 	//Inode do directorio: directorio
 	//inode do ficheiro: idFile
 	
 	//Apagar o inode do ficheiro	
-	BMAP_CLR(fs->inode_bmap,idFile);	//colocar o inode do ficheiro como livre
+	fsi_free_inode(fs,idFile);	//colocar o inode do ficheiro como livre
 
 	dprintf("[fs_remove]directorio na inode_tab: %d\n",directorio);
 	dprintf("[fs_remove]ficheiro na inode_tab: %d\n",idFile);
 	
 	// save the file system metadata
-   fsi_store_fsdata(fs);		//actualizar a meta data
+   fsi_mark_inode(fs,directorio);		//actualizar a meta data
+   fsi_mark_inode(fs,idFile);
 	
 	*fileHandler = idFile;
-	terminaEscrita(fs);
+	destrancarDois(fs,directorio,ESCRITA,idFile,ESCRITA);
+	sairFS(fs);
    return 0;
   }
  
@@ -1406,7 +2847,7 @@ int fs_copy(fs_t* fs, inodeid_t dirOrigem, char* nomeOrigem,inodeid_t dirDestino
 	5º Obter o handler do destino
 	*/
 	
-	if (fs==NULL || dirOrigem>=ITAB_SIZE || nomeOrigem==NULL || fileHandler==NULL) {
+	if (fs==NULL || dirOrigem>=FS_NUM_INODES(fs) || nomeOrigem==NULL || fileHandler==NULL) {
 		printf("[fs_copy] malformed source arguments.\n");
 		return -1;
 	}
@@ -1418,11 +2859,13 @@ int fs_copy(fs_t* fs, inodeid_t dirOrigem, char* nomeOrigem,inodeid_t dirDestino
 		return -1;
 	}
 
-	iniciaEscrita(fs);
+	entrarFS(fs);
+	trancarDois(fs,dirOrigem,LEITURA,dirDestino,ESCRITA);	//directorios por ordem crescente
 	//verificar se o directorio de origem existe
 	if (!BMAP_ISSET(fs->inode_bmap,dirOrigem)) {
 		printf("[fs_copy] inode is not being used.\n");
-		terminaEscrita(fs);
+		destrancarDois(fs,dirOrigem,LEITURA,dirDestino,ESCRITA);
+		sairFS(fs);
 		return -1;
 	}
 	
@@ -1430,14 +2873,16 @@ int fs_copy(fs_t* fs, inodeid_t dirOrigem, char* nomeOrigem,inodeid_t dirDestino
 	
 	if (iDirOrigem->type != FS_DIR) {
 		printf("[fs_copy] inode directory source is not a directory.\n");
-		terminaEscrita(fs);
+		destrancarDois(fs,dirOrigem,LEITURA,dirDestino,ESCRITA);
+		sairFS(fs);
 		return -1;
 	}
 	
 	//verificar o nome do ficheiro de origem
 	if (strlen(nomeOrigem) == 0 || strlen(nomeOrigem)+1 > FS_MAX_FNAME_SZ){
 		printf("[fs_copy] source directory size error.\n");
-		terminaEscrita(fs);
+		destrancarDois(fs,dirOrigem,LEITURA,dirDestino,ESCRITA);
+		sairFS(fs);
 		return -1;
 	}
 	
@@ -1445,7 +2890,8 @@ int fs_copy(fs_t* fs, inodeid_t dirOrigem, char* nomeOrigem,inodeid_t dirDestino
 	//procurar o id do inode do ficheiro de origem	*/
 	if (fsi_dir_search(fs,dirOrigem,nomeOrigem,&idFileOrigem) != 0) {		
 		printf("[fs_copy] file source doesn't exist.\n");
-		terminaEscrita(fs);
+		destrancarDois(fs,dirOrigem,LEITURA,dirDestino,ESCRITA);
+		sairFS(fs);
 		return -1;
 	}	
 	
@@ -1454,7 +2900,8 @@ int fs_copy(fs_t* fs, inodeid_t dirOrigem, char* nomeOrigem,inodeid_t dirDestino
    fs_inode_t* iFileOrigem = &fs->inode_tab[idFileOrigem];
    if(iFileOrigem->type != FS_FILE){
 	   printf("[fs_copy] Copia de directorios nao suportada\n");
-	   terminaEscrita(fs);
+	   destrancarDois(fs,dirOrigem,LEITURA,dirDestino,ESCRITA);
+	   sairFS(fs);
 	   return -1;
    }
    
@@ -1462,14 +2909,16 @@ int fs_copy(fs_t* fs, inodeid_t dirOrigem, char* nomeOrigem,inodeid_t dirDestino
 	//verificar o nome do ficheiro do destino
 	if (strlen(nomeDestino) == 0 || strlen(nomeDestino)+1 > FS_MAX_FNAME_SZ){
 		printf("[fs_copy] destination directory size error.\n");
-		terminaEscrita(fs);
+		destrancarDois(fs,dirOrigem,LEITURA,dirDestino,ESCRITA);
+		sairFS(fs);
 		return -1;
 	}
 	
 	//verificar se o directorio de destino existe
 	if (!BMAP_ISSET(fs->inode_bmap,dirDestino)) {
 		printf("[fs_copy] inode destination is not being used.\n");
-		terminaEscrita(fs);
+		destrancarDois(fs,dirOrigem,LEITURA,dirDestino,ESCRITA);
+		sairFS(fs);
 		return -1;
 	}
 	
@@ -1477,23 +2926,19 @@ int fs_copy(fs_t* fs, inodeid_t dirOrigem, char* nomeOrigem,inodeid_t dirDestino
 	
 	if (iDirDestino->type != FS_DIR) {
 		printf("[fs_copy] inode directory destination is not a directory.\n");
-		terminaEscrita(fs);
+		destrancarDois(fs,dirOrigem,LEITURA,dirDestino,ESCRITA);
+		sairFS(fs);
 		return -1;
 	}
 
 	inodeid_t idFileDestino;
 	//procurar o id do inode do ficheiro de destino		*/
 	if (fsi_dir_search(fs,dirDestino,nomeDestino,&idFileDestino) != 0) {
-		terminaEscrita(fs);	//vamos criar um ficheiro novo
-		if((fs_create(fs,dirDestino,nomeDestino,&idFileDestino)) == -1){	//se nao existe, criar ficheiro novo		
-			printf("[fs_copy] Erro ao criar o ficheiro de destino\n");
-			terminaEscrita(fs);
-			return -1;
-		}
-		iniciaEscrita(fs);	//voltar a ter exclusividade
-		if(fsi_dir_search(fs,dirDestino,nomeDestino,&idFileDestino) != 0){ //confirmar que o ficheiro foi criado
+		//se nao existe, criar ficheiro novo (ja temos o trinco de escrita do directorio)
+		if(fsi_create(fs,dirDestino,nomeDestino,FS_FILE,&idFileDestino) == -1){
 			printf("[fs_copy] Erro ao criar o ficheiro de destino\n");
-			terminaEscrita(fs);
+			destrancarDois(fs,dirOrigem,LEITURA,dirDestino,ESCRITA);
+			sairFS(fs);
 			return -1;
 		}
 	}	
@@ -1503,16 +2948,22 @@ int fs_copy(fs_t* fs, inodeid_t dirOrigem, char* nomeOrigem,inodeid_t dirDestino
     fs_inode_t* iFileDestino = &fs->inode_tab[idFileDestino];
 	if(iFileDestino->type != FS_FILE){
 	   printf("[fs_copy] O destino e um directorio");
-	   terminaEscrita(fs);
+	   destrancarDois(fs,dirOrigem,LEITURA,dirDestino,ESCRITA);
+	   sairFS(fs);
 	   return -1;
    }
+   
+	if(idFileDestino == idFileOrigem){	//copiar um ficheiro para si proprio nao muda nada
+		*fileHandler = idFileDestino;
+		destrancarDois(fs,dirOrigem,LEITURA,dirDestino,ESCRITA);
+		sairFS(fs);
+		return 0;
+	}
+	trancarDois(fs,idFileOrigem,LEITURA,idFileDestino,ESCRITA);	//ficheiros depois dos directorios
      
      //garantir que o destino se existir, e substituido
- 	int numBlocoSubs = OFFSET_TO_BLOCKS(iFileDestino->size);
-			
-	for(int k = 0; k<numBlocoSubs;k++){
-		apagarBloco(fs,iFileDestino->blocks[k],idFileDestino);
-	}
+	fsi_free_blocks(fs,idFileDestino,0,OFFSET_TO_BLOCKS(iFileDestino->size));
+	iFileDestino->size = 0;
 	
    	dprintf("[fs_copy]Origem: directorio %d, inode ficheiro %d\n",dirOrigem,idFileOrigem);
 	dprintf("[fs_copy]Destino: directorio %d, inode ficheiro %d\n",dirDestino,idFileDestino);
@@ -1532,13 +2983,29 @@ int fs_copy(fs_t* fs, inodeid_t dirOrigem, char* nomeOrigem,inodeid_t dirDestino
 	int num = OFFSET_TO_BLOCKS(iFileOrigem->size);
 	int i;
 	
+	//os blocos de dados sao partilhados; os de referencias do destino sao novos
 	for(i = 0; i < num;i++){
-		iFileDestino->blocks[i] = iFileOrigem->blocks[i];	//copiar a referencia para o bloco
-		fs->referencias[iFileDestino->blocks[i]]++;//adicionar referencia do destino ao bloco
+		unsigned idBloco = fsi_get_block(fs,iFileOrigem,i);
+		if(fsi_set_block(fs,iFileDestino,i,idBloco) < 0){	//copiar a referencia para o bloco
+			printf("[fs_copy] Nao ha blocos livres para o mapa do destino\n");
+			fsi_free_blocks(fs,idFileDestino,0,i);
+			fsi_mark_inode(fs,idFileDestino);
+			destrancarDois(fs,idFileOrigem,LEITURA,idFileDestino,ESCRITA);
+			destrancarDois(fs,dirOrigem,LEITURA,dirDestino,ESCRITA);
+			sairFS(fs);
+			return -1;
+		}
+		sthread_mutex_lock(fs->trincoBitmaps);	//as referencias sao partilhadas com outros ficheiros
+		fs->referencias[idBloco]++;//adicionar referencia do destino ao bloco
+		sthread_mutex_unlock(fs->trincoBitmaps);
 	}
 	iFileDestino->size = iFileOrigem->size;
+	*fileHandler = idFileDestino;
 	
-	terminaEscrita(fs);
+	fsi_mark_inode(fs,idFileDestino);
+	destrancarDois(fs,idFileOrigem,LEITURA,idFileDestino,ESCRITA);
+	destrancarDois(fs,dirOrigem,LEITURA,dirDestino,ESCRITA);
+	sairFS(fs);
 	return 0;
 	
 }	
@@ -1555,7 +3022,7 @@ int fs_append(fs_t* fs, inodeid_t dirOrigem, char* nomeOrigem,inodeid_t dirDesti
 	
 	dprintf("[fs_append] INICIAR Apend: dirOrigem: %d , nomeOrigem: %s , dirDestino: %d ,nomeDestino: %s\n",dirOrigem,nomeOrigem,dirDestino,nomeDestino);
 
-	if (fs==NULL || dirOrigem>=ITAB_SIZE || nomeOrigem==NULL || fileHandler==NULL) {
+	if (fs==NULL || dirOrigem>=FS_NUM_INODES(fs) || nomeOrigem==NULL || fileHandler==NULL) {
 		printf("[fs_append] malformed source arguments.\n");
 		return -1;
 	}
@@ -1567,11 +3034,13 @@ int fs_append(fs_t* fs, inodeid_t dirOrigem, char* nomeOrigem,inodeid_t dirDesti
 		return -1;
 	}
 	
-	iniciaEscrita(fs);
+	entrarFS(fs);
+	trancarDois(fs,dirOrigem,LEITURA,dirDestino,LEITURA);	//directorios por ordem crescente
 	//verificar se o directorio de origem existe
 	if (!BMAP_ISSET(fs->inode_bmap,dirOrigem)) {
 		printf("[fs_append] directory not exist.\n");
-		terminaEscrita(fs);
+		destrancarDois(fs,dirOrigem,LEITURA,dirDestino,LEITURA);
+		sairFS(fs);
 		return -1;
 	}
 
@@ -1579,14 +3048,16 @@ int fs_append(fs_t* fs, inodeid_t dirOrigem, char* nomeOrigem,inodeid_t dirDesti
 
 	if (iDirOrigem->type != FS_DIR) {
 		printf("[fs_append] inode directory source is not a directory.\n");
-		terminaEscrita(fs);
+		destrancarDois(fs,dirOrigem,LEITURA,dirDestino,LEITURA);
+		sairFS(fs);
 		return -1;
 	}
 	inodeid_t idFileOrigem;
 	//procurar o id do inode do ficheiro de origem	*/
 	if (fsi_dir_search(fs,dirOrigem,nomeOrigem,&idFileOrigem) != 0) {
 		printf("[fs_append] file source doesn't exist.\n");
-		terminaEscrita(fs);
+		destrancarDois(fs,dirOrigem,LEITURA,dirDestino,LEITURA);
+		sairFS(fs);
 		return -1;
 	}
 
@@ -1594,7 +3065,8 @@ int fs_append(fs_t* fs, inodeid_t dirOrigem, char* nomeOrigem,inodeid_t dirDesti
 	 fs_inode_t* iFileOrigem = &fs->inode_tab[idFileOrigem];
 	 if(iFileOrigem->type != FS_FILE){
 		 printf("[fs_append] inode que pretende fazer append nao e um ficheiro");
-		 terminaEscrita(fs);
+		 destrancarDois(fs,dirOrigem,LEITURA,dirDestino,LEITURA);
+		 sairFS(fs);
 		 return -1;
 	 }
 
@@ -1602,14 +3074,16 @@ int fs_append(fs_t* fs, inodeid_t dirOrigem, char* nomeOrigem,inodeid_t dirDesti
 	 //verificar o nome do segundo ficheiro
 	 if (strlen(nomeDestino) == 0 || strlen(nomeDestino)+1 > FS_MAX_FNAME_SZ){
 	 	printf("[fs_append] destination directory size error.\n");
-	 	terminaEscrita(fs);
+	 	destrancarDois(fs,dirOrigem,LEITURA,dirDestino,LEITURA);
+	 	sairFS(fs);
 	 	return -1;
 	 }
 
 	 //verificar se o directorio de segundo ficheiro existe
 	 if (!BMAP_ISSET(fs->inode_bmap,dirDestino)) {
 	 	printf("[fs_append] inode destination is not being used.\n");
-	 	terminaEscrita(fs);
+	 	destrancarDois(fs,dirOrigem,LEITURA,dirDestino,LEITURA);
+	 	sairFS(fs);
 	 	return -1;
 	 }
 
@@ -1617,7 +3091,8 @@ int fs_append(fs_t* fs, inodeid_t dirOrigem, char* nomeOrigem,inodeid_t dirDesti
 
 	 if (iDirDestino->type != FS_DIR) {
 	 	printf("[fs_append] inode directory destination is not a directory.\n");
-	 	terminaEscrita(fs);
+	 	destrancarDois(fs,dirOrigem,LEITURA,dirDestino,LEITURA);
+	 	sairFS(fs);
 	 	return -1;
 	}
 
@@ -1625,17 +3100,20 @@ int fs_append(fs_t* fs, inodeid_t dirOrigem, char* nomeOrigem,inodeid_t dirDesti
 	 //procurar o id do inode do segundo ficheiro		*/
 	 if (fsi_dir_search(fs,dirDestino,nomeDestino,&idFileDestino) != 0) {
 	 	printf("[fs_append] erro, o ficheiro de destino nao foi criado\n");
-	 	terminaEscrita(fs);
+	 	destrancarDois(fs,dirOrigem,LEITURA,dirDestino,LEITURA);
+	 	sairFS(fs);
 		return -1;
 	}
 
 	fs_inode_t* iFileDestino = &fs->inode_tab[idFileDestino];
-	 if(iFileOrigem->type != FS_FILE){
+	 if(iFileDestino->type != FS_FILE){
 		 printf("[fs_append] inode para onde pretende copiar nao e um ficheiro");
-		 terminaEscrita(fs);
+		 destrancarDois(fs,dirOrigem,LEITURA,dirDestino,LEITURA);
+		 sairFS(fs);
 	 	 return -1;
 	   }
 
+	 trancarDois(fs,idFileOrigem,ESCRITA,idFileDestino,LEITURA);	//ficheiros depois dos directorios
 	 dprintf("[fs_append]1º: directorio %d, inode ficheiro %d\n",dirOrigem,idFileOrigem);
 	 dprintf("[fs_append]2º: directorio %d, inode ficheiro %d\n",dirDestino,idFileDestino);
 
@@ -1645,173 +3123,373 @@ int fs_append(fs_t* fs, inodeid_t dirOrigem, char* nomeOrigem,inodeid_t dirDesti
 	 int num2 = OFFSET_TO_BLOCKS(iFileDestino->size);
 
 	 dprintf("[fs_append]freepointers file1: %d   file2 :%d\n", num, num2);
-	 if(INODE_NUM_BLKS-num < num2){
+	 if(FILE_MAX_BLKS-num < num2){
 		 printf("[fs_append] File Will not Fit\n");
-		 terminaEscrita(fs);
+		 destrancarDois(fs,idFileOrigem,ESCRITA,idFileDestino,LEITURA);
+		 destrancarDois(fs,dirOrigem,LEITURA,dirDestino,LEITURA);
+		 sairFS(fs);
 		return -1;
 	 }
 
 	 //Fazer a copia das referencias
 	 for(int a=0;a<num2;++a){
-		 iFileOrigem->blocks[num+a] = iFileDestino->blocks[a];
-		 fs->referencias[iFileDestino->blocks[a]]++;//adicionar referencia do destino ao bloco
+		 unsigned idBloco = fsi_get_block(fs,iFileDestino,a);
+		 if(fsi_set_block(fs,iFileOrigem,num+a,idBloco) < 0){	//pode precisar de um bloco de referencias
+			 printf("[fs_append] Nao ha blocos livres para o mapa do ficheiro\n");
+			 fsi_free_blocks(fs,idFileOrigem,num,num+a);	//desfazer: o ficheiro fica como estava
+			 fsi_mark_inode(fs,idFileOrigem);
+			 destrancarDois(fs,idFileOrigem,ESCRITA,idFileDestino,LEITURA);
+			 destrancarDois(fs,dirOrigem,LEITURA,dirDestino,LEITURA);
+			 sairFS(fs);
+			 return -1;
+		 }
+		 sthread_mutex_lock(fs->trincoBitmaps);
+		 fs->referencias[idBloco]++;//adicionar referencia do destino ao bloco
+		 sthread_mutex_unlock(fs->trincoBitmaps);
 	 }
 	 //mandar o novo tamanho do ficheiro
 	 iFileOrigem->size += iFileDestino->size;
 	 *fsize = iFileOrigem->size;
 	 dprintf("[fs_append] new file size %u\n",*fsize);
+	 fsi_mark_inode(fs,idFileOrigem);	//pode ter reservado blocos de referencias
 	 //imprimirInodeTab(fs);
-	 terminaEscrita(fs);
+	 destrancarDois(fs,idFileOrigem,ESCRITA,idFileDestino,LEITURA);
+	 destrancarDois(fs,dirOrigem,LEITURA,dirDestino,LEITURA);
+	 sairFS(fs);
 	 return 0;
 }
 
 
 /* //SNFS_defrag
-* Efectua a operacao de desfragmentacao do disco.
-* STAT_OK - teve sucesso 1
+* Desfragmentacao do disco em segundo plano. fs_defrag lanca uma thread que
+* percorre os inodes por ordem e poe os blocos de cada um, pela ordem do
+* ficheiro, seguidos a partir do inicio da zona de dados (a posicao "pos").
+* Os blocos sao lidos e escritos pela cache, por isso vai o conteudo mais
+* recente, mesmo que ainda nao esteja no disco.
+*
+* Nao para o FS: tem o trincoFS partilhado em lotes de DEFRAG_LOTE blocos,
+* entre os quais da a vez aos pedidos, e um so inode trancado de cada vez.
+* Se "pos" esta ocupado por outro bloco, solta o inode que tem, tranca o
+* dono desse bloco e muda-o para o ultimo bloco livre do disco. O dono vem
+* do mapa inverso (fs->dono), confirmado no mapa de blocos do dono. Os
+* blocos de indice de um directorio nao se mudam: o indice e libertado e
+* refeito no fim. Os blocos partilhados por copy/append (mais de uma
+* referencia) ficam onde estao.
+*
+* fs_defrag devolve
+* STAT_OK - lancou a desfragmentacao 1
 * STAT_BUSY - esta em curso outra operacao de desfragmentacao 0
-* STAT_ERROR se nao foi possivel a desgramentacao por falta de espaco -1
+* STAT_ERROR se nao ha blocos livres para onde mudar os blocos -1
 */
-static int defrag_state = 0;
 
-void mexeBlocoPara(fs_t* fs, int bl, int dest);
+#define DEFRAG_LOTE 32	//blocos vistos de cada vez que se tem o trincoFS
 
-int fs_defrag(fs_t* fs){
-	
-	if(defrag_state == 1){
-		printf("[snfs_defrag] Esta em curso outra operacao de desfragmentacao\n");
-		return 0;
+/*Ultimo bloco livre depois de "desde", FS_NUM_BLOCKS se nao ha. Com o
+ * trincoBitmaps*/
+static unsigned fsi_blk_last_free(fs_t* fs, unsigned desde)
+{
+	unsigned total = FS_NUM_BLOCKS(fs);
+	unsigned g = BMAP_NUM_GROUPS(fs);
+
+	while(g-- > desde / BMAP_GROUP){	//do ultimo grupo para tras, saltando os cheios
+		if(fs->livres[g] == 0)
+			continue;
+		for(unsigned i = MIN((g+1)*BMAP_GROUP,total); i > MAX(g*BMAP_GROUP,desde+1); i--)
+			if(!BMAP_ISSET(fs->blk_bmap,i-1))
+				return i-1;
 	}
-	iniciaEscrita(fs);
-	dprintf("[fs_defrag]DESFRAGMENTANDO\n");
-	defrag_state = 1;
+	return total;
+}
 
-	//verifica quantidade de blocos vazios
-	int blocosvz=0;
-	int i=INODES_USED_BY_FS*INODE_NUM_BLKS;
-	for(;i<NUM_BLOCOS_MAX;++i)
-		if(BMAP_ISSET(fs->blk_bmap,i)){
-			++blocosvz;
-			break;
+/*Trocar "antigo" por "novo" no bloco de referencias "tbl", que fica em
+ * "tabela". Devolve 1 se o encontrou*/
+static int fsi_repoint_table(fs_t* fs, unsigned tbl, unsigned antigo, unsigned novo, fs_inode_ext_t* tabela){
+	int encontrou = 0;
+	lerCache(fs->cache,tbl,(char*)tabela);
+	for(int w=0;w<EXT_INODE_NUM_BLKS;++w)
+		if(tabela[w] == antigo){
+			tabela[w] = novo;
+			encontrou = 1;
 		}
+	if(encontrou && antigo != novo)
+		escreverCacheMeta(fs->cache,tbl,(char*)tabela);
+	return encontrou;
+}
 
+/*Trocar no mapa do inode as referencias para o bloco "antigo", de dados
+ * ou de referencias, por "novo" (com novo == antigo so se procura).
+ * Devolve 2 se e um bloco de referencias do inode, 1 se e de dados e 0
+ * se o inode nao o usa*/
+static int fsi_repoint(fs_t* fs, fs_inode_t* inode, unsigned antigo, unsigned novo){
+	fs_inode_ext_t tabela[EXT_INODE_NUM_BLKS];
+	fs_inode_ext_t indirectos[EXT_INODE_NUM_BLKS];
+	int encontrou = 0;
+	int w;
+
+	for(w=0;w<INODE_NUM_BLKS;++w)
+		if(inode->blocks[w] == antigo){
+			inode->blocks[w] = novo;
+			encontrou = 1;
+		}
+	if(inode->reserved[INODE_IND] == antigo){
+		inode->reserved[INODE_IND] = novo;
+		encontrou = 2;
+	}
+	if(inode->reserved[INODE_DIND] == antigo){
+		inode->reserved[INODE_DIND] = novo;
+		encontrou = 2;
+	}
 
-	if(blocosvz==0){
-		printf("\n[snfs_defrag] Nao existe espaço suficiente\n");
-		defrag_state = 0;
-		terminaEscrita(fs);
-		return -1;
+	if(inode->reserved[INODE_IND] != 0 && fsi_repoint_table(fs,inode->reserved[INODE_IND],antigo,novo,tabela))
+		encontrou = MAX(encontrou,1);
+	if(inode->reserved[INODE_DIND] != 0){
+		if(fsi_repoint_table(fs,inode->reserved[INODE_DIND],antigo,novo,tabela))
+			encontrou = 2;	//um bloco indirecto
+		for(w=0;w<EXT_INODE_NUM_BLKS;++w)
+			if(tabela[w] != 0 && fsi_repoint_table(fs,tabela[w],antigo,novo,indirectos))
+				encontrou = MAX(encontrou,1);
 	}
+	return encontrou;
+}
 
-	int z,q,pos=10;//pos a posiçao de ordenamento
-	for(z=INODES_USED_BY_FS;z<ITAB_SIZE;++z){
-		for(q=0;q<INODE_NUM_BLKS;++q){
-			if(fs->inode_tab[z].blocks[q]==pos){	//se for igual passa a frente
-				++pos;
-			}else if(fs->inode_tab[z].blocks[q]>pos){//verifica se é para organizar
-					mexeBlocoPara(fs, fs->inode_tab[z].blocks[q], pos);
-					++pos;
-			}
+/*Tirar o bloco "blk" ao inode "id", para a desfragmentacao o usar: um
+ * bloco de dados ou de referencias vai para o ultimo bloco livre, um do
+ * indice de um directorio sai com o indice. O bloco fica livre: a
+ * desfragmentacao so o reserva quando muda outro para la. Tranca o inode.
+ * Devolve 1 se o bloco foi libertado, 0 se o inode nao o usa ou nao ha
+ * para onde o mudar*/
+static int fsi_defrag_evict(fs_t* fs, inodeid_t id, unsigned blk){
+	fs_inode_t* inode = &fs->inode_tab[id];
+	char bloco[BLOCK_SIZE];
+	unsigned novo;
+	int feito = 0, tipo;
+
+	trancar(fs,id,ESCRITA);
+	if(!BMAP_ISSET(fs->inode_bmap,id)){
+		destrancar(fs,id,ESCRITA);
+		return 0;
+	}
+	if(inode->type == FS_DIR && blk >= inode->reserved[INODE_DIDX] &&
+	   blk < inode->reserved[INODE_DIDX] + inode->reserved[INODE_DIDX_BLKS]){
+		fsi_dir_idx_free(fs,id);	//fica sem indice ate ao fim (ou ao proximo create)
+		fsi_mark_inode(fs,id);
+		feito = 1;
+	}
+	else if((tipo = fsi_repoint(fs,inode,blk,blk)) != 0){	//confirmar o dono
+		sthread_mutex_lock(fs->trincoBitmaps);
+		novo = fsi_blk_last_free(fs,blk);
+		int movivel = novo < FS_NUM_BLOCKS(fs) && fs->referencias[blk] <= 1;
+		if(movivel)
+			fsi_blk_set(fs,novo);
+		sthread_mutex_unlock(fs->trincoBitmaps);
+
+		if(movivel){
+			lerCache(fs->cache,blk,bloco);
+			if(tipo == 2 || inode->type == FS_DIR)	//metadados: vai no commit do mapa novo
+				escreverCacheMeta(fs->cache,novo,bloco);
+			else
+				escreverCache(fs->cache,novo,bloco);
+			fsi_repoint(fs,inode,blk,novo);
+			fs->dono[novo] = id;
+			fsi_mark_inode(fs,id);
+			invalidarBloco(fs->cache,blk);	//o conteudo antigo ja nao serve
+			sthread_mutex_lock(fs->trincoBitmaps);
+			fs->referencias[novo] = fs->referencias[blk];
+			fs->referencias[blk] = 0;
+			fsi_blk_free(fs,blk);
+			sthread_mutex_unlock(fs->trincoBitmaps);
+			feito = 1;
 		}
 	}
-	puts("");
-	defrag_state = 0;
-	terminaEscrita(fs);
-	return 1;
-
+	destrancar(fs,id,ESCRITA);
+	return feito;
 }
- 
-//mexe bloco bl para pos dest
-void mexeBlocoPara(fs_t* fs, int bl, int dest){
-
-	dprintf(".");
-
-	int o,p,r=0;
-	int l,w;
-	int refinodes[ITAB_SIZE+1];	// inodes que apontam para o bloco e
-	int tempRef[ITAB_SIZE+1];	// inodes que apontam pa o bloco temporario
-	char* tp = malloc(sizeof(char)*BLOCK_SIZE);
-
-	for(o=0;o<ITAB_SIZE+1;++o)//zera o vector
-				refinodes[o] = 0;
-	for(o=0;o<ITAB_SIZE+1;++o)//zera o vector
-			tempRef[o] = 0;
-
-	//encontra as referencia para esse bloco
-	for(o=INODES_USED_BY_FS;o<ITAB_SIZE;o++){// mete no vector os inodes que referenciam este bloco
-		for(p=0;p<INODE_NUM_BLKS;++p)
-			if(fs->inode_tab[o].blocks[p] == bl){
-				refinodes[r++] = o;
-				break;
-			}
-	}
 
+/*Libertar o bloco "blk", que esta ocupado, para a desfragmentacao. O dono
+ * vem do mapa inverso; se afinal nao o usa, procura-se nos outros inodes,
+ * um de cada vez. Um bloco sem dono conhecido (acabado de reservar por um
+ * pedido) fica onde esta. Sem nenhum inode trancado.
+ * Devolve 1 se o bloco foi libertado*/
+static int fsi_defrag_take(fs_t* fs, unsigned blk){
+	inodeid_t dono = fs->dono[blk];
+
+	if(dono == 0)
+		return 0;
+	if(fsi_defrag_evict(fs,dono,blk))
+		return 1;
+	for(unsigned id = INODES_USED_BY_FS; id < FS_NUM_INODES(fs); id++)
+		if(id != dono && BMAP_ISSET(fs->inode_bmap,id) && fsi_defrag_evict(fs,id,blk))
+			return 1;
+	return 0;
+}
 
+/*Mudar o bloco "de", que e o bloco "iblock" do inode "id", para "para",
+ * acabado de reservar pela desfragmentacao. O inode esta trancado para
+ * escrita e o bloco e so dele*/
+static void fsi_defrag_move(fs_t* fs, inodeid_t id, unsigned iblock, unsigned de, unsigned para){
+	char bloco[BLOCK_SIZE];
 
-	if(!BMAP_ISSET(fs->blk_bmap,dest)){//se o bloco destino estiver vazio copia para para la
+	lerCache(fs->cache,de,bloco);	//copia o bloco
+	if(fs->inode_tab[id].type == FS_DIR)	//entradas de directorio: vao no commit do mapa novo
+		escreverCacheMeta(fs->cache,para,bloco);
+	else
+		escreverCache(fs->cache,para,bloco);	//a cache grava-o na nova posicao antes do commit
+	fsi_set_block(fs,&fs->inode_tab[id],iblock,para);	//a entrada ja existe: nao reserva tabelas
+	fsi_mark_inode(fs,id);
+	invalidarBloco(fs->cache,de);	//o conteudo antigo ja nao serve
+	sthread_mutex_lock(fs->trincoBitmaps);
+	fs->referencias[para] = fs->referencias[de];
+	fs->referencias[de] = 0;
+	fsi_blk_free(fs,de);
+	sthread_mutex_unlock(fs->trincoBitmaps);
+}
 
-		block_read(fs->blocks,bl,tp);	//copia o ficheiro encontrado
-		block_write(fs->blocks,dest,tp);// grava-o na nova posiçao
-		BMAP_SET(fs->blk_bmap,dest); // actualiza bitmap
-		for(l=0;refinodes[l] != 0;++l){
-			for(w=0;w<INODE_NUM_BLKS;++w){//actualiza referencias
-				if(fs->inode_tab[refinodes[l]].blocks[w] == bl){
-					dprintf("inode %d bloco:%d     de %d para%d\n",refinodes[l],w,bl,dest);
-					fs->inode_tab[refinodes[l]].blocks[w] = dest;
-					break;
-				}
-			}
+/*Refazer o indice dos directorios que ficaram sem ele*/
+static void fsi_defrag_dir_idx(fs_t* fs){
+	for(unsigned d = INODES_USED_BY_FS; d < FS_NUM_INODES(fs); d++){
+		fs_inode_t* idir = &fs->inode_tab[d];
+		if(!BMAP_ISSET(fs->inode_bmap,d) || idir->type != FS_DIR || idir->reserved[INODE_DIDX_BLKS] != 0)
+			continue;
+		trancar(fs,d,ESCRITA);
+		if(BMAP_ISSET(fs->inode_bmap,d) && idir->type == FS_DIR &&
+		   idir->reserved[INODE_DIDX_BLKS] == 0 && idir->size > 0){
+			fsi_dir_idx_build(fs,d);
+			fsi_mark_inode(fs,d);
 		}
-	}else{//senao copia o que estava la para o fim do disco
+		destrancar(fs,d,ESCRITA);
+	}
+}
 
-		//encontra um bloco vazio a contar do fim
-		int k=NUM_BLOCOS_MAX; // vai ter a pos do bloco vazio
+/*Publicar o progresso da desfragmentacao*/
+static void fsi_defrag_progress(fs_t* fs, unsigned movidos, unsigned feitos, int aCorrer){
+	sthread_mutex_lock(fs->trincoDesfrag);
+	fs->desfrag.moved = movidos;
+	fs->desfrag.done = feitos;
+	fs->desfrag.running = aCorrer;
+	sthread_mutex_unlock(fs->trincoDesfrag);
+}
 
-		for(;k>INODES_USED_BY_FS*INODE_NUM_BLKS-1;--k){
-			if(!BMAP_ISSET(fs->blk_bmap,k)){
-				break;
-			}
-		}
-		BMAP_SET(fs->blk_bmap,k);//mete o bloco k como utilizado
-		r = 0;
-		for(o=INODES_USED_BY_FS;o<ITAB_SIZE;o++){// mete no vector os inodes que referenciam o bloco temporario
-				for(p=0;p<INODE_NUM_BLKS;++p)
-					if(fs->inode_tab[o].blocks[p] == dest){
-						tempRef[r++] = o;
-						break;
-					}
-		}
-		block_read(fs->blocks,dest,tp);	//copia o ficheiro temporario
-		block_write(fs->blocks,k,tp);// grava-o na nova posiçao temporaria
-		BMAP_SET(fs->blk_bmap,k); // actualiza bitmap
-		for(l=0;tempRef[l] != 0;++l){
-			for(w=0;w<INODE_NUM_BLKS;++w){//actualiza referencias
-				if(fs->inode_tab[tempRef[l]].blocks[w] == dest){
-					dprintf("inode %d   bloco:%d     de   %d   para  %d\n",tempRef[l],w,dest,k);
-					fs->inode_tab[tempRef[l]].blocks[w] = k;
+/*Thread da desfragmentacao*/
+static void* fsi_defrag_job(void* arg){
+	fs_t* fs = (fs_t*) arg;
+	unsigned pos = fs->sb.data_start;	//proxima posicao da zona arrumada
+	unsigned movidos = 0, lote = 0;
+	unsigned id;
+
+	entrarFS(fs);
+	unsigned epoca = fs->epoca;	//um format muda-a: o que se sabia do disco deixa de valer
+	for(id = INODES_USED_BY_FS; id < FS_NUM_INODES(fs) && fs->epoca == epoca; id++){
+		fs_inode_t* inode = &fs->inode_tab[id];
+		if(!BMAP_ISSET(fs->inode_bmap,id))
+			continue;
+		trancar(fs,id,ESCRITA);
+		unsigned q = 0;
+		while(BMAP_ISSET(fs->inode_bmap,id) && q < OFFSET_TO_BLOCKS(inode->size)){
+			if(++lote == DEFRAG_LOTE){	//dar a vez aos pedidos
+				lote = 0;
+				destrancar(fs,id,ESCRITA);
+				sairFS(fs);
+				fsi_defrag_progress(fs,movidos,id-INODES_USED_BY_FS,1);
+				sthread_yield();
+				entrarFS(fs);
+				if(fs->epoca != epoca)
 					break;
-				}
+				trancar(fs,id,ESCRITA);
+				continue;	//o inode pode ter mudado entretanto
 			}
-		}
-		invalidarBloco(fs->cache,dest);//retira o bloco da cache se existir
-
-		block_read(fs->blocks,bl,tp);	//copia o ficheiro encontrado
-		block_write(fs->blocks,dest,tp);// grava-o na nova posiçao
-		BMAP_SET(fs->blk_bmap,dest); // actualiza bitmap
-		for(l=0;refinodes[l] != 0;++l){
-			for(w=0;w<INODE_NUM_BLKS;++w){//actualiza referencias
-				if(fs->inode_tab[refinodes[l]].blocks[w] == bl){
-					dprintf("inode %d     bloco:%d     de %d para%d\n",refinodes[l],w,bl,dest);
-					fs->inode_tab[refinodes[l]].blocks[w] = dest;
+			unsigned bloco = fsi_get_block(fs,inode,q);
+			if(bloco == pos){	//ja esta no sitio
+				++pos;
+				++q;
+				continue;
+			}
+			if(bloco < pos || fs->referencias[bloco] > 1){	//buraco, ja arrumado ou partilhado
+				++q;
+				continue;
+			}
+			//"pos" so e reservado aqui, para a mudanca que se segue: nao
+			//fica marcado sem dono quando se da a vez (um commit entretanto
+			//deixava-o perdido no disco)
+			sthread_mutex_lock(fs->trincoBitmaps);
+			int livre = !BMAP_ISSET(fs->blk_bmap,pos);
+			if(livre)
+				fsi_blk_set(fs,pos);
+			int partilhado = fs->referencias[pos] > 1;
+			int pendente = !livre && (BMAP_ISSET(fs->a_libertar,pos) || BMAP_ISSET(fs->em_commit,pos));
+			sthread_mutex_unlock(fs->trincoBitmaps);
+			if(pendente){	//libertado: fica livre com o commit
+				destrancar(fs,id,ESCRITA);
+				sairFS(fs);
+				fsi_journal_commit(fs);
+				entrarFS(fs);
+				if(fs->epoca != epoca)
 					break;
-				}
+				trancar(fs,id,ESCRITA);
+				continue;
+			}
+			if(!livre){	//e de outro inode: so um inode trancado de cada vez
+				destrancar(fs,id,ESCRITA);
+				if(partilhado || !fsi_defrag_take(fs,pos))
+					++pos;	//fica onde esta
+				trancar(fs,id,ESCRITA);
+				continue;	//se foi libertado, volta-se a tentar reserva-lo
 			}
+			fsi_defrag_move(fs,id,q,bloco,pos);
+			++pos;
+			++q;
+			++movidos;
 		}
+		if(fs->epoca != epoca)	//saiu do ciclo sem o inode
+			break;
+		destrancar(fs,id,ESCRITA);
+	}
+
+	if(fs->epoca == epoca)	//senao o bitmap ja foi apagado
+		fsi_defrag_dir_idx(fs);
+	sairFS(fs);
+	fsi_defrag_progress(fs,movidos,id-INODES_USED_BY_FS,0);
+	dprintf("[fs_defrag] %u blocos mudados\n",movidos);
+	return NULL;
+}
 
+int fs_defrag(fs_t* fs, fs_defrag_stat_t* estado){
+	sthread_mutex_lock(fs->trincoBitmaps);
+	int livres = fsi_blk_next_free(fs,fs->sb.data_start) < FS_NUM_BLOCKS(fs);
+	sthread_mutex_unlock(fs->trincoBitmaps);
+
+	sthread_mutex_lock(fs->trincoDesfrag);
+	if(fs->desfrag.running){
+		*estado = fs->desfrag;
+		sthread_mutex_unlock(fs->trincoDesfrag);
+		printf("[snfs_defrag] Esta em curso outra operacao de desfragmentacao\n");
+		return 0;
+	}
+	if(!livres){
+		*estado = fs->desfrag;
+		sthread_mutex_unlock(fs->trincoDesfrag);
+		printf("[snfs_defrag] Nao existe espaço suficiente\n");
+		return -1;
 	}
-	invalidarBloco(fs->cache,bl);//retira o bloco da cache se existir
-	BMAP_CLR(fs->blk_bmap,bl); // actualiza bitmap
-	fsi_store_fsdata(fs);//guarda os bitmaps
+	if(fs->desfragThread != NULL)
+		sthread_join(fs->desfragThread,NULL);	//a anterior ja acabou
+	fs->desfrag.running = 1;
+	fs->desfrag.moved = 0;
+	fs->desfrag.done = 0;
+	fs->desfrag.total = FS_NUM_INODES(fs) - INODES_USED_BY_FS;
+	fs->desfragThread = sthread_create(fsi_defrag_job,(void*)fs,1);
+	if(fs->desfragThread == NULL){
+		printf("[snfs_defrag] Erro ao criar a thread de desfragmentacao\n");
+		fs->desfrag.running = 0;
+	}
+	*estado = fs->desfrag;
+	sthread_mutex_unlock(fs->trincoDesfrag);
+	return estado->running ? 1 : -1;
+}
+
+void fs_defrag_status(fs_t* fs, fs_defrag_stat_t* estado){
+	sthread_mutex_lock(fs->trincoDesfrag);
+	*estado = fs->desfrag;
+	sthread_mutex_unlock(fs->trincoDesfrag);
 }
  
 /* //SNFS_DISKUSAGE
@@ -1830,7 +3508,7 @@ void imprimirInodeTab(fs_t* fs){
 	  int i,w;
 	dprintf("TABELA DE INODES\n");
 	dprintf("type1: directorio, type2:ficheiro\n");
-	for(i = 0; i<ITAB_SIZE;i++){
+	for(i = 0; i<FS_NUM_INODES(fs);i++){
 	  if(fs->inode_tab[i].size>0){
 			dprintf("\n");
 			dprintf("inode:%d  %d:%d    \n",i,(fs->inode_tab[i]).type,(fs->inode_tab[i]).size);
@@ -1847,15 +3525,15 @@ void imprimirInodeTab(fs_t* fs){
 
 void fs_dump(fs_t* fs)
 {
-	iniciaLeitura(fs);
+	sthread_mutex_lock(fs->trincoBitmaps);
    printf("[fs_dump]Free block bitmap:\n");
-   fsi_dump_bmap(fs->blk_bmap,BLOCK_SIZE);
+   fsi_dump_bmap(fs->blk_bmap,fs->sb.bmap_blks*BLOCK_SIZE);
    printf("\n");
    
    printf("[fs_dump]Free inode table bitmap:\n");
-   fsi_dump_bmap(fs->inode_bmap,BLOCK_SIZE);
+   fsi_dump_bmap(fs->inode_bmap,fs->sb.imap_blks*BLOCK_SIZE);
    printf("\n");
-   terminaLeitura(fs);
+   sthread_mutex_unlock(fs->trincoBitmaps);
 }
 
 /**===== Dump: FileSystem Blocks =======================
@@ -1873,7 +3551,7 @@ int fs_diskUsage(fs_t* fs){
 	unsigned idBloco,novoIdBloco;
 	int i;
 	
-	iniciaLeitura(fs);
+	iniciaEscrita(&fs->trincoFS);	//percorre todos os directorios e ficheiros
 	
 	List listaReferencias = gerar_lista_referencias(fs);
 	noRef_t referencia;
@@ -1903,7 +3581,7 @@ int fs_diskUsage(fs_t* fs){
 		printf("file_name%d: %s\n",i++,referencia->pathname);
 	}
 	printf("*******************************************************\n");
-	terminaLeitura(fs);
+	terminaEscrita(&fs->trincoFS);
 	return 0;
 }
 
@@ -1917,10 +3595,8 @@ Blk_Cnt: <Conteúdo do Bloco (em Hex?)>
 ************************************************************
 */	
 int fs_dumpcache(fs_t* fs){
-	iniciaEscrita(fs);	//apesar de ser uma leitura, garantimos que mais nenhuma thread está a modificar a cache (o que acontece se permitirmos leituras)
-	int status = visualizarCache(fs->cache);
-	terminaEscrita(fs);
-	return status;
+	estatisticasDCache(fs->dcache);
+	return visualizarCache(fs->cache);	//a cache tem o seu proprio trinco
 }
 
 void* thread_actualiza_Cache(void* sistemaFicheiros){
@@ -1928,12 +3604,13 @@ void* thread_actualiza_Cache(void* sistemaFicheiros){
 	fs_t* fs = (fs_t*) sistemaFicheiros;
 	int tempoInvervalo = INTERVALO_TEMPO_CACHE;	//guardar os dados de 2 em 2 segundos
 	while(1){
+		fsi_journal_commit(fs);	//metadados marcados pelos pedidos desde a ultima vez
 		if((actualizarCache(fs->cache,tempoInvervalo)) != 0){
 			printf("[thread_actualizaCache] Erro ao actualizar a cache\n");
 			sthread_exit(NULL);
 		}
 			    
-		sthread_sleep(tempoInvervalo*100000); 
+		sthread_sleep(tempoInvervalo*1000000);	//sthread_sleep recebe microsegundos
 	}
 	sthread_exit(NULL);
 }
@@ -14,10 +14,30 @@
 #ifndef _FS_H_
 #define _FS_H_
 
+#include <sys/uio.h>
 #include "cache.h"
+#include "structCache.h"
 #include "block.h"
 #include "list.h"
 
+// size of the blocks of the file system (and of the cache entries):
+// a power of two from 512 B to 64 KiB, chosen at build time
+// (-DFS_BLOCK_SIZE=...); the superblock records it, and a volume
+// formatted with another size is not loaded
+#ifndef FS_BLOCK_SIZE
+#define FS_BLOCK_SIZE 512
+#endif
+
+#if FS_BLOCK_SIZE < 512 || FS_BLOCK_SIZE > 65536 || (FS_BLOCK_SIZE & (FS_BLOCK_SIZE-1)) != 0
+#error "FS_BLOCK_SIZE must be a power of two from 512 to 65536"
+#endif
+
+// the block buffers live on the stack: user-level sthreads have 64 KiB
+// stacks, so larger blocks need the pthreads build
+#if FS_BLOCK_SIZE > 8192 && !defined(USE_PTHREADS)
+#error "FS_BLOCK_SIZE above 8 KiB needs USE_PTHREADS"
+#endif
+
 // maximum space for the file name (13 chars + '\0')
 #define FS_MAX_FNAME_SZ 14
 
@@ -125,6 +145,33 @@ int fs_write(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
    char* buffer);
 
 
+/*
+ * fs_readv/fs_writev: same as fs_read/fs_write, but the data is
+ * scattered into / gathered from the buffers of 'iov' in order; count
+ * is the sum of their lengths. Whole blocks that fall inside a single
+ * buffer are copied straight between it and the cache.
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_readv(fs_t* fs, inodeid_t file, unsigned offset,
+   const struct iovec* iov, int iovcnt, int* nread);
+int fs_writev(fs_t* fs, inodeid_t file, unsigned offset,
+   const struct iovec* iov, int iovcnt);
+
+
+/*
+ * fs_read_pinned: same as fs_read, but the data is left in the cache:
+ * iov[0..*iovcnt) point into cache blocks that stay pinned, and are not
+ * changed, until fs_unpin is called with pins[0..*iovcnt)
+ * - maxiov: room in iov and pins; FS_READ_MAX_IOV(count) is enough
+ *   returns: 0 if successful, -1 otherwise (nothing is left pinned)
+ */
+#define FS_READ_MAX_IOV(count) ((count) / FS_BLOCK_SIZE + 2)
+
+int fs_read_pinned(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
+   struct iovec* iov, icache_t* pins, int maxiov, int* iovcnt, int* nread);
+void fs_unpin(fs_t* fs, icache_t* pins, int npins);
+
+
 /*
  * fs_create: create a file in a specified directory
  * - fs: reference to file system
@@ -176,7 +223,33 @@ void imprimirInodeTab(fs_t* fs);	//para debug
 
 
 
-int fs_defrag(fs_t* X);
+// progress of the defragmentation job
+typedef struct {
+   int running;        // 1 while the job is going on
+   unsigned moved;     // blocks moved so far
+   unsigned done;      // inodes already walked
+   unsigned total;     // inodes to walk
+} fs_defrag_stat_t;
+
+
+/*
+ * fs_defrag: starts the defragmentation of the disk as a background
+ * job, that moves the blocks of one inode at a time in small batches
+ * while the other requests go on
+ * - fs: reference to file system
+ * - stat: progress of the job that was started or is running [out]
+ *   returns: 1 if the job was started, 0 if one is already running,
+ *   -1 if there are no free blocks to move the blocks to
+ */
+int fs_defrag(fs_t* fs, fs_defrag_stat_t* stat);
+
+
+/*
+ * fs_defrag_status: progress of the running job, or of the last one
+ * - fs: reference to file system
+ * - stat: the progress [out]
+ */
+void fs_defrag_status(fs_t* fs, fs_defrag_stat_t* stat);
 
 
 
@@ -29,6 +29,7 @@ int keyEquals(int n1,int n2){
 HashMap newHash(int size)
 {
 	mutex = sthread_mutex_init();
+	sthread_mutex_setname(mutex, "hash.mutex");
 	
 	HashMap hmap=(HashMap)malloc(sizeof(SHashMap));
 
@@ -132,7 +133,7 @@ int hashRemove(HashMap hmap,int key,icache_t* value)
   if(aux)
   {
     *last=aux->next;
-    if(*value) *value=aux->value;
+    if(value) *value=aux->value;
     free(aux);
     hmap->size--;
     sthread_mutex_unlock(mutex);
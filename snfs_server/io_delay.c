@@ -13,6 +13,7 @@ static int sleep_time = 0;
 void io_delay_on(int disk_delay)
 {
    mon_delay = sthread_monitor_init();
+   sthread_monitor_setname(mon_delay, "io_delay.mon");
    Is_off = 0;
    sleep_time = disk_delay;
 }
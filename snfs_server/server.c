@@ -9,17 +9,22 @@
  * Read the project specification for futher information.
  */
 
+#define _GNU_SOURCE 1		// recvmmsg/sendmmsg
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/time.h>
 #include <sys/select.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <signal.h>
 #include <sthread.h>
 #ifdef USE_PTHREADS
 #include <pthread.h>
@@ -27,106 +32,592 @@
 
 // SNFS includes
 #include <snfs_proto.h>
+#include <snfs_wire.h>
 #include "snfs.h"
+#include "arena.h"
 
 
 #ifndef SERVER_SOCK
 #define SERVER_SOCK "/tmp/server.socket"
 #endif
 
-// request descriptor structure
+// request descriptor structure (also holds the response, so that a
+// consumer can send the responses of several requests in one batch).
+// Requests that came through a stream connection have 'conn' set and
+// are answered with a frame carrying the same serial number. Requests
+// in the compact format are decoded into 'req' and answered with the
+// encoding of 'res' kept in 'wire'. What goes back is 'iov' ('outsz'
+// bytes): the response message followed, for reads, by the data right
+// from the cache blocks in 'pins' (see snfs_read_pinned), which stay
+// pinned until it is sent. Bulk writes carry their data apart, in a
+// malloc'd 'bulk' buffer. While queued, 'next' links the requests of
+// the same client and class (see enqueue_req).
+// Each request is stamped (sthread_now) when received, queued, taken
+// by a consumer, served and sent; the times and 'insz', its size on
+// the wire, go into the per-op statistics. A request with a deadline
+// (snfs_wire.h) that has passed when a consumer gets to it is answered
+// RES_TIMEOUT instead of being served.
+#define RES_MAX_IOV (FS_READ_MAX_IOV(SNFS_MAX_BULK_DATA) + 3)
+
 struct _req {
 	snfs_msg_req_t req;
 	struct sockaddr_un cliaddr;
 	int reqsz;
 	socklen_t clilen;
+	struct conn_* conn;
+	int compact;
+	snfs_frame_hdr_t hdr;
+	snfs_msg_res_t res;
+	int ressz;
+	struct iovec iov[RES_MAX_IOV];
+	int iovcnt;
+	int outsz;
+	icache_t pins[RES_MAX_IOV];
+	int npins;
+	char wire[SNFS_WIRE_MAX];
+	char* bulk;
+	unsigned bulklen;
+	int cls;
+	struct _req* next;
+	int insz;
+	unsigned long long t_recv, t_queued, t_dequeue, t_start, t_end, t_sent;
+	unsigned long long deadline;	// 0 if none
 };
 typedef struct _req* req_t;
 
+void conn_put(struct conn_* c);
+
+
+void srv_stats(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, int* ressz);
+
 
 /*
  * SNFS Services
  *
- * all services are registered in a global table which is
- * used during request resolution to find the handler that
- * serves the request
+ * all services are registered in a global table indexed by the
+ * request type, so the handler of a request is found by looking
+ * up its type; types without a handler are unknown
  *
  * service handlers are implemented in snfs.c
  */
 
-#define NUM_REQ_HANDLERS 13
 #define NUM_TC 5		// max number of active threads
-#define RING_SIZE 10
 
+// request classes: each has its own queue of QUEUE_SIZE requests and
+// a weight, the number of requests the consumers take from it in turn
+// when the others are backlogged too. Within a class the clients take
+// turns, and a client already holding CLIENT_QUEUE_SIZE of the queue is
+// turned away with RES_BUSY while others wait, as is every request
+// that finds its queue full (the producers never block on it).
+#define NUM_CLASSES 3
+enum { CLASS_META, CLASS_DATA, CLASS_MAINT };
+
+#ifndef QUEUE_SIZE
+#define QUEUE_SIZE 32
+#endif
+#ifndef CLIENT_QUEUE_SIZE
+#define CLIENT_QUEUE_SIZE 8
+#endif
+
+static const int Class_weight[NUM_CLASSES] = {
+	[CLASS_META] = 4, [CLASS_DATA] = 2, [CLASS_MAINT] = 1
+};
+
+// syscall batching: the producer receives up to RECV_BATCH datagrams
+// per recvmmsg and each consumer serves up to SEND_BATCH requests,
+// sending their responses with a single sendmmsg
+#ifndef RECV_BATCH
+#define RECV_BATCH 8
+#endif
+#ifndef SEND_BATCH
+#define SEND_BATCH 4
+#endif
+
+// worker placement (honoured by the pthread implementation):
+// PIN_WORKERS 1 pins consumer i to CPU i (mod the number of CPUs);
+// WORKERS_NUMA_NODE >= 0 keeps all workers on that node's CPUs
+#ifndef PIN_WORKERS
+#define PIN_WORKERS 0
+#endif
+#ifndef WORKERS_NUMA_NODE
+#define WORKERS_NUMA_NODE -1
+#endif
+
+
+// sharded mode: NUM_SHARDS listening sockets, each with its own
+// producer, queues, descriptor pool and group of NUM_TC consumers.
+// Shard 0 listens on SERVER_SOCK, shard i on SERVER_SOCK.i (see
+// SNFS_SHARD_SOCK_FMT); clients pick the shard by the handle in the
+// request (the pathname for lookups).
+#ifndef NUM_SHARDS
+#define NUM_SHARDS 1
+#endif
+
+// request descriptor pool: enough for full queues, the batches held by
+// the consumers and the ones being received by the producer and the
+// stream thread, so in practice the producers never wait for one
+#define NUM_REQ_DESC (NUM_CLASSES * QUEUE_SIZE + NUM_TC * SEND_BATCH + 2 * RECV_BATCH)
+
+// stream transport: connections served by the stream thread and the
+// size of their receive buffer (must hold at least one whole frame,
+// and a bulk write frame carries up to SNFS_MAX_BULK_DATA)
+#define MAX_CONNS 64
+#define CONN_BUF_SIZE (64*1024 + SNFS_MAX_BULK_DATA)
+
+// latency histograms, HDR style: up to 2*LAT_SUB us the buckets are
+// 1us wide, above that each power of two is split in LAT_SUB buckets,
+// so a percentile is off by 1/LAT_SUB at most
+#define LAT_SUB 16
+#define LAT_MAX_EXP 26
+#define LAT_BUCKETS ((LAT_MAX_EXP + 2) * LAT_SUB)
+
+// per-op statistics of the server are logged every STATS_LOG_PERIOD
+// seconds (0 never)
+#ifndef STATS_LOG_PERIOD
+#define STATS_LOG_PERIOD 10
+#endif
+
+// per-op counters: requests, errors, deadlines missed, bytes in and
+// out, log2 histograms of the time spent waiting and being served and
+// the latency histogram (from receiving to sending)
+typedef struct {
+	unsigned long count, errors, expired;
+	unsigned long long bytes;
+	unsigned long wait[SNFS_STATS_BUCKETS];
+	unsigned long service[SNFS_STATS_BUCKETS];
+	unsigned long lat[LAT_BUCKETS];
+} op_stats_t;
+
+// the requests of one client queued in one class, in arrival order;
+// stream clients are told apart by connection, datagram ones by the
+// path of their socket
+typedef struct flow_ {
+	struct conn_* conn;
+	char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+	req_t head, tail;
+	int queued;
+	struct flow_* next;	// next client of the class (or free flow)
+} flow_t;
+
+// a class queue: its clients with queued requests, served in turn
+typedef struct {
+	flow_t* head, *tail;
+	int queued;
+} class_queue_t;
+
+// everything below 'mon' is protected by it, except the recv_*
+// counters that belong to the producer
+typedef struct {
+	int id;
+	int sockfd;
+	sthread_mon_t mon;
+	int available_reqs; // queued requests not yet consumed 
+	class_queue_t queues[NUM_CLASSES];
+	int cur_class, credit; // class being served, requests left in its turn
+	flow_t flow_pool[NUM_REQ_DESC];
+	flow_t* free_flows;
+	struct _req req_pool[NUM_REQ_DESC];
+	req_t free_reqs[NUM_REQ_DESC];
+	int num_free_reqs;
+	int desc_waiters; // producers waiting for a free descriptor
+	// batch fill counters: fill[n] counts batches of n messages
+	struct {
+		unsigned long recv_calls, recv_msgs, recv_fill[RECV_BATCH + 1];
+		unsigned long send_calls, send_msgs, send_fill[SEND_BATCH + 1];
+	} batch_stats;
+	volatile sig_atomic_t dump_batch_stats;
+	// indexed by request type, unknown types count as REQ_NULL
+	op_stats_t op_stats[SNFS_NUM_REQ_TYPES];
+} shard_t;
 
-static sthread_mon_t mon = NULL;
-static int available_reqs; // buffer requests not yet consumed 
-req_t ring[RING_SIZE];
-int sockfd;
+static shard_t shards[NUM_SHARDS];
 
+void build_response(req_t r);
+int srv_send_responses(shard_t* sh, req_t* reqs, int n);
+void account_req(shard_t* sh, req_t r);
+void log_stats_tick(void);
+
+// a stream connection; it is freed when the stream thread and every
+// request still in flight have dropped their reference
+typedef struct conn_ {
+	int fd;
+	shard_t* sh;
+	sthread_mutex_t wlock; // serializes response frames, protects refs
+	int refs;
+	int buflen;
+	char buf[CONN_BUF_SIZE];
+} conn_t;
+
+static int stream_fd;
+
+// reads (REQ_READ, REQ_READ_BULK) are served from the cache by
+// serve_read; bulk writes only come on stream connections (see
+// snfs_proto.h) and have a bulk handler instead
 struct {
-  snfs_msg_type_t type;
+  const char* name;
+  int cls;
   snfs_handler_t handler;
-} Service[NUM_REQ_HANDLERS] = {
-  {REQ_PING, snfs_ping},
-  {REQ_LOOKUP, snfs_lookup},
-  {REQ_READ, snfs_read},
-  {REQ_WRITE, snfs_write},
-  {REQ_CREATE, snfs_create},
-  {REQ_MKDIR, snfs_mkdir},
-  {REQ_READDIR, snfs_readdir},
-  {REQ_REMOVE, snfs_remove},
-  {REQ_COPY, snfs_copy},
-  {REQ_APPEND, snfs_append},
-  {REQ_DEFRAG, snfs_defrag},
-  {REQ_DISKUSAGE, snfs_diskusage},
-  {REQ_DUMPCACHE, snfs_dumpcache}
+  snfs_bulk_handler_t bulk_handler;
+} Service[SNFS_NUM_REQ_TYPES] = {
+  [REQ_NULL]       = {"unknown", CLASS_META, NULL, NULL},
+  [REQ_PING]       = {"ping", CLASS_META, snfs_ping, NULL},
+  [REQ_LOOKUP]     = {"lookup", CLASS_META, snfs_lookup, NULL},
+  [REQ_READ]       = {"read", CLASS_DATA, snfs_read, NULL},
+  [REQ_WRITE]      = {"write", CLASS_DATA, snfs_write, NULL},
+  [REQ_CREATE]     = {"create", CLASS_META, snfs_create, NULL},
+  [REQ_MKDIR]      = {"mkdir", CLASS_META, snfs_mkdir, NULL},
+  [REQ_READDIR]    = {"readdir", CLASS_META, snfs_readdir, NULL},
+  [REQ_COPY]       = {"copy", CLASS_DATA, snfs_copy, NULL},
+  [REQ_REMOVE]     = {"remove", CLASS_META, snfs_remove, NULL},
+  [REQ_APPEND]     = {"append", CLASS_DATA, snfs_append, NULL},
+  [REQ_DEFRAG]     = {"defrag", CLASS_MAINT, snfs_defrag, NULL},
+  [REQ_DISKUSAGE]  = {"diskusage", CLASS_MAINT, snfs_diskusage, NULL},
+  [REQ_DUMPCACHE]  = {"dumpcache", CLASS_MAINT, snfs_dumpcache, NULL},
+  [REQ_READ_BULK]  = {"read_bulk", CLASS_DATA, NULL, NULL},
+  [REQ_WRITE_BULK] = {"write_bulk", CLASS_DATA, NULL, snfs_write_bulk},
+  [REQ_STATS]      = {"stats", CLASS_META, srv_stats, NULL}
 };
 
+// slot of a request type in Service and in the per-op statistics
+#define REQ_SLOT(type) ((unsigned)(type) < SNFS_NUM_REQ_TYPES ? (type) : REQ_NULL)
+
 /*
- * Buffer management functions
+ * Request queues (callers hold the shard's 'mon')
  */
 
-req_t get_req() {
-	static short int pos = 0;
+void init_queues(shard_t* sh) {
+	memset(sh->queues, 0, sizeof(sh->queues));
+	sh->cur_class = 0;
+	sh->credit = 0;
+	sh->free_flows = NULL;
+	for (int i = 0; i < NUM_REQ_DESC; i++) {
+		sh->flow_pool[i].next = sh->free_flows;
+		sh->free_flows = &sh->flow_pool[i];
+	}
+}
+
+/* the flow of r's client in queue q, or NULL if it has none queued */
+static flow_t* find_flow(class_queue_t* q, req_t r) {
+	flow_t* f;
 	
-	req_t temp = ring[pos];
-	pos = (pos + 1) % RING_SIZE;
+	for (f = q->head; f != NULL; f = f->next) {
+		if (r->conn != NULL ? f->conn == r->conn :
+		    f->conn == NULL && strncmp(f->path, r->cliaddr.sun_path, sizeof(f->path)) == 0)
+			break;
+	}
+	return f;
+}
+
+/* queues r in its class, behind the other requests of its client;
+ * returns 0 if admission control turns it away */
+int enqueue_req(shard_t* sh, req_t r) {
+	class_queue_t* q = &sh->queues[r->cls];
+	flow_t* f = find_flow(q, r);
 	
-	return temp;
+	if (q->queued == QUEUE_SIZE)
+		return 0;
+	if (f != NULL && f->queued >= CLIENT_QUEUE_SIZE && q->queued > f->queued)
+		return 0;
+	
+	if (f == NULL) {
+		f = sh->free_flows;
+		sh->free_flows = f->next;
+		f->conn = r->conn;
+		if (r->conn == NULL)
+			strncpy(f->path, r->cliaddr.sun_path, sizeof(f->path));
+		f->head = f->tail = NULL;
+		f->queued = 0;
+		f->next = NULL;
+		if (q->tail != NULL)
+			q->tail->next = f;
+		else
+			q->head = f;
+		q->tail = f;
+	}
+	r->next = NULL;
+	if (f->tail != NULL)
+		f->tail->next = r;
+	else
+		f->head = r;
+	f->tail = r;
+	f->queued++;
+	q->queued++;
+	sh->available_reqs++;
+	return 1;
 }
 
-void put_req(req_t req) {
-	static short int pos = 0;
+/* takes the next request: the classes are served by weighted round
+ * robin and, within one, its clients take turns (there must be a
+ * request queued) */
+req_t dequeue_req(shard_t* sh) {
+	class_queue_t* q;
+	flow_t* f;
+	req_t r;
 	
-	ring[pos] = req;
-	pos = (pos + 1) % RING_SIZE;
+	while (sh->credit == 0 || sh->queues[sh->cur_class].queued == 0) {
+		sh->cur_class = (sh->cur_class + 1) % NUM_CLASSES;
+		sh->credit = Class_weight[sh->cur_class];
+	}
+	sh->credit--;
+	q = &sh->queues[sh->cur_class];
+	
+	f = q->head;
+	r = f->head;
+	f->head = r->next;
+	if (f->head == NULL)
+		f->tail = NULL;
+	f->queued--;
+	q->queued--;
+	sh->available_reqs--;
 	
-	return;
+	// the client goes to the back of the class, or away if it is done
+	q->head = f->next;
+	if (q->head == NULL)
+		q->tail = NULL;
+	if (f->queued > 0) {
+		f->next = NULL;
+		if (q->tail != NULL)
+			q->tail->next = f;
+		else
+			q->head = f;
+		q->tail = f;
+	} else {
+		f->next = sh->free_flows;
+		sh->free_flows = f;
+	}
+	return r;
 }
 
-int my_recvfrom(snfs_msg_req_t* req, struct sockaddr_un* cliaddr, socklen_t* clilen) {
-	int reqsz;
+/*
+ * Request descriptor pool (callers hold the shard's 'mon')
+ */
+
+void init_req_pool(shard_t* sh) {
+	for (int i = 0; i < NUM_REQ_DESC; i++)
+		sh->free_reqs[i] = &sh->req_pool[i];
+	sh->num_free_reqs = NUM_REQ_DESC;
+}
+
+req_t alloc_req(shard_t* sh) {
+	if (sh->num_free_reqs == 0) {
+		printf("[snfs_srv] request descriptor pool exhausted.\n");
+		exit(-1);
+	}
+	return sh->free_reqs[--sh->num_free_reqs];
+}
+
+void free_req(shard_t* sh, req_t req) {
+	sh->free_reqs[sh->num_free_reqs++] = req;
+}
+
+/* takes up to max clean descriptors, waiting for one if the pool is
+ * empty; returns how many were taken */
+int reserve_reqs(shard_t* sh, req_t* batch, int max) {
+	int n, i;
+	
+	sthread_monitor_enter(sh->mon);
+	while (sh->num_free_reqs == 0) {
+		sh->desc_waiters++;
+		sthread_monitor_wait(sh->mon);
+		sh->desc_waiters--;
+	}
+	n = sh->num_free_reqs;
+	if (n > max) n = max;
+	for (i = 0; i < n; i++)
+		batch[i] = alloc_req(sh);
+	sthread_monitor_exit(sh->mon); 
+
+	// only the descriptor fields; the message is cleaned once received
+	for (i = 0; i < n; i++) {
+		batch[i]->reqsz = 0;
+		batch[i]->conn = NULL;
+		batch[i]->compact = 0;
+		batch[i]->bulk = NULL;
+		batch[i]->bulklen = 0;
+		batch[i]->npins = 0;
+		batch[i]->insz = 0;
+		batch[i]->deadline = 0;
+	}
+	return n;
+}
+
+/* the deadline of a compact request, from the time it was received */
+static void set_deadline(req_t r, const char* msg, int len)
+{
+	unsigned usec = snfs_wire_req_deadline(msg, len);
+	
+	r->deadline = usec ? r->t_recv + usec * 1000ULL : 0;
+}
+
+/* turns the received bytes into a fixed request: compact messages are
+ * decoded, fixed ones have the part that was not sent cleared */
+void prepare_req(req_t r) {
+	char msg[sizeof(snfs_msg_req_t)];
+	
+	if (r->compact)		// decoded by conn_parse
+		return;
+	if (snfs_wire_is_compact((char*)&r->req, r->reqsz)) {
+		memcpy(msg, &r->req, r->reqsz);
+		r->compact = 1;
+		set_deadline(r, msg, r->reqsz);
+		r->reqsz = snfs_wire_decode_req(msg, r->reqsz, &r->req);
+		if (r->reqsz < 0)
+			r->reqsz = 0;
+	} else if (r->reqsz > 0) {
+		memset((char*)&r->req + r->reqsz, 0, sizeof(r->req) - r->reqsz);
+	}
+}
+
+/* answers the requests turned away by admission control with RES_BUSY
+ * and gives back their descriptors */
+void shed_reqs(shard_t* sh, req_t* shed, int n) {
+	unsigned long long now;
+	int i;
+	
+	for (i = 0; i < n; i++) {
+		req_t r = shed[i];
+		memset(&r->res, 0, snfs_wire_res_size(r->req.type));
+		r->res.type = r->req.type;
+		r->res.status = RES_BUSY;
+		r->ressz = sizeof(r->res) - sizeof(r->res.body);
+		build_response(r);
+		r->t_dequeue = r->t_start = r->t_end = r->t_queued;
+	}
+	for (i = 0; i < n; i += SEND_BATCH)
+		srv_send_responses(sh, shed + i, n - i > SEND_BATCH ? SEND_BATCH : n - i);
+	now = sthread_now();
+	for (i = 0; i < n; i++)
+		shed[i]->t_sent = now;
 	
-	*clilen = sizeof(*cliaddr);
+	sthread_monitor_enter(sh->mon);
+	for (i = 0; i < n; i++) {
+		free(shed[i]->bulk);
+		account_req(sh, shed[i]);
+		free_req(sh, shed[i]);
+	}
+	sthread_monitor_exit(sh->mon);
+}
+
+/* queues the first 'got' of the n reserved descriptors (empty requests
+ * are dropped, and the ones admission control turns away answered
+ * busy) and returns the others to the pool */
+void commit_reqs(shard_t* sh, req_t* batch, int n, int got) {
+	unsigned long long now = sthread_now();
+	req_t shed[RECV_BATCH];
+	int i, nshed = 0;
+	
+	for (i = 0; i < got; i++) {
+		batch[i]->t_queued = now;
+		prepare_req(batch[i]);
+		batch[i]->cls = Service[REQ_SLOT(batch[i]->req.type)].cls;
+		// dropped below: release what the request holds
+		if (batch[i]->reqsz == 0) {
+			if (batch[i]->conn != NULL)
+				conn_put(batch[i]->conn);
+			free(batch[i]->bulk);
+			batch[i]->bulk = NULL;
+		}
+	}
+	
+	sthread_monitor_enter(sh->mon); 
+	for (i = 0; i < got; i++) {
+		if (batch[i]->reqsz == 0) {
+			printf("[snfs_srv] request error.\n");
+			free_req(sh, batch[i]);
+			continue;
+		}
+		if (!enqueue_req(sh, batch[i]))
+			shed[nshed++] = batch[i];
+	}
+	for (; i < n; i++)
+		free_req(sh, batch[i]);
+	sthread_monitor_signalall(sh->mon);
+	sthread_monitor_exit(sh->mon);
+	
+	if (nshed > 0)
+		shed_reqs(sh, shed, nshed);
+}
+
+/*
+ * Batch counters: printed by each producer after a SIGUSR1
+ */
+
+void batch_stats_signal(int sig) {
+	for (int i = 0; i < NUM_SHARDS; i++)
+		shards[i].dump_batch_stats = 1;
+}
+
+void print_fill(const char* name, unsigned long calls, unsigned long msgs,
+                unsigned long* fill, int max) {
+	printf("[snfs_srv] %s: %lu calls, %lu msgs, %.2f msgs/call, fill:",
+	       name, calls, msgs, calls ? (double)msgs / calls : 0.0);
+	for (int i = 1; i <= max; i++)
+		printf(" %d:%lu", i, fill[i]);
+	printf("\n");
+}
+
+void print_batch_stats(shard_t* sh) {
+	printf("[snfs_srv] shard %d:\n", sh->id);
+	print_fill("recvmmsg", sh->batch_stats.recv_calls, sh->batch_stats.recv_msgs,
+	           sh->batch_stats.recv_fill, RECV_BATCH);
+	sthread_monitor_enter(sh->mon);
+	print_fill("sendmmsg", sh->batch_stats.send_calls, sh->batch_stats.send_msgs,
+	           sh->batch_stats.send_fill, SEND_BATCH);
+	sthread_monitor_exit(sh->mon);
+	fflush(stdout);
+}
+
+/*
+ * receives up to n datagrams into reqs; polls so that user-level
+ * threads are never blocked inside the kernel
+ */
+int my_recvmmsg(shard_t* sh, req_t* reqs, int n) {
+	struct mmsghdr msgs[RECV_BATCH];
+	struct iovec iov[RECV_BATCH];
+	unsigned long long now;
+	int got;
+	
+	memset(msgs, 0, sizeof(msgs));
+	for (int i = 0; i < n; i++) {
+		iov[i].iov_base = &reqs[i]->req;
+		iov[i].iov_len = sizeof(reqs[i]->req);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &reqs[i]->cliaddr;
+		msgs[i].msg_hdr.msg_namelen = sizeof(reqs[i]->cliaddr);
+	}
 	
 	do {
+		if (sh->dump_batch_stats) {
+			sh->dump_batch_stats = 0;
+			print_batch_stats(sh);
+		}
+		if (sh->id == 0)
+			log_stats_tick();
 		sthread_yield();
 		errno = 0;
-		reqsz = recvfrom(sockfd, (void*)req, sizeof(*req), MSG_DONTWAIT,
-							(struct sockaddr *)cliaddr, clilen);
-	} while(errno == EAGAIN);
+		got = recvmmsg(sh->sockfd, msgs, n, MSG_DONTWAIT, NULL);
+	} while(got < 0 && errno == EAGAIN);
 	
-	return reqsz;
+	now = sthread_now();
+	for (int i = 0; i < got; i++) {
+		reqs[i]->t_recv = now;
+		reqs[i]->reqsz = reqs[i]->insz = msgs[i].msg_len;
+		reqs[i]->clilen = msgs[i].msg_hdr.msg_namelen;
+		// the path identifies the client (see find_flow)
+		if (reqs[i]->clilen < sizeof(reqs[i]->cliaddr))
+			((char*)&reqs[i]->cliaddr)[reqs[i]->clilen] = '\0';
+	}
+	return got;
 }
 
 
-/* receives a Server Id, from the main function argv */
+/* creates and binds the socket of shard sh */
 
-void srv_init_socket(struct sockaddr_un* servaddr)
+void srv_init_socket(shard_t* sh, struct sockaddr_un* servaddr)
 {	
    	// creates socket datagram domain unix
-	if ((sockfd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0){
+	if ((sh->sockfd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0){
 		printf("[snfs_srv] socket error: %s.\n", strerror(errno));
 		exit(-1);
 	}
@@ -134,7 +625,11 @@ void srv_init_socket(struct sockaddr_un* servaddr)
    	// structure address cleaning
 	bzero(servaddr, sizeof(*servaddr));
 	servaddr->sun_family = AF_UNIX;
-	strcpy(servaddr->sun_path, SERVER_SOCK);
+	if (sh->id == 0)
+		strcpy(servaddr->sun_path, SERVER_SOCK);
+	else
+		snprintf(servaddr->sun_path, sizeof(servaddr->sun_path),
+		         SNFS_SHARD_SOCK_FMT, SERVER_SOCK, sh->id);
 
 	// if exists, deletes socket file name
 	if (unlink(servaddr->sun_path) < 0 && errno != ENOENT) {
@@ -143,89 +638,515 @@ void srv_init_socket(struct sockaddr_un* servaddr)
 	}
 
    	// binds socket to address
-	if (bind(sockfd, (struct sockaddr *) servaddr, sizeof(*servaddr)) < 0){
+	if (bind(sh->sockfd, (struct sockaddr *) servaddr, sizeof(*servaddr)) < 0){
 		printf("[snfs_srv] unbind error: %s.\n", strerror(errno));
 		exit(-1);
 	}
-	
-	printf("Server is running...\n");
 }
 
 
-int srv_recv_request(snfs_msg_req_t* req, struct sockaddr_un* cliaddr, socklen_t* clilen)
+int srv_recv_requests(shard_t* sh, req_t* reqs, int n)
 {
-	int status = my_recvfrom(req, cliaddr, clilen);
+	int status = my_recvmmsg(sh, reqs, n);
 	
-	if (status == 0) {
-		printf("[snfs_srv] request error.\n");
-		return 0;
-	}
 	if (status < 0) {
-		printf("[snfs_srv] recvfrom error: %s.\n", strerror(errno));
+		printf("[snfs_srv] recvmmsg error: %s.\n", strerror(errno));
 		exit(-1);
 	}
 	
+	sh->batch_stats.recv_calls++;
+	sh->batch_stats.recv_msgs += status;
+	sh->batch_stats.recv_fill[status]++;
 	return status;
 }
 
 
-void srv_send_response(snfs_msg_res_t* res, int ressz, struct sockaddr_un* cliaddr, socklen_t clilen)
+/*
+ * Stream connections
+ */
+
+void conn_put(conn_t* c) {
+	int last;
+	
+	sthread_mutex_lock(c->wlock);
+	last = (--c->refs == 0);
+	sthread_mutex_unlock(c->wlock);
+	if (last) {
+		close(c->fd);
+		sthread_mutex_free(c->wlock);
+		free(c);
+	}
+}
+
+/* writes all the iovecs to the connection, resuming partial writes;
+ * returns -1 if the connection is gone */
+int conn_send(conn_t* c, struct iovec* iov, int iovcnt) {
+	struct msghdr msg;
+	ssize_t sent;
+	
+	while (iovcnt > 0) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		sent = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		while (iovcnt > 0 && (size_t)sent >= iov->iov_len) {
+			sent -= iov->iov_len;
+			iov++; iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char*)iov->iov_base + sent;
+			iov->iov_len -= sent;
+		}
+	}
+	return 0;
+}
+
+/* sends the responses of the stream requests among the n given, the
+ * frames of each connection together in as few writes as the iovec
+ * array allows (a large read takes one write of its own) */
+#define FRAME_IOV 64
+
+void srv_send_frames(req_t* reqs, int n)
 {
-	int status = sendto(sockfd, res, ressz, 0, (struct sockaddr *)cliaddr, clilen);
-	if (status < 0) {
-		printf("[snfs_srv] sendto error: %s.\n", strerror(errno));
+	struct iovec iov[FRAME_IOV];
+	int sent[SEND_BATCH];
+	int i, j, cnt, err;
+	
+	memset(sent, 0, sizeof(sent));
+	for (i = 0; i < n; i++) {
+		if (reqs[i]->conn == NULL || sent[i])
+			continue;
+		conn_t* c = reqs[i]->conn;
+		sthread_mutex_lock(c->wlock);
+		for (j = i, cnt = 0, err = 0; j < n; j++) {
+			req_t r = reqs[j];
+			if (r->conn != c)
+				continue;
+			if (cnt + 1 + r->iovcnt > FRAME_IOV && cnt > 0) {
+				err |= conn_send(c, iov, cnt);
+				cnt = 0;
+			}
+			r->hdr.len = r->outsz;
+			iov[cnt].iov_base = &r->hdr;
+			iov[cnt++].iov_len = sizeof(r->hdr);
+			if (1 + r->iovcnt > FRAME_IOV) {
+				err |= conn_send(c, iov, cnt);
+				err |= conn_send(c, r->iov, r->iovcnt);
+				cnt = 0;
+			} else {
+				memcpy(iov + cnt, r->iov, r->iovcnt * sizeof(struct iovec));
+				cnt += r->iovcnt;
+			}
+			sent[j] = 1;
+		}
+		if (cnt > 0)
+			err |= conn_send(c, iov, cnt);
+		if (err)
+			printf("[snfs_srv] stream send error: %s.\n", strerror(errno));
+		sthread_mutex_unlock(c->wlock);
 	}
-	if (status != ressz) {
-		printf("[snfs_srv] message size mismatch.\n");
+	for (i = 0; i < n; i++)
+		if (reqs[i]->conn != NULL)
+			conn_put(reqs[i]->conn);
+}
+
+
+/* sends the responses of the n requests; returns the number of
+ * sendmmsg calls it took */
+int srv_send_responses(shard_t* sh, req_t* reqs, int n)
+{
+	struct mmsghdr msgs[SEND_BATCH];
+	req_t dg[SEND_BATCH];
+	int done = 0, calls = 0, status, ndg = 0;
+	
+	srv_send_frames(reqs, n);
+	
+	// the others go back as datagrams
+	memset(msgs, 0, sizeof(msgs));
+	for (int i = 0; i < n; i++) {
+		if (reqs[i]->conn != NULL)
+			continue;
+		dg[ndg] = reqs[i];
+		msgs[ndg].msg_hdr.msg_iov = reqs[i]->iov;
+		msgs[ndg].msg_hdr.msg_iovlen = reqs[i]->iovcnt;
+		msgs[ndg].msg_hdr.msg_name = &reqs[i]->cliaddr;
+		msgs[ndg].msg_hdr.msg_namelen = reqs[i]->clilen;
+		ndg++;
+	}
+	
+	while (done < ndg) {
+		status = sendmmsg(sh->sockfd, msgs + done, ndg - done, 0);
+		calls++;
+		if (status < 0) {
+			// skip the response that failed and go on with the others
+			printf("[snfs_srv] sendmmsg error: %s.\n", strerror(errno));
+			done++;
+			continue;
+		}
+		for (int i = done; i < done + status; i++)
+			if (msgs[i].msg_len != dg[i]->outsz)
+				printf("[snfs_srv] message size mismatch.\n");
+		done += status;
+	}
+	return calls;
+}
+
+/*
+ * serves r if it is a read (REQ_READ or REQ_READ_BULK), leaving the data
+ * in the cache: r->iov[1..npins] point into the pinned blocks and the
+ * message that goes before them is laid out by build_response. Returns
+ * 0 if r is not a read.
+ */
+int serve_read(req_t r)
+{
+	if (r->req.type != REQ_READ && r->req.type != REQ_READ_BULK)
+		return 0;
+	
+	r->npins = 0;
+	if (r->req.type == REQ_READ_BULK && (r->conn == NULL || !r->compact)) {
+		memset(&r->res, 0, snfs_wire_res_size(r->req.type));
+		r->ressz = sizeof(r->res) - sizeof(r->res.body) + sizeof(r->res.body.bulk);
+		r->res.type = r->req.type;
+		r->res.status = RES_ERROR;
+		printf("[snfs_srv] bulk request out of a stream.\n");
+		return 1;
 	}
+	snfs_read_pinned(&r->req, &r->res, &r->ressz, r->iov + 1, r->pins,
+	                 RES_MAX_IOV - 3, &r->npins);
+	return 1;
 }
 
+/*
+ * serves r if it is a bulk write; returns 0 if it is not
+ */
+int serve_bulk(req_t r)
+{
+	struct iovec iov;
+	snfs_bulk_handler_t handler = Service[REQ_SLOT(r->req.type)].bulk_handler;
+	
+	if (handler == NULL)
+		return 0;
+	
+	r->ressz = sizeof(r->res) - sizeof(r->res.body) + sizeof(r->res.body.bulk);
+	r->res.type = r->req.type;
+	r->res.status = RES_ERROR;
+	if (r->conn == NULL || !r->compact || r->req.body.bulk.count > SNFS_MAX_BULK_DATA) {
+		printf("[snfs_srv] bulk request out of a stream or too large.\n");
+		return 1;
+	}
+	
+	iov.iov_base = r->bulk;
+	iov.iov_len = r->req.body.bulk.count;
+	handler(&r->req, &iov, 1, &r->res, &r->ressz);
+	return 1;
+}
+
+/*
+ * serves a request that is not a read with the handler of its type
+ */
+void serve_req(req_t r)
+{
+	snfs_handler_t handler = Service[REQ_SLOT(r->req.type)].handler;
+	
+	// clean response (only the body of this type)
+	memset(&r->res,0,snfs_wire_res_size(r->req.type));
+	
+	if (serve_bulk(r))
+		return;
+	
+	// serve the request
+	if (handler == NULL) {
+		r->res.status = RES_UNKNOWN;
+		r->ressz = sizeof(r->res) - sizeof(r->res.body);
+		printf("[snfs_srv] unknown request.\n");
+	} else {
+		handler(&(r->req),r->reqsz,&r->res,&r->ressz);
+	}
+}
+
+/*
+ * answers r, whose deadline has passed, without serving it
+ */
+void expire_req(req_t r)
+{
+	memset(&r->res, 0, snfs_wire_res_size(r->req.type));
+	r->res.type = r->req.type;
+	r->res.status = RES_TIMEOUT;
+	r->ressz = sizeof(r->res) - sizeof(r->res.body);
+}
+
+/*
+ * lays out the response of r in r->iov, in the format of the request:
+ * the message and, for reads, the data from the pinned cache blocks
+ * (r->iov[1..npins]); a fixed read response also needs the unused part
+ * of its data array and the 'nread' field that comes after it
+ */
+void build_response(req_t r)
+{
+	static const char zeros[MAX_READ_DATA];
+	int i;
+	
+	r->iovcnt = 1 + r->npins;
+	if (r->compact) {
+		r->res.type = r->req.type;
+		r->iov[0].iov_base = r->wire;
+		r->iov[0].iov_len = snfs_wire_encode_res_head(&r->res, r->wire);
+	} else if (r->req.type == REQ_READ) {
+		r->iov[0].iov_base = &r->res;
+		r->iov[0].iov_len = sizeof(r->res) - sizeof(r->res.body);
+		r->iov[r->iovcnt].iov_base = (void*) zeros;
+		r->iov[r->iovcnt++].iov_len = MAX_READ_DATA - r->res.body.read.nread;
+		r->iov[r->iovcnt].iov_base = &r->res.body.read.nread;
+		r->iov[r->iovcnt++].iov_len = sizeof(r->res.body.read.nread);
+	} else {
+		r->iov[0].iov_base = &r->res;
+		r->iov[0].iov_len = r->ressz;
+	}
+	
+	r->outsz = 0;
+	for (i = 0; i < r->iovcnt; i++)
+		r->outsz += r->iov[i].iov_len;
+}
+
+
+/*
+ * Per-op statistics
+ */
+
+/* log2 bucket of a time in ns (see snfs_msg_res_stats_t) */
+static int stats_bucket(unsigned long long ns)
+{
+	unsigned long long us = ns / 1000;
+	int b = 0;
+	
+	while (us > 0 && b < SNFS_STATS_BUCKETS - 1) {
+		us >>= 1;
+		b++;
+	}
+	return b;
+}
+
+/* latency bucket of a time in ns */
+static int lat_bucket(unsigned long long ns)
+{
+	unsigned long long us = ns / 1000;
+	int e = 0;
+	
+	while (us >= 2 * LAT_SUB && e < LAT_MAX_EXP) {
+		us >>= 1;
+		e++;
+	}
+	if (us >= 2 * LAT_SUB)
+		us = 2 * LAT_SUB - 1;
+	return e * LAT_SUB + us;
+}
+
+/* the largest time (us) in latency bucket b */
+static unsigned lat_value(int b)
+{
+	int e = b / LAT_SUB - 1;
+	
+	if (b < 2 * LAT_SUB)
+		return b;
+	return ((unsigned)(b - e * LAT_SUB + 1) << e) - 1;
+}
+
+/* the time (us) under which 'permille' of the requests were served */
+static unsigned lat_percentile(const op_stats_t* st, int permille)
+{
+	unsigned long long want = ((unsigned long long)st->count * permille + 999) / 1000;
+	unsigned long long seen = 0;
+	
+	for (int b = 0; b < LAT_BUCKETS; b++) {
+		seen += st->lat[b];
+		if (seen >= want && seen > 0)
+			return lat_value(b);
+	}
+	return 0;
+}
+
+/* folds a request that was answered into the counters of its op
+ * (caller holds the shard's 'mon') */
+void account_req(shard_t* sh, req_t r)
+{
+	op_stats_t* st = &sh->op_stats[REQ_SLOT(r->req.type)];
+	
+	st->count++;
+	if (r->res.status != RES_OK)
+		st->errors++;
+	if (r->res.status == RES_TIMEOUT)
+		st->expired++;
+	st->bytes += r->insz + r->outsz;
+	st->wait[stats_bucket(r->t_dequeue - r->t_recv)]++;
+	st->service[stats_bucket(r->t_end - r->t_start)]++;
+	st->lat[lat_bucket(r->t_sent - r->t_recv)]++;
+}
+
+/* the counters of op summed over every shard */
+static void sum_op_stats(int op, op_stats_t* sum)
+{
+	memset(sum, 0, sizeof(*sum));
+	for (int s = 0; s < NUM_SHARDS; s++) {
+		op_stats_t* st = &shards[s].op_stats[op];
+		sthread_monitor_enter(shards[s].mon);
+		sum->count += st->count;
+		sum->errors += st->errors;
+		sum->expired += st->expired;
+		sum->bytes += st->bytes;
+		for (int b = 0; b < SNFS_STATS_BUCKETS; b++) {
+			sum->wait[b] += st->wait[b];
+			sum->service[b] += st->service[b];
+		}
+		for (int b = 0; b < LAT_BUCKETS; b++)
+			sum->lat[b] += st->lat[b];
+		sthread_monitor_exit(shards[s].mon);
+	}
+}
+
+/* REQ_STATS handler: the counters of op summed over every shard */
+void srv_stats(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, int* ressz)
+{
+	snfs_msg_type_t op = req->body.stats.op;
+	snfs_msg_res_stats_t* out = &res->body.stats;
+	op_stats_t sum;
+	
+	res->type = REQ_STATS;
+	*ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.stats);
+	if ((unsigned)op >= SNFS_NUM_REQ_TYPES) {
+		res->status = RES_ERROR;
+		return;
+	}
+	
+	sum_op_stats(op, &sum);
+	out->count = sum.count;
+	out->errors = sum.errors;
+	out->expired = sum.expired;
+	out->kbytes = sum.bytes / 1024;
+	out->p50 = lat_percentile(&sum, 500);
+	out->p90 = lat_percentile(&sum, 900);
+	out->p99 = lat_percentile(&sum, 990);
+	out->p999 = lat_percentile(&sum, 999);
+	for (int b = 0; b < SNFS_STATS_BUCKETS; b++) {
+		out->wait[b] = sum.wait[b];
+		out->service[b] = sum.service[b];
+	}
+	res->status = RES_OK;
+}
+
+/* logs the latency of every op served so far, once every
+ * STATS_LOG_PERIOD seconds (called by the producer of shard 0) */
+void log_stats_tick(void)
+{
+	static unsigned long long last = 0;
+	static unsigned long logged = 0;
+	unsigned long long now = sthread_now();
+	unsigned long total = 0;
+	op_stats_t sum;
+	
+	if (STATS_LOG_PERIOD == 0 || now - last < STATS_LOG_PERIOD * 1000000000ULL)
+		return;
+	if (last == 0) {
+		last = now;
+		return;
+	}
+	last = now;
+	
+	// nothing new since the last time
+	for (int s = 0; s < NUM_SHARDS; s++) {
+		sthread_monitor_enter(shards[s].mon);
+		for (int op = 0; op < SNFS_NUM_REQ_TYPES; op++)
+			total += shards[s].op_stats[op].count;
+		sthread_monitor_exit(shards[s].mon);
+	}
+	if (total == logged)
+		return;
+	logged = total;
+	for (int op = 0; op < SNFS_NUM_REQ_TYPES; op++) {
+		sum_op_stats(op, &sum);
+		if (sum.count == 0)
+			continue;
+		printf("[snfs_srv] %s: %lu reqs, %lu errors, %lu expired, "
+		       "p50 %uus p90 %uus p99 %uus p99.9 %uus\n", Service[op].name,
+		       sum.count, sum.errors, sum.expired, lat_percentile(&sum, 500),
+		       lat_percentile(&sum, 900), lat_percentile(&sum, 990),
+		       lat_percentile(&sum, 999));
+	}
+}
+
+
 /*
 * SNFS request handler thread
 */
 
-void* thread_consumer() {
-	req_t req_d;
-	int ressz, req_i;
-	snfs_msg_res_t res;
+void* thread_consumer(void* arg) {
+	shard_t* sh = (shard_t*) arg;
+	req_t batch[SEND_BATCH];
+	unsigned long long now;
+	int n = 0, calls = 0;
 	
 	while(1) {
-		sthread_monitor_enter(mon);
-		// get request from queue
-		while (!available_reqs) sthread_monitor_wait(mon);
-		
-		req_d = get_req();
-		available_reqs--;
-		sthread_monitor_signal(mon); 
-		sthread_monitor_exit(mon); 
-
-		
-		// clean response
-		memset(&res,0,sizeof(res));
-		
-		// find request handler
-		req_i = -1;
-		for (int i = 0; i < NUM_REQ_HANDLERS; i++) {
-			if (req_d->req.type == Service[i].type) {
-				req_i = i;
-				break;
+		sthread_monitor_enter(sh->mon);
+		// give back the previous batch while holding the monitor
+		if (n > 0) {
+			for (int i = 0; i < n; i++) {
+				account_req(sh, batch[i]);
+				free_req(sh, batch[i]);
 			}
+			sh->batch_stats.send_calls += calls;
+			sh->batch_stats.send_msgs += n;
+			sh->batch_stats.send_fill[n]++;
+			if (sh->desc_waiters > 0)
+				sthread_monitor_signalall(sh->mon);
 		}
+		// get requests from queue: an equal share of the backlog, so
+		// that idle consumers are not starved by a large batch
+		while (!sh->available_reqs) sthread_monitor_wait(sh->mon);
+		
+		n = (sh->available_reqs + NUM_TC - 1) / NUM_TC;
+		if (n > SEND_BATCH) n = SEND_BATCH;
+		for (int i = 0; i < n; i++)
+			batch[i] = dequeue_req(sh);
+		sthread_monitor_exit(sh->mon); 
+		
+		now = sthread_now();
+		for (int b = 0; b < n; b++)
+			batch[b]->t_dequeue = now;
 
-      		// serve the request
-		if (req_i == -1) {
-			res.status = RES_UNKNOWN;
-			ressz = sizeof(res) - sizeof(res.body);
-			printf("[snfs_srv] unknown request.\n");
-		} else {
-			Service[req_i].handler(&(req_d->req),req_d->reqsz,&res,&ressz);
+		for (int b = 0; b < n; b++) {
+			req_t req_d = batch[b];
+			
+			// a request waits for the ones before it in the batch too
+			req_d->t_start = sthread_now();
+			
+			// too late for the client: not worth the disk
+			if (req_d->deadline != 0 && req_d->t_start > req_d->deadline)
+				expire_req(req_d);
+			// reads leave their data in the cache, the others fill 'res'
+			else if (!serve_read(req_d))
+				serve_req(req_d);
+			req_d->t_end = sthread_now();
+			
+			// answer in the format of the request
+			build_response(req_d);
+			
+			// scratch memory of the request goes right away
+			arena_reset();
 		}
 
-      		// send response to client
-		srv_send_response(&res,ressz,&(req_d->cliaddr),req_d->clilen);
+      		// send responses to clients
+		calls = srv_send_responses(sh, batch, n);
+		now = sthread_now();
+		for (int b = 0; b < n; b++) {
+			batch[b]->t_sent = now;
+			snfs_unpin(batch[b]->pins, batch[b]->npins);
+			free(batch[b]->bulk);
+		}
 		
-		// free stuff
-		free(req_d); req_d = NULL;
+		// the descriptors return to the pool on the next monitor entry
 		
 		// force request processing
 		sthread_yield();
@@ -237,34 +1158,191 @@ void* thread_consumer() {
 * SNFS request receiver thread
 */
 
-void* thread_producer() 
+void* thread_producer(void* arg) 
 {
-	req_t req_d;
+	shard_t* sh = (shard_t*) arg;
+	req_t batch[RECV_BATCH];
+	int n, got;
 	
 	while(1) 
 	{
-		// wait for a free buffer slot
-		sthread_monitor_enter(mon);
-		while (available_reqs == RING_SIZE) sthread_monitor_wait(mon);
-		sthread_monitor_exit(mon); 
+		// wait for free buffer slots, take one descriptor for each
+		n = reserve_reqs(sh, batch, RECV_BATCH);
+
+		got = srv_recv_requests(sh, batch, n);
+		
+		// send to buffer, unused descriptors go back to the pool
+		commit_reqs(sh, batch, n, got);
+		sthread_yield();
+	}
+}
+
+/*
+* SNFS stream thread: accepts connections and turns their frames into
+* requests of the connection's shard
+*/
+
+void srv_init_stream_socket()
+{
+	struct sockaddr_un addr;
+	
+	if ((stream_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		printf("[snfs_srv] socket error: %s.\n", strerror(errno));
+		exit(-1);
+	}
+	bzero(&addr, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), SNFS_STREAM_SOCK_FMT, SERVER_SOCK);
+	if (unlink(addr.sun_path) < 0 && errno != ENOENT) {
+		printf("[snfs_srv] unlink error: %s.\n", strerror(errno));
+		exit(-1);
+	}
+	if (bind(stream_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+	    listen(stream_fd, MAX_CONNS) < 0) {
+		printf("[snfs_srv] bind/listen error: %s.\n", strerror(errno));
+		exit(-1);
+	}
+	// accept is polled like the datagram sockets
+	fcntl(stream_fd, F_SETFL, O_NONBLOCK);
+}
+
+/* a bulk write frame: a compact message followed by 'count' bytes of
+ * data, that are kept apart in r->bulk */
+static int is_bulk_write(const char* msg, unsigned len)
+{
+	return snfs_wire_is_compact(msg, len) && len >= 2 &&
+	       (unsigned char)msg[1] == REQ_WRITE_BULK;
+}
 
-		// create and clean request
-		req_d = (req_t) malloc(sizeof(struct _req));
-		memset(req_d,0,sizeof(struct _req));
+static void conn_take_bulk(req_t r, const char* msg, unsigned len)
+{
+	unsigned count;
+	
+	r->compact = 1;
+	set_deadline(r, msg, len);
+	r->reqsz = snfs_wire_decode_req(msg, len, &r->req);
+	count = r->req.body.bulk.count;
+	if (r->reqsz < 0 || count > SNFS_MAX_BULK_DATA || count > len - 2 ||
+	    (count > 0 && (r->bulk = (char*) malloc(count)) == NULL)) {
+		r->reqsz = 0;
+		return;
+	}
+	memcpy(r->bulk, msg + len - count, count);
+	r->bulklen = count;
+}
 
-		if ((req_d->reqsz = srv_recv_request(&(req_d->req),&(req_d->cliaddr),&(req_d->clilen))) == 0) 
+/* queues every complete frame in the connection buffer; returns -1 if
+ * the connection sent a malformed frame */
+int conn_parse(conn_t* c)
+{
+	req_t batch[RECV_BATCH];
+	snfs_frame_hdr_t hdr;
+	unsigned long long now = sthread_now();
+	int pos = 0, n, got;
+	
+	while (1) {
+		// count the complete frames (at most a batch)
+		int p = pos, frames = 0;
+		while (frames < RECV_BATCH && c->buflen - p >= (int)sizeof(hdr)) {
+			memcpy(&hdr, c->buf + p, sizeof(hdr));
+			if (hdr.len == 0 || hdr.len > SNFS_WIRE_MAX + SNFS_MAX_BULK_DATA)
+				return -1;
+			if (c->buflen - p < (int)(sizeof(hdr) + hdr.len))
+				break;
+			if (hdr.len > sizeof(snfs_msg_req_t) &&
+			    !is_bulk_write(c->buf + p + sizeof(hdr), hdr.len))
+				return -1;
+			p += sizeof(hdr) + hdr.len;
+			frames++;
+		}
+		if (frames == 0)
+			break;
+		
+		for (got = 0; got < frames; got += n) {
+			n = reserve_reqs(c->sh, batch, frames - got);
+			for (int i = 0; i < n; i++) {
+				memcpy(&hdr, c->buf + pos, sizeof(hdr));
+				pos += sizeof(hdr);
+				batch[i]->t_recv = now;
+				if (is_bulk_write(c->buf + pos, hdr.len)) {
+					conn_take_bulk(batch[i], c->buf + pos, hdr.len);
+				} else {
+					memcpy(&batch[i]->req, c->buf + pos, hdr.len);
+					batch[i]->reqsz = hdr.len;
+				}
+				pos += hdr.len;
+				batch[i]->insz = hdr.len;
+				batch[i]->hdr.serial = hdr.serial;
+				batch[i]->conn = c;
+			}
+			sthread_mutex_lock(c->wlock);
+			c->refs += n;
+			sthread_mutex_unlock(c->wlock);
+			commit_reqs(c->sh, batch, n, n);
+		}
+	}
+	
+	// keep the partial frame at the start of the buffer
+	memmove(c->buf, c->buf + pos, c->buflen - pos);
+	c->buflen -= pos;
+	return 0;
+}
+
+void* thread_stream(void* arg)
+{
+	struct pollfd fds[MAX_CONNS];
+	conn_t* conns[MAX_CONNS];
+	int nconns = 0, next_shard = 0, fd, i;
+	ssize_t got;
+	
+	while (1) {
+		// new connections
+		if (nconns < MAX_CONNS && (fd = accept(stream_fd, NULL, NULL)) >= 0) {
+			conn_t* c = (conn_t*) malloc(sizeof(conn_t));
+			c->fd = fd;
+			c->sh = &shards[next_shard];
+			next_shard = (next_shard + 1) % NUM_SHARDS;
+			c->wlock = sthread_mutex_init();
+			sthread_mutex_setname(c->wlock, "server.conn");
+			c->refs = 1;
+			c->buflen = 0;
+			conns[nconns] = c;
+			fds[nconns].fd = fd;
+			fds[nconns].events = POLLIN;
+			nconns++;
+		}
+		
+		if (nconns == 0 || poll(fds, nconns, 0) <= 0) {
+			sthread_yield();
 			continue;
+		}
 		
-		sthread_monitor_enter(mon); 
-		// send to buffer
-		put_req(req_d);
-		available_reqs++;
-		sthread_monitor_signalall(mon);
-		sthread_monitor_exit(mon);
+		for (i = 0; i < nconns; i++) {
+			conn_t* c = conns[i];
+			if (!fds[i].revents)
+				continue;
+			got = recv(c->fd, c->buf + c->buflen, CONN_BUF_SIZE - c->buflen, MSG_DONTWAIT);
+			if (got < 0 && (errno == EAGAIN || errno == EINTR))
+				continue;
+			if (got > 0) {
+				c->buflen += got;
+				if (conn_parse(c) == 0)
+					continue;
+				printf("[snfs_srv] malformed frame, closing connection.\n");
+			}
+			// closed: requests in flight keep the connection alive
+			shutdown(c->fd, SHUT_RD);
+			conn_put(c);
+			nconns--;
+			conns[i] = conns[nconns];
+			fds[i] = fds[nconns];
+			i--;
+		}
 		sthread_yield();
 	}
 }
 
+
 /*
 * SNFS server main
 */
@@ -274,13 +1352,16 @@ void* thread_producer()
 
 int main(int argc, char **argv)
 {
-	sthread_t threads[NUM_TC];
-	sthread_t prodthr;
-	int i;
-	available_reqs = 0;
+	sthread_t threads[NUM_SHARDS * NUM_TC];
+	sthread_t prodthr[NUM_SHARDS];
+	sthread_t streamthr;
+	sthread_attr_t attr;
+	shard_t* sh;
+	int i, s;
 	
 	// initialize sthread lib	
 	sthread_init();
+	arena_init();
 	
 	//initialize filesystem
 	snfs_init(argc, argv);
@@ -288,29 +1369,52 @@ int main(int argc, char **argv)
    	// initialize SNFS layer
        struct sockaddr_un servaddr;
                 	
-	// initialize communications
-	srv_init_socket(&servaddr);
-			
-	// initialize  monitor
-        mon = sthread_monitor_init();
+	// initialize communications, monitors and pools of every shard
+	for(s = 0; s < NUM_SHARDS; s++) {
+		sh = &shards[s];
+		sh->id = s;
+		sh->available_reqs = 0;
+		sh->desc_waiters = 0;
+		srv_init_socket(sh, &servaddr);
+		sh->mon = sthread_monitor_init();
+		sthread_monitor_setname(sh->mon, "server.mon");
+		init_req_pool(sh);
+		init_queues(sh);
+	}
+	srv_init_stream_socket();
+	signal(SIGUSR1, batch_stats_signal);
+	printf("Server is running...\n");
         
-	// create thread_consumer threads
-	for(i = 0; i < NUM_TC; i++) {
-		threads[i] = sthread_create(thread_consumer, (void*) NULL,1);
-		if (threads[i] == NULL) {
-			printf("Error while creating threads. Terminating...\n");
-			exit(-1);
+	for(s = 0; s < NUM_SHARDS; s++) {
+		// create thread_consumer threads
+		for(i = s * NUM_TC; i < (s + 1) * NUM_TC; i++) {
+			sthread_attr_init(&attr);
+			sthread_attr_setnumanode(&attr, WORKERS_NUMA_NODE);
+			if (PIN_WORKERS)
+				sthread_attr_setcpu(&attr, i % sthread_num_cpus());
+			threads[i] = sthread_create_attr(thread_consumer, (void*) &shards[s], 1, &attr);
+			if (threads[i] == NULL) {
+				printf("Error while creating threads. Terminating...\n");
+				exit(-1);
+			}
 		}
+		
+		// create producer thread
+		sthread_attr_init(&attr);
+		sthread_attr_setnumanode(&attr, WORKERS_NUMA_NODE);
+		prodthr[s] = sthread_create_attr(thread_producer, (void*) &shards[s], 1, &attr);
 	}
 	
-	// create producer thread
-	prodthr = sthread_create(thread_producer, (void*) NULL,1);
+	// create stream thread
+	sthread_attr_init(&attr);
+	sthread_attr_setnumanode(&attr, WORKERS_NUMA_NODE);
+	streamthr = sthread_create_attr(thread_stream, (void*) NULL, 1, &attr);
 	
-	
-	sthread_join(prodthr, (void**)NULL);
-	for(i = 0; i < NUM_TC; i++)
+	sthread_join(streamthr, (void**)NULL);
+	for(s = 0; s < NUM_SHARDS; s++)
+		sthread_join(prodthr[s], (void**)NULL);
+	for(i = 0; i < NUM_SHARDS * NUM_TC; i++)
 		sthread_join(threads[i], (void **)NULL);
 
 	return 0;
 }
-
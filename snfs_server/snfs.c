@@ -22,7 +22,7 @@
 #define NUM_BLOCKS (8*1024*2)
 #endif
 
-#define DEFAULT_DISK_DELAY 10000
+#define DEFAULT_DISK_DELAY 10000	// microseconds per block access
 
 static fs_t* FS;
 
@@ -127,6 +127,67 @@ void snfs_write(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res,
 }
 
 
+void snfs_read_pinned(snfs_msg_req_t *req, snfs_msg_res_t *res, int* ressz,
+   struct iovec* data, icache_t* pins, int maxdata, int* ndata)
+{
+   // get input arguments (REQ_READ or REQ_READ_BULK)
+   int bulk = (req->type == REQ_READ_BULK);
+   inodeid_t file = (inodeid_t)(bulk ? req->body.bulk.fhandle : req->body.read.fhandle);
+   unsigned offset = bulk ? req->body.bulk.offset : req->body.read.offset;
+   unsigned count = bulk ? req->body.bulk.count : req->body.read.count;
+   unsigned max = bulk ? SNFS_MAX_BULK_DATA : MAX_READ_DATA;
+
+   // prepare the response (the data is not copied into it)
+   *ressz = sizeof(*res) - sizeof(res->body) +
+            (bulk ? sizeof(res->body.bulk) : sizeof(res->body.read));
+   res->type = req->type;
+   res->status = RES_ERROR;
+   res->body.read.nread = 0;
+   res->body.bulk.count = 0;
+   *ndata = 0;
+
+   // handle request
+   int nread;
+   if (count <= max && !fs_read_pinned(FS,file,offset,count,data,pins,maxdata,ndata,&nread)){
+      res->status = RES_OK;
+      if (bulk)
+         res->body.bulk.count = nread;
+      else
+         res->body.read.nread = nread;
+   }
+}
+
+
+void snfs_unpin(icache_t* pins, int npins)
+{
+   fs_unpin(FS, pins, npins);
+}
+
+
+void snfs_write_bulk(snfs_msg_req_t *req, const struct iovec* data, int ndata,
+   snfs_msg_res_t *res, int* ressz)
+{
+   // get input arguments
+   inodeid_t file = (inodeid_t)req->body.bulk.fhandle;
+   unsigned offset = req->body.bulk.offset;
+
+   // prepare the response
+   *ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.bulk);
+   res->type = REQ_WRITE_BULK;
+   res->status = RES_ERROR;
+
+   // handle request
+   if (!fs_writev(FS,file,offset,data,ndata)){
+      fs_file_attrs_t attrs;
+      if (fs_get_attrs(FS,file,&attrs) == 0) {
+         res->status = RES_OK;
+         res->body.bulk.count = req->body.bulk.count;
+         res->body.bulk.fsize = attrs.size;
+      }
+   }
+}
+
+
 void snfs_create(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
    int* ressz)
 {
@@ -177,6 +238,8 @@ void snfs_readdir(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res,
    // get input arguments
    inodeid_t dir = (inodeid_t)req->body.readdir.dir;
    unsigned maxentries = req->body.readdir.cmax;
+   if (maxentries > MAX_READDIR_ENTRIES) // a resposta so leva estas
+      maxentries = MAX_READDIR_ENTRIES;
    
    // format the response
    *ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.readdir);
@@ -285,15 +348,26 @@ void snfs_append(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, int* ressz
 		   
 void snfs_defrag(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, int* ressz)
 {
-	int stat = fs_defrag(FS);
+	fs_defrag_stat_t estado;
+	int stat;
 
+	if(reqsz >= (int)(sizeof(req->type) + sizeof(req->body.defrag)) && req->body.defrag.query){	//so o progresso
+		fs_defrag_status(FS,&estado);
+		stat = estado.running ? 0 : 1;
+	}
+	else
+		stat = fs_defrag(FS,&estado);
 
+	*ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.defrag);
 	res->type = REQ_DEFRAG;
+	res->body.defrag.moved = estado.moved;
+	res->body.defrag.done = estado.done;
+	res->body.defrag.total = estado.total;
 
 	if(stat==-1)
 		res->status = RES_ERROR;
-	if(stat==0)
-		res->status = RES_UNKNOWN;
+	else if(stat==0)
+		res->status = RES_UNKNOWN;	//esta uma a correr
 	else
 		res->status =  RES_OK;
 }	   
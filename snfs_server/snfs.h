@@ -12,7 +12,9 @@
 #ifndef _SNFS_HANDLERS_H_
 #define _SNFS_HANDLERS_H_
 
+#include <sys/uio.h>
 #include <snfs_proto.h>
+#include "fs.h"
 
 
 /*
@@ -26,6 +28,18 @@ typedef void (*snfs_handler_t)(snfs_msg_req_t *req, int reqsz,
    snfs_msg_res_t *res, int* ressz);
 
 
+/*
+ * the snfs bulk handler type: the data of the request (or the buffers
+ * for the data of the response) is given apart from the message
+ * - req: the incoming message (request)
+ * - data, ndata: the data buffers, 'count' bytes in all
+ * - res: the outgoing message (response) [out]
+ * - ressz: the size of the outgoing message [out]
+ */
+typedef void (*snfs_bulk_handler_t)(snfs_msg_req_t *req,
+   const struct iovec* data, int ndata, snfs_msg_res_t *res, int* ressz);
+
+
 /*
  * snfs_init: performs internal SNFS initialization; currently
  * argc and argv are not being used.
@@ -86,5 +100,30 @@ void snfs_diskusage(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res,
 		   
 void snfs_dumpcache(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
 	       int* ressz);		   
+
+
+/*
+ * SNFS Reads without copies: REQ_READ and REQ_READ_BULK are served
+ * leaving the data in the cache; data[0..*ndata) point into cache
+ * blocks pinned until snfs_unpin(pins, *ndata), and res carries
+ * everything but the data.
+ */
+
+
+void snfs_read_pinned(snfs_msg_req_t *req, snfs_msg_res_t *res, int* ressz,
+   struct iovec* data, icache_t* pins, int maxdata, int* ndata);
+
+
+void snfs_unpin(icache_t* pins, int npins);
+
+
+/*
+ * SNFS Bulk Handlers (stream transport only)
+ */
+
+
+void snfs_write_bulk(snfs_msg_req_t *req, const struct iovec* data, int ndata,
+   snfs_msg_res_t *res, int* ressz);
+
 		   
 #endif
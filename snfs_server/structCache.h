@@ -21,6 +21,10 @@ typedef struct icache_{
 	int referenciado;	//referenciado
 	int modificado;		//o bloco necessita de ser escrito antes de ser removido?
 	int tempoEmCache;			//quando aguardar 10segundos, escrita em disco.
+	int pins;		//leitores que enviam conteudobloco sem o copiar (fixarBloco)
+	int retirado;		//ja saiu da tabela: e libertada quando pins chegar a 0
+	int metadados;		//bloco de metadados: so vai para o disco pelo diario do fs
+	int noDiario;		//ja esta numa transaccao, mas ainda nao no sitio
 	char* conteudobloco;
 }*icache_t;
 
@@ -63,6 +67,7 @@ typedef struct cache_{
 	HashMap tabela;
 	int numeroNosUtilizados;
 	int numeroMaxNos;
+	int numeroMeta;		//entradas de metadados modificadas, por recolher
 	blocks_t* disco;
 	List naoRef_naoMod;	//nao referenciadas, nao modificadas
 	List naoRef_Mod;	//nao referenciadas, modificadas
@@ -106,6 +106,28 @@ void* queue_remove(queue_t *queue) {
 }
 
 
+int queue_remove_conteudo(queue_t *queue, void *conteudo) {
+  queue_element_t *temp, *prev = NULL;
+
+  for(temp = queue->first; temp != NULL; prev = temp, temp = temp->next) {
+    if(temp->conteudo != conteudo)
+      continue;
+    if(prev == NULL)
+      queue->first = temp->next;
+    else
+      prev->next = temp->next;
+    if(queue->last == temp)
+      queue->last = prev;
+    temp->conteudo = NULL;
+    temp->next = NULL;
+    if(empty_element_ptr)free(temp);
+    else empty_element_ptr = temp;
+    return 1;
+  }
+  return 0;
+}
+
+
 queue_element_t* queue_next(queue_element_t* no){
 	return no->next;
 }
@@ -38,6 +38,10 @@ void queue_insert(queue_t *queue, void *conteudo);
 /* queue_remove - removes the first element of the queue */
 void* queue_remove(queue_t *queue);
 
+/* queue_remove_conteudo - removes the element holding conteudo, wherever it is
+ *                          in the queue. Returns 1 if found, else returns 0 */
+int queue_remove_conteudo(queue_t *queue, void *conteudo);
+
 /* queue_rotate - replaces active conteudo for the first in the queue, the old
  *                conteudo is inserted in the queue end */  
 void* queue_rotate(queue_t *queue, void* old_thr);
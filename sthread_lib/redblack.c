@@ -548,6 +548,25 @@ int RBSearchTID(ArvoreRB arvore,int TID){
 }
 
 
+PtNo RBProcurarTIDAUX(PtNo no,PtNo nil,int TID){
+	PtNo encontrado;
+	if(no == NULL || no == nil)
+		return NULL;
+		
+	if(no->tid == TID)
+		return no;
+		
+	if((encontrado = RBProcurarTIDAUX(no->esq,nil,TID)) != NULL)
+		return encontrado;
+	return RBProcurarTIDAUX(no->dir,nil,TID);
+}
+
+/*Procurar o no de uma thread com o mesmo TID, retorna NULL se nao encontrar*/
+PtNo RBProcurarTID(ArvoreRB arvore,int TID){
+	return RBProcurarTIDAUX(arvore->raiz->esq,arvore->nil,TID);
+}
+
+
 /*Devolve o valor da menor chave da arvore*/
 long int RBMenorChave(ArvoreRB arvore){
 	PtNo noMinimo = RBMinimoArvore(arvore);
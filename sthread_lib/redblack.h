@@ -43,6 +43,7 @@ void RBarvoreDestroy(ArvoreRB arvore); /*Destruir a arvore*/
 
 /*Pesquisa*/
 int RBSearchTID(ArvoreRB arvore,int tid);		/*Procurar uma thread na arvore com o mesmo TID da thread recebida*/
+PtNo RBProcurarTID(ArvoreRB arvore,int tid);	/*Devolve o no com o TID, NULL se nao existir*/
 long int RBMenorChave(ArvoreRB arvore);	//Devolve o valor da menor chave
 /*Acesso*/
 
@@ -13,7 +13,10 @@
 #include <sthread.h>
 #include <sthread_pthread.h>
 #include <sthread_user.h>
+#include <sthread_lockdep.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <time.h>
 
 #ifdef USE_PTHREADS
 #define IMPL_CHOOSE(pthread, user) pthread
@@ -23,6 +26,7 @@
 
 void sthread_init(void) {
   IMPL_CHOOSE(sthread_pthread_init(), sthread_user_init());
+  sthread_lockdep_init();
 }
 /*argumento adiconado:int priority*/
 sthread_t sthread_create(sthread_start_func_t start_routine, void *arg,int priority) { 
@@ -32,6 +36,14 @@ sthread_t sthread_create(sthread_start_func_t start_routine, void *arg,int prior
   return newth;
 }
 
+sthread_t sthread_create_attr(sthread_start_func_t start_routine, void *arg,
+			      int priority, const sthread_attr_t *attr) {
+  sthread_t newth;
+  IMPL_CHOOSE(newth = sthread_pthread_create_attr(start_routine, arg, attr),
+	      newth = sthread_user_create_attr(start_routine, arg, priority, attr));
+  return newth;
+}
+
 void sthread_exit(void *ret) {
   IMPL_CHOOSE(sthread_pthread_exit(ret), sthread_user_exit(ret));
 }
@@ -44,6 +56,12 @@ int sthread_sleep(int time) {
    return IMPL_CHOOSE(sthread_pthread_sleep(time),sthread_user_sleep(time));
 }
 
+unsigned long long sthread_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 int sthread_join(sthread_t thread, void **value_ptr) {
   return IMPL_CHOOSE(sthread_pthread_join(thread,value_ptr),sthread_user_join(thread,value_ptr));
 }
@@ -51,6 +69,58 @@ int sthread_join(sthread_t thread, void **value_ptr) {
 /*NOSSO*/
 void sthread_dump() {
 	IMPL_CHOOSE(printf("No Define Func"),sthread_user_dump());
+	sthread_lockdep_dump();
+}
+
+/**********************************************************************/
+/* Thread attributes                                                  */
+/**********************************************************************/
+
+void sthread_attr_init(sthread_attr_t *attr) {
+  attr->stack_size = 0;
+  attr->cpu_mask = 0;
+  attr->numa_node = -1;
+}
+
+void sthread_attr_setstacksize(sthread_attr_t *attr, unsigned int size) {
+  attr->stack_size = size;
+}
+
+void sthread_attr_setaffinity(sthread_attr_t *attr, unsigned long long cpu_mask) {
+  attr->cpu_mask = cpu_mask;
+}
+
+void sthread_attr_setcpu(sthread_attr_t *attr, int cpu) {
+  if (cpu >= 0 && cpu < STHREAD_MAX_CPUS)
+    attr->cpu_mask |= 1ULL << cpu;
+}
+
+void sthread_attr_setnumanode(sthread_attr_t *attr, int node) {
+  attr->numa_node = node;
+}
+
+int sthread_num_cpus(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return (n < 1) ? 1 : (int)n;
+}
+
+/**********************************************************************/
+/* Thread-local storage                                               */
+/**********************************************************************/
+
+int sthread_key_create(sthread_key_t *key, void (*destructor)(void *)) {
+  return IMPL_CHOOSE(sthread_pthread_key_create(key, destructor),
+		     sthread_user_key_create(key, destructor));
+}
+
+void *sthread_getspecific(sthread_key_t key) {
+  return IMPL_CHOOSE(sthread_pthread_getspecific(key),
+		     sthread_user_getspecific(key));
+}
+
+int sthread_setspecific(sthread_key_t key, const void *value) {
+  return IMPL_CHOOSE(sthread_pthread_setspecific(key, value),
+		     sthread_user_setspecific(key, value));
 }
 
 /**********************************************************************/
@@ -66,11 +136,13 @@ sthread_mutex_t sthread_mutex_init() {
 }
 
 void sthread_mutex_free(sthread_mutex_t lock) {
+  sthread_lockdep_forget(lock);
   IMPL_CHOOSE(sthread_pthread_mutex_free(lock),
 	      sthread_user_mutex_free(lock));
 }
 
 void sthread_mutex_lock(sthread_mutex_t lock) {
+  sthread_lockdep_acquire(lock);
   IMPL_CHOOSE(sthread_pthread_mutex_lock(lock),
 	      sthread_user_mutex_lock(lock));
 }
@@ -78,6 +150,11 @@ void sthread_mutex_lock(sthread_mutex_t lock) {
 void sthread_mutex_unlock(sthread_mutex_t lock) {
   IMPL_CHOOSE(sthread_pthread_mutex_unlock(lock),
 	      sthread_user_mutex_unlock(lock));
+  sthread_lockdep_release(lock);
+}
+
+void sthread_mutex_setname(sthread_mutex_t lock, const char *name) {
+  sthread_lockdep_setname(lock, name);
 }
 
 sthread_mon_t sthread_monitor_init() {
@@ -88,11 +165,13 @@ sthread_mon_t sthread_monitor_init() {
 }
 
 void sthread_monitor_free(sthread_mon_t mon) {
+  sthread_lockdep_forget(mon);
   IMPL_CHOOSE(sthread_pthread_monitor_free(mon),
 	      sthread_user_monitor_free(mon));
 }
 
 void sthread_monitor_enter(sthread_mon_t mon) {
+  sthread_lockdep_acquire(mon);
   IMPL_CHOOSE(sthread_pthread_monitor_enter(mon),
 	      sthread_user_monitor_enter(mon));
 }
@@ -100,6 +179,11 @@ void sthread_monitor_enter(sthread_mon_t mon) {
 void sthread_monitor_exit(sthread_mon_t mon) {
   IMPL_CHOOSE(sthread_pthread_monitor_exit(mon),
 	      sthread_user_monitor_exit(mon));
+  sthread_lockdep_release(mon);
+}
+
+void sthread_monitor_setname(sthread_mon_t mon, const char *name) {
+  sthread_lockdep_setname(mon, name);
 }
 
 
@@ -108,6 +192,11 @@ void sthread_monitor_wait(sthread_mon_t mon) {
 	      sthread_user_monitor_wait(mon));
 }
 
+int sthread_monitor_timedwait(sthread_mon_t mon, int time) {
+  return IMPL_CHOOSE(sthread_pthread_monitor_timedwait(mon, time),
+		     sthread_user_monitor_timedwait(mon, time));
+}
+
 void sthread_monitor_signal(sthread_mon_t mon) {
   IMPL_CHOOSE(sthread_pthread_monitor_signal(mon),
 	      sthread_user_monitor_signal(mon));
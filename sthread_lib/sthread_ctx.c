@@ -25,11 +25,18 @@
 const size_t sthread_stack_size = 64 * 1024;
 
 static void sthread_init_stack(sthread_ctx_t *ctx,
-			       sthread_ctx_start_func_t func);
+			       sthread_ctx_start_func_t func, size_t stack_size);
 
 
 sthread_ctx_t *sthread_new_ctx(sthread_ctx_start_func_t func) {
+    return sthread_new_ctx_size(func, sthread_stack_size);
+}
+
+sthread_ctx_t *sthread_new_ctx_size(sthread_ctx_start_func_t func, size_t stack_size) {
     sthread_ctx_t *ctx;
+
+    if (stack_size == 0)
+	stack_size = sthread_stack_size;
     
     ctx = (sthread_ctx_t*)malloc(sizeof(sthread_ctx_t));
     if (ctx == NULL) {
@@ -37,7 +44,7 @@ sthread_ctx_t *sthread_new_ctx(sthread_ctx_start_func_t func) {
 	return NULL;
     }
 
-    ctx->stackbase = (char*)malloc(sthread_stack_size);
+    ctx->stackbase = (char*)malloc(stack_size);
     if (ctx->stackbase == NULL) {
 	free(ctx);
 	fprintf(stderr, "Out of memory (sthread_new_ctx)\n");
@@ -45,16 +52,17 @@ sthread_ctx_t *sthread_new_ctx(sthread_ctx_start_func_t func) {
     }
 
     /* The stack grows down, so the first SP is at the top. */
-    ctx->sp = ctx->stackbase + sthread_stack_size - 16;
+    ctx->sp = ctx->stackbase + stack_size - 16;
     
-    sthread_init_stack(ctx, func);
+    sthread_init_stack(ctx, func, stack_size);
     
     return ctx;
 }
 
 /* Initialize a stack as if it had been saved by sthread_switch. */
-static void sthread_init_stack(sthread_ctx_t *ctx, sthread_ctx_start_func_t func) {
-    memset(ctx->stackbase, 0, sthread_stack_size);
+static void sthread_init_stack(sthread_ctx_t *ctx, sthread_ctx_start_func_t func,
+			       size_t stack_size) {
+    memset(ctx->stackbase, 0, stack_size);
 
     ctx->sp -= sizeof(sthread_ctx_start_func_t);
     *((sthread_ctx_start_func_t*)ctx->sp) = func;
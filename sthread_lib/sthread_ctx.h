@@ -11,6 +11,7 @@
 #ifndef STHREAD_CTX_H
 #define STHREAD_CTX_H 1
 
+#include <stddef.h>
 #include <sthread.h>
 
 typedef struct _sthread_ctx {
@@ -27,6 +28,10 @@ typedef void (*sthread_ctx_start_func_t)(void);
  */
 sthread_ctx_t *sthread_new_ctx(sthread_ctx_start_func_t func);
 
+/* Same as sthread_new_ctx, with a stack of stack_size bytes
+ * (0 selects the default size). */
+sthread_ctx_t *sthread_new_ctx_size(sthread_ctx_start_func_t func, size_t stack_size);
+
 /* Create a new sthread_ctx_t, but don't initialize it.
  * This new sthread_ctx_t is suitable for use as 'old' in
  * a call to sthread_switch, since sthread_switch is defined to overwrite
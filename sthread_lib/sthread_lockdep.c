@@ -0,0 +1,285 @@
+/*
+ * sthread_lockdep.c - Lock dependency checker. Locks are grouped in
+ *                     classes (by the name given with sthread_*_setname,
+ *                     or one class per lock when unnamed). Whenever a
+ *                     thread takes a lock of class B while holding one of
+ *                     class A the edge A -> B is added to a global graph,
+ *                     together with the stack trace where it was first
+ *                     seen. A new edge that closes a cycle means two code
+ *                     paths take the same locks in opposite orders, which
+ *                     can deadlock under the right interleaving even if
+ *                     it has never hung yet; it is reported on stderr.
+ *
+ *                     The checker runs before the real acquisition, so
+ *                     the report comes out even when the thread then
+ *                     blocks forever. Only compiled with -DSTHREAD_LOCKDEP.
+ *
+ */
+
+#include <config.h>
+
+#ifdef STHREAD_LOCKDEP
+
+#include <execinfo.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sthread.h>
+#include <sthread_lockdep.h>
+
+#define LOCKDEP_MAP_SIZE 1024		/* lock -> class table, power of 2 */
+#define LOCKDEP_MAX_DEPS 1024
+#define LOCKDEP_NAME_SIZE 32
+#define LOCKDEP_TOMB ((void *)1)
+
+struct lock_class {
+  char name[LOCKDEP_NAME_SIZE];
+};
+
+struct lock_dep {
+  short from, to;
+  int nframes;
+  void *trace[LOCKDEP_TRACE_DEPTH];
+};
+
+struct lock_map {
+  void *lock;
+  short cls;
+};
+
+struct held_locks {
+  int n;
+  int lost;				/* acquisitions beyond LOCKDEP_MAX_HELD */
+  short cls[LOCKDEP_MAX_HELD];
+  void *lock[LOCKDEP_MAX_HELD];
+};
+
+static struct lock_class classes[LOCKDEP_MAX_CLASSES];
+static int nclasses = 0;
+static struct lock_dep deps[LOCKDEP_MAX_DEPS];
+static int ndeps = 0;
+static short dep_idx[LOCKDEP_MAX_CLASSES][LOCKDEP_MAX_CLASSES]; /* 1 + index in deps */
+static struct lock_map map[LOCKDEP_MAP_SIZE];
+static short bfs_parent[LOCKDEP_MAX_CLASSES];
+static short bfs_queue[LOCKDEP_MAX_CLASSES];
+
+static sthread_key_t held_key;
+static int ready = 0;
+
+/* The graph is shared by every thread and cannot be protected by an
+ * sthread lock (it would check itself), so a spinlock that yields is
+ * used; it works with both implementations. */
+static volatile int graph_lock = 0;
+
+static void graph_enter(void) {
+  while (__sync_lock_test_and_set(&graph_lock, 1))
+    sthread_yield();
+}
+
+static void graph_exit(void) {
+  __sync_lock_release(&graph_lock);
+}
+
+static int class_get(const char *name) {
+  int i;
+  for (i = 0; i < nclasses; i++)
+    if (strncmp(classes[i].name, name, LOCKDEP_NAME_SIZE - 1) == 0)
+      return i;
+  if (nclasses == LOCKDEP_MAX_CLASSES)
+    return -1;
+  strncpy(classes[nclasses].name, name, LOCKDEP_NAME_SIZE - 1);
+  return nclasses++;
+}
+
+/* Find the slot of lock, creating it when create is set */
+static struct lock_map *map_slot(void *lock, int create) {
+  unsigned h = (unsigned)(((uintptr_t)lock >> 4) & (LOCKDEP_MAP_SIZE - 1));
+  struct lock_map *tomb = NULL;
+  int i;
+
+  for (i = 0; i < LOCKDEP_MAP_SIZE; i++, h = (h + 1) & (LOCKDEP_MAP_SIZE - 1)) {
+    if (map[h].lock == lock)
+      return &map[h];
+    if (map[h].lock == LOCKDEP_TOMB && tomb == NULL)
+      tomb = &map[h];
+    if (map[h].lock == NULL) {
+      if (tomb == NULL)
+	tomb = &map[h];
+      break;
+    }
+  }
+  if (!create || tomb == NULL)
+    return NULL;
+  tomb->lock = lock;
+  tomb->cls = -1;
+  return tomb;
+}
+
+/* Class of lock; unnamed locks get a class of their own */
+static int lock_class_of(void *lock) {
+  struct lock_map *slot = map_slot(lock, 1);
+  char name[LOCKDEP_NAME_SIZE];
+
+  if (slot == NULL)
+    return -1;
+  if (slot->cls < 0) {
+    snprintf(name, sizeof(name), "lock@%p", lock);
+    slot->cls = class_get(name);
+  }
+  return slot->cls;
+}
+
+static struct held_locks *held(void) {
+  struct held_locks *h = sthread_getspecific(held_key);
+  if (h == NULL) {
+    h = calloc(1, sizeof(struct held_locks));
+    sthread_setspecific(held_key, h);
+  }
+  return h;
+}
+
+static void print_trace(void *const *trace, int nframes) {
+  fflush(stderr);
+  backtrace_symbols_fd(trace, nframes, 2);
+}
+
+/* Path from 'from' to 'to' in the graph, left in bfs_parent.
+ * Returns 1 if there is one. */
+static int find_path(int from, int to) {
+  int head = 0, tail = 0, c, n;
+
+  for (c = 0; c < nclasses; c++)
+    bfs_parent[c] = -1;
+  bfs_parent[from] = from;
+  bfs_queue[tail++] = from;
+  while (head < tail) {
+    c = bfs_queue[head++];
+    if (c == to)
+      return 1;
+    for (n = 0; n < nclasses; n++)
+      if (dep_idx[c][n] && bfs_parent[n] < 0) {
+	bfs_parent[n] = c;
+	bfs_queue[tail++] = n;
+      }
+  }
+  return 0;
+}
+
+static void report(int held_cls, int cls) {
+  void *trace[LOCKDEP_TRACE_DEPTH];
+  int nframes = backtrace(trace, LOCKDEP_TRACE_DEPTH);
+  short path[LOCKDEP_MAX_CLASSES];
+  int len = 0, c, i;
+
+  fprintf(stderr, "\n[lockdep] possible deadlock: acquiring '%s' while holding '%s'\n",
+	  classes[cls].name, classes[held_cls].name);
+  fprintf(stderr, "[lockdep] the opposite order was already seen:\n");
+  for (c = held_cls; c != cls; c = bfs_parent[c])
+    path[len++] = c;
+  path[len++] = cls;
+  for (i = len - 1; i > 0; i--) {
+    struct lock_dep *d = &deps[dep_idx[path[i]][path[i - 1]] - 1];
+    fprintf(stderr, "[lockdep]   '%s' -> '%s' first taken at:\n",
+	    classes[d->from].name, classes[d->to].name);
+    print_trace(d->trace, d->nframes);
+  }
+  fprintf(stderr, "[lockdep] current acquisition:\n");
+  print_trace(trace, nframes);
+}
+
+static void add_dep(int from, int to) {
+  struct lock_dep *d;
+
+  if (ndeps == LOCKDEP_MAX_DEPS)
+    return;
+  d = &deps[ndeps++];
+  d->from = from;
+  d->to = to;
+  d->nframes = backtrace(d->trace, LOCKDEP_TRACE_DEPTH);
+  dep_idx[from][to] = ndeps;
+}
+
+void sthread_lockdep_init(void) {
+  sthread_key_create(&held_key, free);
+  ready = 1;
+}
+
+void sthread_lockdep_setname(void *lock, const char *name) {
+  struct lock_map *slot;
+
+  graph_enter();
+  slot = map_slot(lock, 1);
+  if (slot != NULL)
+    slot->cls = class_get(name);
+  graph_exit();
+}
+
+void sthread_lockdep_acquire(void *lock) {
+  struct held_locks *h;
+  int cls, i;
+
+  if (!ready)
+    return;
+  h = held();
+  if (h == NULL)
+    return;
+  graph_enter();
+  cls = lock_class_of(lock);
+  for (i = 0; cls >= 0 && i < h->n; i++) {
+    int a = h->cls[i];
+    /* nesting locks of the same class (e.g. two inodes) is left to the
+     * caller's own ordering rule */
+    if (a < 0 || a == cls || dep_idx[a][cls])
+      continue;
+    if (find_path(cls, a))
+      report(a, cls);
+    add_dep(a, cls);
+  }
+  if (h->n < LOCKDEP_MAX_HELD) {
+    h->cls[h->n] = cls;
+    h->lock[h->n++] = lock;
+  } else
+    h->lost++;
+  graph_exit();
+}
+
+void sthread_lockdep_release(void *lock) {
+  struct held_locks *h;
+  int i;
+
+  if (!ready || (h = held()) == NULL)
+    return;
+  /* locks need not be released in LIFO order */
+  for (i = h->n - 1; i >= 0; i--)
+    if (h->lock[i] == lock) {
+      memmove(&h->cls[i], &h->cls[i + 1], (h->n - i - 1) * sizeof(h->cls[0]));
+      memmove(&h->lock[i], &h->lock[i + 1], (h->n - i - 1) * sizeof(h->lock[0]));
+      h->n--;
+      return;
+    }
+  if (h->lost > 0)
+    h->lost--;
+}
+
+void sthread_lockdep_forget(void *lock) {
+  struct lock_map *slot;
+
+  graph_enter();
+  slot = map_slot(lock, 0);
+  if (slot != NULL)
+    slot->lock = LOCKDEP_TOMB;
+  graph_exit();
+}
+
+void sthread_lockdep_dump(void) {
+  int i;
+
+  graph_enter();
+  printf("=== lockdep: %d classes, %d dependencies ===\n", nclasses, ndeps);
+  for (i = 0; i < ndeps; i++)
+    printf("  %s -> %s\n", classes[deps[i].from].name, classes[deps[i].to].name);
+  graph_exit();
+}
+
+#endif /* STHREAD_LOCKDEP */
@@ -0,0 +1,44 @@
+/*
+ * sthread_lockdep.h - Lock dependency checker (debug builds only).
+ *                     When the library is compiled with -DSTHREAD_LOCKDEP
+ *                     every mutex and monitor acquisition made through
+ *                     the public API is recorded in a graph of lock
+ *                     classes, and an acquisition order that closes a
+ *                     cycle is reported with the stack traces of both
+ *                     orders. Without the flag the hooks compile away.
+ *
+ */
+
+#ifndef STHREAD_LOCKDEP_H
+#define STHREAD_LOCKDEP_H 1
+
+#ifdef STHREAD_LOCKDEP
+
+/* Maximum number of distinct lock classes */
+#define LOCKDEP_MAX_CLASSES 128
+
+/* Maximum number of locks a thread may hold at once */
+#define LOCKDEP_MAX_HELD 16
+
+/* Frames kept for each recorded dependency */
+#define LOCKDEP_TRACE_DEPTH 16
+
+void sthread_lockdep_init(void);
+void sthread_lockdep_setname(void *lock, const char *name);
+void sthread_lockdep_acquire(void *lock);
+void sthread_lockdep_release(void *lock);
+void sthread_lockdep_forget(void *lock);
+void sthread_lockdep_dump(void);
+
+#else
+
+#define sthread_lockdep_init()			((void)0)
+#define sthread_lockdep_setname(lock, name)	((void)0)
+#define sthread_lockdep_acquire(lock)		((void)0)
+#define sthread_lockdep_release(lock)		((void)0)
+#define sthread_lockdep_forget(lock)		((void)0)
+#define sthread_lockdep_dump()			((void)0)
+
+#endif /* STHREAD_LOCKDEP */
+
+#endif /* STHREAD_LOCKDEP_H */
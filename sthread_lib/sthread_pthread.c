@@ -9,8 +9,14 @@
  *   - Initial version.
  * 2009-11-06       so-ist-utl-pt
  *   - Support for monitors
+ *   - Thread attributes: stack size, CPU affinity and NUMA node
+ *   - Sleep and timed monitor waits on CLOCK_MONOTONIC
+ *   - Thread-local storage on pthread keys
  */
 
+/* pthread_attr_setaffinity_np and the CPU_* macros are GNU extensions */
+#define _GNU_SOURCE 1
+
 #include <config.h>
 
 #include <unistd.h>
@@ -24,11 +30,15 @@
 #endif
 
 #include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
 
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
 #include <sthread.h>
+#include <sthread_pthread.h>
 #ifdef HAVE_PTHREAD_H
 #include <pthread.h>
 #endif
@@ -48,12 +58,102 @@ void sthread_pthread_init(void) {
 }
 
 sthread_t sthread_pthread_create(sthread_start_func_t start_routine, void *arg) {
+  return sthread_pthread_create_attr(start_routine, arg, NULL);
+}
+
+/* Add to 'set' the CPUs of NUMA node 'node', as listed by the kernel
+ * in sysfs (e.g. "0-7,16-23"). Returns the number of CPUs added. */
+static int sthread_pthread_node_cpus(int node, cpu_set_t *set) {
+  char path[64];
+  FILE *f;
+  int first, last, n = 0;
+  char sep;
+
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+  if ((f = fopen(path, "r")) == NULL)
+    return 0;
+  while (fscanf(f, "%d", &first) == 1) {
+    last = first;
+    if (fscanf(f, "%c", &sep) == 1 && sep == '-') {
+      if (fscanf(f, "%d", &last) != 1)
+        break;
+      if (fscanf(f, "%c", &sep) != 1)
+        sep = '\n';
+    }
+    for (; first <= last && first < CPU_SETSIZE; first++, n++)
+      CPU_SET(first, set);
+    if (sep != ',')
+      break;
+  }
+  fclose(f);
+  return n;
+}
+
+/* Translate the sthread attributes to pthread attributes.
+ * Returns 0 if successful, the pthread error code otherwise */
+static int sthread_pthread_apply_attr(pthread_attr_t *pattr, const sthread_attr_t *attr) {
+  cpu_set_t mask, node;
+  int err, i;
+
+  if (attr->stack_size != 0) {
+    size_t size = attr->stack_size;
+    if (size < PTHREAD_STACK_MIN)
+      size = PTHREAD_STACK_MIN;
+    if ((err = pthread_attr_setstacksize(pattr, size)) != 0)
+      return err;
+  }
+
+  CPU_ZERO(&mask);
+  for (i = 0; i < STHREAD_MAX_CPUS; i++)
+    if (attr->cpu_mask & (1ULL << i))
+      CPU_SET(i, &mask);
+
+  if (attr->numa_node >= 0) {
+    CPU_ZERO(&node);
+    if (sthread_pthread_node_cpus(attr->numa_node, &node) > 0) {
+      if (attr->cpu_mask == 0)
+        mask = node;
+      else
+        CPU_AND(&mask, &mask, &node);
+    }
+    /* a node hint that leaves no CPU is dropped, the cpu_mask still holds */
+    if (CPU_COUNT(&mask) == 0) {
+      for (i = 0; i < STHREAD_MAX_CPUS; i++)
+        if (attr->cpu_mask & (1ULL << i))
+          CPU_SET(i, &mask);
+    }
+  }
+
+  if (CPU_COUNT(&mask) > 0)
+    return pthread_attr_setaffinity_np(pattr, sizeof(mask), &mask);
+  return 0;
+}
+
+sthread_t sthread_pthread_create_attr(sthread_start_func_t start_routine, void *arg,
+				      const sthread_attr_t *attr) {
   sthread_t sth;
+  pthread_attr_t pattr;
   int err;
   
   sth = (sthread_t)malloc(sizeof(struct _sthread));
+  if (sth == NULL)
+    return NULL;
+
+  pthread_attr_init(&pattr);
+  if (attr != NULL && (err = sthread_pthread_apply_attr(&pattr, attr)) != 0) {
+    fprintf(stderr, "sthread_pthread_create: invalid attributes: %s\n", strerror(err));
+    pthread_attr_destroy(&pattr);
+    free(sth);
+    return NULL;
+  }
 
-  err = pthread_create(&(sth->pth), NULL, start_routine, arg);
+  err = pthread_create(&(sth->pth), &pattr, start_routine, arg);
+  pthread_attr_destroy(&pattr);
+  if (err != 0) {
+    fprintf(stderr, "pthread_create error: %s\n", strerror(err));
+    free(sth);
+    return NULL;
+  }
 
   return sth;
 }
@@ -77,24 +177,26 @@ void sthread_pthread_yield(void) {
 #endif
 }
 
-int sthread_pthread_sleep(int timevalue) {
-  pthread_mutex_t mutex;
-  pthread_cond_t conditionvar;
+/* Absolute CLOCK_MONOTONIC deadline 'usec' microseconds from now */
+static void sthread_pthread_deadline(int usec, struct timespec *deadline) {
+  unsigned long long when = sthread_now() + (unsigned long long)usec * 1000ULL;
 
-  struct timespec timetoexpire;
-
-  if(pthread_mutex_init(&mutex,NULL))
-      return -1;
-  if(pthread_cond_init(&conditionvar,NULL))
-      return -1;
+  deadline->tv_sec = when / 1000000000ULL;
+  deadline->tv_nsec = when % 1000000000ULL;
+}
 
-  //When to expire is an absolute time, so get the current time and add it
-  //to our delay time
+int sthread_pthread_sleep(int timevalue) {
+  struct timespec deadline;
+  int err;
 
-  timetoexpire.tv_sec = (unsigned int)time(NULL) + timevalue/100000;
-  timetoexpire.tv_nsec = 0;
+  if (timevalue <= 0)
+    return 0;
 
-  return pthread_cond_timedwait(&conditionvar, &mutex, &timetoexpire);
+  /* an absolute deadline makes restarts after signals exact */
+  sthread_pthread_deadline(timevalue, &deadline);
+  while ((err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL)) == EINTR)
+    ;
+  return err == 0 ? 0 : -1;
 }
 
 int sthread_pthread_join(sthread_t thread, void **value_ptr) {
@@ -105,6 +207,40 @@ int sthread_pthread_join(sthread_t thread, void **value_ptr) {
 
 
 
+/**********************************************************************/
+/* Thread-local storage                                               */
+/**********************************************************************/
+
+/* sthread keys are indexes into this table, so lookups stay O(1) */
+static pthread_key_t sthread_pthread_keys[STHREAD_KEYS_MAX];
+static int sthread_pthread_nkeys = 0;
+static pthread_mutex_t sthread_pthread_keys_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int sthread_pthread_key_create(sthread_key_t *key, void (*destructor)(void *)) {
+  int ret = -1;
+
+  pthread_mutex_lock(&sthread_pthread_keys_lock);
+  if (sthread_pthread_nkeys < STHREAD_KEYS_MAX &&
+      pthread_key_create(&sthread_pthread_keys[sthread_pthread_nkeys], destructor) == 0) {
+    *key = sthread_pthread_nkeys++;
+    ret = 0;
+  }
+  pthread_mutex_unlock(&sthread_pthread_keys_lock);
+  return ret;
+}
+
+void *sthread_pthread_getspecific(sthread_key_t key) {
+  if (key < 0 || key >= sthread_pthread_nkeys)
+    return NULL;
+  return pthread_getspecific(sthread_pthread_keys[key]);
+}
+
+int sthread_pthread_setspecific(sthread_key_t key, const void *value) {
+  if (key < 0 || key >= sthread_pthread_nkeys)
+    return -1;
+  return pthread_setspecific(sthread_pthread_keys[key], value) == 0 ? 0 : -1;
+}
+
 /**********************************************************************/
 /* Synchronization Primitives: Mutexs and Condition Variables         */
 /**********************************************************************/
@@ -161,8 +297,12 @@ sthread_mon_t sthread_pthread_monitor_init() {
   sthread_mon_t monitor;
   monitor = (sthread_mon_t)malloc(sizeof(struct _sthread_mon));
   assert(monitor != NULL);
+  pthread_condattr_t cattr;
   pthread_mutex_init(&(monitor->plock), NULL);
-  pthread_cond_init(&(monitor->pcondition), NULL);
+  pthread_condattr_init(&cattr);
+  pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);	/* timedwait deadlines */
+  pthread_cond_init(&(monitor->pcondition), &cattr);
+  pthread_condattr_destroy(&cattr);
   return monitor;
 }
 
@@ -202,6 +342,21 @@ void sthread_pthread_monitor_wait(sthread_mon_t mon) {
   }
 }
 
+int sthread_pthread_monitor_timedwait(sthread_mon_t mon, int time) {
+  struct timespec deadline;
+  int err;
+
+  sthread_pthread_deadline(time > 0 ? time : 0, &deadline);
+  err = pthread_cond_timedwait(&(mon->pcondition), &(mon->plock), &deadline);
+  if (err == ETIMEDOUT)
+    return 1;
+  if (err != 0) {
+    fprintf(stderr, "pthred_monitor_timedwait error: %s", strerror(err));
+    abort();
+  }
+  return 0;
+}
+
 void sthread_pthread_monitor_signal(sthread_mon_t mon) {
   int err;
   if ((err = pthread_cond_signal(&(mon->pcondition))) != 0) {
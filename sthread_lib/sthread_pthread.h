@@ -11,6 +11,8 @@
 
 void sthread_pthread_init(void);
 sthread_t sthread_pthread_create(sthread_start_func_t start_routine, void *arg);
+sthread_t sthread_pthread_create_attr(sthread_start_func_t start_routine, void *arg,
+				      const sthread_attr_t *attr);
 void sthread_pthread_exit(void *ret);
 void sthread_pthread_yield(void);
 
@@ -18,6 +20,9 @@ void sthread_pthread_yield(void);
 int sthread_pthread_sleep(int time);
 int sthread_pthread_join(sthread_t thread, void **value_ptr);
 
+int sthread_pthread_key_create(sthread_key_t *key, void (*destructor)(void *));
+void *sthread_pthread_getspecific(sthread_key_t key);
+int sthread_pthread_setspecific(sthread_key_t key, const void *value);
 
 sthread_mutex_t sthread_pthread_mutex_init(void);
 void sthread_pthread_mutex_free(sthread_mutex_t lock);
@@ -29,6 +34,7 @@ void sthread_pthread_monitor_free(sthread_mon_t mon);
 void sthread_pthread_monitor_enter(sthread_mon_t mon);
 void sthread_pthread_monitor_exit(sthread_mon_t mon);
 void sthread_pthread_monitor_wait(sthread_mon_t mon);
+int sthread_pthread_monitor_timedwait(sthread_mon_t mon, int time);
 void sthread_pthread_monitor_signal(sthread_mon_t mon);
 void sthread_pthread_monitor_signalall(sthread_mon_t mon);
 
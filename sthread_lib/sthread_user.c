@@ -14,6 +14,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <sthread.h>
 #include <sthread_user.h>
@@ -47,6 +48,11 @@ struct _sthread {
   
   long int waittime;						/*Tempo que esteve a espera na arvore*/
   long int sleeptime;						/*Tempo que esteve em bloqueado*/
+
+  struct _sthread_mon* timed_mon;			/*Monitor onde faz timedwait (NULL se nenhum)*/
+  int timed_out;							/*1 se o ultimo timedwait expirou*/
+
+  void* tls[STHREAD_KEYS_MAX];				/*Valores das chaves de thread-local storage*/
 };
 
        
@@ -66,6 +72,9 @@ static int tid_gen;                   	/* gerador de tid's */
 #define CLOCK_TICK 10000				/*Periodo do time_slicer*/
 static unsigned long int Clock;
 		
+static int key_gen = 0;					/*Gerador de chaves de thread-local storage*/
+static void (*key_destructor[STHREAD_KEYS_MAX])(void*);	/*Destrutor de cada chave*/
+
 static int mutex_id_gen = 0;			/*Gerar os id's para mutex's*/
 static int monitor_id_gen = 0;			/*Gerar os id's para monitores*/
 
@@ -131,6 +140,9 @@ void sthread_user_init(void) {						/*Iniciar o sistema de tarefas*/
   main_thread->sleeptime = 0;
   
   main_thread->times_runned = 0;
+  main_thread->timed_mon = NULL;
+  main_thread->timed_out = 0;
+  memset(main_thread->tls, 0, sizeof(main_thread->tls));
    
   active_thr = main_thread; /*Thread passa a activa*/
   splx(HIGH);
@@ -141,6 +153,14 @@ void sthread_user_init(void) {						/*Iniciar o sistema de tarefas*/
 
 
 sthread_t sthread_user_create(sthread_start_func_t start_routine, void *arg, int priority)/*Criar uma thread de user*/
+{
+  return sthread_user_create_attr(start_routine, arg, priority, NULL);
+}
+
+/*Criar uma thread de user com atributos. Todas as sthreads correm sobre a mesma tarefa do kernel,
+ * por isso apenas a dimensao da pilha e respeitada (afinidade e no NUMA sao ignorados)*/
+sthread_t sthread_user_create_attr(sthread_start_func_t start_routine, void *arg, int priority,
+				   const sthread_attr_t *attr)
 {
 	
   struct _sthread *new_thread = (struct _sthread*)malloc(sizeof(struct _sthread));/*Cria uma estrutura sthread*/
@@ -150,7 +170,11 @@ sthread_t sthread_user_create(sthread_start_func_t start_routine, void *arg, int
   new_thread->wake_time = 0;								
   new_thread->join_tid = 0;
   new_thread->join_ret = NULL;
-  new_thread->saved_ctx = sthread_new_ctx(func);			/*Criar um novo contexto de funcao */
+  new_thread->saved_ctx = sthread_new_ctx_size(func, attr ? attr->stack_size : 0);	/*Criar um novo contexto de funcao */
+  if(new_thread->saved_ctx == NULL){
+	free(new_thread);
+	return NULL;
+  }
   new_thread->vruntime = RBMenorChave(exe_thr_arvore_rb);	/*O novo processo criado fica com o tempo do processo com maior prioridade*/
   new_thread->exectime = 0; 								/* Tempo execuçao começa a 0 */
   new_thread->nice = 0;
@@ -174,6 +198,9 @@ sthread_t sthread_user_create(sthread_start_func_t start_routine, void *arg, int
   new_thread->wake_time = 0;
   new_thread->sleeptime = 0;
   new_thread->times_runned = 0;
+  new_thread->timed_mon = NULL;
+  new_thread->timed_out = 0;
+  memset(new_thread->tls, 0, sizeof(new_thread->tls));
   RBInserir(exe_thr_arvore_rb,new_thread);/*Insere thread na arvore rb dos executaveis*/
   
   splx(LOW);
@@ -183,6 +210,16 @@ sthread_t sthread_user_create(sthread_start_func_t start_routine, void *arg, int
 
 
 void sthread_user_exit(void *ret) {
+  int k;
+  
+  for(k = 0; k < key_gen; k++){					/*Destruir os valores thread-local antes de morrer*/
+	void* valor = active_thr->tls[k];
+	if(valor != NULL && key_destructor[k] != NULL){
+		active_thr->tls[k] = NULL;
+		key_destructor[k](valor);
+	}
+  }
+  
   splx(HIGH);
   
    int is_zombie = 1;
@@ -419,6 +456,40 @@ int sthread_user_sleep(int time){
    return 0;
 }
 
+/* --------------------------------------------------------------------------*
+ * Thread-local storage                                                      *
+ * ------------------------------------------------------------------------- */
+
+/*As chaves sao indices no vector tls de cada thread: acesso em tempo constante e sem locks*/
+int sthread_user_key_create(sthread_key_t *key, void (*destructor)(void *))
+{
+  int nivel = splx(HIGH);
+  
+  if(key_gen == STHREAD_KEYS_MAX){
+	splx(nivel);
+	return -1;
+  }
+  key_destructor[key_gen] = destructor;
+  *key = key_gen++;
+  splx(nivel);
+  return 0;
+}
+
+void *sthread_user_getspecific(sthread_key_t key)
+{
+  if(key < 0 || key >= key_gen)
+	return NULL;
+  return active_thr->tls[key];
+}
+
+int sthread_user_setspecific(sthread_key_t key, const void *value)
+{
+  if(key < 0 || key >= key_gen)
+	return -1;
+  active_thr->tls[key] = (void*) value;
+  return 0;
+}
+
 /* --------------------------------------------------------------------------*
  * Synchronization Primitives                                                *
  * ------------------------------------------------------------------------- */
@@ -627,6 +698,51 @@ void sthread_user_monitor_wait(sthread_mon_t mon)		/*Fazer wait no monitor,bloqu
   splx(LOW);
 }
 
+/*Espera no monitor no maximo "time" microsegundos (minimo de 1 clock tick).
+ * A thread fica na fila do monitor e na arvore de sleep; o primeiro a acontecer
+ * (signal ou fim do tempo) retira-a do outro.
+ * return 0 se foi assinalada, 1 se o tempo expirou*/
+int sthread_user_monitor_timedwait(sthread_mon_t mon, int time)
+{
+  long int num_ticks = time / CLOCK_TICK;
+  int expirou;
+
+  if(mon->mutex->thr != active_thr){
+    dprintf("monitor timedwait called outside monitor\n");
+    return -1;
+  }
+  if(num_ticks == 0)
+    num_ticks = 1;
+
+  splx(HIGH);
+  active_thr->timed_mon = mon;
+  active_thr->timed_out = 0;
+  active_thr->wake_time = Clock + num_ticks;
+  RBInserirNo(sleep_thr_arvore_rb,active_thr->wake_time,active_thr->tid,active_thr);
+  splx(LOW);
+
+  sthread_user_monitor_wait(mon);		/*volta com o mutex do monitor adquirido*/
+
+  expirou = active_thr->timed_out;
+  active_thr->timed_out = 0;
+  return expirou;
+}
+
+/*A thread em timedwait foi assinalada: retira-la da arvore de sleep*/
+static void cancelarTimeout(struct _sthread *thread)
+{
+  PtNo no;
+  int nivel = splx(HIGH);
+
+  thread->timed_mon = NULL;
+  thread->wake_time = 0;
+  if((no = RBProcurarTID(sleep_thr_arvore_rb,thread->tid)) != NULL){
+    no->elem = NULL;		/*Nao destruir a thread ao remover o no*/
+    RBRemoverNo(sleep_thr_arvore_rb,no);
+  }
+  splx(nivel);
+}
+
 void sthread_user_monitor_signal(sthread_mon_t mon)		/*Assinalar monitor,libertar 1 processo*/
 {
   struct _sthread *temp;
@@ -641,6 +757,8 @@ void sthread_user_monitor_signal(sthread_mon_t mon)		/*Assinalar monitor,liberta
   if(!queue_is_empty(mon->queue)){
     /* changes blocking queue for thread */
     temp = queue_remove(mon->queue);		/*Assinala passando da fila do monitor para a do mutex*/
+    if(temp->timed_mon != NULL)
+      cancelarTimeout(temp);
     queue_insert(mon->mutex->queue, temp);
   }
   atomic_clear(&(mon->mutex->l));
@@ -659,6 +777,8 @@ void sthread_user_monitor_signalall(sthread_mon_t mon)
   while(!queue_is_empty(mon->queue)){
     /* changes blocking queue for thread */
     temp = queue_remove(mon->queue);
+    if(temp->timed_mon != NULL)
+      cancelarTimeout(temp);
     queue_insert(mon->mutex->queue, temp);		/*Vao todas para a queue do mutex*/
   }
   atomic_clear(&(mon->mutex->l));
@@ -856,7 +976,25 @@ void acordarProcessos(ArvoreRB arvore_sleep,PtNo h){					/*Actualiza automaticam
 	
 	thread = h->elem;	
 	
-	if(thread->wake_time <= Clock){	/*Ha algum processo para acordar, temos de ter em conta os 5pulsos minimos (usamos o <=)*/
+	if(thread->wake_time <= Clock && thread->timed_mon != NULL){	/*Expirou um timedwait*/
+		struct _sthread_mon *mon = thread->timed_mon;
+		
+		if(queue_remove_conteudo(mon->queue,thread)){	/*Se ainda nao entrou na fila do monitor, tenta no proximo tick*/
+			thread->timed_mon = NULL;
+			thread->timed_out = 1;
+			thread->wake_time = 0;
+			h->elem = NULL;
+			RBRemoverNo(arvore_sleep,h);
+			
+			if(mon->mutex->thr == NULL){		/*Readquirir o mutex do monitor*/
+				mon->mutex->thr = thread;
+				RBInserir(exe_thr_arvore_rb,thread);
+			}
+			else
+				queue_insert(mon->mutex->queue,thread);
+		}
+	}
+	else if(thread->wake_time <= Clock){	/*Ha algum processo para acordar, temos de ter em conta os 5pulsos minimos (usamos o <=)*/
 		
 		thread->wake_time = 0; /*Reset ao "despertador"*/
 		
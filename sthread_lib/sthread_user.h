@@ -11,6 +11,8 @@
 /* Basic Threads */
 void sthread_user_init(void);
 sthread_t sthread_user_create(sthread_start_func_t start_routine, void *arg,int prioridade);
+sthread_t sthread_user_create_attr(sthread_start_func_t start_routine, void *arg,int prioridade,
+				   const sthread_attr_t *attr);
 void sthread_user_exit(void *ret);
 void sthread_user_yield(void);
 
@@ -19,6 +21,11 @@ int sthread_user_sleep(int time);
 int sthread_user_join(sthread_t thread, void **value_ptr);
 int sthread_nice(int nice);
 
+/* Thread-local storage */
+int sthread_user_key_create(sthread_key_t *key, void (*destructor)(void *));
+void *sthread_user_getspecific(sthread_key_t key);
+int sthread_user_setspecific(sthread_key_t key, const void *value);
+
 /* Synchronization Primitives */
 sthread_mutex_t sthread_user_mutex_init(void);
 void sthread_user_mutex_free(sthread_mutex_t lock);
@@ -30,6 +37,7 @@ void sthread_user_monitor_free(sthread_mon_t mon);
 void sthread_user_monitor_enter(sthread_mon_t mon);
 void sthread_user_monitor_exit(sthread_mon_t mon);
 void sthread_user_monitor_wait(sthread_mon_t mon);
+int sthread_user_monitor_timedwait(sthread_mon_t mon, int time);
 void sthread_user_monitor_signal(sthread_mon_t mon);
 void sthread_user_monitor_signalall(sthread_mon_t mon);
 